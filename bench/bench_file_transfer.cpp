@@ -0,0 +1,182 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+// A benchmark comparing the file transfer throughput of
+// Connection::write(fs::path) and Connection::read(fs::path, long),
+// which use sendfile(2) and splice(2) where possible, with copying
+// the file through a FILE_BUFFER_SIZE userspace buffer on both ends
+// (as done before).
+//
+// Usage: bench-file-transfer [file size in MiB] [pipe|tcp]
+
+#include "server/socket.hpp"
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/StreamSocket.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <unistd.h>
+
+using namespace adaptyst;
+
+/**
+   Copies a file to a file descriptor through a userspace buffer.
+*/
+static void copy_send(fs::path path, int fd) {
+  std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+  std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+
+  while (stream) {
+    stream.read(buf.get(), FILE_BUFFER_SIZE);
+    int bytes = stream.gcount();
+
+    for (int written = 0; written < bytes;) {
+      int result = ::write(fd, buf.get() + written, bytes - written);
+
+      if (result <= 0) {
+        throw std::runtime_error("write failed");
+      }
+
+      written += result;
+    }
+  }
+}
+
+/**
+   Receives data from a file descriptor and saves them to a file
+   through a userspace buffer.
+*/
+static void copy_receive(int fd, fs::path path) {
+  std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+  std::ofstream stream(path, std::ios_base::out | std::ios_base::binary);
+
+  while (true) {
+    int bytes = ::read(fd, buf.get(), FILE_BUFFER_SIZE);
+
+    if (bytes <= 0) {
+      break;
+    }
+
+    stream.write(buf.get(), bytes);
+  }
+}
+
+/**
+   Runs a sender and a receiver concurrently and returns the time taken,
+   in seconds.
+*/
+static double measure(std::function<void()> sender,
+                      std::function<void()> receiver) {
+  auto start = std::chrono::steady_clock::now();
+  std::future<void> sender_future = std::async(std::launch::async, sender);
+  receiver();
+  sender_future.get();
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+  unsigned long long size_mib = argc > 1 ? std::stoull(argv[1]) : 1024;
+  std::string mode = argc > 2 ? argv[2] : "pipe";
+
+  fs::path tmp_dir = fs::temp_directory_path();
+  fs::path src_path = tmp_dir / ("adaptyst-bench-src." + std::to_string(getpid()));
+  fs::path dst_path = tmp_dir / ("adaptyst-bench-dst." + std::to_string(getpid()));
+
+  {
+    std::ofstream stream(src_path, std::ios_base::out | std::ios_base::binary);
+    std::string chunk(1048576, 'x');
+
+    for (unsigned long long i = 0; i < size_mib; i++) {
+      std::memset(chunk.data(), 'a' + i % 26, 64);
+      stream.write(chunk.data(), chunk.size());
+    }
+  }
+
+  double copy_seconds, zero_copy_seconds;
+
+  if (mode == "pipe") {
+    auto run = [&](bool zero_copy) {
+      int fds[2];
+
+      if (pipe(fds) != 0) {
+        throw std::runtime_error("pipe failed");
+      }
+
+      return measure([&]() {
+        if (zero_copy) {
+          FileDescriptor sender(nullptr, fds, 1);
+          sender.write(src_path);
+        } else {
+          copy_send(src_path, fds[1]);
+          ::close(fds[1]);
+        }
+      }, [&]() {
+        if (zero_copy) {
+          FileDescriptor receiver(fds, nullptr, 1);
+          receiver.read(dst_path, NO_TIMEOUT);
+        } else {
+          copy_receive(fds[0], dst_path);
+          ::close(fds[0]);
+        }
+      });
+    };
+
+    copy_seconds = run(false);
+    zero_copy_seconds = run(true);
+  } else if (mode == "tcp") {
+    auto run = [&](bool zero_copy) {
+      Poco::Net::ServerSocket server(Poco::Net::SocketAddress("127.0.0.1", 0));
+      Poco::Net::SocketAddress address = server.address();
+
+      return measure([&]() {
+        Poco::Net::StreamSocket socket(address);
+
+        if (zero_copy) {
+          TCPSocket sender(socket, 1);
+          sender.write(src_path);
+        } else {
+          copy_send(src_path, socket.impl()->sockfd());
+          socket.close();
+        }
+      }, [&]() {
+        Poco::Net::StreamSocket socket = server.acceptConnection();
+
+        if (zero_copy) {
+          TCPSocket receiver(socket, 1);
+          receiver.read(dst_path, NO_TIMEOUT);
+        } else {
+          copy_receive(socket.impl()->sockfd(), dst_path);
+          socket.close();
+        }
+      });
+    };
+
+    copy_seconds = run(false);
+    zero_copy_seconds = run(true);
+  } else {
+    std::cerr << "Unknown mode " << mode << "!" << std::endl;
+    return 1;
+  }
+
+  bool same_size = fs::file_size(src_path) == fs::file_size(dst_path);
+
+  fs::remove(src_path);
+  fs::remove(dst_path);
+
+  if (!same_size) {
+    std::cerr << "The received file differs in size from the sent one!" << std::endl;
+    return 1;
+  }
+
+  std::cout << "File size: " << size_mib << " MiB, mode: " << mode << std::endl;
+  std::cout << "Buffer copy: " << size_mib / copy_seconds << " MiB/s" << std::endl;
+  std::cout << "sendfile/splice: " << size_mib / zero_copy_seconds << " MiB/s" << std::endl;
+  std::cout << "Speedup: " << copy_seconds / zero_copy_seconds << "x" << std::endl;
+
+  return 0;
+}
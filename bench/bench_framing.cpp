@@ -0,0 +1,235 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+// A benchmark comparing the line framing previously used by TCPSocket
+// and FileDescriptor (std::getline() over the receive buffer with
+// a queue of copied lines) with LineFramer.
+//
+// Usage: bench-framing [number of lines] [line length] [buffer sizes...]
+//
+// The default buffer sizes are 1024 (the "-b" default of adaptyst-server),
+// 65536, and 1048576.
+
+#include "server/framer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+using namespace adaptyst;
+
+/**
+   A source returning at most a given number of bytes per read,
+   in the same way as a socket or a pipe.
+*/
+class MemorySource {
+private:
+  const std::string &data;
+  std::size_t pos;
+
+public:
+  MemorySource(const std::string &data) : data(data) {
+    this->pos = 0;
+  }
+
+  int read(char *buf, unsigned int len) {
+    unsigned int to_read = std::min((std::size_t)len, this->data.size() - this->pos);
+    std::memcpy(buf, this->data.data() + this->pos, to_read);
+    this->pos += to_read;
+    return to_read;
+  }
+};
+
+class charstreambuf : public std::streambuf {
+public:
+  charstreambuf(std::unique_ptr<char> &begin, unsigned int length) {
+    this->setg(begin.get(), begin.get(), begin.get() + length - 1);
+  }
+};
+
+/**
+   The previous line-reading algorithm of TCPSocket::read(long)
+   and FileDescriptor::read(long).
+*/
+class LegacyFramer {
+private:
+  MemorySource &source;
+  std::unique_ptr<char> buf;
+  unsigned int buf_size;
+  int start_pos;
+  std::queue<std::string> buffered_msgs;
+
+public:
+  LegacyFramer(MemorySource &source, unsigned int buf_size) : source(source) {
+    this->buf.reset(new char[buf_size]);
+    this->buf_size = buf_size;
+    this->start_pos = 0;
+  }
+
+  std::string read() {
+    if (!this->buffered_msgs.empty()) {
+      std::string msg = this->buffered_msgs.front();
+      this->buffered_msgs.pop();
+      return msg;
+    }
+
+    std::string cur_msg = "";
+
+    while (true) {
+      int bytes_received = this->source.read(this->buf.get() + this->start_pos,
+                                             this->buf_size - this->start_pos);
+
+      if (bytes_received == 0) {
+        return std::string(this->buf.get(), this->start_pos);
+      }
+
+      bool first_msg_to_receive = true;
+      std::string first_msg;
+
+      charstreambuf buf(this->buf, bytes_received + this->start_pos);
+      std::istream in(&buf);
+
+      int cur_pos = 0;
+      bool last_is_newline = this->buf.get()[bytes_received + this->start_pos - 1] == '\n';
+
+      while (!in.eof()) {
+        std::string msg;
+        std::getline(in, msg);
+
+        if (in.eof() && !last_is_newline) {
+          int size = bytes_received + this->start_pos - cur_pos;
+
+          if (size == this->buf_size) {
+            cur_msg += std::string(this->buf.get(), this->buf_size);
+            this->start_pos = 0;
+          } else {
+            std::memmove(this->buf.get(), this->buf.get() + cur_pos, size);
+            this->start_pos = size;
+          }
+        } else {
+          if (!cur_msg.empty() || !msg.empty()) {
+            if (first_msg_to_receive) {
+              first_msg = cur_msg + msg;
+              first_msg_to_receive = false;
+            } else {
+              this->buffered_msgs.push(cur_msg + msg);
+            }
+
+            cur_msg = "";
+          }
+
+          cur_pos += msg.length() + 1;
+        }
+      }
+
+      if (last_is_newline) {
+        this->start_pos = 0;
+      }
+
+      if (!first_msg_to_receive) {
+        return first_msg;
+      }
+    }
+  }
+};
+
+int main(int argc, char **argv) {
+  unsigned int line_count = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  unsigned int line_len = argc > 2 ? std::stoul(argv[2]) : 200;
+  std::vector<unsigned int> buf_sizes;
+
+  for (int i = 3; i < argc; i++) {
+    buf_sizes.push_back(std::stoul(argv[i]));
+  }
+
+  if (buf_sizes.empty()) {
+    buf_sizes = {1024, 65536, 1048576};
+  }
+
+  std::string data;
+  data.reserve((std::size_t)line_count * (line_len + 1));
+
+  for (unsigned int i = 0; i < line_count; i++) {
+    // Vary the line length a bit so that lines do not align with
+    // the buffer boundaries
+    data.append(line_len + (i % 17), 'a' + (i % 26));
+    data.push_back('\n');
+  }
+
+  data += "<STOP>\n";
+
+  for (unsigned int buf_size : buf_sizes) {
+    unsigned long long legacy_checksum = 0;
+    unsigned long long framer_checksum = 0;
+
+    auto legacy_start = std::chrono::steady_clock::now();
+
+    {
+      MemorySource source(data);
+      LegacyFramer framer(source, buf_size);
+
+      while (true) {
+        std::string line = framer.read();
+
+        if (line == "<STOP>" || line.empty()) {
+          break;
+        }
+
+        legacy_checksum += line.size();
+      }
+    }
+
+    auto legacy_end = std::chrono::steady_clock::now();
+
+    {
+      MemorySource source(data);
+      LineFramer framer(buf_size);
+      std::string_view line;
+      bool stop = false;
+
+      while (!stop) {
+        while (!framer.next(line)) {
+          unsigned int space = framer.get_write_space();
+          int bytes = source.read(framer.get_write_ptr(), space);
+
+          if (bytes == 0) {
+            stop = true;
+            break;
+          }
+
+          framer.commit(bytes);
+        }
+
+        if (stop || line == "<STOP>") {
+          break;
+        }
+
+        framer_checksum += line.size();
+      }
+    }
+
+    auto framer_end = std::chrono::steady_clock::now();
+
+    double legacy_s = std::chrono::duration<double>(legacy_end - legacy_start).count();
+    double framer_s = std::chrono::duration<double>(framer_end - legacy_end).count();
+
+    std::cout << "Buffer size " << buf_size << " B:" << std::endl;
+    std::cout << "  getline: " << (unsigned long long)(line_count / legacy_s)
+              << " lines/s" << std::endl;
+    std::cout << "  LineFramer: " << (unsigned long long)(line_count / framer_s)
+              << " lines/s" << std::endl;
+
+    if (legacy_checksum != framer_checksum) {
+      std::cerr << "Checksum mismatch (" << legacy_checksum << " vs "
+                << framer_checksum << ")!" << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
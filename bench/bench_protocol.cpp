@@ -0,0 +1,97 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+// A benchmark comparing the throughput of the JSON-line and binary
+// sample encodings used between the "perf" scripts and StdSubclient.
+//
+// Usage: bench-protocol [number of samples] [callchain length]
+
+#include "server/protocol.hpp"
+#include <nlohmann/json.hpp>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace adaptyst;
+
+int main(int argc, char **argv) {
+  unsigned int sample_count = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  unsigned int callchain_len = argc > 2 ? std::stoul(argv[2]) : 32;
+
+  protocol::Sample sample;
+  sample.event_type = "task-clock";
+  sample.pid = 123456;
+  sample.tid = 123470;
+  sample.time = 1234567890123456ULL;
+  sample.period = 1000000;
+
+  std::vector<std::pair<std::string, std::string> > json_callchain;
+
+  for (unsigned int i = 0; i < callchain_len; i++) {
+    sample.callchain.push_back({i * 7, 0x7f0000001000ULL + i * 0x40});
+    json_callchain.push_back(std::make_pair(std::to_string(i * 7),
+                                            protocol::offset_to_string(sample.callchain.back().offset)));
+  }
+
+  unsigned long long checksum = 0;
+
+  auto json_start = std::chrono::steady_clock::now();
+
+  for (unsigned int i = 0; i < sample_count; i++) {
+    nlohmann::json obj;
+    obj["type"] = "sample";
+    obj["event_type"] = sample.event_type;
+    obj["pid"] = std::to_string(sample.pid);
+    obj["tid"] = std::to_string(sample.tid);
+    obj["time"] = sample.time + i;
+    obj["period"] = sample.period;
+    obj["callchain"] = json_callchain;
+
+    std::string line = obj.dump();
+
+    nlohmann::json parsed = nlohmann::json::parse(line);
+    unsigned long long time = parsed["time"];
+    auto callchain = parsed["callchain"].template get<
+      std::vector<std::pair<std::string, std::string> > >();
+    checksum += time + callchain.size();
+  }
+
+  auto json_end = std::chrono::steady_clock::now();
+
+  std::string buf;
+  protocol::Sample decoded;
+
+  auto binary_start = std::chrono::steady_clock::now();
+
+  for (unsigned int i = 0; i < sample_count; i++) {
+    buf.clear();
+    sample.time++;
+    protocol::encode(sample, buf);
+
+    std::string_view payload(buf.data() + 4, buf.size() - 4);
+
+    if (protocol::get_type(payload) != protocol::SAMPLE ||
+        !protocol::decode(payload, decoded)) {
+      std::cerr << "Binary decoding failed!" << std::endl;
+      return 1;
+    }
+
+    checksum += decoded.time + decoded.callchain.size();
+  }
+
+  auto binary_end = std::chrono::steady_clock::now();
+
+  double json_seconds = std::chrono::duration<double>(json_end - json_start).count();
+  double binary_seconds = std::chrono::duration<double>(binary_end - binary_start).count();
+
+  std::cout << "Samples: " << sample_count << ", callchain length: ";
+  std::cout << callchain_len << " (checksum " << checksum << ")" << std::endl;
+  std::cout << "JSON:   " << (unsigned long long)(sample_count / json_seconds);
+  std::cout << " samples/s" << std::endl;
+  std::cout << "Binary: " << (unsigned long long)(sample_count / binary_seconds);
+  std::cout << " samples/s" << std::endl;
+  std::cout << "Speedup: " << json_seconds / binary_seconds << "x" << std::endl;
+
+  return 0;
+}
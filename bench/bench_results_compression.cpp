@@ -0,0 +1,137 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+// A benchmark reporting the size and time tradeoff of saving
+// a processed/<pid_tid>.json file compressed with zstd at different
+// levels (see ZstdOutputStream), compared with saving it uncompressed.
+// The file consists of a pair of call trees built from random samples
+// in the same way as by StdSubclient.
+//
+// Usage: bench-results-compression [number of samples] [zstd workers] [levels...]
+//
+// The default levels are 1, 3, 6, 9, 12, 15, and 19.
+
+#include "server/calltree.hpp"
+#include "server/zstdfile.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+using namespace adaptyst;
+
+/**
+   Runs a function and returns the time taken, in seconds.
+*/
+template<typename F> static double measure(F func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+  int sample_cnt = argc > 1 ? std::stoi(argv[1]) : 200000;
+  int workers = argc > 2 ? std::stoi(argv[2]) : 0;
+  std::vector<int> levels;
+
+  for (int i = 3; i < argc; i++) {
+    levels.push_back(std::stoi(argv[i]));
+  }
+
+  if (levels.empty()) {
+    levels = {1, 3, 6, 9, 12, 15, 19};
+  }
+
+  CallTree tree(false);
+  CallTree tree_time_ordered(true);
+
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<int> len_dist(2, 20);
+  std::uniform_int_distribution<int> leaf_len_dist(1, 4);
+  std::uniform_int_distribution<int> sym_dist(0, 200);
+  std::uniform_int_distribution<int> off_dist(0, 8);
+  std::uniform_int_distribution<int> period_dist(1, 100000);
+  std::bernoulli_distribution offcpu_dist(0.2);
+
+  // Callchains share long prefixes (as real ones do), so that the trees
+  // are deep rather than a flat list of random symbols
+  std::vector<protocol::CallchainElem> base;
+
+  for (int i = 0; i < 40; i++) {
+    base.push_back({(std::uint32_t)sym_dist(gen), (std::uint64_t)off_dist(gen) * 4});
+  }
+
+  for (int i = 0; i < sample_cnt; i++) {
+    std::vector<protocol::CallchainElem> callchain(base.begin(),
+                                                   base.begin() + len_dist(gen));
+    int extra = leaf_len_dist(gen);
+
+    for (int j = 0; j < extra; j++) {
+      callchain.push_back({(std::uint32_t)sym_dist(gen), (std::uint64_t)off_dist(gen) * 4});
+    }
+
+    unsigned long long period = period_dist(gen);
+    bool offcpu = offcpu_dist(gen);
+    tree.add(callchain, period, offcpu);
+    tree_time_ordered.add(callchain, period, offcpu);
+  }
+
+  std::stringstream content_stream;
+  content_stream << "{\"walltime\":[";
+  tree.write_json(content_stream);
+  content_stream << ",";
+  tree_time_ordered.write_json(content_stream);
+  content_stream << "]}" << std::endl;
+
+  std::string content = content_stream.str();
+  fs::path path = fs::temp_directory_path() /
+    ("adaptyst-bench-results." + std::to_string(getpid()) + ".json");
+  fs::path compressed_path = path;
+  compressed_path += ZSTD_FILE_EXTENSION;
+
+  double plain_write = measure([&]() {
+    std::ofstream stream(path, std::ios::out | std::ios::binary);
+    stream << content;
+  });
+
+  double plain_read = measure([&]() { read_processed_file(path); });
+
+  fs::remove(path);
+
+  std::printf("Uncompressed: %.2f MiB, write %.3f s, read %.3f s\n",
+              content.size() / 1048576.0, plain_write, plain_read);
+  std::printf("zstd workers: %d\n\n", workers);
+  std::printf("%5s %12s %8s %10s %10s %12s\n", "level", "size (MiB)", "ratio",
+              "write (s)", "read (s)", "write MiB/s");
+
+  for (int level : levels) {
+    double write = measure([&]() {
+      ZstdOutputStream stream(compressed_path, level, workers);
+      stream << content;
+      stream.close();
+    });
+
+    std::uintmax_t size = fs::file_size(compressed_path);
+    std::string decompressed;
+    double read = measure([&]() { decompressed = read_processed_file(path); });
+
+    if (decompressed != content) {
+      std::cerr << "Decompressed data do not match for level " << level << "!" << std::endl;
+      fs::remove(compressed_path);
+      return 1;
+    }
+
+    std::printf("%5d %12.2f %8.1f %10.3f %10.3f %12.1f\n", level, size / 1048576.0,
+                (double)content.size() / size, write, read,
+                content.size() / 1048576.0 / write);
+  }
+
+  fs::remove(compressed_path);
+
+  return 0;
+}
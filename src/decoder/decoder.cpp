@@ -0,0 +1,377 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "decoder.hpp"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       Constructs a CallchainFilter object.
+
+       @param settings The "data" element of the "filter_settings"
+                       message sent by the frontend.
+
+       @throw std::runtime_error If the settings are invalid or describe
+                                 a Python script filter.
+    */
+    CallchainFilter::CallchainFilter(nlohmann::json &settings) {
+      std::string type = settings.value("type", "");
+
+      if (type != "allow" && type != "deny") {
+        throw std::runtime_error("Filter type \"" + type + "\" is not "
+                                 "supported by adaptyst-perf-decode.");
+      }
+
+      this->allow = type == "allow";
+      this->mark = settings.value("mark", false);
+
+      static const std::regex condition_regex("^(SYM|EXEC|ANY) (.+)$");
+
+      for (auto &group : settings["conditions"]) {
+        std::vector<Condition> conditions;
+
+        for (auto &condition : group) {
+          std::string condition_str = condition.get<std::string>();
+          std::smatch match;
+
+          if (!std::regex_match(condition_str, match, condition_regex)) {
+            throw std::runtime_error("Filter condition \"" + condition_str +
+                                     "\" is invalid.");
+          }
+
+          ConditionType condition_type = match[1] == "SYM" ? SYM :
+            (match[1] == "EXEC" ? EXEC : ANY);
+          conditions.push_back({condition_type, std::regex(match[2].str())});
+        }
+
+        this->conditions.push_back(std::move(conditions));
+      }
+    }
+
+    bool CallchainFilter::satisfies(const SymbolName *symbol) {
+      for (auto &group : this->conditions) {
+        bool matched = true;
+
+        for (auto &condition : group) {
+          bool sym_matched = condition.type != EXEC &&
+            std::regex_search(symbol->name, condition.regex);
+          bool exec_matched = condition.type != SYM &&
+            std::regex_search(symbol->dso, condition.regex);
+
+          if (!sym_matched && !exec_matched) {
+            matched = false;
+            break;
+          }
+        }
+
+        if (matched) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    /**
+       Checks whether a callchain element should be kept. Decisions
+       are cached per symbol, as regex matching is expensive.
+    */
+    bool CallchainFilter::accepts(const SymbolName *symbol) {
+      if (symbol->id >= this->decisions.size()) {
+        this->decisions.resize(std::max<std::size_t>(symbol->id + 1,
+                                                     this->decisions.size() * 2),
+                               -1);
+      }
+
+      if (this->decisions[symbol->id] == -1) {
+        this->decisions[symbol->id] = this->satisfies(symbol) == this->allow;
+      }
+
+      return this->decisions[symbol->id];
+    }
+
+    /**
+       Checks whether every run of removed callchain elements should be
+       replaced with a "(cut)" element.
+    */
+    bool CallchainFilter::marks_cuts() {
+      return this->mark;
+    }
+
+    /**
+       Constructs a Decoder object.
+
+       @param symbolizer The symbolizer to use.
+       @param sender     The sample sender to use.
+       @param filter     The stack trace filter to use (nullptr if
+                         callchains should not be filtered). It is taken
+                         over by the new object.
+       @param max_stack  The maximum number of callchain elements
+                         to symbolize per sample, starting from
+                         the most recent call (same as --max-stack
+                         of perf-script).
+    */
+    Decoder::Decoder(Symbolizer &symbolizer,
+                     SampleSender &sender,
+                     std::unique_ptr<CallchainFilter> &filter,
+                     unsigned int max_stack) : symbolizer(symbolizer),
+                                               sender(sender) {
+      this->filter = std::move(filter);
+      this->max_stack = max_stack;
+      this->sampled = false;
+      this->lost = 0;
+    }
+
+    /**
+       Symbolizes and filters the callchain of a sample, storing
+       the result in this->callchain (starting from the outermost call).
+    */
+    void Decoder::make_callchain(PerfSample &sample, unsigned int stream) {
+      bool kernel = sample.cpumode == PERF_RECORD_MISC_KERNEL;
+      bool resolvable = kernel || sample.cpumode == PERF_RECORD_MISC_USER;
+
+      this->resolved.clear();
+
+      for (std::uint64_t ip : sample.callchain) {
+        if (ip >= PERF_CONTEXT_MAX) {
+          kernel = ip == PERF_CONTEXT_KERNEL;
+          resolvable = kernel || ip == PERF_CONTEXT_USER;
+          continue;
+        }
+
+        if (this->resolved.size() >= this->max_stack) {
+          break;
+        }
+
+        // Guest and hypervisor addresses are never resolved, which is
+        // achieved by looking them up in a process without any mappings
+        this->resolved.push_back(this->symbolizer.resolve(resolvable ? sample.pid : -1,
+                                                          ip, kernel));
+      }
+
+      this->callchain.clear();
+
+      if (this->filter) {
+        bool last_cut = false;
+
+        for (auto &elem : this->resolved) {
+          if (this->filter->accepts(elem.symbol)) {
+            this->callchain.push_back({this->sender.get_symbol(stream, elem.symbol),
+                                       elem.offset});
+            last_cut = false;
+          } else if (this->filter->marks_cuts() && !last_cut) {
+            this->callchain.push_back({this->sender.get_symbol(stream,
+                                                               this->symbolizer.intern("(cut)", "")),
+                                       NO_OFFSET});
+            last_cut = true;
+          }
+        }
+
+        std::reverse(this->callchain.begin(), this->callchain.end());
+      } else {
+        for (auto it = this->resolved.rbegin(); it != this->resolved.rend(); it++) {
+          this->callchain.push_back({this->sender.get_symbol(stream, it->symbol),
+                                     it->offset});
+        }
+      }
+    }
+
+    void Decoder::on_sample(PerfSample &sample) {
+      unsigned int stream = this->sender.get_stream(sample.pid, sample.tid);
+      this->make_callchain(sample, stream);
+      this->sender.add_sample(stream, sample.event->name, sample.pid, sample.tid,
+                              sample.time, sample.period, this->callchain);
+      this->sampled = true;
+    }
+
+    void Decoder::on_mmap(std::int32_t pid, std::uint64_t start,
+                          std::uint64_t len, std::uint64_t pgoff,
+                          std::string_view filename) {
+      this->symbolizer.add_mapping(pid, start, len, pgoff, filename);
+    }
+
+    void Decoder::on_comm(std::int32_t pid, std::int32_t /* tid */,
+                          std::string_view /* comm */, bool exec) {
+      if (exec) {
+        this->symbolizer.exec(pid);
+      }
+    }
+
+    void Decoder::on_fork(std::int32_t pid, std::int32_t ppid,
+                          std::int32_t /* tid */, std::int32_t /* ptid */) {
+      this->symbolizer.fork(pid, ppid);
+    }
+
+    void Decoder::on_lost(std::uint64_t count) {
+      this->lost += count;
+    }
+
+    void Decoder::on_idle() {
+      this->sender.flush();
+    }
+
+    /**
+       Checks whether any sample has been decoded.
+    */
+    bool Decoder::has_samples() {
+      return this->sampled;
+    }
+
+    /**
+       Gets the number of records the kernel has reported as lost
+       because of a full ring buffer.
+    */
+    std::uint64_t Decoder::get_lost() {
+      return this->lost;
+    }
+
+    /**
+       Constructs a ThreadTreeDecoder object.
+
+       The offsets of the tracepoint fields must be set with
+       set_field_offset() before any sample is handled.
+
+       @param symbolizer The symbolizer to use.
+       @param sender     The sample sender to use.
+       @param filter     The stack trace filter to use (nullptr if
+                         callchains should not be filtered). It is taken
+                         over by the new object.
+       @param max_stack  The maximum number of callchain elements
+                         to symbolize per sample.
+    */
+    ThreadTreeDecoder::ThreadTreeDecoder(Symbolizer &symbolizer,
+                                         SampleSender &sender,
+                                         std::unique_ptr<CallchainFilter> &filter,
+                                         unsigned int max_stack) : Decoder(symbolizer,
+                                                                           sender,
+                                                                           filter,
+                                                                           max_stack) {
+
+    }
+
+    /**
+       Sets the offset of a tracepoint field in the raw sample data.
+
+       @param event  The tracepoint name, e.g. "sched_process_fork".
+       @param field  The field name, e.g. "child_pid".
+       @param offset The offset of the field as described in the "format"
+                     file of the tracepoint.
+    */
+    void ThreadTreeDecoder::set_field_offset(std::string event, std::string field,
+                                             std::uint32_t offset) {
+      this->field_offsets[event + "/" + field] = offset;
+    }
+
+    /**
+       Gets the location of a tracepoint field in the raw data of a sample.
+
+       @return Whether the field exists and fits in the raw data.
+    */
+    bool ThreadTreeDecoder::get_field(PerfSample &sample, std::string field,
+                                      std::size_t size, const char *&data) {
+      auto it = this->field_offsets.find(sample.event->name + "/" + field);
+
+      if (it == this->field_offsets.end() || sample.raw == nullptr ||
+          it->second + size > sample.raw_size) {
+        return false;
+      }
+
+      data = sample.raw + it->second;
+      return true;
+    }
+
+    /**
+       Gets the name of a thread at the moment, reading it from /proc
+       if the thread has not been renamed since profiling started.
+    */
+    std::string &ThreadTreeDecoder::get_comm(std::int32_t pid, std::int32_t tid) {
+      auto it = this->comms.find(tid);
+
+      if (it != this->comms.end()) {
+        return it->second;
+      }
+
+      std::string comm;
+      std::ifstream comm_file("/proc/" + std::to_string(pid) + "/task/" +
+                              std::to_string(tid) + "/comm");
+
+      if (!comm_file || !std::getline(comm_file, comm)) {
+        comm = ":" + std::to_string(tid);
+      }
+
+      return this->comms[tid] = comm;
+    }
+
+    void ThreadTreeDecoder::on_sample(PerfSample &sample) {
+      const std::string &event = sample.event->name;
+      unsigned int stream = this->sender.get_stream(sample.pid, sample.tid);
+      const char *data;
+
+      // The thread name is taken from the tracepoint data if possible,
+      // as the names tracked with on_comm() may be more recent than
+      // the sample
+      std::string comm;
+
+      if ((this->get_field(sample, "parent_comm", 16, data) ||
+           this->get_field(sample, "comm", 16, data)) && data[0] != '\0') {
+        comm = std::string(data, strnlen(data, 16));
+      } else {
+        comm = this->get_comm(sample.pid, sample.tid);
+      }
+
+      if (event == "sched_process_fork") {
+        std::int32_t child_pid;
+
+        if (!this->get_field(sample, "child_pid", 4, data)) {
+          throw std::runtime_error("The data of tracepoint " + event +
+                                   " are invalid.");
+        }
+
+        std::memcpy(&child_pid, data, 4);
+
+        if (child_pid != 0) {
+          this->make_callchain(sample, stream);
+          this->sender.add_syscall(stream, child_pid, this->callchain);
+        }
+
+        this->sender.add_syscall_meta(stream, {"new_proc", comm, sample.pid,
+                                               sample.tid, sample.time,
+                                               child_pid});
+      } else if (event == "sched_process_exit") {
+        this->sender.add_syscall_meta(stream, {"exit", comm, sample.pid,
+                                               sample.tid, sample.time, 0});
+      } else if (event == "sys_exit_execve" || event == "sys_exit_execveat") {
+        std::int64_t ret;
+
+        if (!this->get_field(sample, "ret", 8, data)) {
+          throw std::runtime_error("The data of tracepoint " + event +
+                                   " are invalid.");
+        }
+
+        std::memcpy(&ret, data, 8);
+
+        if (ret == 0) {
+          this->sender.add_syscall_meta(stream, {"execve", comm, sample.pid,
+                                                 sample.tid, sample.time, 0});
+        }
+      }
+
+      this->sampled = true;
+    }
+
+    void ThreadTreeDecoder::on_comm(std::int32_t pid, std::int32_t tid,
+                                    std::string_view comm, bool exec) {
+      Decoder::on_comm(pid, tid, comm, exec);
+      this->comms[tid] = std::string(comm);
+    }
+
+    void ThreadTreeDecoder::on_fork(std::int32_t pid, std::int32_t ppid,
+                                    std::int32_t tid, std::int32_t ptid) {
+      Decoder::on_fork(pid, ppid, tid, ptid);
+      this->comms[tid] = this->get_comm(ppid, ptid);
+    }
+  };
+};
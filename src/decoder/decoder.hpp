@@ -0,0 +1,139 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef DECODER_HPP_
+#define DECODER_HPP_
+
+#include "perfstream.hpp"
+#include "symbolizer.hpp"
+#include "sender.hpp"
+#include <nlohmann/json.hpp>
+#include <regex>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A class describing an allowlist/denylist stack trace filter,
+       as sent by the frontend in the "filter_settings" message
+       (see Perf::Filter). Python script filters are not supported.
+    */
+    class CallchainFilter {
+    private:
+      enum ConditionType {
+        SYM,
+        EXEC,
+        ANY
+      };
+
+      struct Condition {
+        ConditionType type;
+        std::regex regex;
+      };
+
+      bool allow;
+      bool mark;
+      std::vector<std::vector<Condition> > conditions;
+      std::vector<std::int8_t> decisions;
+
+      bool satisfies(const SymbolName *symbol);
+
+    public:
+      CallchainFilter(nlohmann::json &settings);
+      bool accepts(const SymbolName *symbol);
+      bool marks_cuts();
+    };
+
+    /**
+       A structure describing a copy of a sample handled later than
+       it has been decoded, e.g. by another thread.
+    */
+    struct QueuedSample {
+      PerfSample sample;
+
+      // The copy of the tracepoint data of the sample
+      std::string raw;
+
+      QueuedSample(PerfSample &sample) : sample(sample) {
+        if (sample.raw != nullptr) {
+          this->raw = std::string(sample.raw, sample.raw_size);
+        }
+      }
+
+      PerfSample &get() {
+        this->sample.raw = this->sample.raw == nullptr ? nullptr : this->raw.data();
+        return this->sample;
+      }
+    };
+
+    /**
+       A class handling the records of a "perf" pipe-mode stream:
+       samples are symbolized, filtered, and passed to SampleSender,
+       and everything else is used for keeping track of the memory
+       mappings of profiled processes.
+    */
+    class Decoder : public PerfStream::Handler {
+    protected:
+      Symbolizer &symbolizer;
+      SampleSender &sender;
+      std::unique_ptr<CallchainFilter> filter;
+      unsigned int max_stack;
+      bool sampled;
+      std::uint64_t lost;
+      std::vector<ResolvedIp> resolved;
+      std::vector<protocol::CallchainElem> callchain;
+
+      void make_callchain(PerfSample &sample, unsigned int stream);
+
+    public:
+      Decoder(Symbolizer &symbolizer,
+              SampleSender &sender,
+              std::unique_ptr<CallchainFilter> &filter,
+              unsigned int max_stack);
+      void on_sample(PerfSample &sample);
+      void on_mmap(std::int32_t pid, std::uint64_t start,
+                   std::uint64_t len, std::uint64_t pgoff,
+                   std::string_view filename);
+      void on_comm(std::int32_t pid, std::int32_t tid,
+                   std::string_view comm, bool exec);
+      void on_fork(std::int32_t pid, std::int32_t ppid,
+                   std::int32_t tid, std::int32_t ptid);
+      void on_lost(std::uint64_t count);
+      void on_idle();
+      bool has_samples();
+      std::uint64_t get_lost();
+    };
+
+    /**
+       A class handling the records of the tracepoints used for
+       building the thread tree (sched:sched_process_fork,
+       sched:sched_process_exit, syscalls:sys_exit_execve, and
+       syscalls:sys_exit_execveat), sending the same messages
+       to adaptyst-server as adaptyst-syscall-process.py.
+    */
+    class ThreadTreeDecoder : public Decoder {
+    private:
+      std::unordered_map<std::string, std::uint32_t> field_offsets;
+      std::unordered_map<std::int32_t, std::string> comms;
+
+      bool get_field(PerfSample &sample, std::string field,
+                     std::size_t size, const char *&data);
+
+      std::string &get_comm(std::int32_t pid, std::int32_t tid);
+
+    public:
+      ThreadTreeDecoder(Symbolizer &symbolizer,
+                        SampleSender &sender,
+                        std::unique_ptr<CallchainFilter> &filter,
+                        unsigned int max_stack);
+      void set_field_offset(std::string event, std::string field,
+                            std::uint32_t offset);
+      void on_sample(PerfSample &sample);
+      void on_comm(std::int32_t pid, std::int32_t tid,
+                   std::string_view comm, bool exec);
+      void on_fork(std::int32_t pid, std::int32_t ppid,
+                   std::int32_t tid, std::int32_t ptid);
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,132 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "frontend.hpp"
+#include "server/protocol.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       Constructs a FrontendConnection object and establishes
+       the connection.
+
+       @param instrs The connection instructions of a pipe acceptor
+                     of the frontend, i.e. "pipe <read fd>_<write fd>".
+
+       @throw std::runtime_error If the instructions are not supported
+                                 or the connection cannot be established.
+    */
+    FrontendConnection::FrontendConnection(std::string instrs) {
+      std::size_t space = instrs.find(' ');
+      std::size_t underscore = instrs.find('_', space);
+
+      if (instrs.substr(0, space) != "pipe" || underscore == std::string::npos) {
+        throw std::runtime_error("The frontend connection instructions \"" +
+                                 instrs + "\" are not supported.");
+      }
+
+      this->read_fd = std::stoi(instrs.substr(space + 1, underscore - space - 1));
+      this->write_fd = std::stoi(instrs.substr(underscore + 1));
+      this->write("connect");
+    }
+
+    FrontendConnection::~FrontendConnection() {
+      close(this->read_fd);
+      close(this->write_fd);
+    }
+
+    /**
+       Sends a message to the frontend as is.
+
+       @throw std::runtime_error In case of a write error.
+    */
+    void FrontendConnection::write(std::string msg) {
+      const char *data = msg.data();
+      std::size_t len = msg.size();
+
+      while (len > 0) {
+        ssize_t written = ::write(this->write_fd, data, len);
+
+        if (written == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+
+          throw std::runtime_error("Could not send data to the frontend: " +
+                                   std::string(std::strerror(errno)));
+        }
+
+        data += written;
+        len -= written;
+      }
+    }
+
+    /**
+       Reads a line sent by the frontend.
+
+       @param line The string where the line (without the newline
+                   character) should be stored.
+
+       @return Whether the line has been read (false means that
+               the frontend has closed the connection).
+    */
+    bool FrontendConnection::read_line(std::string &line) {
+      while (true) {
+        std::size_t newline = this->buf.find('\n');
+
+        if (newline != std::string::npos) {
+          line = this->buf.substr(0, newline);
+          this->buf.erase(0, newline + 1);
+          return true;
+        }
+
+        char data[4096];
+        ssize_t bytes = read(this->read_fd, data, sizeof(data));
+
+        if (bytes == -1 && errno == EINTR) {
+          continue;
+        } else if (bytes <= 0) {
+          return false;
+        }
+
+        this->buf.append(data, bytes);
+      }
+    }
+
+    /**
+       Sends the executable/library offsets of all samples and
+       the missing "perf" symbol maps to the frontend, followed by
+       the end-of-messages marker.
+
+       @param symbolizer The symbolizer used for profiling.
+       @param sampled    Whether any sample has been received (the offsets
+                         are not sent otherwise, as in adaptyst-process.py).
+
+       @throw std::runtime_error In case of a write error.
+    */
+    void FrontendConnection::send_results(Symbolizer &symbolizer, bool sampled) {
+      if (sampled) {
+        nlohmann::json sources = nlohmann::json::object();
+
+        for (auto &[dso, offsets] : symbolizer.get_sources()) {
+          nlohmann::json &offset_list = sources[dso] = nlohmann::json::array();
+
+          for (auto &offset : offsets) {
+            offset_list.push_back(protocol::offset_to_string(offset));
+          }
+        }
+
+        this->write(nlohmann::json({{"type", "sources"},
+                                    {"data", sources}}).dump() + "\n");
+      }
+
+      this->write(nlohmann::json({{"type", "missing_symbol_maps"},
+                                  {"data", symbolizer.get_missing_maps()}}).dump() + "\n");
+      this->write("<STOP>\n");
+    }
+  };
+};
@@ -0,0 +1,35 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef FRONTEND_HPP_
+#define FRONTEND_HPP_
+
+#include "symbolizer.hpp"
+#include <nlohmann/json.hpp>
+#include <string>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A class describing the pipe connection to the frontend
+       (ADAPTYST_CONNECT in adaptyst-process.py), used for receiving
+       the profiling settings and sending the information needed for
+       post-processing.
+    */
+    class FrontendConnection {
+    private:
+      int read_fd;
+      int write_fd;
+      std::string buf;
+
+    public:
+      FrontendConnection(std::string instrs);
+      ~FrontendConnection();
+      void write(std::string msg);
+      bool read_line(std::string &line);
+      void send_results(Symbolizer &symbolizer, bool sampled);
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,493 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "live.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A structure describing a reader thread of LiveSession.
+    */
+    struct LiveSession::Reader : public PerfRecordDecoder::Handler {
+      LiveSession &session;
+      unsigned int index;
+      std::vector<PerfEventRing *> rings;
+      PerfRecordDecoder record_decoder;
+      std::unique_ptr<SampleSender> sender;
+      std::unique_ptr<Decoder> decoder;
+      std::unordered_map<std::uint64_t, unsigned int> owner_cache;
+
+      // The time all records written before have been drained by
+      // the reader
+      std::atomic<std::uint64_t> watermark;
+
+      // The samples passed by other readers
+      std::mutex inbox_mutex;
+      std::vector<QueuedSample> inbox;
+
+      // The samples waiting for the watermarks of all readers
+      std::vector<QueuedSample> pending;
+
+      std::thread thread;
+
+      Reader(LiveSession &session, unsigned int index) : session(session) {
+        this->index = index;
+        this->watermark = 0;
+      }
+
+      void on_sample(PerfSample &sample) {
+        QueuedSample queued(sample);
+
+        unsigned int owner = this->session.get_owner(*this, sample.pid,
+                                                     sample.tid);
+
+        if (owner == this->index) {
+          this->pending.push_back(std::move(queued));
+        } else {
+          Reader &target = *this->session.readers[owner];
+          std::lock_guard lock(target.inbox_mutex);
+          target.inbox.push_back(std::move(queued));
+        }
+      }
+
+      void on_mmap(std::int32_t pid, std::uint64_t start,
+                   std::uint64_t len, std::uint64_t pgoff,
+                   std::string_view filename) {
+        this->decoder->on_mmap(pid, start, len, pgoff, filename);
+      }
+
+      void on_comm(std::int32_t pid, std::int32_t tid,
+                   std::string_view comm, bool exec) {
+        this->decoder->on_comm(pid, tid, comm, exec);
+      }
+
+      void on_fork(std::int32_t pid, std::int32_t ppid,
+                   std::int32_t tid, std::int32_t ptid) {
+        this->decoder->on_fork(pid, ppid, tid, ptid);
+      }
+
+      void on_exit(std::int32_t pid, std::int32_t tid) {
+        this->decoder->on_exit(pid, tid);
+      }
+
+      void on_lost(std::uint64_t count) {
+        this->decoder->on_lost(count);
+      }
+    };
+
+    static std::uint64_t get_monotonic_time() {
+      timespec time;
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      return (std::uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+    }
+
+    /**
+       Constructs a LiveSession object, opening all events (disabled)
+       on every given CPU.
+
+       @param events      The events to profile.
+       @param pid         The PID of the process to profile (the process
+                          should not have started executing the profiled
+                          program yet, as the events are inherited only
+                          by threads and processes spawned afterwards).
+       @param cpus        The CPUs to open the events on.
+       @param thread_tree Whether the events are the tracepoints used
+                          for building the thread tree (see
+                          ThreadTreeDecoder).
+
+       @throw std::runtime_error In case of any error when opening
+                                 the events.
+    */
+    LiveSession::LiveSession(std::vector<LiveEvent> &events, pid_t pid,
+                             std::vector<int> &cpus, bool thread_tree) {
+      this->events = events;
+      this->thread_tree = thread_tree;
+      this->next_owner = 0;
+      this->finished = 0;
+      this->stopping = false;
+      this->event_ids.resize(this->events.size());
+
+      long page_size = sysconf(_SC_PAGESIZE);
+
+      for (int i = 0; i < this->events.size(); i++) {
+        perf_event_attr &attr = this->events[i].attr;
+        attr.size = sizeof(perf_event_attr);
+        attr.sample_type |= PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID |
+          PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD | PERF_SAMPLE_CALLCHAIN;
+
+        if (attr.type == PERF_TYPE_TRACEPOINT) {
+          attr.sample_type |= PERF_SAMPLE_RAW;
+        }
+
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.use_clockid = 1;
+        attr.clockid = CLOCK_MONOTONIC;
+        attr.sample_id_all = 1;
+        attr.watermark = 1;
+        attr.wakeup_watermark = PERF_RING_PAGES * page_size / 2;
+
+        // Memory mappings and thread changes need to be written to
+        // a ring buffer only once
+        bool sideband = i == 0;
+        attr.mmap = sideband;
+        attr.comm = sideband;
+        attr.comm_exec = sideband;
+        attr.task = sideband;
+      }
+
+      for (int cpu : cpus) {
+        std::unique_ptr<PerfEventRing> ring = std::make_unique<PerfEventRing>();
+
+        for (int i = 0; i < this->events.size(); i++) {
+          this->event_ids[i].push_back(ring->add_event(this->events[i].attr,
+                                                       pid, cpu));
+        }
+
+        this->rings.push_back(std::move(ring));
+      }
+    }
+
+    LiveSession::~LiveSession() {
+      this->stop();
+
+      for (auto &reader : this->readers) {
+        if (reader->thread.joinable()) {
+          reader->thread.join();
+        }
+      }
+    }
+
+    /**
+       Starts the reader threads, one per adaptyst-server connection.
+       The ring buffers are distributed evenly among the threads.
+
+       @param connections     The adaptyst-server connections. They are
+                              taken over by the session.
+       @param binary          Whether adaptyst-server should be talked to
+                              in the binary protocol (see SampleSender).
+       @param aggregate_window The sample aggregation window (see
+                              SampleSender).
+       @param filter_settings The stack trace filter settings as sent
+                              by the frontend (nullptr if callchains
+                              should not be filtered).
+       @param max_stack       The maximum number of callchain elements
+                              to symbolize per sample.
+       @param affinity        The CPUs the reader threads should run on.
+
+       @throw std::runtime_error In case of no connections or any error
+                                 when talking to adaptyst-server.
+    */
+    void LiveSession::start(std::vector<std::unique_ptr<ServerStream> > &connections,
+                            bool binary, unsigned int aggregate_window,
+                            nlohmann::json *filter_settings, unsigned int max_stack,
+                            cpu_set_t affinity) {
+      if (connections.empty()) {
+        throw std::runtime_error("No adaptyst-server connections have been provided.");
+      }
+
+      for (int i = 0; i < connections.size(); i++) {
+        std::unique_ptr<Reader> reader = std::make_unique<Reader>(*this, i);
+
+        for (int j = i; j < this->rings.size(); j += connections.size()) {
+          reader->rings.push_back(this->rings[j].get());
+        }
+
+        for (int j = 0; j < this->events.size(); j++) {
+          reader->record_decoder.add_event(this->events[j].attr,
+                                           this->events[j].name,
+                                           this->event_ids[j]);
+        }
+
+        std::vector<std::unique_ptr<ServerStream> > reader_connections;
+        reader_connections.push_back(std::move(connections[i]));
+
+        reader->sender = std::make_unique<SampleSender>(reader_connections,
+                                                        binary,
+                                                        aggregate_window);
+
+        std::unique_ptr<CallchainFilter> filter;
+
+        if (filter_settings) {
+          filter = std::make_unique<CallchainFilter>(*filter_settings);
+        }
+
+        if (this->thread_tree) {
+          std::unique_ptr<ThreadTreeDecoder> decoder =
+            std::make_unique<ThreadTreeDecoder>(this->symbolizer, *reader->sender,
+                                                filter, max_stack);
+
+          for (auto &event : this->events) {
+            for (auto &offset : event.field_offsets) {
+              decoder->set_field_offset(event.name, offset.first, offset.second);
+            }
+          }
+
+          reader->decoder = std::move(decoder);
+        } else {
+          reader->decoder = std::make_unique<Decoder>(this->symbolizer,
+                                                      *reader->sender,
+                                                      filter, max_stack);
+        }
+
+        this->readers.push_back(std::move(reader));
+      }
+
+      connections.clear();
+
+      for (auto &reader : this->readers) {
+        Reader *reader_ptr = reader.get();
+        reader->thread = std::thread([this, reader_ptr, affinity]() {
+          pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity);
+          this->run(*reader_ptr);
+        });
+      }
+    }
+
+    /**
+       Gets the reader thread all samples of a given thread should
+       be handled by. Threads are assigned to readers on a round-robin
+       basis when they are first seen.
+    */
+    unsigned int LiveSession::get_owner(Reader &reader, std::int32_t pid,
+                                        std::int32_t tid) {
+      std::uint64_t key = ((std::uint64_t)(std::uint32_t)pid << 32) |
+        (std::uint32_t)tid;
+
+      auto it = reader.owner_cache.find(key);
+
+      if (it != reader.owner_cache.end()) {
+        return it->second;
+      }
+
+      std::lock_guard lock(this->owners_mutex);
+      auto owner = this->owners.find(key);
+      unsigned int index;
+
+      if (owner == this->owners.end()) {
+        index = this->next_owner;
+        this->next_owner = (this->next_owner + 1) % this->readers.size();
+        this->owners[key] = index;
+      } else {
+        index = owner->second;
+      }
+
+      reader.owner_cache[key] = index;
+      return index;
+    }
+
+    /**
+       Symbolizes and sends the samples of a reader which are older than
+       the watermarks of all readers (or all its samples if "all" is
+       true), in the time order.
+    */
+    void LiveSession::process(Reader &reader, bool all) {
+      std::uint64_t watermark = std::numeric_limits<std::uint64_t>::max();
+
+      // The watermarks must be read before the inbox: a sample passed
+      // by another reader after that is newer than its watermark
+      if (!all) {
+        for (auto &r : this->readers) {
+          watermark = std::min(watermark,
+                               r->watermark.load(std::memory_order_acquire));
+        }
+      }
+
+      {
+        std::lock_guard lock(reader.inbox_mutex);
+
+        for (auto &sample : reader.inbox) {
+          reader.pending.push_back(std::move(sample));
+        }
+
+        reader.inbox.clear();
+      }
+
+      if (!reader.pending.empty()) {
+        std::stable_sort(reader.pending.begin(), reader.pending.end(),
+                         [](const QueuedSample &a, const QueuedSample &b) {
+                           return a.sample.time < b.sample.time;
+                         });
+
+        auto end = reader.pending.end();
+
+        if (!all) {
+          end = std::lower_bound(reader.pending.begin(), reader.pending.end(),
+                                 watermark,
+                                 [](const QueuedSample &a, std::uint64_t time) {
+                                   return a.sample.time < time;
+                                 });
+        }
+
+        for (auto it = reader.pending.begin(); it != end; it++) {
+          reader.decoder->on_sample(it->get());
+        }
+
+        reader.pending.erase(reader.pending.begin(), end);
+      }
+
+      reader.decoder->on_idle();
+    }
+
+    /**
+       Runs a reader thread until all profiled threads have exited
+       (or stop() has been called) and all samples have been sent.
+    */
+    void LiveSession::run(Reader &reader) {
+      std::vector<pollfd> fds;
+
+      for (auto &ring : reader.rings) {
+        fds.push_back({ring->get_fd(), POLLIN, 0});
+      }
+
+      try {
+        bool hang_up = fds.empty();
+
+        while (true) {
+          bool done = hang_up || this->stopping;
+          std::uint64_t time = get_monotonic_time();
+
+          for (auto &ring : reader.rings) {
+            ring->drain(reader.record_decoder, reader);
+          }
+
+          reader.watermark.store(done ? std::numeric_limits<std::uint64_t>::max() : time,
+                                 std::memory_order_release);
+          this->process(reader, false);
+
+          if (done) {
+            break;
+          }
+
+          if (poll(fds.data(), fds.size(), LIVE_POLL_INTERVAL_MS) == -1 &&
+              errno != EINTR) {
+            throw std::runtime_error("Could not poll the perf ring buffers, code " +
+                                     std::to_string(errno) + ".");
+          }
+
+          // POLLHUP is reported when all threads the events have been
+          // inherited by have exited
+          hang_up = std::all_of(fds.begin(), fds.end(), [](pollfd &fd) {
+            return (fd.revents & POLLHUP) != 0;
+          });
+        }
+      } catch (std::exception &e) {
+        std::lock_guard lock(this->error_mutex);
+
+        if (this->error.empty()) {
+          this->error = e.what();
+        }
+
+        this->stopping = true;
+        reader.watermark.store(std::numeric_limits<std::uint64_t>::max(),
+                               std::memory_order_release);
+      }
+
+      this->finished++;
+
+      try {
+        // Other readers may still pass samples until they finish
+        while (this->finished < this->readers.size()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(LIVE_POLL_INTERVAL_MS));
+          this->process(reader, false);
+        }
+
+        this->process(reader, true);
+        reader.sender->close();
+      } catch (std::exception &e) {
+        std::lock_guard lock(this->error_mutex);
+
+        if (this->error.empty()) {
+          this->error = e.what();
+        }
+      }
+    }
+
+    /**
+       Enables all events.
+    */
+    void LiveSession::enable() {
+      for (auto &ring : this->rings) {
+        ring->enable();
+      }
+    }
+
+    /**
+       Disables all events.
+    */
+    void LiveSession::disable() {
+      for (auto &ring : this->rings) {
+        ring->disable();
+      }
+    }
+
+    /**
+       Makes the reader threads finish after draining the ring buffers
+       once more, even if the profiled threads are still running.
+    */
+    void LiveSession::stop() {
+      this->stopping = true;
+    }
+
+    /**
+       Waits for all reader threads to finish.
+
+       @throw std::runtime_error In case of any error in a reader thread.
+    */
+    void LiveSession::wait() {
+      for (auto &reader : this->readers) {
+        if (reader->thread.joinable()) {
+          reader->thread.join();
+        }
+      }
+
+      if (!this->error.empty()) {
+        throw std::runtime_error(this->error);
+      }
+    }
+
+    /**
+       Gets the symbolizer shared by all reader threads.
+    */
+    Symbolizer &LiveSession::get_symbolizer() {
+      return this->symbolizer;
+    }
+
+    /**
+       Checks whether any sample has been sent. Must be called only
+       after wait().
+    */
+    bool LiveSession::has_samples() {
+      for (auto &reader : this->readers) {
+        if (reader->decoder->has_samples()) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    /**
+       Gets the number of records the kernel has reported as lost
+       because of full ring buffers. Must be called only after wait().
+    */
+    std::uint64_t LiveSession::get_lost() {
+      std::uint64_t lost = 0;
+
+      for (auto &reader : this->readers) {
+        lost += reader->decoder->get_lost();
+      }
+
+      return lost;
+    }
+  };
+};
@@ -0,0 +1,94 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef LIVE_HPP_
+#define LIVE_HPP_
+
+#include "decoder.hpp"
+#include "ring.hpp"
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+
+// The interval at which reader threads check the ring buffers even
+// if the kernel has not woken them up, in milliseconds
+#ifndef LIVE_POLL_INTERVAL_MS
+#define LIVE_POLL_INTERVAL_MS 10
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A structure describing an event to be profiled by LiveSession.
+    */
+    struct LiveEvent {
+      // The attribute of the event. The fields which LiveSession needs
+      // for decoding (e.g. the sample type or the clock) are
+      // overwritten.
+      perf_event_attr attr;
+
+      // The name of the event as sent to adaptyst-server
+      std::string name;
+
+      // The offsets of the tracepoint fields (for thread tree
+      // profiling only)
+      std::unordered_map<std::string, std::uint32_t> field_offsets;
+    };
+
+    /**
+       A class describing an in-process profiling session, where
+       events are opened with perf_event_open() on every given CPU
+       (with their records going to one ring buffer per CPU) and
+       the ring buffers are drained by reader threads, which send
+       samples to adaptyst-server in the same way as adaptyst-process.py
+       (or adaptyst-syscall-process.py) does.
+
+       Every thread of the profiled program is assigned to one reader
+       thread, which receives all samples of the thread regardless of
+       the ring buffer they have been written to. Samples are symbolized
+       only when all reader threads have drained their ring buffers past
+       the sample time, so that the memory mappings written to other
+       ring buffers in the meantime are taken into account.
+    */
+    class LiveSession {
+    private:
+      struct Reader;
+
+      std::vector<std::unique_ptr<PerfEventRing> > rings;
+      std::vector<LiveEvent> events;
+      std::vector<std::vector<std::uint64_t> > event_ids;
+      bool thread_tree;
+      Symbolizer symbolizer;
+      std::vector<std::unique_ptr<Reader> > readers;
+      std::mutex owners_mutex;
+      std::unordered_map<std::uint64_t, unsigned int> owners;
+      unsigned int next_owner;
+      std::atomic<unsigned int> finished;
+      std::atomic<bool> stopping;
+      std::mutex error_mutex;
+      std::string error;
+
+      unsigned int get_owner(Reader &reader, std::int32_t pid, std::int32_t tid);
+      void process(Reader &reader, bool all);
+      void run(Reader &reader);
+
+    public:
+      LiveSession(std::vector<LiveEvent> &events, pid_t pid,
+                  std::vector<int> &cpus, bool thread_tree);
+      ~LiveSession();
+      void start(std::vector<std::unique_ptr<ServerStream> > &connections,
+                 bool binary, unsigned int aggregate_window,
+                 nlohmann::json *filter_settings, unsigned int max_stack,
+                 cpu_set_t affinity);
+      void enable();
+      void disable();
+      void stop();
+      void wait();
+      Symbolizer &get_symbolizer();
+      bool has_samples();
+      std::uint64_t get_lost();
+    };
+  };
+};
+
+#endif
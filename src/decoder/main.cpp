@@ -0,0 +1,104 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+// adaptyst-perf-decode is a native replacement for
+// "perf script -s adaptyst-process.py": it reads the pipe-mode output of
+// "perf record" from stdin and talks to the frontend and adaptyst-server
+// in exactly the same way as adaptyst-process.py does (see the latter
+// for the description of the environment variables used).
+
+#include "decoder.hpp"
+#include "frontend.hpp"
+#include "parallel.hpp"
+#include <cstdlib>
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace adaptyst::decoder;
+
+int main(int argc, char **argv) {
+  // A closed connection should result in an error rather than
+  // in a silent termination
+  signal(SIGPIPE, SIG_IGN);
+
+  unsigned int max_stack = 1024;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+
+    if (arg.starts_with("--max-stack=")) {
+      max_stack = std::stoul(arg.substr(12));
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--max-stack=N] < perf-record-output" << std::endl;
+      return 2;
+    }
+  }
+
+  try {
+    std::unique_ptr<FrontendConnection> frontend;
+    std::unique_ptr<CallchainFilter> filter;
+    nlohmann::json filter_settings;
+
+    if (getenv("ADAPTYST_CONNECT")) {
+      frontend = std::make_unique<FrontendConnection>(getenv("ADAPTYST_CONNECT"));
+
+      std::string line;
+
+      while (frontend->read_line(line) && line != "<STOP>") {
+        nlohmann::json command = nlohmann::json::parse(line);
+
+        if (command["type"] == "filter_settings") {
+          filter_settings = command["data"];
+          filter = std::make_unique<CallchainFilter>(filter_settings);
+        }
+      }
+    }
+
+    if (!getenv("ADAPTYST_SERV_CONNECT")) {
+      throw std::runtime_error("ADAPTYST_SERV_CONNECT is not set.");
+    }
+
+    char *compression = getenv("ADAPTYST_COMPRESSION");
+    char *protocol = getenv("ADAPTYST_PROTOCOL");
+    char *aggregate_window = getenv("ADAPTYST_AGGREGATE");
+
+    std::vector<std::unique_ptr<ServerStream> > connections =
+      ServerStream::connect(getenv("ADAPTYST_SERV_CONNECT"),
+                            compression && std::string(compression) == "zstd");
+
+    bool binary = !protocol || std::string(protocol) == "binary";
+    unsigned int window = aggregate_window ? std::stoul(aggregate_window) : 0;
+    Symbolizer symbolizer;
+    PerfStream stream(STDIN_FILENO);
+    bool sampled;
+
+    // With more than one adaptyst-server connection (i.e. more than
+    // one profiler thread), samples are decoded by one thread per
+    // connection
+    if (connections.size() > 1) {
+      ParallelDecoder decoder(symbolizer, connections, binary, window,
+                              filter ? &filter_settings : nullptr, max_stack);
+
+      stream.process(decoder);
+      decoder.close();
+      sampled = decoder.has_samples();
+    } else {
+      SampleSender sender(connections, binary, window);
+      Decoder decoder(symbolizer, sender, filter, max_stack);
+
+      stream.process(decoder);
+      sender.close();
+      sampled = decoder.has_samples();
+    }
+
+    if (frontend) {
+      frontend->send_results(symbolizer, sampled);
+    }
+  } catch (std::exception &e) {
+    std::cerr << "adaptyst-perf-decode: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,368 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "parallel.hpp"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A structure describing a worker thread of ParallelDecoder.
+    */
+    struct ParallelDecoder::Worker {
+      std::unique_ptr<SampleSender> sender;
+      std::unique_ptr<Decoder> decoder;
+
+      // The samples collected by the thread reading the stream,
+      // not passed to the worker yet
+      std::vector<QueuedSample> batch;
+
+      std::mutex mutex;
+      std::condition_variable cond;
+
+      // The samples passed to the worker
+      std::vector<QueuedSample> queue;
+
+      // Whether the worker is handling samples taken from the queue
+      bool busy;
+
+      bool closing;
+      std::thread thread;
+
+      Worker() {
+        this->busy = false;
+        this->closing = false;
+      }
+    };
+
+    /**
+       Constructs a ParallelDecoder object and starts its worker threads,
+       one per adaptyst-server connection.
+
+       @param symbolizer      The symbolizer to use (shared by all
+                              worker threads).
+       @param connections     The adaptyst-server connections. They are
+                              taken over by the decoder.
+       @param binary          Whether adaptyst-server should be talked to
+                              in the binary protocol (see SampleSender).
+       @param aggregate_window The sample aggregation window (see
+                              SampleSender).
+       @param filter_settings The stack trace filter settings as sent
+                              by the frontend (nullptr if callchains
+                              should not be filtered).
+       @param max_stack       The maximum number of callchain elements
+                              to symbolize per sample.
+
+       @throw std::runtime_error In case of no connections or any error
+                                 when talking to adaptyst-server.
+    */
+    ParallelDecoder::ParallelDecoder(Symbolizer &symbolizer,
+                                     std::vector<std::unique_ptr<ServerStream> > &connections,
+                                     bool binary, unsigned int aggregate_window,
+                                     nlohmann::json *filter_settings,
+                                     unsigned int max_stack) : symbolizer(symbolizer) {
+      this->next_owner = 0;
+      this->lost = 0;
+      this->failed = false;
+
+      if (connections.empty()) {
+        throw std::runtime_error("No adaptyst-server connections have been provided.");
+      }
+
+      for (auto &connection : connections) {
+        std::unique_ptr<Worker> worker = std::make_unique<Worker>();
+
+        std::vector<std::unique_ptr<ServerStream> > worker_connections;
+        worker_connections.push_back(std::move(connection));
+
+        worker->sender = std::make_unique<SampleSender>(worker_connections,
+                                                        binary,
+                                                        aggregate_window);
+
+        std::unique_ptr<CallchainFilter> filter;
+
+        if (filter_settings) {
+          filter = std::make_unique<CallchainFilter>(*filter_settings);
+        }
+
+        worker->decoder = std::make_unique<Decoder>(symbolizer, *worker->sender,
+                                                    filter, max_stack);
+        this->workers.push_back(std::move(worker));
+      }
+
+      connections.clear();
+
+      for (auto &worker : this->workers) {
+        Worker *worker_ptr = worker.get();
+        worker->thread = std::thread([this, worker_ptr]() {
+          this->run(*worker_ptr);
+        });
+      }
+    }
+
+    ParallelDecoder::~ParallelDecoder() {
+      // Nothing more is sent to adaptyst-server if close() has not
+      // been called, e.g. because of an error when reading the stream
+      this->failed = true;
+
+      for (auto &worker : this->workers) {
+        {
+          std::lock_guard lock(worker->mutex);
+          worker->closing = true;
+        }
+
+        worker->cond.notify_all();
+      }
+
+      for (auto &worker : this->workers) {
+        if (worker->thread.joinable()) {
+          worker->thread.join();
+        }
+      }
+    }
+
+    /**
+       Rethrows the first error of the worker threads, if any.
+    */
+    void ParallelDecoder::check() {
+      if (this->failed) {
+        std::lock_guard lock(this->error_mutex);
+        throw std::runtime_error(this->error);
+      }
+    }
+
+    /**
+       Passes the samples collected for a worker to it, waiting if
+       the worker lags behind by more than PARALLEL_DECODE_QUEUE_SIZE
+       samples.
+    */
+    void ParallelDecoder::submit(Worker &worker) {
+      this->check();
+
+      if (worker.batch.empty()) {
+        return;
+      }
+
+      {
+        std::unique_lock lock(worker.mutex);
+        worker.cond.wait(lock, [&worker]() {
+          return worker.queue.size() < PARALLEL_DECODE_QUEUE_SIZE;
+        });
+
+        if (worker.queue.empty()) {
+          worker.queue.swap(worker.batch);
+        } else {
+          std::move(worker.batch.begin(), worker.batch.end(),
+                    std::back_inserter(worker.queue));
+        }
+      }
+
+      worker.batch.clear();
+      worker.cond.notify_all();
+    }
+
+    /**
+       Waits until all samples decoded so far have been handled by
+       the workers.
+    */
+    void ParallelDecoder::barrier() {
+      for (auto &worker : this->workers) {
+        this->submit(*worker);
+      }
+
+      for (auto &worker : this->workers) {
+        std::unique_lock lock(worker->mutex);
+        worker->cond.wait(lock, [&worker]() {
+          return worker->queue.empty() && !worker->busy;
+        });
+      }
+
+      this->check();
+    }
+
+    /**
+       Runs a worker thread until close() is called and all samples
+       passed to the worker have been sent.
+    */
+    void ParallelDecoder::run(Worker &worker) {
+      std::vector<QueuedSample> samples;
+
+      while (true) {
+        {
+          std::unique_lock lock(worker.mutex);
+          worker.busy = false;
+          worker.cond.notify_all();
+          worker.cond.wait(lock, [&worker]() {
+            return !worker.queue.empty() || worker.closing;
+          });
+
+          if (worker.queue.empty()) {
+            break;
+          }
+
+          samples.swap(worker.queue);
+          worker.busy = true;
+        }
+
+        // The thread reading the stream may be waiting for space
+        // in the queue
+        worker.cond.notify_all();
+
+        // A worker which has failed keeps taking samples, so that
+        // the thread reading the stream is never blocked
+        if (!this->failed) {
+          try {
+            for (auto &sample : samples) {
+              worker.decoder->on_sample(sample.get());
+            }
+
+            bool idle;
+
+            {
+              std::lock_guard lock(worker.mutex);
+              idle = worker.queue.empty();
+            }
+
+            // Data are sent to adaptyst-server right away only if
+            // there is nothing more to do, as in Decoder
+            if (idle) {
+              worker.decoder->on_idle();
+            }
+          } catch (std::exception &e) {
+            std::lock_guard lock(this->error_mutex);
+
+            if (!this->failed) {
+              this->error = e.what();
+              this->failed = true;
+            }
+          }
+        }
+
+        samples.clear();
+      }
+
+      if (!this->failed) {
+        try {
+          worker.sender->close();
+        } catch (std::exception &e) {
+          std::lock_guard lock(this->error_mutex);
+
+          if (!this->failed) {
+            this->error = e.what();
+            this->failed = true;
+          }
+        }
+      }
+    }
+
+    void ParallelDecoder::on_sample(PerfSample &sample) {
+      std::uint64_t key = ((std::uint64_t)(std::uint32_t)sample.pid << 32) |
+        (std::uint32_t)sample.tid;
+
+      auto owner = this->owners.find(key);
+
+      if (owner == this->owners.end()) {
+        owner = this->owners.insert({key, this->next_owner}).first;
+        this->next_owner = (this->next_owner + 1) % this->workers.size();
+      }
+
+      Worker &worker = *this->workers[owner->second];
+      worker.batch.emplace_back(sample);
+
+      if (worker.batch.size() >= PARALLEL_DECODE_BATCH) {
+        this->submit(worker);
+      }
+    }
+
+    void ParallelDecoder::on_mmap(std::int32_t pid, std::uint64_t start,
+                                  std::uint64_t len, std::uint64_t pgoff,
+                                  std::string_view filename) {
+      if (this->symbolizer.overlaps(pid, start, len)) {
+        this->barrier();
+      }
+
+      this->symbolizer.add_mapping(pid, start, len, pgoff, filename);
+    }
+
+    void ParallelDecoder::on_comm(std::int32_t pid, std::int32_t /* tid */,
+                                  std::string_view /* comm */, bool exec) {
+      if (exec) {
+        if (this->symbolizer.overlaps(pid, 0, UINT64_MAX)) {
+          this->barrier();
+        }
+
+        this->symbolizer.exec(pid);
+      }
+    }
+
+    void ParallelDecoder::on_fork(std::int32_t pid, std::int32_t ppid,
+                                  std::int32_t /* tid */, std::int32_t /* ptid */) {
+      if (pid != ppid && this->symbolizer.overlaps(pid, 0, UINT64_MAX)) {
+        this->barrier();
+      }
+
+      this->symbolizer.fork(pid, ppid);
+    }
+
+    void ParallelDecoder::on_lost(std::uint64_t count) {
+      this->lost += count;
+    }
+
+    void ParallelDecoder::on_idle() {
+      for (auto &worker : this->workers) {
+        this->submit(*worker);
+      }
+    }
+
+    /**
+       Waits for all samples to be sent and closes all adaptyst-server
+       connections.
+
+       @throw std::runtime_error In case of any error in a worker thread.
+    */
+    void ParallelDecoder::close() {
+      for (auto &worker : this->workers) {
+        this->submit(*worker);
+
+        {
+          std::lock_guard lock(worker->mutex);
+          worker->closing = true;
+        }
+
+        worker->cond.notify_all();
+      }
+
+      for (auto &worker : this->workers) {
+        if (worker->thread.joinable()) {
+          worker->thread.join();
+        }
+      }
+
+      this->check();
+    }
+
+    /**
+       Checks whether any sample has been sent. Must be called only
+       after close().
+    */
+    bool ParallelDecoder::has_samples() {
+      for (auto &worker : this->workers) {
+        if (worker->decoder->has_samples()) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    /**
+       Gets the number of records the kernel has reported as lost
+       because of a full ring buffer.
+    */
+    std::uint64_t ParallelDecoder::get_lost() {
+      return this->lost;
+    }
+  };
+};
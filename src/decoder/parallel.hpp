@@ -0,0 +1,89 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef PARALLEL_HPP_
+#define PARALLEL_HPP_
+
+#include "decoder.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// The number of samples passed to a worker thread of ParallelDecoder
+// at once
+#ifndef PARALLEL_DECODE_BATCH
+#define PARALLEL_DECODE_BATCH 256
+#endif
+
+// The maximum number of samples waiting for a worker thread of
+// ParallelDecoder before the thread reading the stream is stopped
+#ifndef PARALLEL_DECODE_QUEUE_SIZE
+#define PARALLEL_DECODE_QUEUE_SIZE 16384
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A class handling the records of a "perf" pipe-mode stream in
+       the same way as Decoder, but with samples symbolized, filtered,
+       and sent by one worker thread per adaptyst-server connection.
+
+       Every profiled thread is assigned to one worker on a round-robin
+       basis when it is first seen, and the worker handles the samples
+       of its threads in the order they arrive. As "perf record" is run
+       with --sorted-stream, every connection receives its samples in
+       the time order, exactly as with a single decoder.
+
+       Memory mapping changes are applied by the thread reading
+       the stream. If a change can affect how already decoded samples
+       are symbolized (i.e. a process replacing its image, a new
+       process reusing a PID, or a mapping overlapping an existing one),
+       all queued samples are handled by the workers first.
+
+       The worker threads inherit the CPU affinity of the process,
+       i.e. they run on the profiler cores when adaptyst-perf-decode
+       is started by Adaptyst.
+    */
+    class ParallelDecoder : public PerfStream::Handler {
+    private:
+      struct Worker;
+
+      Symbolizer &symbolizer;
+      std::vector<std::unique_ptr<Worker> > workers;
+      std::unordered_map<std::uint64_t, unsigned int> owners;
+      unsigned int next_owner;
+      std::uint64_t lost;
+      std::atomic<bool> failed;
+      std::mutex error_mutex;
+      std::string error;
+
+      void check();
+      void submit(Worker &worker);
+      void barrier();
+      void run(Worker &worker);
+
+    public:
+      ParallelDecoder(Symbolizer &symbolizer,
+                      std::vector<std::unique_ptr<ServerStream> > &connections,
+                      bool binary, unsigned int aggregate_window,
+                      nlohmann::json *filter_settings, unsigned int max_stack);
+      ~ParallelDecoder();
+      void on_sample(PerfSample &sample);
+      void on_mmap(std::int32_t pid, std::uint64_t start,
+                   std::uint64_t len, std::uint64_t pgoff,
+                   std::string_view filename);
+      void on_comm(std::int32_t pid, std::int32_t tid,
+                   std::string_view comm, bool exec);
+      void on_fork(std::int32_t pid, std::int32_t ppid,
+                   std::int32_t tid, std::int32_t ptid);
+      void on_lost(std::uint64_t count);
+      void on_idle();
+      void close();
+      bool has_samples();
+      std::uint64_t get_lost();
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,598 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "perfstream.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+
+#define PERF_PIPE_MAGIC 0x32454c4946524550ULL // "PERFILE2"
+#define PERF_PIPE_HEADER_SIZE 16
+#define PERF_EVENT_UPDATE_NAME 2
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       Gets the name "perf" gives to an event described by a given
+       attribute when the event name is not sent explicitly.
+    */
+    static std::string default_event_name(const perf_event_attr &attr) {
+      static const char *hardware[] = {
+        "cycles", "instructions", "cache-references", "cache-misses",
+        "branches", "branch-misses", "bus-cycles", "stalled-cycles-frontend",
+        "stalled-cycles-backend", "ref-cycles"
+      };
+
+      static const char *software[] = {
+        "cpu-clock", "task-clock", "page-faults", "context-switches",
+        "cpu-migrations", "minor-faults", "major-faults", "alignment-faults",
+        "emulation-faults", "dummy", "bpf-output", "cgroup-switches"
+      };
+
+      if (attr.type == PERF_TYPE_HARDWARE &&
+          attr.config < sizeof(hardware) / sizeof(hardware[0])) {
+        return hardware[attr.config];
+      }
+
+      if (attr.type == PERF_TYPE_SOFTWARE &&
+          attr.config < sizeof(software) / sizeof(software[0])) {
+        return software[attr.config];
+      }
+
+      char buf[48];
+      std::snprintf(buf, sizeof(buf), "raw-%u-0x%llx", attr.type,
+                    (unsigned long long)attr.config);
+      return std::string(buf);
+    }
+
+    /**
+       Constructs a PerfRecordDecoder object.
+    */
+    PerfRecordDecoder::PerfRecordDecoder() {
+      this->id_pos = -1;
+    }
+
+    /**
+       Registers an event the decoded records may refer to.
+
+       @param attr The attribute the event has been opened with.
+       @param name The name of the event. If empty, the name "perf" gives
+                   to an event with the attribute is used.
+       @param ids  The IDs of the event as returned by the kernel
+                   (one per file descriptor the event has been opened as).
+
+       @return The registered event.
+    */
+    RecordedEvent *PerfRecordDecoder::add_event(const perf_event_attr &attr,
+                                                std::string name,
+                                                const std::vector<std::uint64_t> &ids) {
+      std::unique_ptr<RecordedEvent> event = std::make_unique<RecordedEvent>();
+      event->attr = attr;
+      event->name = name.empty() ? default_event_name(attr) : name;
+
+      for (std::uint64_t id : ids) {
+        this->events_by_id[id] = event.get();
+      }
+
+      if (this->events.empty()) {
+        // "perf" requires the ID of a sample to be at the same position
+        // for all events, so the first event is enough to determine it
+        std::uint64_t sample_type = attr.sample_type;
+
+        if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+          this->id_pos = 0;
+        } else if (sample_type & PERF_SAMPLE_ID) {
+          this->id_pos = 0;
+
+          for (std::uint64_t flag : {PERF_SAMPLE_IP, PERF_SAMPLE_TID,
+                                     PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR}) {
+            if (sample_type & flag) {
+              this->id_pos++;
+            }
+          }
+        }
+      }
+
+      this->events.push_back(std::move(event));
+      return this->events.back().get();
+    }
+
+    /**
+       Constructs a PerfStream object.
+
+       @param fd The file descriptor to read the output of
+                 "perf record -o -" from, e.g. STDIN_FILENO.
+    */
+    PerfStream::PerfStream(int fd) : buf(PERF_STREAM_BUFFER_SIZE) {
+      this->fd = fd;
+      this->start = 0;
+      this->end = 0;
+      this->header_read = false;
+    }
+
+    /**
+       Makes sure that at least a given number of bytes are available
+       in the buffer starting from this->start.
+
+       @param min_bytes The number of bytes to make available.
+       @param handler   The handler to notify before blocking.
+
+       @throw std::runtime_error In case of a read error.
+       @return Whether the bytes are available (false means that
+               the end of the stream has been reached first).
+    */
+    bool PerfStream::fill(std::size_t min_bytes, Handler &handler) {
+      if (this->end - this->start >= min_bytes) {
+        return true;
+      }
+
+      if (this->start > 0) {
+        std::memmove(this->buf.data(), this->buf.data() + this->start,
+                     this->end - this->start);
+        this->end -= this->start;
+        this->start = 0;
+      }
+
+      if (this->buf.size() < min_bytes) {
+        this->buf.resize(min_bytes);
+      }
+
+      while (this->end < min_bytes) {
+        struct pollfd poll_struct;
+        poll_struct.fd = this->fd;
+        poll_struct.events = POLLIN;
+
+        if (poll(&poll_struct, 1, 0) == 0) {
+          handler.on_idle();
+        }
+
+        ssize_t bytes = read(this->fd, this->buf.data() + this->end,
+                             this->buf.size() - this->end);
+
+        if (bytes == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+
+          throw std::runtime_error("Could not read the perf-record output: " +
+                                   std::string(std::strerror(errno)));
+        } else if (bytes == 0) {
+          return false;
+        }
+
+        this->end += bytes;
+      }
+
+      return true;
+    }
+
+    /**
+       Discards a given number of bytes from the stream.
+
+       @param bytes   The number of bytes to discard.
+       @param handler The handler to notify before blocking.
+
+       @throw std::runtime_error In case of a read error or if the stream
+                                 ends before the bytes are discarded.
+    */
+    void PerfStream::skip(std::uint64_t bytes, Handler &handler) {
+      while (bytes > 0) {
+        if (!this->fill(1, handler)) {
+          throw std::runtime_error("The perf-record output has ended in "
+                                   "the middle of a record.");
+        }
+
+        std::size_t to_skip = std::min<std::uint64_t>(bytes,
+                                                      this->end - this->start);
+        this->start += to_skip;
+        bytes -= to_skip;
+      }
+    }
+
+    void PerfStream::read_header(Handler &handler) {
+      if (!this->fill(PERF_PIPE_HEADER_SIZE, handler)) {
+        throw std::runtime_error("The perf-record output is too short.");
+      }
+
+      std::uint64_t magic, size;
+      std::memcpy(&magic, this->buf.data() + this->start, 8);
+      std::memcpy(&size, this->buf.data() + this->start + 8, 8);
+
+      if (magic != PERF_PIPE_MAGIC || size != PERF_PIPE_HEADER_SIZE) {
+        throw std::runtime_error("The perf-record output is not "
+                                 "a pipe-mode perf.data stream.");
+      }
+
+      this->start += PERF_PIPE_HEADER_SIZE;
+      this->header_read = true;
+    }
+
+    void PerfStream::process_attr(const char *data, std::size_t size) {
+      if (size < 8) {
+        throw std::runtime_error("A perf-record attribute record is too short.");
+      }
+
+      std::uint32_t attr_size;
+      std::memcpy(&attr_size, data + 4, 4);
+
+      if (attr_size == 0) {
+        attr_size = PERF_ATTR_SIZE_VER0;
+      }
+
+      if (attr_size > size) {
+        throw std::runtime_error("A perf-record attribute record is too short.");
+      }
+
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      std::memcpy(&attr, data, std::min<std::size_t>(attr_size, sizeof(attr)));
+
+      std::vector<std::uint64_t> ids;
+
+      for (std::size_t pos = attr_size; pos + 8 <= size; pos += 8) {
+        std::uint64_t id;
+        std::memcpy(&id, data + pos, 8);
+        ids.push_back(id);
+      }
+
+      this->add_event(attr, "", ids);
+    }
+
+    void PerfStream::process_event_update(const char *data, std::size_t size) {
+      if (size < 16) {
+        return;
+      }
+
+      std::uint64_t type, id;
+      std::memcpy(&type, data, 8);
+      std::memcpy(&id, data + 8, 8);
+
+      if (type != PERF_EVENT_UPDATE_NAME) {
+        return;
+      }
+
+      RecordedEvent *event = nullptr;
+
+      if (this->events_by_id.find(id) != this->events_by_id.end()) {
+        event = this->events_by_id[id];
+      } else if (this->events.size() == 1) {
+        event = this->events[0].get();
+      }
+
+      if (event == nullptr) {
+        return;
+      }
+
+      std::string_view name(data + 16, strnlen(data + 16, size - 16));
+      event->name = std::string(name.substr(0, name.find('/')));
+    }
+
+    bool PerfRecordDecoder::process_sample(const perf_event_header &header,
+                                    const char *data, std::size_t size) {
+      if (this->events.empty()) {
+        return false;
+      }
+
+      std::size_t pos = 0;
+
+      auto take = [&](std::uint64_t &value) {
+        if (pos + 8 > size) {
+          throw std::runtime_error("A perf-record sample record is too short.");
+        }
+
+        std::memcpy(&value, data + pos, 8);
+        pos += 8;
+      };
+
+      std::uint64_t value;
+      RecordedEvent *event = this->events[0].get();
+
+      if (this->events.size() > 1 && this->id_pos >= 0) {
+        pos = this->id_pos * 8;
+        take(value);
+        pos = 0;
+
+        if (this->events_by_id.find(value) == this->events_by_id.end()) {
+          return false;
+        }
+
+        event = this->events_by_id[value];
+      }
+
+      const perf_event_attr &attr = event->attr;
+      std::uint64_t sample_type = attr.sample_type;
+      std::uint64_t ip = 0;
+
+      if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+        take(value);
+      }
+
+      if (sample_type & PERF_SAMPLE_IP) {
+        take(ip);
+      }
+
+      this->sample.pid = -1;
+      this->sample.tid = -1;
+
+      if (sample_type & PERF_SAMPLE_TID) {
+        take(value);
+        this->sample.pid = (std::int32_t)(value & 0xffffffff);
+        this->sample.tid = (std::int32_t)(value >> 32);
+      }
+
+      this->sample.time = 0;
+
+      if (sample_type & PERF_SAMPLE_TIME) {
+        take(this->sample.time);
+      }
+
+      for (std::uint64_t flag : {PERF_SAMPLE_ADDR, PERF_SAMPLE_ID,
+                                 PERF_SAMPLE_STREAM_ID, PERF_SAMPLE_CPU}) {
+        if (sample_type & flag) {
+          take(value);
+        }
+      }
+
+      if (sample_type & PERF_SAMPLE_PERIOD) {
+        take(this->sample.period);
+      } else {
+        this->sample.period = attr.freq ? 1 : attr.sample_period;
+      }
+
+      if (sample_type & PERF_SAMPLE_READ) {
+        std::uint64_t format = attr.read_format;
+        std::uint64_t values = 1;
+
+        if (format & PERF_FORMAT_GROUP) {
+          take(values);
+        }
+
+        for (std::uint64_t flag : {PERF_FORMAT_TOTAL_TIME_ENABLED,
+                                   PERF_FORMAT_TOTAL_TIME_RUNNING}) {
+          if (format & flag) {
+            take(value);
+          }
+        }
+
+        for (std::uint64_t i = 0; i < values; i++) {
+          take(value);
+
+          for (std::uint64_t flag : {(std::uint64_t)PERF_FORMAT_ID,
+                                     (std::uint64_t)PERF_FORMAT_LOST}) {
+            if (format & flag) {
+              take(value);
+            }
+          }
+        }
+      }
+
+      if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+        std::uint64_t nr;
+        take(nr);
+
+        if (nr > (size - pos) / 8) {
+          throw std::runtime_error("A perf-record sample record is too short.");
+        }
+
+        this->sample.callchain.resize(nr);
+        std::memcpy(this->sample.callchain.data(), data + pos, nr * 8);
+        pos += nr * 8;
+      } else {
+        this->sample.callchain.assign(1, ip);
+      }
+
+      this->sample.raw = nullptr;
+      this->sample.raw_size = 0;
+
+      if (sample_type & PERF_SAMPLE_RAW) {
+        if (pos + 4 > size) {
+          throw std::runtime_error("A perf-record sample record is too short.");
+        }
+
+        std::memcpy(&this->sample.raw_size, data + pos, 4);
+
+        if (this->sample.raw_size > size - pos - 4) {
+          throw std::runtime_error("A perf-record sample record is too short.");
+        }
+
+        this->sample.raw = data + pos + 4;
+      }
+
+      this->sample.event = event;
+      this->sample.cpumode = header.misc & PERF_RECORD_MISC_CPUMODE_MASK;
+      return true;
+    }
+
+    /**
+       Decodes the next record of the stream and calls the relevant
+       method of a handler if needed.
+
+       @param handler The handler to call.
+
+       @throw std::runtime_error In case of a read error or if the stream
+                                 is invalid.
+       @return Whether a record has been decoded (false means that
+               the end of the stream has been reached).
+    */
+    bool PerfStream::next(Handler &handler) {
+      if (!this->header_read) {
+        this->read_header(handler);
+      }
+
+      perf_event_header header;
+
+      if (!this->fill(sizeof(header), handler)) {
+        if (this->end > this->start) {
+          throw std::runtime_error("The perf-record output has ended in "
+                                   "the middle of a record.");
+        }
+
+        return false;
+      }
+
+      std::memcpy(&header, this->buf.data() + this->start, sizeof(header));
+
+      if (header.size < sizeof(header)) {
+        throw std::runtime_error("The perf-record output has a record of "
+                                 "invalid size " + std::to_string(header.size) +
+                                 ".");
+      }
+
+      if (!this->fill(header.size, handler)) {
+        throw std::runtime_error("The perf-record output has ended in "
+                                 "the middle of a record.");
+      }
+
+      const char *data = this->buf.data() + this->start + sizeof(header);
+      std::size_t size = header.size - sizeof(header);
+      this->start += header.size;
+
+      std::uint32_t u32;
+      std::uint64_t u64;
+
+      switch (header.type) {
+      case HEADER_ATTR:
+        this->process_attr(data, size);
+        break;
+
+      case EVENT_UPDATE:
+        this->process_event_update(data, size);
+        break;
+
+      case HEADER_TRACING_DATA:
+        // Tracing data follow the record rather than being part of it
+        if (size >= 4) {
+          std::memcpy(&u32, data, 4);
+          this->skip(u32, handler);
+        }
+        break;
+
+      case AUXTRACE:
+        // Same as above
+        if (size >= 8) {
+          std::memcpy(&u64, data, 8);
+          this->skip(u64, handler);
+        }
+        break;
+
+      case COMPRESSED:
+      case COMPRESSED2:
+        throw std::runtime_error("Compressed perf-record output is not "
+                                 "supported.");
+
+      default:
+        this->handle_record(header, data, handler);
+      }
+
+      return true;
+    }
+
+    /**
+       Decodes a kernel record and calls the relevant method of
+       a handler if needed.
+
+       @param header  The header of the record.
+       @param data    The record data following the header
+                      (header.size - sizeof(header) bytes).
+       @param handler The handler to call.
+
+       @throw std::runtime_error If the record is invalid.
+       @return Whether the record is of a type relevant to profiling.
+    */
+    bool PerfRecordDecoder::handle_record(const perf_event_header &header,
+                                          const char *data, Handler &handler) {
+      std::size_t size = header.size - sizeof(header);
+      std::uint32_t u32[4];
+      std::uint64_t u64[3];
+
+      switch (header.type) {
+      case PERF_RECORD_SAMPLE:
+        if (this->process_sample(header, data, size)) {
+          handler.on_sample(this->sample);
+        }
+        return true;
+
+      case PERF_RECORD_MMAP:
+      case PERF_RECORD_MMAP2: {
+        std::size_t filename_pos = header.type == PERF_RECORD_MMAP ? 32 : 64;
+
+        if ((header.misc & PERF_RECORD_MISC_MMAP_DATA) || size < filename_pos) {
+          return true;
+        }
+
+        std::memcpy(u32, data, 8);
+        std::memcpy(u64, data + 8, 24);
+        handler.on_mmap(u32[0], u64[0], u64[1], u64[2],
+                        std::string_view(data + filename_pos,
+                                         strnlen(data + filename_pos,
+                                                 size - filename_pos)));
+        return true;
+      }
+
+      case PERF_RECORD_COMM:
+        if (size < 8) {
+          return true;
+        }
+
+        std::memcpy(u32, data, 8);
+        handler.on_comm(u32[0], u32[1],
+                        std::string_view(data + 8, strnlen(data + 8, size - 8)),
+                        header.misc & PERF_RECORD_MISC_COMM_EXEC);
+        return true;
+
+      case PERF_RECORD_FORK:
+        if (size < 16) {
+          return true;
+        }
+
+        std::memcpy(u32, data, 16);
+        handler.on_fork(u32[0], u32[1], u32[2], u32[3]);
+        return true;
+
+      case PERF_RECORD_EXIT:
+        if (size < 16) {
+          return true;
+        }
+
+        std::memcpy(u32, data, 16);
+        handler.on_exit(u32[0], u32[2]);
+        return true;
+
+      case PERF_RECORD_LOST:
+        if (size < 16) {
+          return true;
+        }
+
+        std::memcpy(u64, data, 16);
+        handler.on_lost(u64[1]);
+        return true;
+
+      default:
+        return false;
+      }
+    }
+
+    /**
+       Decodes all records until the end of the stream.
+
+       @param handler The handler to call for the records.
+
+       @throw std::runtime_error In case of a read error or if the stream
+                                 is invalid.
+    */
+    void PerfStream::process(Handler &handler) {
+      while (this->next(handler)) { }
+    }
+
+    /**
+       Gets all events registered so far.
+    */
+    const std::vector<std::unique_ptr<RecordedEvent> > &PerfRecordDecoder::get_events() {
+      return this->events;
+    }
+  };
+};
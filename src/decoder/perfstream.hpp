@@ -0,0 +1,146 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef PERFSTREAM_HPP_
+#define PERFSTREAM_HPP_
+
+#include <linux/perf_event.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef PERF_STREAM_BUFFER_SIZE
+#define PERF_STREAM_BUFFER_SIZE 1048576
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       Record types synthesized by "perf" itself rather than by
+       the kernel (see tools/lib/perf/include/perf/event.h in the Linux
+       source tree). Only the ones relevant to PerfStream are listed.
+    */
+    enum PerfUserRecordType : std::uint32_t {
+      HEADER_ATTR = 64,
+      HEADER_TRACING_DATA = 66,
+      AUXTRACE = 71,
+      EVENT_UPDATE = 78,
+      COMPRESSED = 81,
+      COMPRESSED2 = 83
+    };
+
+    /**
+       A structure describing an event recorded by "perf".
+    */
+    struct RecordedEvent {
+      perf_event_attr attr;
+
+      // The name of the event without its modifiers, e.g. "task-clock"
+      // or "cycles" for "cycles/period=1000/"
+      std::string name;
+    };
+
+    /**
+       A structure describing a sample decoded by PerfStream.
+    */
+    struct PerfSample {
+      const RecordedEvent *event;
+      std::uint16_t cpumode;
+      std::int32_t pid;
+      std::int32_t tid;
+      std::uint64_t time;
+      std::uint64_t period;
+
+      // Instruction pointers starting from the most recent call,
+      // interleaved with PERF_CONTEXT_* markers
+      std::vector<std::uint64_t> callchain;
+
+      // The tracepoint data (PERF_SAMPLE_RAW), valid only until
+      // the next record is decoded
+      const char *raw;
+      std::uint32_t raw_size;
+    };
+
+    /**
+       A class decoding the records written by the kernel to a "perf"
+       ring buffer, calling a handler for every record relevant
+       to profiling. The events the records refer to must be registered
+       with add_event() first.
+    */
+    class PerfRecordDecoder {
+    public:
+      /**
+         An interface for handling records decoded by PerfRecordDecoder.
+      */
+      class Handler {
+      public:
+        virtual ~Handler() {}
+        virtual void on_sample(PerfSample & /* sample */) {}
+        virtual void on_mmap(std::int32_t /* pid */, std::uint64_t /* start */,
+                             std::uint64_t /* len */, std::uint64_t /* pgoff */,
+                             std::string_view /* filename */) {}
+        virtual void on_comm(std::int32_t /* pid */, std::int32_t /* tid */,
+                             std::string_view /* comm */, bool /* exec */) {}
+        virtual void on_fork(std::int32_t /* pid */, std::int32_t /* ppid */,
+                             std::int32_t /* tid */, std::int32_t /* ptid */) {}
+        virtual void on_exit(std::int32_t /* pid */, std::int32_t /* tid */) {}
+        virtual void on_lost(std::uint64_t /* count */) {}
+
+        // Called before blocking while waiting for more data
+        virtual void on_idle() {}
+      };
+
+    protected:
+      std::vector<std::unique_ptr<RecordedEvent> > events;
+      std::unordered_map<std::uint64_t, RecordedEvent *> events_by_id;
+      int id_pos;
+      PerfSample sample;
+
+      bool process_sample(const perf_event_header &header,
+                          const char *data, std::size_t size);
+
+    public:
+      PerfRecordDecoder();
+      RecordedEvent *add_event(const perf_event_attr &attr,
+                               std::string name,
+                               const std::vector<std::uint64_t> &ids);
+      bool handle_record(const perf_event_header &header,
+                         const char *data, Handler &handler);
+      const std::vector<std::unique_ptr<RecordedEvent> > &get_events();
+    };
+
+    /**
+       A class decoding the pipe-mode output of "perf record"
+       (i.e. "perf record -o -"), calling a handler for every record
+       relevant to profiling.
+
+       Records are handled in the order they arrive: "perf record" is
+       always run with --sorted-stream by Adaptyst, so there is
+       no need to reorder them.
+    */
+    class PerfStream : public PerfRecordDecoder {
+    private:
+      int fd;
+      std::vector<char> buf;
+      std::size_t start;
+      std::size_t end;
+      bool header_read;
+
+      bool fill(std::size_t min_bytes, Handler &handler);
+      void skip(std::uint64_t bytes, Handler &handler);
+      void read_header(Handler &handler);
+      void process_attr(const char *data, std::size_t size);
+      void process_event_update(const char *data, std::size_t size);
+
+    public:
+      PerfStream(int fd);
+      bool next(Handler &handler);
+      void process(Handler &handler);
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,422 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "ring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace adaptyst {
+  namespace decoder {
+    namespace fs = std::filesystem;
+
+    static std::string read_first_line(fs::path path) {
+      std::ifstream file(path);
+      std::string line;
+
+      if (!file || !std::getline(file, line)) {
+        throw std::runtime_error("Could not read " + path.string() + ".");
+      }
+
+      return line;
+    }
+
+    /**
+       Sets a term of a PMU event (e.g. "umask=0x1") in an attribute,
+       following the format description of the PMU in sysfs.
+    */
+    static void set_pmu_term(perf_event_attr &attr, fs::path pmu_path,
+                             std::string term) {
+      std::size_t equals = term.find('=');
+      std::string name = term.substr(0, equals);
+      std::uint64_t value = equals == std::string::npos ? 1 :
+        std::stoull(term.substr(equals + 1), nullptr, 0);
+
+      if (name == "period") {
+        attr.sample_period = value;
+        return;
+      }
+
+      std::string format;
+
+      try {
+        format = read_first_line(pmu_path / "format" / name);
+      } catch (std::runtime_error &e) {
+        throw std::runtime_error("Term \"" + name + "\" is not supported by "
+                                 "PMU " + pmu_path.filename().string() + ".");
+      }
+
+      // e.g. "config:0-7" or "config1:0-7,32-35"
+      std::size_t colon = format.find(':');
+      std::string field = format.substr(0, colon);
+      __u64 *target;
+
+      if (field == "config") {
+        target = &attr.config;
+      } else if (field == "config1") {
+        target = &attr.config1;
+      } else if (field == "config2") {
+        target = &attr.config2;
+      } else {
+        throw std::runtime_error("The format of term \"" + name + "\" is "
+                                 "not supported.");
+      }
+
+      std::stringstream ranges(format.substr(colon + 1));
+      std::string range;
+
+      while (std::getline(ranges, range, ',')) {
+        std::size_t dash = range.find('-');
+        unsigned int low = std::stoul(range.substr(0, dash));
+        unsigned int high = dash == std::string::npos ? low :
+          std::stoul(range.substr(dash + 1));
+
+        for (unsigned int bit = low; bit <= high; bit++) {
+          *target &= ~(1ULL << bit);
+          *target |= (value & 1) << bit;
+          value >>= 1;
+        }
+      }
+    }
+
+    /**
+       Converts the name of a "perf" event, as accepted by "perf record -e",
+       to the attribute opening the event with perf_event_open().
+
+       Generic hardware/software events (e.g. "cycles"), raw events
+       (e.g. "r01c2"), tracepoints (e.g. "sched:sched_switch"), events
+       described in sysfs (e.g. "mem-loads"), and PMU events with terms
+       (e.g. "cpu/event=0xc2,umask=0x1/") are supported. Only the type
+       and config fields of the returned attribute (and the period if
+       given as a term) are set.
+
+       @throw std::runtime_error If the event is not supported.
+    */
+    perf_event_attr parse_event(std::string name) {
+      static const std::unordered_map<std::string,
+                                      std::pair<std::uint32_t, std::uint64_t> > generic = {
+        {"cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}},
+        {"cpu-cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}},
+        {"instructions", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}},
+        {"cache-references", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES}},
+        {"cache-misses", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}},
+        {"branches", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS}},
+        {"branch-instructions", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS}},
+        {"branch-misses", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}},
+        {"bus-cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES}},
+        {"stalled-cycles-frontend", {PERF_TYPE_HARDWARE,
+                                     PERF_COUNT_HW_STALLED_CYCLES_FRONTEND}},
+        {"stalled-cycles-backend", {PERF_TYPE_HARDWARE,
+                                    PERF_COUNT_HW_STALLED_CYCLES_BACKEND}},
+        {"ref-cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES}},
+        {"cpu-clock", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK}},
+        {"task-clock", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}},
+        {"page-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}},
+        {"faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}},
+        {"context-switches", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}},
+        {"cs", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}},
+        {"cpu-migrations", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS}},
+        {"migrations", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS}},
+        {"minor-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN}},
+        {"major-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ}},
+        {"alignment-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS}},
+        {"emulation-faults", {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS}}
+      };
+
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+
+      auto generic_it = generic.find(name);
+
+      if (generic_it != generic.end()) {
+        attr.type = generic_it->second.first;
+        attr.config = generic_it->second.second;
+        return attr;
+      }
+
+      static const std::regex raw_regex("^r([0-9a-fA-F]+)$");
+      static const std::regex tracepoint_regex("^([^:/]+):([^:/]+)$");
+      static const std::regex pmu_regex("^([^/]+)/([^/]*)/$");
+      std::smatch match;
+
+      if (std::regex_match(name, match, raw_regex)) {
+        attr.type = PERF_TYPE_RAW;
+        attr.config = std::stoull(match[1].str(), nullptr, 16);
+        return attr;
+      }
+
+      if (std::regex_match(name, match, tracepoint_regex)) {
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.config = get_tracepoint(match[1].str(), match[2].str()).id;
+        return attr;
+      }
+
+      fs::path pmus_path("/sys/bus/event_source/devices");
+      fs::path pmu_path;
+      std::string terms;
+
+      if (std::regex_match(name, match, pmu_regex)) {
+        pmu_path = pmus_path / match[1].str();
+        terms = match[2].str();
+
+        if (!fs::exists(pmu_path / "type")) {
+          throw std::runtime_error("PMU " + match[1].str() + " does not exist.");
+        }
+      } else {
+        for (std::string pmu : {"cpu", "cpu_core", "cpu_atom"}) {
+          if (fs::exists(pmus_path / pmu / "events" / name)) {
+            pmu_path = pmus_path / pmu;
+            terms = read_first_line(pmu_path / "events" / name);
+            break;
+          }
+        }
+
+        if (pmu_path.empty()) {
+          throw std::runtime_error("Event \"" + name + "\" is not supported "
+                                   "without \"perf\".");
+        }
+      }
+
+      attr.type = std::stoul(read_first_line(pmu_path / "type"));
+
+      std::stringstream term_stream(terms);
+      std::string term;
+
+      while (std::getline(term_stream, term, ',')) {
+        if (!term.empty()) {
+          set_pmu_term(attr, pmu_path, term);
+        }
+      }
+
+      return attr;
+    }
+
+    /**
+       Gets the ID and the field layout of a kernel tracepoint
+       from tracefs.
+
+       @param category The tracepoint category, e.g. "sched".
+       @param name     The tracepoint name, e.g. "sched_process_fork".
+
+       @throw std::runtime_error If the tracepoint does not exist or
+                                 tracefs is not accessible.
+    */
+    Tracepoint get_tracepoint(std::string category, std::string name) {
+      fs::path events_path;
+
+      for (std::string tracefs : {"/sys/kernel/tracing",
+                                  "/sys/kernel/debug/tracing"}) {
+        std::error_code error;
+
+        if (fs::exists(fs::path(tracefs) / "events", error)) {
+          events_path = fs::path(tracefs) / "events";
+          break;
+        }
+      }
+
+      if (events_path.empty()) {
+        throw std::runtime_error("tracefs is not mounted or not accessible.");
+      }
+
+      fs::path tracepoint_path = events_path / category / name;
+
+      if (!fs::exists(tracepoint_path / "id")) {
+        throw std::runtime_error("Tracepoint " + category + ":" + name +
+                                 " does not exist or is not accessible.");
+      }
+
+      Tracepoint tracepoint;
+      tracepoint.id = std::stoull(read_first_line(tracepoint_path / "id"));
+
+      // e.g. "	field:pid_t child_pid;	offset:44;	size:4;	signed:1;"
+      static const std::regex field_regex("field:[^;]*?([A-Za-z0-9_]+)(\\[[^;]*\\])?;"
+                                          "\\s*offset:(\\d+);");
+      std::ifstream format(tracepoint_path / "format");
+      std::string line;
+
+      while (std::getline(format, line)) {
+        std::smatch match;
+
+        if (std::regex_search(line, match, field_regex)) {
+          tracepoint.field_offsets[match[1].str()] = std::stoul(match[3].str());
+        }
+      }
+
+      return tracepoint;
+    }
+
+    /**
+       Constructs a PerfEventRing object.
+
+       @param pages The number of data pages of the buffer (must be
+                    a power of 2).
+    */
+    PerfEventRing::PerfEventRing(unsigned int pages) {
+      this->pages = pages;
+      this->region = nullptr;
+      this->region_size = 0;
+      this->data_size = 0;
+    }
+
+    PerfEventRing::~PerfEventRing() {
+      if (this->region != nullptr) {
+        munmap(this->region, this->region_size);
+      }
+
+      for (int fd : this->fds) {
+        close(fd);
+      }
+    }
+
+    /**
+       Opens an event writing its records to the buffer.
+
+       @param attr The attribute of the event.
+       @param pid  The PID of the process to attach the event to
+                   (-1 for all processes).
+       @param cpu  The CPU to attach the event to (-1 for all CPUs).
+
+       @throw std::runtime_error If the event cannot be opened.
+       @return The ID of the event, as used in PERF_SAMPLE_IDENTIFIER.
+    */
+    std::uint64_t PerfEventRing::add_event(perf_event_attr &attr, pid_t pid,
+                                           int cpu) {
+      int fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1,
+                       PERF_FLAG_FD_CLOEXEC);
+
+      if (fd == -1) {
+        throw std::runtime_error("Could not open a perf event on CPU " +
+                                 std::to_string(cpu) + ": " +
+                                 std::string(std::strerror(errno)));
+      }
+
+      this->fds.push_back(fd);
+
+      if (this->region == nullptr) {
+        std::size_t page_size = sysconf(_SC_PAGESIZE);
+        this->data_size = (std::uint64_t)this->pages * page_size;
+        this->region_size = page_size + this->data_size;
+
+        void *region = mmap(nullptr, this->region_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+
+        if (region == MAP_FAILED) {
+          throw std::runtime_error("Could not map a perf ring buffer to "
+                                   "memory: " + std::string(std::strerror(errno)));
+        }
+
+        this->region = (char *)region;
+      } else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, this->fds[0]) == -1) {
+        throw std::runtime_error("Could not redirect a perf event to "
+                                 "a ring buffer: " +
+                                 std::string(std::strerror(errno)));
+      }
+
+      std::uint64_t id;
+
+      if (ioctl(fd, PERF_EVENT_IOC_ID, &id) == -1) {
+        throw std::runtime_error("Could not get the ID of a perf event: " +
+                                 std::string(std::strerror(errno)));
+      }
+
+      return id;
+    }
+
+    /**
+       Gets the file descriptor to poll for new records (or for
+       POLLHUP signalling that all profiled processes have exited).
+    */
+    int PerfEventRing::get_fd() {
+      return this->fds.empty() ? -1 : this->fds[0];
+    }
+
+    /**
+       Starts counting and sampling all events of the buffer.
+    */
+    void PerfEventRing::enable() {
+      for (int fd : this->fds) {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+
+    /**
+       Stops counting and sampling all events of the buffer.
+    */
+    void PerfEventRing::disable() {
+      for (int fd : this->fds) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+
+    /**
+       Decodes all records currently in the buffer and frees their
+       space for the kernel.
+
+       Pointers passed to the handler (e.g. the raw data of samples) are
+       valid only until the handler method returns.
+
+       @param decoder The decoder the events of the buffer have been
+                      registered with.
+       @param handler The handler to call for the records.
+
+       @throw std::runtime_error If a record is invalid.
+    */
+    void PerfEventRing::drain(PerfRecordDecoder &decoder,
+                              PerfRecordDecoder::Handler &handler) {
+      if (this->region == nullptr) {
+        return;
+      }
+
+      perf_event_mmap_page *meta = (perf_event_mmap_page *)this->region;
+      char *data = this->region + (this->region_size - this->data_size);
+
+      std::uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+      std::uint64_t tail = meta->data_tail;
+
+      auto copy = [&](char *dst, std::uint64_t from, std::size_t len) {
+        std::size_t start = from % this->data_size;
+        std::size_t first_part = std::min<std::size_t>(len, this->data_size - start);
+        std::memcpy(dst, data + start, first_part);
+        std::memcpy(dst + first_part, data, len - first_part);
+      };
+
+      while (head - tail >= sizeof(perf_event_header)) {
+        perf_event_header header;
+        copy((char *)&header, tail, sizeof(header));
+
+        if (header.size < sizeof(header) || header.size > head - tail) {
+          throw std::runtime_error("A perf ring buffer has a record of "
+                                   "invalid size " + std::to_string(header.size) +
+                                   ".");
+        }
+
+        std::size_t start = tail % this->data_size;
+        const char *record;
+
+        if (start + header.size <= this->data_size) {
+          record = data + start + sizeof(header);
+        } else {
+          // The record wraps around the end of the buffer
+          this->buf.resize(header.size);
+          copy(this->buf.data(), tail, header.size);
+          record = this->buf.data() + sizeof(header);
+        }
+
+        decoder.handle_record(header, record, handler);
+        tail += header.size;
+      }
+
+      __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+  };
+};
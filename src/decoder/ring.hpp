@@ -0,0 +1,62 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef RING_HPP_
+#define RING_HPP_
+
+#include "perfstream.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+// The number of data pages of a per-CPU ring buffer (must be
+// a power of 2)
+#ifndef PERF_RING_PAGES
+#define PERF_RING_PAGES 128
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A structure describing a kernel tracepoint.
+    */
+    struct Tracepoint {
+      std::uint64_t id;
+
+      // The offsets of the tracepoint fields in the raw sample data,
+      // per field name
+      std::unordered_map<std::string, std::uint32_t> field_offsets;
+    };
+
+    perf_event_attr parse_event(std::string name);
+    Tracepoint get_tracepoint(std::string category, std::string name);
+
+    /**
+       A class describing a ring buffer the kernel writes the records
+       of one or more events to, opened with perf_event_open().
+       The buffer is mapped to memory when the first event is added.
+    */
+    class PerfEventRing {
+    private:
+      std::vector<int> fds;
+      unsigned int pages;
+      char *region;
+      std::size_t region_size;
+      std::uint64_t data_size;
+      std::vector<char> buf;
+
+    public:
+      PerfEventRing(unsigned int pages = PERF_RING_PAGES);
+      ~PerfEventRing();
+      std::uint64_t add_event(perf_event_attr &attr, pid_t pid, int cpu);
+      int get_fd();
+      void enable();
+      void disable();
+      void drain(PerfRecordDecoder &decoder, PerfRecordDecoder::Handler &handler);
+    };
+  };
+};
+
+#endif
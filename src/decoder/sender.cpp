@@ -0,0 +1,815 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "sender.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace adaptyst {
+  namespace decoder {
+    static std::vector<std::string> split(std::string str, char delimiter) {
+      std::vector<std::string> parts;
+      std::stringstream stream(str);
+      std::string part;
+
+      while (std::getline(stream, part, delimiter)) {
+        parts.push_back(part);
+      }
+
+      return parts;
+    }
+
+    static int connect_socket(int domain, const sockaddr *address,
+                              socklen_t address_len) {
+      int fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+      if (fd == -1) {
+        return -1;
+      }
+
+      if (::connect(fd, address, address_len) == -1) {
+        ::close(fd);
+        return -1;
+      }
+
+      return fd;
+    }
+
+    /**
+       Connects to adaptyst-server.
+
+       @param instrs      The connection instructions provided by
+                          the frontend in ADAPTYST_SERV_CONNECT, i.e.
+                          "<type> <instructions for stream 1> <...>".
+       @param compression Whether zstd compression should be negotiated
+                          with adaptyst-server (only for sockets, as
+                          adaptyst-process.py does).
+
+       @throw std::runtime_error In case of any connection error.
+       @return One ServerStream object per stream.
+    */
+    std::vector<std::unique_ptr<ServerStream> > ServerStream::connect(std::string instrs,
+                                                                      bool compression) {
+      std::vector<std::string> parts = split(instrs, ' ');
+      std::vector<std::unique_ptr<ServerStream> > result;
+
+      if (parts.empty()) {
+        throw std::runtime_error("The adaptyst-server connection instructions "
+                                 "are empty.");
+      }
+
+      std::string type = parts[0];
+
+      for (std::size_t i = 1; i < parts.size(); i++) {
+        std::vector<std::string> fields = split(parts[i], '_');
+        std::unique_ptr<ServerStream> stream;
+        bool socket = false;
+
+        if (type == "tcp" && fields.size() >= 2) {
+          addrinfo hints;
+          std::memset(&hints, 0, sizeof(hints));
+          hints.ai_family = AF_UNSPEC;
+          hints.ai_socktype = SOCK_STREAM;
+
+          addrinfo *addresses;
+
+          if (getaddrinfo(fields[0].c_str(), fields[1].c_str(), &hints,
+                          &addresses) != 0) {
+            throw std::runtime_error("Could not resolve " + fields[0] + ".");
+          }
+
+          int fd = -1;
+
+          for (addrinfo *address = addresses; address != nullptr && fd == -1;
+               address = address->ai_next) {
+            fd = connect_socket(address->ai_family, address->ai_addr,
+                                address->ai_addrlen);
+          }
+
+          freeaddrinfo(addresses);
+
+          if (fd == -1) {
+            throw std::runtime_error("Could not connect to adaptyst-server at " +
+                                     fields[0] + ":" + fields[1] + ".");
+          }
+
+          stream = std::make_unique<FdServerStream>(fd, fd);
+          socket = true;
+        } else if (type == "unix") {
+          // The instructions are a socket path which is not split
+          // into fields
+          sockaddr_un address;
+          std::memset(&address, 0, sizeof(address));
+          address.sun_family = AF_UNIX;
+
+          if (parts[i].size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("The adaptyst-server socket path " +
+                                     parts[i] + " is too long.");
+          }
+
+          std::strcpy(address.sun_path, parts[i].c_str());
+
+          int fd = connect_socket(AF_UNIX, (sockaddr *)&address, sizeof(address));
+
+          if (fd == -1) {
+            throw std::runtime_error("Could not connect to adaptyst-server at " +
+                                     parts[i] + ".");
+          }
+
+          stream = std::make_unique<FdServerStream>(fd, fd);
+          socket = true;
+        } else if (type == "pipe" && fields.size() >= 2) {
+          stream = std::make_unique<FdServerStream>(std::stoi(fields[1]),
+                                                    std::stoi(fields[0]));
+          stream->write("connect", 7);
+          stream->flush();
+        } else if (type == "shm" && fields.size() >= 5) {
+          stream = std::make_unique<ShmServerStream>(std::stoi(fields[0]),
+                                                     std::stoull(fields[1]),
+                                                     std::stoi(fields[2]),
+                                                     std::stoi(fields[3]),
+                                                     std::stoi(fields[4]));
+          stream->write("connect", 7);
+        } else {
+          throw std::runtime_error("The adaptyst-server connection instructions "
+                                   "\"" + instrs + "\" are invalid.");
+        }
+
+#ifdef ZSTD_AVAILABLE
+        if (compression && socket) {
+          std::string request = COMPRESSION_NEGOTIATION " zstd\n";
+          stream->write(request.data(), request.size());
+          stream->flush();
+
+          if (stream->read_line() == COMPRESSION_NEGOTIATION " zstd") {
+            stream = std::make_unique<ZstdServerStream>(stream);
+          }
+        }
+#endif
+
+        result.push_back(std::move(stream));
+      }
+
+      return result;
+    }
+
+    /**
+       Constructs a FdServerStream object.
+
+       @param write_fd The file descriptor to write data to.
+       @param read_fd  The file descriptor to read replies from
+                       (may be the same as write_fd).
+    */
+    FdServerStream::FdServerStream(int write_fd, int read_fd) {
+      this->write_fd = write_fd;
+      this->read_fd = read_fd;
+    }
+
+    FdServerStream::~FdServerStream() {
+      if (this->write_fd != -1) {
+        ::close(this->write_fd);
+      }
+
+      if (this->read_fd != -1 && this->read_fd != this->write_fd) {
+        ::close(this->read_fd);
+      }
+    }
+
+    void FdServerStream::write_all(const char *buf, std::size_t len) {
+      while (len > 0) {
+        ssize_t written = ::write(this->write_fd, buf, len);
+
+        if (written == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+
+          throw std::runtime_error("Could not send data to adaptyst-server: " +
+                                   std::string(std::strerror(errno)));
+        }
+
+        buf += written;
+        len -= written;
+      }
+    }
+
+    void FdServerStream::write(const char *buf, std::size_t len) {
+      this->buf.append(buf, len);
+
+      if (this->buf.size() >= BINARY_BUFFER_SIZE) {
+        this->flush();
+      }
+    }
+
+    void FdServerStream::flush() {
+      this->write_all(this->buf.data(), this->buf.size());
+      this->buf.clear();
+    }
+
+    /**
+       Reads a line (without the newline character) sent by
+       adaptyst-server, e.g. a negotiation reply.
+    */
+    std::string FdServerStream::read_line() {
+      std::string line;
+      char c;
+
+      while (true) {
+        ssize_t bytes = ::read(this->read_fd, &c, 1);
+
+        if (bytes == -1 && errno == EINTR) {
+          continue;
+        } else if (bytes <= 0 || c == '\n') {
+          break;
+        }
+
+        line.push_back(c);
+      }
+
+      return line;
+    }
+
+    void FdServerStream::close() {
+      this->flush();
+
+      ::close(this->write_fd);
+
+      if (this->read_fd != this->write_fd) {
+        ::close(this->read_fd);
+      }
+
+      this->write_fd = -1;
+      this->read_fd = -1;
+    }
+
+    /**
+       Constructs a ShmServerStream object.
+
+       @param memfd     The file descriptor of the shared memory, closed
+                        after mapping it.
+       @param ring_size The size of the ring in bytes.
+       @param data_fd   The eventfd for waking up adaptyst-server.
+       @param space_fd  The eventfd adaptyst-server signals when it frees
+                        up space in the ring.
+       @param read_fd   The file descriptor to read replies from.
+
+       @throw std::runtime_error If the shared memory cannot be mapped.
+    */
+    ShmServerStream::ShmServerStream(int memfd, std::uint64_t ring_size,
+                                     int data_fd, int space_fd, int read_fd) {
+      this->ring_size = ring_size;
+      this->data_fd = data_fd;
+      this->space_fd = space_fd;
+      this->read_fd = read_fd;
+
+      void *region = mmap(nullptr, ShmConnection::DATA_OFFSET + ring_size,
+                          PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+      ::close(memfd);
+
+      if (region == MAP_FAILED) {
+        throw std::runtime_error("Could not map the adaptyst-server "
+                                 "shared memory: " +
+                                 std::string(std::strerror(errno)));
+      }
+
+      this->region = (char *)region;
+      this->head = this->word(ShmConnection::HEAD_OFFSET).load();
+    }
+
+    ShmServerStream::~ShmServerStream() {
+      if (this->region != nullptr) {
+        munmap(this->region, ShmConnection::DATA_OFFSET + this->ring_size);
+        ::close(this->data_fd);
+        ::close(this->space_fd);
+        ::close(this->read_fd);
+      }
+    }
+
+    std::atomic_ref<std::uint64_t> ShmServerStream::word(unsigned int offset) {
+      return std::atomic_ref<std::uint64_t>(*(std::uint64_t *)(this->region + offset));
+    }
+
+    void ShmServerStream::wake_up(int fd) {
+      std::uint64_t value = 1;
+
+      while (::write(fd, &value, sizeof(value)) == -1 && errno == EINTR) { }
+    }
+
+    void ShmServerStream::wait_for_space() {
+      this->word(ShmConnection::PRODUCER_WAITING_OFFSET).store(1);
+
+      if (this->head - this->word(ShmConnection::TAIL_OFFSET).load() ==
+          this->ring_size) {
+        if (this->word(ShmConnection::CONSUMER_WAITING_OFFSET).load()) {
+          this->wake_up(this->data_fd);
+        }
+
+        struct pollfd poll_struct;
+        poll_struct.fd = this->space_fd;
+        poll_struct.events = POLLIN;
+
+        if (poll(&poll_struct, 1, SHM_POLL_INTERVAL_MS) > 0) {
+          std::uint64_t value;
+          ::read(this->space_fd, &value, sizeof(value));
+        }
+      }
+
+      this->word(ShmConnection::PRODUCER_WAITING_OFFSET).store(0);
+    }
+
+    /**
+       Copies data to the ring without any system calls unless the ring
+       is full. adaptyst-server is woken up explicitly only when the ring
+       is getting full, as it checks the ring every SHM_POLL_INTERVAL_MS
+       milliseconds anyway.
+    */
+    void ShmServerStream::write(const char *buf, std::size_t len) {
+      std::size_t pos = 0;
+
+      while (pos < len) {
+        std::uint64_t used = this->head - this->word(ShmConnection::TAIL_OFFSET).load();
+
+        if (used == this->ring_size) {
+          this->wait_for_space();
+          continue;
+        }
+
+        std::uint64_t to_write = std::min<std::uint64_t>(this->ring_size - used,
+                                                         len - pos);
+        std::uint64_t start = this->head % this->ring_size;
+        std::uint64_t first_part = std::min(to_write, this->ring_size - start);
+        char *data = this->region + ShmConnection::DATA_OFFSET;
+
+        std::memcpy(data + start, buf + pos, first_part);
+        std::memcpy(data, buf + pos + first_part, to_write - first_part);
+
+        pos += to_write;
+        this->head += to_write;
+        this->word(ShmConnection::HEAD_OFFSET).store(this->head);
+
+        if (used + to_write >= this->ring_size / 2 &&
+            this->word(ShmConnection::CONSUMER_WAITING_OFFSET).load()) {
+          this->wake_up(this->data_fd);
+        }
+      }
+    }
+
+    void ShmServerStream::flush() {
+      // adaptyst-server checks the ring periodically, see write()
+    }
+
+    std::string ShmServerStream::read_line() {
+      std::string line;
+      char c;
+
+      while (true) {
+        ssize_t bytes = ::read(this->read_fd, &c, 1);
+
+        if (bytes == -1 && errno == EINTR) {
+          continue;
+        } else if (bytes <= 0 || c == '\n') {
+          break;
+        }
+
+        line.push_back(c);
+      }
+
+      return line;
+    }
+
+    void ShmServerStream::close() {
+      this->word(ShmConnection::CLOSED_OFFSET).store(1);
+      this->wake_up(this->data_fd);
+
+      munmap(this->region, ShmConnection::DATA_OFFSET + this->ring_size);
+      ::close(this->data_fd);
+      ::close(this->space_fd);
+      ::close(this->read_fd);
+      this->region = nullptr;
+    }
+
+#ifdef ZSTD_AVAILABLE
+    /**
+       Constructs a ZstdServerStream object.
+
+       @param stream The stream to send compressed data to. It is taken
+                     over by the new object.
+    */
+    ZstdServerStream::ZstdServerStream(std::unique_ptr<ServerStream> &stream) {
+      this->stream = std::move(stream);
+      this->context = ZSTD_createCCtx();
+      ZSTD_CCtx_setParameter(this->context, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+      this->out.resize(ZSTD_CStreamOutSize());
+    }
+
+    ZstdServerStream::~ZstdServerStream() {
+      ZSTD_freeCCtx(this->context);
+    }
+
+    void ZstdServerStream::compress(const char *buf, std::size_t len,
+                                    ZSTD_EndDirective mode) {
+      ZSTD_inBuffer input = {buf, len, 0};
+      bool finished = false;
+
+      while (!finished) {
+        ZSTD_outBuffer output = {this->out.data(), this->out.size(), 0};
+        std::size_t remaining = ZSTD_compressStream2(this->context, &output,
+                                                     &input, mode);
+
+        if (ZSTD_isError(remaining)) {
+          throw std::runtime_error("Could not compress data for "
+                                   "adaptyst-server: " +
+                                   std::string(ZSTD_getErrorName(remaining)));
+        }
+
+        if (output.pos > 0) {
+          this->stream->write(this->out.data(), output.pos);
+        }
+
+        finished = mode == ZSTD_e_continue ? input.pos == input.size :
+          remaining == 0;
+      }
+    }
+
+    void ZstdServerStream::write(const char *buf, std::size_t len) {
+      this->compress(buf, len, ZSTD_e_continue);
+    }
+
+    void ZstdServerStream::flush() {
+      this->compress(nullptr, 0, ZSTD_e_flush);
+      this->stream->flush();
+    }
+
+    std::string ZstdServerStream::read_line() {
+      return this->stream->read_line();
+    }
+
+    void ZstdServerStream::close() {
+      this->compress(nullptr, 0, ZSTD_e_end);
+      this->stream->close();
+    }
+#endif
+
+    /**
+       Constructs a SampleSender object, negotiating the binary protocol
+       with adaptyst-server for every stream.
+
+       @param connections      The streams to use. They are taken over
+                               by the new object.
+       @param binary           Whether the binary protocol should be
+                               negotiated (JSON lines are used otherwise).
+       @param aggregate_window The time in milliseconds within which
+                               consecutive samples of a thread with
+                               identical callchains are sent as one record
+                               (0 disables aggregation).
+    */
+    SampleSender::SampleSender(std::vector<std::unique_ptr<ServerStream> > &connections,
+                               bool binary, unsigned int aggregate_window) {
+      for (auto &connection : connections) {
+        unsigned int version = 0;
+
+        if (binary) {
+          std::string request = PROTOCOL_NEGOTIATION " binary " +
+            std::to_string(BINARY_PROTOCOL_VERSION) + "\n";
+          connection->write(request.data(), request.size());
+          connection->flush();
+
+          std::vector<std::string> reply = split(connection->read_line(), ' ');
+
+          if (reply.size() == 3 && reply[0] == PROTOCOL_NEGOTIATION &&
+              reply[1] == "binary") {
+            try {
+              version = std::stoi(reply[2]);
+            } catch (...) {
+              version = 0;
+            }
+
+            if (version > BINARY_PROTOCOL_VERSION) {
+              version = 0;
+            }
+          }
+        }
+
+        this->streams.push_back({std::move(connection), version, false, {}});
+      }
+
+      connections.clear();
+
+      if (this->streams.empty()) {
+        throw std::runtime_error("No adaptyst-server streams are available.");
+      }
+
+      this->next_stream = 0;
+      this->aggregate_window = (std::uint64_t)aggregate_window * 1000000;
+      this->next_aggregate_sweep = 0;
+    }
+
+    /**
+       Gets the stream samples of a given thread should be sent to.
+       Threads are assigned to streams in a round-robin manner.
+    */
+    unsigned int SampleSender::get_stream(std::int32_t pid, std::int32_t tid) {
+      std::uint64_t key = ((std::uint64_t)(std::uint32_t)pid << 32) | (std::uint32_t)tid;
+      auto it = this->thread_streams.find(key);
+
+      if (it != this->thread_streams.end()) {
+        return it->second;
+      }
+
+      unsigned int stream = this->next_stream;
+      this->next_stream = (this->next_stream + 1) % this->streams.size();
+      this->thread_streams[key] = stream;
+      return stream;
+    }
+
+    /**
+       Gets the ID of a symbol for use in a callchain sent to
+       a given stream, defining the symbol in the stream first if
+       it has not been done yet.
+    */
+    std::uint32_t SampleSender::get_symbol(unsigned int stream,
+                                           const SymbolName *symbol) {
+      Stream &s = this->streams[stream];
+
+      if (symbol->id >= s.sent_symbols.size()) {
+        s.sent_symbols.resize(std::max<std::size_t>(symbol->id + 1,
+                                                    s.sent_symbols.size() * 2));
+      }
+
+      if (!s.sent_symbols[symbol->id]) {
+        s.sent_symbols[symbol->id] = true;
+
+        nlohmann::json name = nlohmann::json::array({symbol->name, symbol->dso});
+
+        if (s.version > 0) {
+          protocol::encode(protocol::Symbol{symbol->id, name.dump()}, this->record);
+        } else {
+          nlohmann::json message = {{"type", "symbol"}, {"id", symbol->id},
+                                    {"name", name}};
+          this->record = message.dump() + "\n";
+        }
+
+        s.connection->write(this->record.data(), this->record.size());
+        this->record.clear();
+      }
+
+      return symbol->id;
+    }
+
+    void SampleSender::send(unsigned int stream, protocol::Sample &sample) {
+      Stream &s = this->streams[stream];
+
+      if (s.version >= 3) {
+        // Consecutive samples of a thread usually share long stack
+        // prefixes, so only the part of the callchain following
+        // the prefix shared with the previous one is sent
+        std::uint64_t key = ((std::uint64_t)(std::uint32_t)sample.pid << 32) |
+          (std::uint32_t)sample.tid;
+        std::vector<protocol::CallchainElem> &previous = this->previous_callchains[key];
+        std::size_t limit = std::min(previous.size(), sample.callchain.size());
+        std::size_t common_prefix = 0;
+
+        while (common_prefix < limit &&
+               previous[common_prefix].symbol == sample.callchain[common_prefix].symbol &&
+               previous[common_prefix].offset == sample.callchain[common_prefix].offset) {
+          common_prefix++;
+        }
+
+        this->delta_sample.event_type = sample.event_type;
+        this->delta_sample.pid = sample.pid;
+        this->delta_sample.tid = sample.tid;
+        this->delta_sample.time = sample.time;
+        this->delta_sample.period = sample.period;
+        this->delta_sample.count = sample.count;
+        this->delta_sample.delta = true;
+        this->delta_sample.common_prefix = common_prefix;
+        this->delta_sample.callchain.assign(sample.callchain.begin() + common_prefix,
+                                            sample.callchain.end());
+
+        protocol::encode(this->delta_sample, this->record);
+        previous = std::move(sample.callchain);
+      } else if (s.version > 0) {
+        protocol::encode(sample, this->record);
+      } else {
+        nlohmann::json callchain = nlohmann::json::array();
+
+        for (auto &elem : sample.callchain) {
+          callchain.push_back({std::to_string(elem.symbol),
+                               protocol::offset_to_string(elem.offset)});
+        }
+
+        nlohmann::json message = {{"type", "sample"},
+                                  {"event_type", sample.event_type},
+                                  {"pid", std::to_string(sample.pid)},
+                                  {"tid", std::to_string(sample.tid)},
+                                  {"time", sample.time},
+                                  {"period", sample.period},
+                                  {"callchain", callchain}};
+        this->record = message.dump() + "\n";
+      }
+
+      s.connection->write(this->record.data(), this->record.size());
+      this->record.clear();
+    }
+
+    /**
+       Sends the aggregated samples which have started at least
+       the aggregation window before a given timestamp, so that threads
+       which are no longer sampled do not hold their last samples back
+       for too long.
+
+       @param timestamp The current sample time.
+       @param all       Whether all aggregated samples should be sent
+                        regardless of the timestamp.
+    */
+    void SampleSender::flush_pending_samples(std::uint64_t timestamp, bool all) {
+      for (auto it = this->pending_samples.begin();
+           it != this->pending_samples.end();) {
+        protocol::Sample &sample = it->second.sample;
+
+        if (all || (timestamp >= sample.time &&
+                    timestamp - sample.time >= this->aggregate_window)) {
+          this->send(it->second.stream, sample);
+          it = this->pending_samples.erase(it);
+        } else {
+          it++;
+        }
+      }
+    }
+
+    /**
+       Sends a sample, or holds it back if it may be aggregated with
+       the next samples of the same thread.
+
+       @param stream     The stream to send the sample to, obtained with
+                         get_stream().
+       @param event_type The event type, e.g. "task-clock".
+       @param pid        The PID of the sampled thread.
+       @param tid        The TID of the sampled thread.
+       @param time       The sample time in nanoseconds.
+       @param period     The sample period.
+       @param callchain  The callchain starting from the outermost call,
+                         with symbol IDs obtained with get_symbol(). Its
+                         contents are moved out.
+    */
+    void SampleSender::add_sample(unsigned int stream, const std::string &event_type,
+                                  std::int32_t pid, std::int32_t tid,
+                                  std::uint64_t time, std::uint64_t period,
+                                  std::vector<protocol::CallchainElem> &callchain) {
+      if (this->aggregate_window > 0 && time >= this->next_aggregate_sweep) {
+        this->flush_pending_samples(time, false);
+        this->next_aggregate_sweep = time + this->aggregate_window;
+      }
+
+      std::uint64_t key = ((std::uint64_t)(std::uint32_t)pid << 32) | (std::uint32_t)tid;
+      auto it = this->pending_samples.find(key);
+
+      if (it != this->pending_samples.end()) {
+        protocol::Sample &pending = it->second.sample;
+
+        if (pending.event_type == event_type && time >= pending.time &&
+            time - pending.time < this->aggregate_window &&
+            std::equal(pending.callchain.begin(), pending.callchain.end(),
+                       callchain.begin(), callchain.end(),
+                       [](const protocol::CallchainElem &a,
+                          const protocol::CallchainElem &b) {
+                         return a.symbol == b.symbol && a.offset == b.offset;
+                       })) {
+          pending.period += period;
+          pending.count++;
+          return;
+        }
+
+        this->send(it->second.stream, pending);
+        this->pending_samples.erase(it);
+      }
+
+      protocol::Sample sample;
+      sample.event_type = event_type;
+      sample.pid = pid;
+      sample.tid = tid;
+      sample.time = time;
+      sample.period = period;
+      sample.callchain = std::move(callchain);
+
+      Stream &s = this->streams[stream];
+
+      // The first sample of a stream is never aggregated, as adaptyst-server
+      // clips its period to the start of profiling. Off-CPU samples are
+      // never aggregated either, as each of them describes a separate
+      // off-CPU region.
+      if (s.version >= 2 && this->aggregate_window > 0 && s.sampled &&
+          event_type != "offcpu-time") {
+        this->pending_samples[key] = {stream, std::move(sample)};
+      } else {
+        this->send(stream, sample);
+      }
+
+      s.sampled = true;
+    }
+
+    /**
+       Sends the callchain of a thread/process creation, as done by
+       adaptyst-syscall-process.py.
+
+       @param stream    The stream to send the record to, obtained with
+                        get_stream().
+       @param ret_value The PID/TID of the new thread/process.
+       @param callchain The callchain starting from the outermost call,
+                        with symbol IDs obtained with get_symbol(). Its
+                        contents are moved out.
+    */
+    void SampleSender::add_syscall(unsigned int stream, std::int64_t ret_value,
+                                   std::vector<protocol::CallchainElem> &callchain) {
+      Stream &s = this->streams[stream];
+
+      if (s.version > 0) {
+        protocol::encode(protocol::Syscall{ret_value, std::move(callchain)},
+                         this->record);
+      } else {
+        nlohmann::json callchain_json = nlohmann::json::array();
+
+        for (auto &elem : callchain) {
+          callchain_json.push_back({std::to_string(elem.symbol),
+                                    protocol::offset_to_string(elem.offset)});
+        }
+
+        nlohmann::json message = {{"type", "syscall"},
+                                  {"ret_value", std::to_string(ret_value)},
+                                  {"callchain", callchain_json}};
+        this->record = message.dump() + "\n";
+      }
+
+      s.connection->write(this->record.data(), this->record.size());
+      this->record.clear();
+    }
+
+    /**
+       Sends a thread tree record (a new thread/process, execve, or exit
+       event), as done by adaptyst-syscall-process.py.
+
+       @param stream The stream to send the record to, obtained with
+                     get_stream().
+       @param meta   The record to send.
+    */
+    void SampleSender::add_syscall_meta(unsigned int stream,
+                                        const protocol::SyscallMeta &meta) {
+      Stream &s = this->streams[stream];
+
+      if (s.version > 0) {
+        protocol::encode(meta, this->record);
+      } else {
+        nlohmann::json message = {{"type", "syscall_meta"},
+                                  {"subtype", meta.subtype},
+                                  {"comm", meta.comm},
+                                  {"pid", std::to_string(meta.pid)},
+                                  {"tid", std::to_string(meta.tid)},
+                                  {"time", meta.time},
+                                  {"ret_value", std::to_string(meta.ret_value)}};
+        this->record = message.dump() + "\n";
+      }
+
+      s.connection->write(this->record.data(), this->record.size());
+      this->record.clear();
+    }
+
+    /**
+       Writes all buffered data to adaptyst-server.
+    */
+    void SampleSender::flush() {
+      for (auto &stream : this->streams) {
+        stream.connection->flush();
+      }
+    }
+
+    /**
+       Sends all aggregated samples along with the end-of-stream
+       records and closes all streams.
+    */
+    void SampleSender::close() {
+      this->flush_pending_samples(0, true);
+
+      for (auto &stream : this->streams) {
+        if (stream.version > 0) {
+          protocol::encode_stop(this->record);
+        } else {
+          this->record = "<STOP>\n";
+        }
+
+        stream.connection->write(this->record.data(), this->record.size());
+        this->record.clear();
+        stream.connection->close();
+      }
+    }
+  };
+};
@@ -0,0 +1,167 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef SENDER_HPP_
+#define SENDER_HPP_
+
+#include "symbolizer.hpp"
+#include "server/protocol.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef ZSTD_AVAILABLE
+#include <zstd.h>
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       An interface describing a connection for sending profiling data
+       to adaptyst-server, equivalent to a stream of adaptyst-process.py.
+    */
+    class ServerStream {
+    public:
+      virtual ~ServerStream() {}
+      virtual void write(const char *buf, std::size_t len) = 0;
+      virtual void flush() = 0;
+      virtual std::string read_line() = 0;
+      virtual void close() = 0;
+
+      static std::vector<std::unique_ptr<ServerStream> > connect(std::string instrs,
+                                                                 bool compression);
+    };
+
+    /**
+       A class describing a ServerStream writing to a file descriptor
+       of a pipe or a socket. Data are buffered up to BINARY_BUFFER_SIZE
+       bytes before being written.
+    */
+    class FdServerStream : public ServerStream {
+    private:
+      int write_fd;
+      int read_fd;
+      std::string buf;
+
+      void write_all(const char *buf, std::size_t len);
+
+    public:
+      FdServerStream(int write_fd, int read_fd);
+      ~FdServerStream();
+      void write(const char *buf, std::size_t len);
+      void flush();
+      std::string read_line();
+      void close();
+    };
+
+    /**
+       A class describing a ServerStream writing to the shared-memory
+       ring of ShmConnection, following the same protocol as ShmStream
+       in adaptyst-process.py.
+    */
+    class ShmServerStream : public ServerStream {
+    private:
+      char *region;
+      std::uint64_t ring_size;
+      int data_fd;
+      int space_fd;
+      int read_fd;
+      std::uint64_t head;
+
+      std::atomic_ref<std::uint64_t> word(unsigned int offset);
+      void wake_up(int fd);
+      void wait_for_space();
+
+    public:
+      ShmServerStream(int memfd, std::uint64_t ring_size, int data_fd,
+                      int space_fd, int read_fd);
+      ~ShmServerStream();
+      void write(const char *buf, std::size_t len);
+      void flush();
+      std::string read_line();
+      void close();
+    };
+
+#ifdef ZSTD_AVAILABLE
+    /**
+       A class describing a ServerStream compressing everything written
+       to another ServerStream into a single zstd stream, decompressed
+       by ZstdConnection on the adaptyst-server side.
+    */
+    class ZstdServerStream : public ServerStream {
+    private:
+      std::unique_ptr<ServerStream> stream;
+      ZSTD_CCtx *context;
+      std::string out;
+
+      void compress(const char *buf, std::size_t len, ZSTD_EndDirective mode);
+
+    public:
+      ZstdServerStream(std::unique_ptr<ServerStream> &stream);
+      ~ZstdServerStream();
+      void write(const char *buf, std::size_t len);
+      void flush();
+      std::string read_line();
+      void close();
+    };
+#endif
+
+    /**
+       A class sending samples to adaptyst-server over a set of
+       ServerStream objects, in the same way as adaptyst-process.py:
+       threads are assigned to streams in a round-robin manner,
+       symbol IDs are defined per stream before their first use,
+       consecutive identical samples of a thread are aggregated if
+       requested, and callchains are delta-encoded if the stream supports
+       it.
+    */
+    class SampleSender {
+    private:
+      struct Stream {
+        std::unique_ptr<ServerStream> connection;
+        unsigned int version;
+        bool sampled;
+        std::vector<bool> sent_symbols;
+      };
+
+      struct PendingSample {
+        unsigned int stream;
+        protocol::Sample sample;
+      };
+
+      std::vector<Stream> streams;
+      unsigned int next_stream;
+      std::unordered_map<std::uint64_t, unsigned int> thread_streams;
+      std::uint64_t aggregate_window;
+      std::uint64_t next_aggregate_sweep;
+      std::unordered_map<std::uint64_t, PendingSample> pending_samples;
+      std::unordered_map<std::uint64_t,
+                         std::vector<protocol::CallchainElem> > previous_callchains;
+      std::string record;
+      protocol::Sample delta_sample;
+
+      void send(unsigned int stream, protocol::Sample &sample);
+      void flush_pending_samples(std::uint64_t timestamp, bool all);
+
+    public:
+      SampleSender(std::vector<std::unique_ptr<ServerStream> > &connections,
+                   bool binary, unsigned int aggregate_window);
+      unsigned int get_stream(std::int32_t pid, std::int32_t tid);
+      std::uint32_t get_symbol(unsigned int stream, const SymbolName *symbol);
+      void add_sample(unsigned int stream, const std::string &event_type,
+                      std::int32_t pid, std::int32_t tid, std::uint64_t time,
+                      std::uint64_t period,
+                      std::vector<protocol::CallchainElem> &callchain);
+      void add_syscall(unsigned int stream, std::int64_t ret_value,
+                       std::vector<protocol::CallchainElem> &callchain);
+      void add_syscall_meta(unsigned int stream, const protocol::SyscallMeta &meta);
+      void flush();
+      void close();
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,816 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "symbolizer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEBUG_FILE_DIR "/usr/lib/debug"
+
+namespace adaptyst {
+  namespace decoder {
+    /**
+       A class describing a read-only memory mapping of a whole file.
+    */
+    class MappedFile {
+    private:
+      void *region;
+
+    public:
+      const char *data;
+      std::size_t size;
+
+      MappedFile(fs::path path) {
+        this->region = MAP_FAILED;
+        this->data = nullptr;
+        this->size = 0;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1) {
+          return;
+        }
+
+        struct stat file_stat;
+
+        if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+            file_stat.st_size > 0) {
+          this->region = mmap(nullptr, file_stat.st_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0);
+
+          if (this->region != MAP_FAILED) {
+            this->data = (const char *)this->region;
+            this->size = file_stat.st_size;
+          }
+        }
+
+        close(fd);
+      }
+
+      ~MappedFile() {
+        if (this->region != MAP_FAILED) {
+          munmap(this->region, this->size);
+        }
+      }
+
+      /**
+         Checks whether the file is a 64-bit little-endian ELF file with
+         section and program header tables inside the file.
+      */
+      bool is_elf() {
+        if (this->size < sizeof(Elf64_Ehdr)) {
+          return false;
+        }
+
+        const Elf64_Ehdr *header = (const Elf64_Ehdr *)this->data;
+
+        return std::memcmp(header->e_ident, ELFMAG, SELFMAG) == 0 &&
+          header->e_ident[EI_CLASS] == ELFCLASS64 &&
+          header->e_ident[EI_DATA] == ELFDATA2LSB &&
+          header->e_shentsize == sizeof(Elf64_Shdr) &&
+          header->e_shoff <= this->size &&
+          header->e_shnum <= (this->size - header->e_shoff) / sizeof(Elf64_Shdr) &&
+          (header->e_phnum == 0 ||
+           (header->e_phentsize == sizeof(Elf64_Phdr) &&
+            header->e_phoff <= this->size &&
+            header->e_phnum <= (this->size - header->e_phoff) / sizeof(Elf64_Phdr)));
+      }
+
+      const Elf64_Ehdr *get_header() {
+        return (const Elf64_Ehdr *)this->data;
+      }
+
+      const Elf64_Phdr *get_segment(unsigned int index) {
+        return (const Elf64_Phdr *)(this->data + this->get_header()->e_phoff) + index;
+      }
+
+      const Elf64_Shdr *get_section(unsigned int index) {
+        return (const Elf64_Shdr *)(this->data + this->get_header()->e_shoff) + index;
+      }
+
+      bool contains(std::uint64_t offset, std::uint64_t size) {
+        return offset <= this->size && size <= this->size - offset;
+      }
+    };
+
+    /**
+       A structure describing an ELF symbol before its virtual
+       address is converted to a file offset.
+    */
+    struct RawSymbol {
+      std::uint64_t address;
+      std::uint64_t size;
+      const char *name;
+    };
+
+    /**
+       Demangles a C++ symbol name, in the same way as "perf" does
+       when called with --demangle. Names which cannot be demangled
+       are returned as they are.
+    */
+    static std::string demangle(const char *name) {
+      if (name[0] == '_' && name[1] == 'Z') {
+        int status;
+        char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+
+        if (demangled != nullptr) {
+          std::string result(demangled);
+          std::free(demangled);
+          return result;
+        }
+      }
+
+      return std::string(name);
+    }
+
+    /**
+       Reads the function symbols of an ELF file.
+
+       @param file          The ELF file.
+       @param section_type  SHT_SYMTAB or SHT_DYNSYM.
+       @param symbols       The vector to append the symbols to. Their
+                            names point to the memory of the file.
+
+       @return Whether the file has a symbol table of the given type.
+    */
+    static bool read_symbols(MappedFile &file, std::uint32_t section_type,
+                             std::vector<RawSymbol> &symbols) {
+      const Elf64_Ehdr *header = file.get_header();
+
+      for (unsigned int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr *section = file.get_section(i);
+
+        if (section->sh_type != section_type ||
+            section->sh_link >= header->e_shnum ||
+            section->sh_entsize != sizeof(Elf64_Sym) ||
+            !file.contains(section->sh_offset, section->sh_size)) {
+          continue;
+        }
+
+        const Elf64_Shdr *strtab = file.get_section(section->sh_link);
+
+        if (strtab->sh_type != SHT_STRTAB ||
+            !file.contains(strtab->sh_offset, strtab->sh_size) ||
+            strtab->sh_size == 0 ||
+            file.data[strtab->sh_offset + strtab->sh_size - 1] != '\0') {
+          continue;
+        }
+
+        const Elf64_Sym *elf_symbols = (const Elf64_Sym *)(file.data + section->sh_offset);
+        std::uint64_t count = section->sh_size / sizeof(Elf64_Sym);
+
+        for (std::uint64_t j = 0; j < count; j++) {
+          const Elf64_Sym &symbol = elf_symbols[j];
+          unsigned char type = ELF64_ST_TYPE(symbol.st_info);
+
+          if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+              symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+              symbol.st_name >= strtab->sh_size) {
+            continue;
+          }
+
+          symbols.push_back({symbol.st_value, symbol.st_size,
+                             file.data + strtab->sh_offset + symbol.st_name});
+        }
+
+        return true;
+      }
+
+      return false;
+    }
+
+    /**
+       Gets the GNU build ID of an ELF file as a hex string (empty
+       if the file does not have any).
+    */
+    static std::string get_build_id(MappedFile &file) {
+      const Elf64_Ehdr *header = file.get_header();
+
+      for (unsigned int i = 0; i < header->e_phnum; i++) {
+        const Elf64_Phdr *segment = file.get_segment(i);
+
+        if (segment->p_type != PT_NOTE ||
+            !file.contains(segment->p_offset, segment->p_filesz)) {
+          continue;
+        }
+
+        std::uint64_t pos = segment->p_offset;
+        std::uint64_t end = segment->p_offset + segment->p_filesz;
+
+        while (pos + sizeof(Elf64_Nhdr) <= end) {
+          const Elf64_Nhdr *note = (const Elf64_Nhdr *)(file.data + pos);
+          std::uint64_t name_pos = pos + sizeof(Elf64_Nhdr);
+          std::uint64_t desc_pos = name_pos + ((note->n_namesz + 3) & ~3ULL);
+          pos = desc_pos + ((note->n_descsz + 3) & ~3ULL);
+
+          if (pos > end) {
+            break;
+          }
+
+          if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+              std::memcmp(file.data + name_pos, "GNU", 4) == 0) {
+            std::string build_id;
+            char buf[3];
+
+            for (std::uint32_t j = 0; j < note->n_descsz; j++) {
+              std::snprintf(buf, sizeof(buf), "%02x",
+                            (unsigned char)file.data[desc_pos + j]);
+              build_id += buf;
+            }
+
+            return build_id;
+          }
+        }
+      }
+
+      return "";
+    }
+
+    /**
+       Constructs an ElfSymbols object. Nothing is read until
+       the first lookup.
+
+       @param path The path to the ELF executable/library.
+    */
+    ElfSymbols::ElfSymbols(fs::path path) {
+      this->path = path;
+      this->unknown = {0, 0, "[" + path.string() + "]", nullptr};
+    }
+
+    /**
+       Reads the symbols of the ELF file. .symtab is used if available,
+       either in the file itself or in a separate debug file installed
+       by a distribution. Otherwise, .dynsym is used.
+    */
+    void ElfSymbols::load() {
+      MappedFile file(this->path);
+
+      if (!file.is_elf()) {
+        return;
+      }
+
+      std::vector<RawSymbol> raw_symbols;
+      std::unique_ptr<MappedFile> debug_file;
+
+      if (!read_symbols(file, SHT_SYMTAB, raw_symbols)) {
+        std::vector<fs::path> debug_paths;
+        std::string build_id = get_build_id(file);
+
+        if (build_id.size() > 2) {
+          debug_paths.push_back(fs::path(DEBUG_FILE_DIR) / ".build-id" /
+                                build_id.substr(0, 2) /
+                                (build_id.substr(2) + ".debug"));
+        }
+
+        debug_paths.push_back(DEBUG_FILE_DIR + this->path.string() + ".debug");
+        debug_paths.push_back(DEBUG_FILE_DIR + this->path.string());
+
+        bool found = false;
+
+        for (auto &debug_path : debug_paths) {
+          debug_file = std::make_unique<MappedFile>(debug_path);
+
+          if (debug_file->is_elf() &&
+              read_symbols(*debug_file, SHT_SYMTAB, raw_symbols)) {
+            found = true;
+            break;
+          }
+        }
+
+        if (!found) {
+          read_symbols(file, SHT_DYNSYM, raw_symbols);
+        }
+      }
+
+      // Virtual addresses are converted to file offsets with the loadable
+      // segments of the original file (a debug file has the same addresses,
+      // but not the same contents)
+      const Elf64_Ehdr *header = file.get_header();
+
+      for (auto &raw_symbol : raw_symbols) {
+        for (unsigned int i = 0; i < header->e_phnum; i++) {
+          const Elf64_Phdr *segment = file.get_segment(i);
+
+          if (segment->p_type == PT_LOAD &&
+              raw_symbol.address >= segment->p_vaddr &&
+              raw_symbol.address < segment->p_vaddr + segment->p_filesz) {
+            std::uint64_t offset = raw_symbol.address - segment->p_vaddr +
+              segment->p_offset;
+            this->symbols.push_back({offset, offset + raw_symbol.size,
+                                     demangle(raw_symbol.name), nullptr});
+            break;
+          }
+        }
+      }
+
+      std::stable_sort(this->symbols.begin(), this->symbols.end(),
+                       [](const LoadedSymbol &a, const LoadedSymbol &b) {
+                         return a.start < b.start;
+                       });
+
+      // Aliases (i.e. symbols at the same address) are reduced to
+      // the first one and symbols without sizes are assumed to span
+      // until the next symbol, as "perf" does
+      this->symbols.erase(std::unique(this->symbols.begin(), this->symbols.end(),
+                                      [](const LoadedSymbol &a, const LoadedSymbol &b) {
+                                        return a.start == b.start;
+                                      }),
+                          this->symbols.end());
+
+      for (std::size_t i = 0; i < this->symbols.size(); i++) {
+        LoadedSymbol &symbol = this->symbols[i];
+
+        if (symbol.end == symbol.start) {
+          symbol.end = i + 1 < this->symbols.size() ?
+            this->symbols[i + 1].start : symbol.start + 4096;
+        }
+      }
+    }
+
+    /**
+       Finds the symbol covering a given file offset.
+
+       @param offset The file offset.
+
+       @return The symbol. If no symbol covers the offset, the returned
+               symbol is named "[<path to the ELF file>]".
+    */
+    LoadedSymbol *ElfSymbols::find(std::uint64_t offset) {
+      std::call_once(this->loaded, &ElfSymbols::load, this);
+
+      auto it = std::upper_bound(this->symbols.begin(), this->symbols.end(),
+                                 offset, [](std::uint64_t offset,
+                                            const LoadedSymbol &symbol) {
+                                   return offset < symbol.start;
+                                 });
+
+      if (it == this->symbols.begin() || offset >= (it - 1)->end) {
+        return &this->unknown;
+      }
+
+      return &*(it - 1);
+    }
+
+    /**
+       Constructs a PerfMap object.
+
+       @param path The path to the "perf" symbol map.
+    */
+    PerfMap::PerfMap(fs::path path) : file(path) {
+      this->path = path;
+      this->line_no = 0;
+      this->unknown = {0, 0, "[" + path.string() + "]", nullptr};
+    }
+
+    /**
+       Checks whether the map file has been found.
+    */
+    bool PerfMap::exists() {
+      return this->file.is_open();
+    }
+
+    fs::path PerfMap::get_path() {
+      return this->path;
+    }
+
+    LoadedSymbol *PerfMap::find_loaded(std::uint64_t ip) {
+      auto it = this->symbols.upper_bound(ip);
+
+      if (it == this->symbols.begin()) {
+        return nullptr;
+      }
+
+      it--;
+
+      if (ip >= it->second.end) {
+        return nullptr;
+      }
+
+      return &it->second;
+    }
+
+    /**
+       Finds the symbol covering a given instruction address, reading
+       the lines appended to the map since the last lookup if needed.
+
+       @param ip The instruction address.
+
+       @return The symbol. If no symbol covers the address, the returned
+               symbol is named "[<path to the map>]".
+    */
+    LoadedSymbol *PerfMap::find(std::uint64_t ip) {
+      LoadedSymbol *symbol = this->find_loaded(ip);
+
+      if (symbol != nullptr || !this->file.is_open()) {
+        return symbol != nullptr ? symbol : &this->unknown;
+      }
+
+      std::string line;
+
+      while (true) {
+        std::streampos line_start = this->file.tellg();
+
+        if (!std::getline(this->file, line) || this->file.eof()) {
+          // An incomplete line is read again once it is complete
+          this->file.clear();
+          this->file.seekg(line_start);
+          break;
+        }
+
+        this->line_no++;
+
+        std::istringstream stream(line);
+        std::uint64_t start, size;
+        std::string name;
+
+        if (!(stream >> std::hex >> start >> size) ||
+            !std::getline(stream >> std::ws, name) || name.empty()) {
+          std::cerr << "Line " << this->line_no << ", " << this->path.string();
+          std::cerr << ": incorrect syntax, ignoring." << std::endl;
+          continue;
+        }
+
+        this->symbols[start] = {start, start + size, demangle(name.c_str()),
+                                nullptr};
+      }
+
+      symbol = this->find_loaded(ip);
+      return symbol != nullptr ? symbol : &this->unknown;
+    }
+
+    /**
+       Constructs a Symbolizer object.
+
+       @param kallsyms_path The path to the kernel symbol list,
+                            read on first use.
+    */
+    Symbolizer::Symbolizer(fs::path kallsyms_path) {
+      this->kallsyms_path = kallsyms_path;
+      this->kernel_unknown = {0, 0, "[[kernel.kallsyms]]", nullptr};
+    }
+
+    /**
+       Gets the interned SymbolName object for a given symbol name and
+       executable/library name, creating it if necessary.
+    */
+    const SymbolName *Symbolizer::intern(const std::string &name,
+                                         const std::string &dso) {
+      std::lock_guard<std::mutex> lock(this->symbols_mutex);
+
+      std::string key = name;
+      key += '\0';
+      key += dso;
+
+      auto it = this->symbols.find(key);
+
+      if (it == this->symbols.end()) {
+        std::uint32_t id = this->symbols.size();
+        it = this->symbols.insert({key, {name, dso, id}}).first;
+      }
+
+      return &it->second;
+    }
+
+    const SymbolName *Symbolizer::intern(LoadedSymbol &symbol,
+                                         const std::string &dso) {
+      std::atomic_ref<const SymbolName *> interned(symbol.interned);
+      const SymbolName *result = interned.load(std::memory_order_acquire);
+
+      if (result == nullptr) {
+        result = this->intern(symbol.name, dso);
+        interned.store(result, std::memory_order_release);
+      }
+
+      return result;
+    }
+
+    /**
+       Adds an executable memory mapping of a process, replacing
+       the overlapping parts of any previous mappings.
+
+       @param pid      The PID of the process (-1 for the kernel,
+                       in which case nothing is done).
+       @param start    The start address of the mapping.
+       @param len      The length of the mapping.
+       @param pgoff    The file offset the mapping starts at.
+       @param filename The path to the mapped file as reported by
+                       the kernel.
+    */
+    void Symbolizer::add_mapping(std::int32_t pid, std::uint64_t start,
+                                 std::uint64_t len, std::uint64_t pgoff,
+                                 std::string_view filename) {
+      std::unique_lock<std::shared_mutex> lock(this->processes_mutex);
+
+      if (pid == -1 || len == 0) {
+        return;
+      }
+
+      std::string name(filename);
+
+      // Executable anonymous memory (e.g. JIT-compiled code) is
+      // described by a "perf" symbol map, as in "perf" itself
+      if (name.starts_with("//anon") || name.starts_with("/dev/zero") ||
+          name.starts_with("/anon_hugepage") || name.starts_with("[stack") ||
+          name.starts_with("/SYSV") || name == "[heap]") {
+        name = "/tmp/perf-" + std::to_string(pid) + ".map";
+      }
+
+      const std::string *interned_name = &*this->filenames.insert(name).first;
+      std::map<std::uint64_t, Mapping> &mappings = this->processes[pid];
+      std::uint64_t end = start + len;
+      std::vector<std::pair<std::uint64_t, Mapping> > tails;
+
+      auto it = mappings.lower_bound(start);
+
+      if (it != mappings.begin()) {
+        auto prev = std::prev(it);
+
+        if (prev->second.end > start) {
+          if (prev->second.end > end) {
+            tails.push_back({end, {prev->second.end,
+                                   prev->second.pgoff + (end - prev->first),
+                                   prev->second.filename}});
+          }
+
+          prev->second.end = start;
+        }
+      }
+
+      while (it != mappings.end() && it->first < end) {
+        if (it->second.end > end) {
+          tails.push_back({end, {it->second.end,
+                                 it->second.pgoff + (end - it->first),
+                                 it->second.filename}});
+        }
+
+        it = mappings.erase(it);
+      }
+
+      for (auto &tail : tails) {
+        mappings.insert(tail);
+      }
+
+      mappings[start] = {end, pgoff, interned_name};
+    }
+
+    /**
+       Handles a new thread/process. A new process inherits
+       the mappings of its parent.
+
+       @param pid  The PID of the new thread/process.
+       @param ppid The PID of the parent.
+    */
+    void Symbolizer::fork(std::int32_t pid, std::int32_t ppid) {
+      std::unique_lock<std::shared_mutex> lock(this->processes_mutex);
+
+      if (pid == ppid || this->processes.find(ppid) == this->processes.end()) {
+        return;
+      }
+
+      this->processes[pid] = this->processes[ppid];
+    }
+
+    /**
+       Handles a process replacing its image with execve(), which
+       removes all its mappings.
+
+       @param pid The PID of the process.
+    */
+    void Symbolizer::exec(std::int32_t pid) {
+      std::unique_lock<std::shared_mutex> lock(this->processes_mutex);
+
+      this->processes.erase(pid);
+    }
+
+    /**
+       Checks whether any executable memory mapping of a process
+       overlaps a given address range, i.e. whether adding a mapping
+       there (or replacing all mappings of the process) can change
+       how already recorded addresses are symbolized.
+
+       @param pid   The PID of the process.
+       @param start The start address of the range.
+       @param len   The length of the range.
+    */
+    bool Symbolizer::overlaps(std::int32_t pid, std::uint64_t start,
+                              std::uint64_t len) {
+      std::shared_lock<std::shared_mutex> lock(this->processes_mutex);
+
+      auto process = this->processes.find(pid);
+
+      if (process == this->processes.end() || len == 0) {
+        return false;
+      }
+
+      std::uint64_t end = start + len < start ? UINT64_MAX : start + len;
+      auto it = process->second.lower_bound(start);
+
+      if (it != process->second.begin() && std::prev(it)->second.end > start) {
+        return true;
+      }
+
+      return it != process->second.end() && it->first < end;
+    }
+
+    void Symbolizer::load_kernel_symbols() {
+      std::ifstream file(this->kallsyms_path);
+      std::string line;
+      std::unordered_map<std::string, std::uint32_t> dso_indices;
+      std::vector<std::pair<LoadedSymbol, std::uint32_t> > loaded;
+
+      while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::uint64_t address;
+        char type;
+        std::string name, module;
+
+        if (!(stream >> std::hex >> address >> type >> name) || address == 0 ||
+            (type != 't' && type != 'T' && type != 'w' && type != 'W')) {
+          continue;
+        }
+
+        std::string dso = "[kernel.kallsyms]";
+
+        if (stream >> module && module.size() > 2 && module.front() == '[' &&
+            module.back() == ']') {
+          dso = module;
+        }
+
+        if (dso_indices.find(dso) == dso_indices.end()) {
+          dso_indices[dso] = this->kernel_dsos.size();
+          this->kernel_dsos.push_back(dso);
+        }
+
+        loaded.push_back({{address, address, name, nullptr}, dso_indices[dso]});
+      }
+
+      std::stable_sort(loaded.begin(), loaded.end(),
+                       [](auto &a, auto &b) {
+                         return a.first.start < b.first.start;
+                       });
+
+      for (std::size_t i = 0; i < loaded.size(); i++) {
+        if (i + 1 < loaded.size() &&
+            loaded[i + 1].first.start == loaded[i].first.start) {
+          continue;
+        }
+
+        loaded[i].first.end = i + 1 < loaded.size() ?
+          loaded[i + 1].first.start : loaded[i].first.start + 4096;
+        this->kernel_symbols.push_back(std::move(loaded[i].first));
+        this->kernel_symbol_dsos.push_back(loaded[i].second);
+      }
+    }
+
+    ResolvedIp Symbolizer::resolve_kernel(std::uint64_t ip) {
+      std::call_once(this->kernel_loaded, &Symbolizer::load_kernel_symbols, this);
+
+      auto it = std::upper_bound(this->kernel_symbols.begin(),
+                                 this->kernel_symbols.end(),
+                                 ip, [](std::uint64_t ip,
+                                        const LoadedSymbol &symbol) {
+                                   return ip < symbol.start;
+                                 });
+
+      if (it == this->kernel_symbols.begin() || ip >= (it - 1)->end) {
+        return {this->intern(this->kernel_unknown, "[kernel.kallsyms]"), ip};
+      }
+
+      std::size_t index = it - 1 - this->kernel_symbols.begin();
+      return {this->intern(this->kernel_symbols[index],
+                           this->kernel_dsos[this->kernel_symbol_dsos[index]]), ip};
+    }
+
+    /**
+       Symbolizes an instruction address of a process.
+
+       @param pid    The PID of the process.
+       @param ip     The instruction address.
+       @param kernel Whether the address is in the kernel space.
+
+       @return The symbol name and the offset to be sent to
+               adaptyst-server. The offset is a file offset if
+               the address belongs to an executable/library, otherwise
+               it is the address itself.
+    */
+    ResolvedIp Symbolizer::resolve(std::int32_t pid, std::uint64_t ip,
+                                   bool kernel) {
+      if (kernel) {
+        return this->resolve_kernel(ip);
+      }
+
+      Mapping mapping = {0, 0, nullptr};
+      std::uint64_t mapping_start = 0;
+
+      {
+        std::shared_lock<std::shared_mutex> lock(this->processes_mutex);
+        auto process = this->processes.find(pid);
+
+        if (process != this->processes.end()) {
+          auto it = process->second.upper_bound(ip);
+
+          if (it != process->second.begin() && ip < std::prev(it)->second.end) {
+            mapping = std::prev(it)->second;
+            mapping_start = std::prev(it)->first;
+          }
+        }
+      }
+
+      if (mapping.filename == nullptr) {
+        char buf[21];
+        std::snprintf(buf, sizeof(buf), "[0x%llx]", (unsigned long long)ip);
+        return {this->intern(buf, ""), ip};
+      }
+
+      const std::string &filename = *mapping.filename;
+      std::string_view basename(filename);
+      basename.remove_prefix(std::min(basename.size(),
+                                      basename.rfind('/') + 1));
+
+      if (basename.starts_with("perf-") && basename.ends_with(".map") &&
+          basename.size() > 9 &&
+          basename.find_first_not_of("0123456789", 5) == basename.size() - 4) {
+        // "perf" symbol maps are read incrementally, so their lookups
+        // cannot be done concurrently
+        std::lock_guard<std::mutex> lock(this->files_mutex);
+        std::unique_ptr<PerfMap> &perf_map = this->perf_maps[filename];
+
+        if (!perf_map) {
+          perf_map = std::make_unique<PerfMap>(filename);
+        }
+
+        return {this->intern(*perf_map->find(ip), filename), ip};
+      }
+
+      std::uint64_t offset = ip - mapping_start + mapping.pgoff;
+
+      {
+        SourceShard &shard = this->source_shards[(offset >> 6) %
+                                                 SYMBOLIZER_SOURCE_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.offsets[mapping.filename].insert(offset);
+      }
+
+      ElfSymbols *elf;
+
+      {
+        std::lock_guard<std::mutex> lock(this->files_mutex);
+        std::unique_ptr<ElfSymbols> &elf_ptr = this->elfs[filename];
+
+        if (!elf_ptr) {
+          elf_ptr = std::make_unique<ElfSymbols>(filename);
+        }
+
+        elf = elf_ptr.get();
+      }
+
+      return {this->intern(*elf->find(offset), filename), offset};
+    }
+
+    /**
+       Gets the file offsets of all symbolized addresses belonging to
+       executables/libraries, per executable/library path.
+    */
+    std::unordered_map<std::string,
+                       std::unordered_set<std::uint64_t> > &Symbolizer::get_sources() {
+      for (auto &shard : this->source_shards) {
+        for (auto &[filename, offsets] : shard.offsets) {
+          this->sources[*filename].merge(offsets);
+        }
+
+        shard.offsets.clear();
+      }
+
+      return this->sources;
+    }
+
+    /**
+       Gets the paths to all "perf" symbol maps which have been needed,
+       but not found.
+    */
+    std::vector<std::string> Symbolizer::get_missing_maps() {
+      std::lock_guard<std::mutex> lock(this->files_mutex);
+
+      std::vector<std::string> result;
+
+      for (auto &perf_map : this->perf_maps) {
+        if (!perf_map.second->exists()) {
+          result.push_back(perf_map.second->get_path().string());
+        }
+      }
+
+      return result;
+    }
+  };
+};
@@ -0,0 +1,178 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef SYMBOLIZER_HPP_
+#define SYMBOLIZER_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The number of independently locked parts the set of symbolized
+// file offsets is split into, so that threads symbolizing samples
+// at the same time rarely wait for each other
+#ifndef SYMBOLIZER_SOURCE_SHARDS
+#define SYMBOLIZER_SOURCE_SHARDS 16
+#endif
+
+namespace adaptyst {
+  namespace decoder {
+    namespace fs = std::filesystem;
+
+    /**
+       A structure describing a callchain element name in the form sent
+       to adaptyst-server, i.e. [<symbol>, <executable/library>].
+
+       SymbolName objects are interned by Symbolizer, so every distinct
+       name has exactly one object (with a unique sequential ID) which
+       stays valid for the lifetime of the Symbolizer object.
+    */
+    struct SymbolName {
+      std::string name;
+      std::string dso;
+      std::uint32_t id;
+    };
+
+    /**
+       A structure describing a symbolized instruction address.
+       The offset is relative to the executable/library if
+       the address belongs to one (NO_OFFSET if not applicable).
+    */
+    struct ResolvedIp {
+      const SymbolName *symbol;
+      std::uint64_t offset;
+    };
+
+    /**
+       A structure describing a symbol loaded from a file, covering
+       the address range [start, end). The interned name is set by
+       Symbolizer on first use (atomically, as the symbol may be looked
+       up by several threads at the same time).
+    */
+    struct LoadedSymbol {
+      std::uint64_t start;
+      std::uint64_t end;
+      std::string name;
+      const SymbolName *interned;
+    };
+
+    /**
+       A class describing the function symbols of an ELF
+       executable/library, loaded on first use. Symbols are looked up
+       by file offsets rather than virtual addresses, as file offsets
+       are what "perf" mmap records provide.
+
+       find() can be called by multiple threads at the same time.
+    */
+    class ElfSymbols {
+    private:
+      fs::path path;
+      std::once_flag loaded;
+      std::vector<LoadedSymbol> symbols;
+      LoadedSymbol unknown;
+
+      void load();
+
+    public:
+      ElfSymbols(fs::path path);
+      LoadedSymbol *find(std::uint64_t offset);
+    };
+
+    /**
+       A class describing a "perf" symbol map of JIT-compiled code
+       (/tmp/perf-<PID>.map), read incrementally as the map may be
+       still appended to during profiling.
+    */
+    class PerfMap {
+    private:
+      fs::path path;
+      std::ifstream file;
+      unsigned long long line_no;
+      std::map<std::uint64_t, LoadedSymbol> symbols;
+      LoadedSymbol unknown;
+
+      LoadedSymbol *find_loaded(std::uint64_t ip);
+
+    public:
+      PerfMap(fs::path path);
+      bool exists();
+      fs::path get_path();
+      LoadedSymbol *find(std::uint64_t ip);
+    };
+
+    /**
+       A class turning instruction addresses of sampled processes into
+       symbol names, following the same rules as adaptyst-process.py
+       does for the callchains provided by perf-script.
+
+       The object can be shared by multiple threads, except for
+       get_sources() which must be called only after symbolization
+       has finished. Addresses are symbolized by several threads
+       concurrently, only changes of memory mappings are exclusive.
+    */
+    class Symbolizer {
+    private:
+      struct Mapping {
+        std::uint64_t end;
+        std::uint64_t pgoff;
+        const std::string *filename;
+      };
+
+      struct SourceShard {
+        std::mutex mutex;
+        std::unordered_map<const std::string *,
+                           std::unordered_set<std::uint64_t> > offsets;
+      };
+
+      std::mutex symbols_mutex;
+      std::unordered_map<std::string, SymbolName> symbols;
+
+      std::mutex files_mutex;
+      std::unordered_map<std::string, std::unique_ptr<ElfSymbols> > elfs;
+      std::unordered_map<std::string, std::unique_ptr<PerfMap> > perf_maps;
+
+      std::shared_mutex processes_mutex;
+      std::unordered_set<std::string> filenames;
+      std::unordered_map<std::int32_t, std::map<std::uint64_t, Mapping> > processes;
+
+      SourceShard source_shards[SYMBOLIZER_SOURCE_SHARDS];
+      std::unordered_map<std::string, std::unordered_set<std::uint64_t> > sources;
+
+      std::once_flag kernel_loaded;
+      std::vector<LoadedSymbol> kernel_symbols;
+      std::vector<std::uint32_t> kernel_symbol_dsos;
+      std::vector<std::string> kernel_dsos;
+      LoadedSymbol kernel_unknown;
+      fs::path kallsyms_path;
+
+      void load_kernel_symbols();
+      const SymbolName *intern(LoadedSymbol &symbol, const std::string &dso);
+      ResolvedIp resolve_kernel(std::uint64_t ip);
+
+    public:
+      Symbolizer(fs::path kallsyms_path = "/proc/kallsyms");
+      const SymbolName *intern(const std::string &name, const std::string &dso);
+      void add_mapping(std::int32_t pid, std::uint64_t start,
+                       std::uint64_t len, std::uint64_t pgoff,
+                       std::string_view filename);
+      void fork(std::int32_t pid, std::int32_t ppid);
+      void exec(std::int32_t pid);
+      bool overlaps(std::int32_t pid, std::uint64_t start, std::uint64_t len);
+      ResolvedIp resolve(std::int32_t pid, std::uint64_t ip, bool kernel);
+      std::unordered_map<std::string,
+                         std::unordered_set<std::uint64_t> > &get_sources();
+      std::vector<std::string> get_missing_maps();
+    };
+  };
+};
+
+#endif
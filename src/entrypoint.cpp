@@ -104,15 +104,47 @@ namespace adaptyst {
     auto addr_opt =
       app.add_option("-a,--address", address, "Delegate processing to "
                      "another machine running adaptyst-server. All results "
-                     "will be stored on that machine.")
+                     "will be stored on that machine. Use "
+                     "\"unix:<path>\" for adaptyst-server listening on "
+                     "a Unix domain socket on the same machine.")
       ->check([](const std::string &arg) -> std::string {
-        if (!std::regex_match(arg, std::regex("^.+\\:[0-9]+$"))) {
-          return "The value must be in form of \"<address>:<port>\"";
+        if (!std::regex_match(arg, std::regex("^.+\\:[0-9]+$")) &&
+            !std::regex_match(arg, std::regex("^unix:\\S+$"))) {
+          return "The value must be in form of \"<address>:<port>\" "
+            "or \"unix:<path>\"";
         }
 
         return "";
       })
-      ->option_text("ADDRESS:PORT");
+      ->option_text("ADDRESS:PORT|unix:PATH");
+
+    bool compress = false;
+    app.add_flag("-z,--compress", compress, "Compress profiling data sent "
+                 "to adaptyst-server with zstd. This is useful when the "
+                 "network bandwidth to adaptyst-server is limited. Data are "
+                 "sent uncompressed if adaptyst-server has been compiled "
+                 "without zstd support or if the \"zstandard\" Python "
+                 "module is not available to perf.")
+      ->needs(addr_opt);
+
+    int results_compression = 0;
+    app.add_option("-Z,--compress-results", results_compression, "Save "
+                   "processed result files compressed with zstd at a "
+                   "specified level (1-19), as *.json.zst. Higher levels "
+                   "produce smaller files at the cost of longer "
+                   "processing (default: 0, i.e. the adaptyst-server "
+                   "default for external servers and no compression "
+                   "otherwise).")
+      ->check(CLI::Range(0, 19))
+      ->option_text("LEVEL");
+
+    int priority = 0;
+    app.add_option("-P,--priority", priority, "Priority of the profiling "
+                   "session in the queue of adaptyst-server when it is busy. "
+                   "Sessions with a higher priority are started first "
+                   "(default: 0).")
+      ->needs(addr_opt)
+      ->option_text("INT");
 
     std::string codes_dst = "";
     app.add_option("-c,--codes", codes_dst, "Send the newline-separated list "
@@ -153,6 +185,35 @@ namespace adaptyst {
       ->check(OnlyMinRange(1))
       ->option_text("UINT>0");
 
+    unsigned int aggregate_window = 0;
+    app.add_option("-A,--aggregate", aggregate_window, "Send consecutive "
+                   "samples of a thread with identical stack traces as one "
+                   "message, as long as they are within a specified number "
+                   "of milliseconds of the first one. This reduces the load "
+                   "on adaptyst-server for programs spending a long time "
+                   "in tight loops, at the cost of delaying the samples "
+                   "by up to the specified time. Results are not affected. "
+                   "(default: 0, i.e. no aggregation)")
+      ->option_text("UINT");
+
+    bool python_decoder = false;
+    app.add_flag("--python-decoder", python_decoder, "Always process "
+                 "perf-record output with perf-script and a Python script "
+                 "instead of the native adaptyst-perf-decode (this is "
+                 "slower, but useful if adaptyst-perf-decode cannot "
+                 "handle the recorded data). The Python path is always used "
+                 "for the thread tree and when -i is a Python script.");
+
+    bool native_profiler = false;
+    app.add_flag("--native-profiler", native_profiler, "Open perf events "
+                 "and process their samples inside Adaptyst instead of "
+                 "running perf-record and perf-script (perf_path is not "
+                 "needed then). This starts faster and has less overhead, "
+                 "but off-CPU profiling, Python script filters, and events "
+                 "not known to the kernel (i.e. only defined in the perf "
+                 "event lists) are not supported.")
+      ->excludes("--python-decoder");
+
     std::vector<std::string> event_strs;
     app.add_option("-e,--event", event_strs, "Extra perf event to be used "
                    "for sampling with a given period (i.e. do a sample on "
@@ -369,48 +430,53 @@ namespace adaptyst {
         return 2;
       }
 
-      if (config.find("perf_path") == config.end()) {
-        print("You must specify the path to your patched \"perf\" installation "
-              "(perf_path) in your config file (" + local_config_path.string() +
-              " or " + ADAPTYST_CONFIG_FILE + ")!", true, true);
-        return 2;
-      }
+      fs::path perf_bin_path;
+      fs::path perf_python_path;
 
-      fs::path perf_path(config["perf_path"]);
-      fs::path perf_bin_path = perf_path / "bin" / "perf";
-      fs::path perf_python_path = perf_path / "libexec" / "perf-core" / "scripts" /
-        "python" / "Perf-Trace-Util" / "lib" / "Perf" / "Trace";
+      if (!native_profiler) {
+        if (config.find("perf_path") == config.end()) {
+          print("You must specify the path to your patched \"perf\" installation "
+                "(perf_path) in your config file (" + local_config_path.string() +
+                " or " + ADAPTYST_CONFIG_FILE + ")!", true, true);
+          return 2;
+        }
 
-      if (!fs::exists(perf_bin_path)) {
-        print(perf_bin_path.string() + " does not exist!", true, true);
-        print("Hint: You may want to verify perf_path in your config file (" +
-              local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
-              false, true);
-        return 2;
-      }
+        fs::path perf_path(config["perf_path"]);
+        perf_bin_path = perf_path / "bin" / "perf";
+        perf_python_path = perf_path / "libexec" / "perf-core" / "scripts" /
+          "python" / "Perf-Trace-Util" / "lib" / "Perf" / "Trace";
 
-      if (!fs::is_regular_file(fs::canonical(perf_bin_path))) {
-        print(perf_bin_path.string() + " does not point to a regular file!", true, true);
-        print("Hint: You may want to verify perf_path in your config file (" +
-              local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
-              false, true);
-        return 2;
-      }
+        if (!fs::exists(perf_bin_path)) {
+          print(perf_bin_path.string() + " does not exist!", true, true);
+          print("Hint: You may want to verify perf_path in your config file (" +
+                local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
+                false, true);
+          return 2;
+        }
 
-      if (!fs::exists(perf_python_path)) {
-        print(perf_python_path.string() + " does not exist!", true, true);
-        print("Hint: You may want to verify perf_path in your config file (" +
-              local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
-              false, true);
-        return 2;
-      }
+        if (!fs::is_regular_file(fs::canonical(perf_bin_path))) {
+          print(perf_bin_path.string() + " does not point to a regular file!", true, true);
+          print("Hint: You may want to verify perf_path in your config file (" +
+                local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
+                false, true);
+          return 2;
+        }
 
-      if (!fs::is_directory(fs::canonical(perf_python_path))) {
-        print(perf_python_path.string() + " does not point to a directory!", true, true);
-        print("Hint: You may want to verify perf_path in your config file (" +
-              local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
-              false, true);
-        return 2;
+        if (!fs::exists(perf_python_path)) {
+          print(perf_python_path.string() + " does not exist!", true, true);
+          print("Hint: You may want to verify perf_path in your config file (" +
+                local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
+                false, true);
+          return 2;
+        }
+
+        if (!fs::is_directory(fs::canonical(perf_python_path))) {
+          print(perf_python_path.string() + " does not point to a directory!", true, true);
+          print("Hint: You may want to verify perf_path in your config file (" +
+                local_config_path.string() + " or " + ADAPTYST_CONFIG_FILE + ").",
+                false, true);
+          return 2;
+        }
       }
 
       Perf::Filter filter;
@@ -441,6 +507,12 @@ namespace adaptyst {
         } else {
           filter.mode = Perf::FilterMode::PYTHON;
           filter.data = fs::canonical(match[2].str());
+
+          if (native_profiler) {
+            print("Python script filters cannot be used with "
+                  "--native-profiler! Exiting.", true, true);
+            return 2;
+          }
         }
       }
 
@@ -565,20 +637,36 @@ namespace adaptyst {
         mode = Perf::CaptureMode::BOTH;
       }
 
-      profilers.push_back(std::make_unique<Perf>(acceptor1,
-                                                 server_buffer,
-                                                 perf_bin_path,
-                                                 perf_python_path,
-                                                 syscall_tree, cpu_config,
-                                                 "Thread tree profiler",
-                                                 mode, filter));
-      profilers.push_back(std::make_unique<Perf>(acceptor2,
-                                                 server_buffer,
-                                                 perf_bin_path,
-                                                 perf_python_path,
-                                                 main, cpu_config,
-                                                 "On-CPU/Off-CPU profiler",
-                                                 mode, filter));
+      if (native_profiler) {
+        profilers.push_back(std::make_unique<NativePerf>(acceptor1,
+                                                         server_buffer,
+                                                         syscall_tree, cpu_config,
+                                                         "Thread tree profiler",
+                                                         mode, filter, 0));
+        profilers.push_back(std::make_unique<NativePerf>(acceptor2,
+                                                         server_buffer,
+                                                         main, cpu_config,
+                                                         "On-CPU/Off-CPU profiler",
+                                                         mode, filter,
+                                                         aggregate_window));
+      } else {
+        profilers.push_back(std::make_unique<Perf>(acceptor1,
+                                                   server_buffer,
+                                                   perf_bin_path,
+                                                   perf_python_path,
+                                                   syscall_tree, cpu_config,
+                                                   "Thread tree profiler",
+                                                   mode, filter, 0, false));
+        profilers.push_back(std::make_unique<Perf>(acceptor2,
+                                                   server_buffer,
+                                                   perf_bin_path,
+                                                   perf_python_path,
+                                                   main, cpu_config,
+                                                   "On-CPU/Off-CPU profiler",
+                                                   mode, filter,
+                                                   aggregate_window,
+                                                   !python_decoder));
+      }
 
       std::unique_ptr<fs::path> roofline_benchmark_path;
 
@@ -730,6 +818,8 @@ namespace adaptyst {
 
       std::unordered_map<std::string, std::string> event_dict;
 
+      std::vector<std::pair<std::string, int> > custom_events;
+
       for (std::string &event_str : event_strs) {
         std::vector<std::string> parts;
         boost::split(parts, event_str, boost::is_any_of(","));
@@ -738,18 +828,44 @@ namespace adaptyst {
         int period = std::stoi(parts[1]);
         std::string website_title = parts[2];
 
+        // Samples are attributed to events by their names, so an event
+        // can be sampled only once
+        if (event_dict.find(event_name) != event_dict.end()) {
+          print("Event " + event_name + " has been specified more than once, "
+                "only the first occurrence will be used.", true, false);
+          continue;
+        }
+
+        custom_events.push_back(std::make_pair(event_name, period));
+        event_dict[event_name] = website_title;
+      }
+
+      // All custom events are sampled by one profiler, which splits
+      // the samples into per-event call trees
+      if (!custom_events.empty()) {
         std::unique_ptr<Acceptor> acceptor =
           generic_acceptor_factory.make_acceptor(1);
 
-        PerfEvent event(event_name, period, buffer);
-        profilers.push_back(std::make_unique<Perf>(acceptor,
-                                                   server_buffer,
-                                                   perf_bin_path,
-                                                   perf_python_path,
-                                                   event, cpu_config,
-                                                   event_name, mode, filter));
+        PerfEvent event(custom_events, buffer);
 
-        event_dict[event_name] = website_title;
+        if (native_profiler) {
+          profilers.push_back(std::make_unique<NativePerf>(acceptor,
+                                                           server_buffer,
+                                                           event, cpu_config,
+                                                           "Custom event profiler",
+                                                           mode, filter,
+                                                           aggregate_window));
+        } else {
+          profilers.push_back(std::make_unique<Perf>(acceptor,
+                                                     server_buffer,
+                                                     perf_bin_path,
+                                                     perf_python_path,
+                                                     event, cpu_config,
+                                                     "Custom event profiler",
+                                                     mode, filter,
+                                                     aggregate_window,
+                                                     !python_decoder));
+        }
       }
 
       std::vector<pid_t> spawned_children;
@@ -758,7 +874,8 @@ namespace adaptyst {
       try {
         int code = start_profiling_session(profilers, command_elements, address, server_buffer,
                                            warmup, cpu_config, tmp_dir, spawned_children,
-                                           event_dict, codes_dst, roofline_benchmark_path.get());
+                                           event_dict, codes_dst, roofline_benchmark_path.get(),
+                                           compress, priority, results_compression);
 
         auto end_time =
           ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
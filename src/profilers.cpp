@@ -17,6 +17,26 @@
 #define ACCEPT_TIMEOUT 5
 
 namespace adaptyst {
+  /**
+     Converts a stack trace filter to the settings sent to
+     a "perf-script" Python script in the "filter_settings" message.
+  */
+  static nlohmann::json get_filter_settings(Perf::Filter &filter) {
+    nlohmann::json settings = nlohmann::json::object();
+    settings["mark"] = filter.mark;
+
+    if (filter.mode == Perf::ALLOW || filter.mode == Perf::DENY) {
+      settings["type"] = filter.mode == Perf::ALLOW ? "allow" : "deny";
+      settings["conditions"] =
+        std::get<std::vector<std::vector<std::string> > >(filter.data);
+    } else if (filter.mode == Perf::PYTHON) {
+      settings["type"] = "python";
+      settings["script"] = std::get<fs::path>(filter.data);
+    }
+
+    return settings;
+  }
+
   /**
      Constructs a PerfEvent object corresponding to thread tree
      profiling.
@@ -58,23 +78,23 @@ namespace adaptyst {
   }
 
   /**
-     Constructs a PerfEvent object corresponding to a custom
-     Linux "perf" event.
-
-     @param name          The name of a "perf" event as displayed by
-                          "perf list".
-     @param period        A sampling period. The value of X means
-                          "do a sample on every X occurrences of the
-                          event".
+     Constructs a PerfEvent object corresponding to one or more custom
+     Linux "perf" events, sampled together by one "perf" instance.
+     Samples are told apart by their event names, so that every event
+     still gets its own call trees.
+
+     @param events        The names of "perf" events as displayed by
+                          "perf list", along with their sampling periods.
+                          The period of X means "do a sample on every X
+                          occurrences of the event".
      @param buffer_events A number of events that should be buffered
                           before sending them for processing. 1
                           effectively disables buffering.
   */
-  PerfEvent::PerfEvent(std::string name,
-                       int period,
+  PerfEvent::PerfEvent(std::vector<std::pair<std::string, int> > events,
                        int buffer_events) {
-    this->name = name;
-    this->options.push_back(std::to_string(period));
+    this->name = "<custom>";
+    this->events = events;
     this->options.push_back(std::to_string(buffer_events));
   }
 
@@ -93,6 +113,18 @@ namespace adaptyst {
      @param cpu_config       A CPUConfig object describing how CPU cores should
                              be used for profiling.
      @param name             The name of this "perf" instance.
+     @param capture_mode     What callchains should be captured (kernel, user, or both).
+     @param filter           The stack trace filter to be used.
+     @param aggregate_window The time in milliseconds within which consecutive
+                             samples of a thread with identical callchains are
+                             sent to adaptyst-server as one message (0 means
+                             that samples are always sent one by one).
+     @param native_decoder   Whether "perf record" output should be processed
+                             by adaptyst-perf-decode instead of "perf script"
+                             with a Python script. "perf script" is still
+                             used if adaptyst-perf-decode is not installed or
+                             cannot handle the profiling setup (i.e. the thread
+                             tree profiling and Python script filters).
   */
   Perf::Perf(std::unique_ptr<Acceptor> &acceptor,
              unsigned int buf_size,
@@ -102,8 +134,10 @@ namespace adaptyst {
              CPUConfig &cpu_config,
              std::string name,
              CaptureMode capture_mode,
-             Filter filter) : Profiler(acceptor, buf_size),
-                              cpu_config(cpu_config) {
+             Filter filter,
+             unsigned int aggregate_window,
+             bool native_decoder) : Profiler(acceptor, buf_size),
+                                    cpu_config(cpu_config) {
     this->perf_bin_path = perf_bin_path;
     this->perf_python_path = perf_python_path;
     this->perf_event = perf_event;
@@ -111,6 +145,8 @@ namespace adaptyst {
     this->max_stack = 1024;
     this->capture_mode = capture_mode;
     this->filter = filter;
+    this->aggregate_window = aggregate_window;
+    this->native_decoder = native_decoder;
 
     this->requirements.push_back(std::make_unique<PerfEventKernelSettingsReq>(this->max_stack));
     this->requirements.push_back(std::make_unique<NUMAMitigationReq>());
@@ -167,22 +203,35 @@ namespace adaptyst {
                      "--demangle", "--demangle-kernel",
                      "--max-stack=" + std::to_string(this->max_stack)};
     } else {
-      stdout = result_out / ("perf_script_" + this->perf_event.name + "_stdout.log");
-      stderr_record = result_out / ("perf_record_" + this->perf_event.name + "_stderr.log");
-      stderr_script = result_out / ("perf_script_" + this->perf_event.name + "_stderr.log");
+      stdout = result_out / "perf_script_custom_stdout.log";
+      stderr_record = result_out / "perf_record_custom_stderr.log";
+      stderr_script = result_out / "perf_script_custom_stderr.log";
 
       argv_record = {this->perf_bin_path.string(), "record", "-o", "-",
                      "--call-graph", "fp", "-k",
-                     "CLOCK_MONOTONIC", "--sorted-stream", "-e",
-                     this->perf_event.name + "/period=" + this->perf_event.options[0] + "/",
-                     "--buffer-events", this->perf_event.options[1],
-                     "--pid=" + std::to_string(pid)};
+                     "CLOCK_MONOTONIC", "--sorted-stream"};
+
+      for (auto &[event_name, period] : this->perf_event.events) {
+        argv_record.push_back("-e");
+        argv_record.push_back(event_name + "/period=" + std::to_string(period) + "/");
+      }
+
+      argv_record.push_back("--buffer-events");
+      argv_record.push_back(this->perf_event.options[0]);
+      argv_record.push_back("--pid=" + std::to_string(pid));
       argv_script = {this->perf_bin_path.string(), "script", "-s",
                      script_path + "/adaptyst-process.py",
                      "--demangle", "--demangle-kernel",
                      "--max-stack=" + std::to_string(this->max_stack)};
     }
 
+    if (this->native_decoder && this->perf_event.name != "<thread_tree>" &&
+        this->filter.mode != PYTHON &&
+        fs::exists(script_path + "/adaptyst-perf-decode")) {
+      argv_script = {script_path + "/adaptyst-perf-decode",
+                     "--max-stack=" + std::to_string(this->max_stack)};
+    }
+
     if (this->capture_mode == KERNEL) {
       argv_record.push_back("--kernel-callchains");
     } else if (this->capture_mode == USER) {
@@ -198,6 +247,16 @@ namespace adaptyst {
     this->script_proc = std::make_unique<Process>(argv_script);
     this->script_proc->add_env("ADAPTYST_SERV_CONNECT", instrs);
 
+    if (this->aggregate_window > 0) {
+      this->script_proc->add_env("ADAPTYST_AGGREGATE",
+                                 std::to_string(this->aggregate_window));
+    }
+
+    if (connection_instrs.get_compression() != "none") {
+      this->script_proc->add_env("ADAPTYST_COMPRESSION",
+                                 connection_instrs.get_compression());
+    }
+
     char *cur_pythonpath = getenv("PYTHONPATH");
 
     if (cur_pythonpath) {
@@ -332,30 +391,8 @@ namespace adaptyst {
 
     if (this->filter.mode != NONE) {
       nlohmann::json allowdenylist_json = nlohmann::json::object();
-
-      if (this->filter.mode == ALLOW) {
-        allowdenylist_json["type"] = "filter_settings";
-        allowdenylist_json["data"] = nlohmann::json::object();
-        allowdenylist_json["data"]["type"] = "allow";
-        allowdenylist_json["data"]["mark"] = this->filter.mark;
-        allowdenylist_json["data"]["conditions"] =
-          std::get<std::vector<std::vector<std::string> > >(this->filter.data);
-      } else if (this->filter.mode == DENY) {
-        allowdenylist_json["type"] = "filter_settings";
-        allowdenylist_json["data"] = nlohmann::json::object();
-        allowdenylist_json["data"]["type"] = "deny";
-        allowdenylist_json["data"]["mark"] = this->filter.mark;
-        allowdenylist_json["data"]["conditions"] =
-          std::get<std::vector<std::vector<std::string> > >(this->filter.data);
-      } else if (this->filter.mode == PYTHON) {
-        allowdenylist_json["type"] = "filter_settings";
-        allowdenylist_json["data"] = nlohmann::json::object();
-        allowdenylist_json["data"]["type"] = "python";
-        allowdenylist_json["data"]["mark"] = this->filter.mark;
-        allowdenylist_json["data"]["script"] =
-          std::get<fs::path>(this->filter.data);
-      }
-
+      allowdenylist_json["type"] = "filter_settings";
+      allowdenylist_json["data"] = get_filter_settings(this->filter);
       this->connection->write(allowdenylist_json.dump());
     }
 
@@ -385,4 +422,240 @@ namespace adaptyst {
   std::vector<std::unique_ptr<Requirement> > &Perf::get_requirements() {
     return this->requirements;
   }
+
+  /**
+     Constructs a NativePerf object.
+
+     @param acceptor         The acceptor to use for establishing a connection
+                             for exchanging generic messages with the profiler.
+     @param buf_size         The buffer size for a connection that the acceptor
+                             will accept.
+     @param perf_event       The PerfEvent object corresponding to a "perf" event
+                             to be used in this profiler instance. Off-CPU
+                             profiling is not supported and custom events must
+                             be known to the kernel (i.e. listed in sysfs or
+                             given as raw/PMU events).
+     @param cpu_config       A CPUConfig object describing how CPU cores should
+                             be used for profiling. The events are opened on
+                             the cores of the profiled command and the records
+                             are decoded on the profiler cores.
+     @param name             The name of this profiler instance.
+     @param capture_mode     What callchains should be captured (kernel, user, or both).
+     @param filter           The stack trace filter to be used. Python script
+                             filters are not supported.
+     @param aggregate_window The time in milliseconds within which consecutive
+                             samples of a thread with identical callchains are
+                             sent to adaptyst-server as one message (0 means
+                             that samples are always sent one by one).
+  */
+  NativePerf::NativePerf(std::unique_ptr<Acceptor> &acceptor,
+                         unsigned int buf_size,
+                         PerfEvent &perf_event,
+                         CPUConfig &cpu_config,
+                         std::string name,
+                         Perf::CaptureMode capture_mode,
+                         Perf::Filter filter,
+                         unsigned int aggregate_window) : Profiler(acceptor, buf_size),
+                                                          cpu_config(cpu_config) {
+    this->perf_event = perf_event;
+    this->name = name;
+    this->max_stack = 1024;
+    this->capture_mode = capture_mode;
+    this->filter = filter;
+    this->aggregate_window = aggregate_window;
+
+    this->requirements.push_back(std::make_unique<PerfEventKernelSettingsReq>(this->max_stack));
+    this->requirements.push_back(std::make_unique<NUMAMitigationReq>());
+  }
+
+  std::string NativePerf::get_name() {
+    return this->name;
+  }
+
+  /**
+     Gets the events to open, equivalent to the ones passed
+     to "perf record" by Perf.
+
+     @throw std::runtime_error If an event is not supported.
+  */
+  std::vector<decoder::LiveEvent> NativePerf::get_events() {
+    std::vector<decoder::LiveEvent> events;
+
+    if (this->perf_event.name == "<thread_tree>") {
+      std::vector<std::pair<std::string, std::string> > tracepoints =
+        {{"syscalls", "sys_exit_execve"}, {"syscalls", "sys_exit_execveat"},
+         {"sched", "sched_process_fork"}, {"sched", "sched_process_exit"}};
+
+      for (auto &[category, name] : tracepoints) {
+        decoder::Tracepoint tracepoint = decoder::get_tracepoint(category, name);
+        decoder::LiveEvent event;
+        event.attr = decoder::parse_event(category + ":" + name);
+        event.attr.sample_period = 1;
+        event.name = name;
+        event.field_offsets = tracepoint.field_offsets;
+        events.push_back(event);
+      }
+    } else if (this->perf_event.name == "<main>") {
+      if (std::stoi(this->perf_event.options[1]) > 0) {
+        print("Off-CPU profiling is not supported by profiler \"" +
+              this->get_name() + "\", only on-CPU samples will be "
+              "collected.", true, false);
+      }
+
+      decoder::LiveEvent event;
+      event.attr = decoder::parse_event("task-clock");
+      event.attr.freq = 1;
+      event.attr.sample_freq = std::stoull(this->perf_event.options[0]);
+      event.name = "task-clock";
+      events.push_back(event);
+    } else {
+      for (auto &[event_name, period] : this->perf_event.events) {
+        decoder::LiveEvent event;
+        event.attr = decoder::parse_event(event_name);
+
+        if (event.attr.sample_period == 0) {
+          event.attr.sample_period = period;
+        }
+
+        event.name = event_name;
+        events.push_back(event);
+      }
+    }
+
+    for (auto &event : events) {
+      event.attr.exclude_callchain_user = this->capture_mode == Perf::KERNEL;
+      event.attr.exclude_callchain_kernel = this->capture_mode == Perf::USER;
+      event.attr.sample_max_stack = std::min(this->max_stack, 65535);
+    }
+
+    return events;
+  }
+
+  void NativePerf::start(pid_t pid,
+                         ServerConnInstrs &connection_instrs,
+                         fs::path result_out,
+                         fs::path result_processed,
+                         bool capture_immediately) {
+    try {
+      if (this->acceptor.get() != nullptr) {
+        this->frontend = std::make_unique<decoder::FrontendConnection>(
+          this->acceptor->get_type() + " " +
+          this->acceptor->get_connection_instructions());
+        this->connection = this->acceptor->accept(this->buf_size, ACCEPT_TIMEOUT);
+      }
+
+      std::vector<decoder::LiveEvent> events = this->get_events();
+      std::vector<int> cpus;
+      cpu_set_t cpu_set = this->cpu_config.get_cpu_command_set();
+
+      for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &cpu_set)) {
+          cpus.push_back(i);
+        }
+      }
+
+      this->session =
+        std::make_unique<decoder::LiveSession>(events, pid, cpus,
+                                               this->perf_event.name == "<thread_tree>");
+
+      std::vector<std::unique_ptr<decoder::ServerStream> > connections =
+        decoder::ServerStream::connect(connection_instrs.get_instructions(this->get_thread_count()),
+                                       connection_instrs.get_compression() == "zstd");
+
+      std::unique_ptr<nlohmann::json> filter_settings;
+
+      if (this->filter.mode == Perf::PYTHON) {
+        throw std::runtime_error("Python script filters are not supported.");
+      } else if (this->filter.mode != Perf::NONE) {
+        filter_settings = std::make_unique<nlohmann::json>(get_filter_settings(this->filter));
+      }
+
+      this->session->start(connections, true, this->aggregate_window,
+                           filter_settings.get(), this->max_stack,
+                           this->cpu_config.get_cpu_profiler_set());
+
+      if (capture_immediately) {
+        this->session->enable();
+      }
+    } catch (std::exception &e) {
+      print("Profiler \"" + this->get_name() + "\" could not be started: " +
+            std::string(e.what()) + " Terminating the profiled command wrapper.",
+            true, true);
+      kill(pid, SIGTERM);
+
+      this->session.reset();
+
+      if (this->frontend) {
+        try {
+          this->frontend->write("<STOP>\n");
+        } catch (std::runtime_error &e) { }
+      }
+
+      this->process = std::async([]() { return 1; });
+      return;
+    }
+
+    // Results must be sent to the frontend before it starts waiting
+    // for the profiler, so the task must not be deferred
+    this->process = std::async(std::launch::async, [this]() {
+      int code = 0;
+
+      try {
+        this->session->wait();
+      } catch (std::exception &e) {
+        print("Profiler \"" + this->get_name() + "\" has encountered an error: " +
+              std::string(e.what()), true, true);
+        code = 1;
+      }
+
+      std::uint64_t lost = this->session->get_lost();
+
+      if (lost > 0) {
+        print("Profiler \"" + this->get_name() + "\" has lost " +
+              std::to_string(lost) + " record(s) because of full ring buffers.",
+              true, false);
+      }
+
+      if (this->frontend) {
+        try {
+          this->frontend->send_results(this->session->get_symbolizer(),
+                                       this->session->has_samples());
+        } catch (std::runtime_error &e) {
+          print("Profiler \"" + this->get_name() + "\" could not send its "
+                "results: " + std::string(e.what()), true, true);
+          code = 1;
+        }
+      }
+
+      return code;
+    });
+  }
+
+  unsigned int NativePerf::get_thread_count() {
+    if (this->perf_event.name == "<thread_tree>") {
+      return 1;
+    } else {
+      return this->cpu_config.get_profiler_thread_count();
+    }
+  }
+
+  void NativePerf::resume() {
+    if (this->session) {
+      this->session->enable();
+    }
+  }
+
+  void NativePerf::pause() {
+    if (this->session) {
+      this->session->disable();
+    }
+  }
+
+  int NativePerf::wait() {
+    return this->process.get();
+  }
+
+  std::vector<std::unique_ptr<Requirement> > &NativePerf::get_requirements() {
+    return this->requirements;
+  }
 };
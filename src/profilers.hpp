@@ -9,6 +9,8 @@
 #include "requirements.hpp"
 #include "print.hpp"
 #include "server/server.hpp"
+#include "decoder/live.hpp"
+#include "decoder/frontend.hpp"
 #include <regex>
 #include <filesystem>
 #include <future>
@@ -29,8 +31,12 @@ namespace adaptyst {
     std::string name;
     std::vector<std::string> options;
 
+    // The names and sampling periods of custom events
+    std::vector<std::pair<std::string, int> > events;
+
   public:
     friend class Perf;
+    friend class NativePerf;
 
     // For thread tree profiling
     PerfEvent();
@@ -42,8 +48,7 @@ namespace adaptyst {
               int buffer_off_cpu_events);
 
     // For custom event profiling
-    PerfEvent(std::string name,
-              int period,
+    PerfEvent(std::vector<std::pair<std::string, int> > events,
               int buffer_events);
   };
 
@@ -85,6 +90,8 @@ namespace adaptyst {
     std::unique_ptr<Process> script_proc;
     CaptureMode capture_mode;
     Filter filter;
+    unsigned int aggregate_window;
+    bool native_decoder;
     bool running;
 
   public:
@@ -96,7 +103,9 @@ namespace adaptyst {
          CPUConfig &cpu_config,
          std::string name,
          CaptureMode capture_mode,
-         Filter filter);
+         Filter filter,
+         unsigned int aggregate_window,
+         bool native_decoder);
     ~Perf() {}
     std::string get_name();
     void start(pid_t pid,
@@ -110,6 +119,50 @@ namespace adaptyst {
     int wait();
     std::vector<std::unique_ptr<Requirement> > &get_requirements();
   };
+
+  /**
+     A class describing a profiler opening Linux "perf" events directly
+     with perf_event_open() and decoding their records in-process,
+     without the "perf" executable.
+  */
+  class NativePerf : public Profiler {
+  private:
+    std::future<int> process;
+    PerfEvent perf_event;
+    CPUConfig &cpu_config;
+    std::string name;
+    std::vector<std::unique_ptr<Requirement> > requirements;
+    int max_stack;
+    Perf::CaptureMode capture_mode;
+    Perf::Filter filter;
+    unsigned int aggregate_window;
+    std::unique_ptr<decoder::LiveSession> session;
+    std::unique_ptr<decoder::FrontendConnection> frontend;
+
+    std::vector<decoder::LiveEvent> get_events();
+
+  public:
+    NativePerf(std::unique_ptr<Acceptor> &acceptor,
+               unsigned int buf_size,
+               PerfEvent &perf_event,
+               CPUConfig &cpu_config,
+               std::string name,
+               Perf::CaptureMode capture_mode,
+               Perf::Filter filter,
+               unsigned int aggregate_window);
+    ~NativePerf() {}
+    std::string get_name();
+    void start(pid_t pid,
+               ServerConnInstrs &connection_instrs,
+               fs::path result_out,
+               fs::path result_processed,
+               bool capture_immediately);
+    unsigned int get_thread_count();
+    void resume();
+    void pause();
+    int wait();
+    std::vector<std::unique_ptr<Requirement> > &get_requirements();
+  };
 };
 
 #endif
@@ -16,6 +16,8 @@
 #include <regex>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
 #include <unordered_set>
 #include <sys/types.h>
@@ -30,6 +32,10 @@
 #define NOTIFY_TIMEOUT 5
 #define FILE_TIMEOUT 30
 
+#ifndef FILE_STREAMS
+#define FILE_STREAMS 4
+#endif
+
 namespace adaptyst {
   namespace fs = std::filesystem;
   namespace ch = std::chrono;
@@ -124,8 +130,13 @@ namespace adaptyst {
                                   takes form of "<field1>_<field2>_..._<fieldX>"
                                   where the number of fields and their content
                                   are implementation-dependent.
+     @param compression           The compression codec negotiated with
+                                  adaptyst-server ("zstd" or "none").
   */
-  ServerConnInstrs::ServerConnInstrs(std::string all_connection_instrs) {
+  ServerConnInstrs::ServerConnInstrs(std::string all_connection_instrs,
+                                     std::string compression) {
+    this->compression = compression;
+
     std::vector<std::string> parts;
     boost::split(parts, all_connection_instrs, boost::is_any_of(" "));
 
@@ -169,6 +180,14 @@ namespace adaptyst {
     return result;
   }
 
+  /**
+     Gets the compression codec which profilers should ask adaptyst-server
+     for ("zstd" or "none").
+  */
+  std::string ServerConnInstrs::get_compression() {
+    return this->compression;
+  }
+
   /**
      Analyses the current machine configuration and returns the most
      appropriate CPUConfig object, taking into account user considerations.
@@ -275,9 +294,10 @@ namespace adaptyst {
      @param command_elements A command to be profiled, in form of a vector of string parts
                              (e.g. "adaptyst -f 100 test" becomes ["adaptyst",
                              "-f", "100", "test"]).
-     @param server_address   The address and port of an external instance of adaptyst-server.
-                             If the external instance usage is not planned, server_address
-                             should be an empty string.
+     @param server_address   The address and port of an external instance of adaptyst-server
+                             or "unix:<path>" if the instance listens on a Unix domain
+                             socket. If the external instance usage is not planned,
+                             server_address should be an empty string.
      @param buf_size         A size of buffer for communication with adaptyst-server,
                              in bytes.
      @param warmup           A number of seconds between the profilers indicating their
@@ -302,6 +322,13 @@ namespace adaptyst {
                              descriptor).
      @param rl_result_path   A pointer to the path to roofline benchmarking results produced
                              by the CARM Tool. Can be null.
+     @param compress         Whether data sent to external adaptyst-server should be
+                             compressed if adaptyst-server supports it.
+     @param priority         The priority of the session in the admission queue of
+                             external adaptyst-server (higher is started earlier).
+     @param results_compression
+                             The zstd compression level adaptyst-server should save
+                             processed result files with (0 means no compression).
   */
   int start_profiling_session(std::vector<std::unique_ptr<Profiler> > &profilers,
                               std::vector<std::string> &command_elements,
@@ -311,7 +338,9 @@ namespace adaptyst {
                               std::vector<pid_t> &spawned_children,
                               std::unordered_map<std::string, std::string> &event_dict,
                               std::string codes_dst,
-                              fs::path *rl_result_path) {
+                              fs::path *rl_result_path,
+                              bool compress, int priority,
+                              int results_compression) {
     print("Verifying profiler requirements...", false, false);
 
     bool requirements_fulfilled = true;
@@ -416,8 +445,23 @@ namespace adaptyst {
       connection = std::make_unique<FileDescriptor>(write_fd, read_fd, buf_size);
       std::unique_ptr<Connection> server_connection =
         std::make_unique<FileDescriptor>(read_fd, write_fd, buf_size);
-      std::unique_ptr<Acceptor::Factory> acceptor_factory =
-        std::make_unique<PipeAcceptor::Factory>();
+      std::unique_ptr<Acceptor::Factory> acceptor_factory;
+
+#if BOOST_ARCH_X86_64 && BOOST_OS_LINUX
+      // The Python side of the shared-memory ring publishes HEAD with
+      // a plain store after copying the data, which is ordered after
+      // the data stores only on x86-64, so pipes are used elsewhere
+      const char *transport = std::getenv("ADAPTYST_TRANSPORT");
+
+      if (transport == nullptr || std::string(transport) != "pipe") {
+        acceptor_factory = std::make_unique<ShmAcceptor::Factory>();
+      } else {
+        acceptor_factory = std::make_unique<PipeAcceptor::Factory>();
+      }
+#else
+      acceptor_factory = std::make_unique<PipeAcceptor::Factory>();
+#endif
+
       std::unique_ptr<Subclient::Factory> subclient_factory =
         std::make_unique<StdSubclient::Factory>(acceptor_factory);
 
@@ -440,6 +484,12 @@ namespace adaptyst {
       });
 
       client_thread.detach();
+    } else if (server_address.starts_with("unix:")) {
+      Poco::Net::SocketAddress address(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                       server_address.substr(5));
+      Poco::Net::StreamSocket socket(address);
+
+      connection = std::make_unique<UnixSocket>(socket, buf_size);
     } else {
       Poco::Net::SocketAddress address(server_address);
       Poco::Net::StreamSocket socket(address);
@@ -447,12 +497,91 @@ namespace adaptyst {
       connection = std::make_unique<TCPSocket>(socket, buf_size);
     }
 
+    if (server_address != "") {
+      // adaptyst-server may not be able to start the session straight
+      // away, in which case it tells where the session is in its queue
+      connection->write("hello " + std::to_string(priority), true);
+
+      while (true) {
+        std::smatch admission_match;
+        std::string admission_msg = connection->read();
+
+        if (admission_msg == "admitted") {
+          break;
+        } else if (admission_msg == "try_again") {
+          print("adaptyst-server is busy and its queue is full, please "
+                "try again later! Exiting.", true, true);
+          return 2;
+        } else if (std::regex_match(admission_msg, admission_match,
+                                    std::regex("^queued (\\d+)$"))) {
+          print("adaptyst-server is busy, waiting in its queue "
+                "(position: " + std::string(admission_match[1]) + ")...",
+                true, false);
+        } else {
+          print("adaptyst-server has sent an unexpected reply (hello), it may "
+                "be incompatible with this version of Adaptyst! Exiting.",
+                true, true);
+          return 2;
+        }
+      }
+    }
+
     unsigned int pipe_triggers = 0;
 
     for (int i = 0; i < profilers.size(); i++) {
       pipe_triggers += profilers[i]->get_thread_count();
     }
 
+    std::string compression = "none";
+
+#ifndef ZSTD_AVAILABLE
+    if (compress) {
+      print("Adaptyst has been compiled without zstd support, "
+            "data will be sent uncompressed.", true, false);
+      compress = false;
+    }
+#endif
+
+    if (compress && server_address != "") {
+      connection->write("compression zstd", true);
+
+      std::smatch compression_match;
+      std::string compression_msg = connection->read();
+
+      if (!std::regex_match(compression_msg, compression_match,
+                            std::regex("^compression (\\S+)$"))) {
+        print("adaptyst-server does not support compression! Exiting.",
+              true, true);
+        return 2;
+      }
+
+      compression = compression_match[1];
+
+      if (compression != "zstd") {
+        print("adaptyst-server has been compiled without zstd support, "
+              "data will be sent uncompressed.", true, false);
+      }
+    }
+
+    if (results_compression > 0) {
+      connection->write("output_compression " + std::to_string(results_compression), true);
+
+      std::smatch compression_match;
+      std::string compression_msg = connection->read();
+
+      if (!std::regex_match(compression_msg, compression_match,
+                            std::regex("^output_compression (\\d+)$"))) {
+        print("adaptyst-server does not support compressing processed results! "
+              "Exiting.", true, true);
+        return 2;
+      }
+
+      if (compression_match[1] == "0") {
+        print("adaptyst-server has been compiled without zstd support, "
+              "processed results will be saved uncompressed.", true, false);
+      }
+    }
+
     connection->write("start" + std::to_string(pipe_triggers) + " " + result_name);
     connection->write(profiled_filename);
 
@@ -467,7 +596,7 @@ namespace adaptyst {
           "readiness. If Adaptyst hangs here, you may want to check "
           "the files in the temporary directory.", true, false);
 
-    ServerConnInstrs connection_instrs(all_connection_instrs);
+    ServerConnInstrs connection_instrs(all_connection_instrs, compression);
 
     for (int i = 0; i < profilers.size(); i++) {
       profilers[i]->start(wrapper_id, connection_instrs, result_out,
@@ -728,6 +857,50 @@ namespace adaptyst {
                 }
               }
             }
+          } else if (parsed["type"] == "stream_stats") {
+            if (!parsed["data"].is_array()) {
+              print("Message received from profiler \"" +
+                    profilers[i]->get_name() + "\" "
+                    "is a JSON object of type \"stream_stats\", but its \"data\" "
+                    "element is not a JSON array, ignoring.", true, false);
+              continue;
+            }
+
+            // The load of adaptyst-server streams is worth reporting
+            // only if there is more than one stream to balance
+            if (parsed["data"].size() < 2) {
+              continue;
+            }
+
+            int index = -1;
+            for (auto &elem : parsed["data"]) {
+              index++;
+
+              if (!elem.is_object() ||
+                  !elem.value("samples", nlohmann::json()).is_number_unsigned() ||
+                  !elem.value("threads", nlohmann::json()).is_number_unsigned() ||
+                  !elem.value("moved_in", nlohmann::json()).is_number_unsigned() ||
+                  !elem.value("moved_out", nlohmann::json()).is_number_unsigned()) {
+                print("Element " + std::to_string(index) +
+                      " in the array in the message "
+                      "of type \"stream_stats\" received from profiler \"" +
+                      profilers[i]->get_name() +
+                      "\" is not a valid JSON object, ignoring this element.",
+                      true, false);
+                continue;
+              }
+
+              print("Profiler \"" + profilers[i]->get_name() + "\", stream " +
+                    std::to_string(index) + ": " +
+                    std::to_string(elem["samples"].get<unsigned long long>()) +
+                    " sample(s), " +
+                    std::to_string(elem["threads"].get<unsigned long long>()) +
+                    " thread(s), " +
+                    std::to_string(elem["moved_in"].get<unsigned long long>()) +
+                    " moved in, " +
+                    std::to_string(elem["moved_out"].get<unsigned long long>()) +
+                    " moved out", true, false);
+            }
           }
         } catch (nlohmann::json::exception) {
           print("Message received from profiler \"" +
@@ -857,6 +1030,21 @@ namespace adaptyst {
           // buf_size = 1 because it is only for string read which is unused here
           file_connection = std::make_unique<TCPSocket>(socket, 1);
 
+          return file_connection;
+        };
+      } else if (general_match[1] == "unix") {
+        std::string file_path = general_match[2];
+
+        get_file_connection = [file_path]() {
+          std::unique_ptr<Connection> file_connection;
+
+          Poco::Net::SocketAddress address(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                           file_path);
+          Poco::Net::StreamSocket socket(address);
+
+          // buf_size = 1 because it is only for string read which is unused here
+          file_connection = std::make_unique<UnixSocket>(socket, 1);
+
           return file_connection;
         };
       } else {
@@ -919,17 +1107,23 @@ namespace adaptyst {
 
       }
 
-      if (!sources_json.empty()) {
-        connection->write("p sources.json", true);
+      // Files to be sent to the "processed" ('p') and "out" ('o')
+      // result directories of adaptyst-server, either from disk
+      // or from memory
+      struct file_to_send {
+        char type;
+        std::string name;
+        std::string title;
+        fs::path path;
+        std::string content;
+      };
 
-        // A separate scope is needed for the file connection to close
-        // automatically after the transfer is finished.
-        {
-          std::unique_ptr<Connection> file_connection = get_file_connection();
-          file_connection->write(nlohmann::to_string(sources_json));
-        }
+      std::vector<struct file_to_send> files_to_send;
 
-        check_data_transfer("the source code detail index");
+      if (!sources_json.empty()) {
+        files_to_send.push_back({'p', "sources.json",
+                                 "the source code detail index", "",
+                                 nlohmann::to_string(sources_json) + "\n"});
       }
 
       for (auto &elem : fs::directory_iterator(result_processed)) {
@@ -942,29 +1136,14 @@ namespace adaptyst {
           continue;
         }
 
-        connection->write("p " + path.filename().string());
-
-        // A separate scope is needed for the file connection to close
-        // automatically after the transfer is finished.
-        {
-          std::unique_ptr<Connection> file_connection = get_file_connection();
-          file_connection->write(path);
-        }
-
-        check_data_transfer(path.filename().string());
+        files_to_send.push_back({'p', path.filename().string(),
+                                 path.filename().string(), path, ""});
       }
 
       if (rl_result_path != nullptr) {
-        connection->write("p roofline.csv", true);
-
-        // A separate scope is needed for the file connection to close
-        // automatically after the transfer is finished.
-        {
-          std::unique_ptr<Connection> file_connection = get_file_connection();
-          file_connection->write(*rl_result_path);
-        }
-
-        check_data_transfer("the roofline benchmarking results");
+        files_to_send.push_back({'p', "roofline.csv",
+                                 "the roofline benchmarking results",
+                                 *rl_result_path, ""});
       }
 
       for (auto &elem : fs::directory_iterator(result_out)) {
@@ -977,16 +1156,159 @@ namespace adaptyst {
           continue;
         }
 
-        connection->write("o " + path.filename().string());
+        files_to_send.push_back({'o', path.filename().string(),
+                                 path.filename().string(), path, ""});
+      }
 
-        // A separate scope is needed for the file connection to close
-        // automatically after the transfer is finished.
-        {
-          std::unique_ptr<Connection> file_connection = get_file_connection();
-          file_connection->write(path);
+      auto write_file = [](std::unique_ptr<Connection> &file_connection,
+                           struct file_to_send &file) {
+        if (file.path.empty()) {
+          file_connection->write(file.content, false);
+        } else {
+          file_connection->write(file.path);
         }
+      };
+
+      unsigned int stream_cnt = FILE_STREAMS;
+      const char *streams_env = std::getenv("ADAPTYST_FILE_STREAMS");
+
+      if (streams_env != nullptr &&
+          std::regex_match(streams_env, std::regex("^\\d{1,3}$"))) {
+        stream_cnt = std::stoi(streams_env);
+      }
+
+      stream_cnt = std::min((std::size_t)stream_cnt, files_to_send.size());
+
+      bool multiplexed = false;
+
+      if (stream_cnt > 0) {
+        // adaptyst-server not supporting multiplexing replies with
+        // an error, in which case files are sent one by one
+        connection->write("mux " + std::to_string(stream_cnt), true);
+        multiplexed = connection->read() == "mux_ok";
+      }
+
+      if (multiplexed) {
+        // Files are sent back-to-back over a few long-lived connections,
+        // each file preceded by a header line "<p|o> <size> <name>".
+        // Every stream picks the next unsent file as soon as it is done
+        // with the previous one, so that large files do not hold up
+        // the others.
+        std::atomic<std::size_t> next_file = 0;
+        std::mutex unsent_mutex;
+        std::vector<std::string> unsent;
+
+        auto send_stream = [&]() {
+          std::unique_ptr<Connection> file_connection;
+
+          try {
+            file_connection = get_file_connection();
+
+#ifdef ZSTD_AVAILABLE
+            if (compression == "zstd") {
+              file_connection = std::make_unique<ZstdConnection>(std::move(file_connection),
+                                                                 false, true);
+            }
+#endif
+          } catch (std::exception &e) {
+            // The files are sent by the other streams instead
+            return;
+          }
+
+          while (true) {
+            std::size_t index = next_file++;
+
+            if (index >= files_to_send.size()) {
+              break;
+            }
+
+            struct file_to_send &file = files_to_send[index];
+
+            try {
+              std::size_t size = file.path.empty() ? file.content.size() :
+                fs::file_size(file.path);
+
+              file_connection->write(std::string(1, file.type) + " " +
+                                     std::to_string(size) + " " + file.name, true);
+              write_file(file_connection, file);
+            } catch (std::exception &e) {
+              std::lock_guard lock(unsent_mutex);
+              unsent.push_back(file.title);
+              return;
+            }
+          }
 
-        check_data_transfer(path.filename().string());
+          try {
+            file_connection->write("<END>", true);
+          } catch (ConnectionException &e) {
+            // The end of the stream is also detected when the connection
+            // is closed
+          }
+        };
+
+        std::vector<std::thread> stream_threads;
+
+        for (unsigned int i = 0; i < stream_cnt; i++) {
+          stream_threads.push_back(std::thread(send_stream));
+        }
+
+        for (auto &thread : stream_threads) {
+          thread.join();
+        }
+
+        for (std::size_t i = next_file; i < files_to_send.size(); i++) {
+          unsent.push_back(files_to_send[i].title);
+        }
+
+        for (auto &title : unsent) {
+          print("Could not send " + title + "!", true, true);
+          transfer_error = true;
+        }
+
+        std::smatch done_match;
+        std::string done_msg = connection->read();
+
+        if (!std::regex_match(done_msg, done_match,
+                              std::regex("^mux_done (\\d+)$"))) {
+          print("Could not obtain confirmation of correct transfer of "
+                "the profiling results!", true, true);
+          transfer_error = true;
+        } else {
+          int failed_cnt = std::stoi(done_match[1]);
+
+          for (int i = 0; i < failed_cnt; i++) {
+            std::smatch failed_match;
+            std::string failed_msg = connection->read();
+
+            if (!std::regex_match(failed_msg, failed_match,
+                                  std::regex("^(\\S+) [po] (.+)$"))) {
+              continue;
+            }
+
+            if (failed_match[1] == "error_out_file_timeout") {
+              print("Could not send " + failed_match[2].str() +
+                    " due to timeout!", true, true);
+            } else {
+              print("Could not send " + failed_match[2].str() + "!",
+                    true, true);
+            }
+
+            transfer_error = true;
+          }
+        }
+      } else {
+        for (auto &file : files_to_send) {
+          connection->write(std::string(1, file.type) + " " + file.name, true);
+
+          // A separate scope is needed for the file connection to close
+          // automatically after the transfer is finished.
+          {
+            std::unique_ptr<Connection> file_connection = get_file_connection();
+            write_file(file_connection, file);
+          }
+
+          check_data_transfer(file.title);
+        }
       }
 
       connection->write("<STOP>", true);
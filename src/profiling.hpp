@@ -93,10 +93,13 @@ namespace adaptyst {
   private:
     std::string type;
     std::queue<std::string> methods;
+    std::string compression;
 
   public:
-    ServerConnInstrs(std::string all_connection_instrs);
+    ServerConnInstrs(std::string all_connection_instrs,
+                     std::string compression = "none");
     std::string get_instructions(int thread_count);
+    std::string get_compression();
   };
 
   /**
@@ -207,7 +210,9 @@ namespace adaptyst {
                               std::vector<pid_t> &spawned_children,
                               std::unordered_map<std::string, std::string> &event_dict,
                               std::string codes_dst,
-                              fs::path *rl_result_path);
+                              fs::path *rl_result_path,
+                              bool compress, int priority,
+                              int results_compression);
 };
 
 #endif
@@ -8,11 +8,15 @@ import os
 import sys
 import subprocess
 import json
+import struct
 import re
-import socket
 import importlib.util
 import select
 from cxxfilt import demangle
+from adaptyst_transport import RECORD_STOP, RECORD_SAMPLE, \
+    RECORD_AGGREGATED_SAMPLE, RECORD_DELTA_SAMPLE, binary_streams, \
+    connect_server, write, write_record, encode_callchain, encode_string, \
+    get_symbol
 from bisect import bisect_left
 from pathlib import Path
 from collections import defaultdict
@@ -23,42 +27,48 @@ sys.path.append(os.environ['PERF_EXEC_PATH'] +
 from perf_trace_context import *
 from Core import *
 
-cur_code_sym = [32]  # In ASCII
-
-def next_code(cur_code):
-    res = ''.join(map(chr, cur_code))
-
-    for i in range(len(cur_code)):
-        cur_code[i] += 1
-
-        if cur_code[i] <= 126:
-            break
-        else:
-            cur_code[i] = 32
-
-            if i == len(cur_code) - 1:
-                cur_code.append(32)
-
-    return res
-
+BINARY_PROTOCOL_VERSION = 3
 
 event_streams = []
-next_index = 0
-symbol_dict = defaultdict(lambda: next_code(cur_code_sym))
+aggregating_streams = set()
+delta_streams = set()
+sampled_streams = set()
 dso_dict = defaultdict(set)
 overall_event_type = None
 perf_maps = {}
 filter_settings = None
 
-
-def get_next_event_stream():
-    global event_streams, next_index
-    stream = event_streams[next_index]
-    next_index = (next_index + 1) % len(event_streams)
-    return stream
-
-
-event_stream_dict = defaultdict(lambda: defaultdict(get_next_event_stream))
+# Consecutive samples of a thread with the same event type and callchain
+# are coalesced into one aggregated sample record as long as they are
+# within this many nanoseconds of the first one (0 disables aggregation)
+aggregate_window = int(os.environ.get('ADAPTYST_AGGREGATE', '0')) * 1000000
+pending_samples = {}
+next_aggregate_sweep = 0
+
+# The most recently sent callchain of every thread, for streams where
+# callchains are sent relative to the previous one of the same thread
+previous_callchains = {}
+
+
+# Threads are assigned to the adaptyst-server streams by their observed
+# sample rates: a new thread goes to the least loaded stream and every
+# REBALANCE_INTERVAL nanoseconds of profiled time, a thread is moved from
+# the most to the least loaded stream if their loads (the numbers of
+# samples, halved at every rebalancing) differ by more than
+# REBALANCE_THRESHOLD times.
+#
+# adaptyst-server merges the trees of a thread received by different
+# streams in the time order of their first samples, so a thread is never
+# moved back to a stream it has already been sampled by.
+REBALANCE_INTERVAL = 100000000
+REBALANCE_THRESHOLD = 1.5
+
+thread_streams = {}
+visited_streams = defaultdict(set)
+thread_loads = defaultdict(int)
+stream_loads = []
+stream_stats = []
+next_rebalance = None
 frontend_stream = None
 
 
@@ -72,18 +82,6 @@ def import_from_path(module_name, file_path):
     return module
 
 
-def write(stream, msg):
-    if isinstance(stream, socket.socket):
-        stream.sendall((msg + '\n').encode('utf-8'))
-    else:
-        if 'b' in stream.mode:
-            stream.write((msg + '\n').encode('utf-8'))
-        else:
-            stream.write(msg + '\n')
-
-        stream.flush()
-
-
 def find_in_map(map_path, map_id, ip):
     global perf_maps
 
@@ -184,20 +182,177 @@ def trace_begin():
     instrs = serv_connect[1:]
 
     for i in instrs:
-        parts = i.split('_')
-        if serv_connect[0] == 'tcp':
-            stream = socket.socket()
-            stream.connect((parts[0], int(parts[1])))
-            event_streams.append(stream)
-        elif serv_connect[0] == 'pipe':
-            stream = os.fdopen(int(parts[1]), 'wb')
-            stream.write('connect'.encode('ascii'))
-            stream.flush()
-            event_streams.append(stream)
+        stream, version = connect_server(serv_connect[0], i,
+                                         BINARY_PROTOCOL_VERSION)
+
+        if version >= 2 and aggregate_window > 0:
+            aggregating_streams.add(stream)
+
+        if version >= 3:
+            delta_streams.add(stream)
+
+        event_streams.append(stream)
+        stream_loads.append(0)
+        stream_stats.append({
+            'samples': 0,
+            'threads': 0,
+            'moved_in': 0,
+            'moved_out': 0
+        })
+
+
+# A sample, or a run of consecutive samples of a thread with the same event
+# type and callchain waiting to be sent as one aggregated sample.
+class PendingSample:
+    __slots__ = ('stream', 'event_type', 'pid', 'tid', 'timestamp', 'period',
+                 'count', 'callchain')
+
+    def __init__(self, stream, event_type, pid, tid, timestamp, period,
+                 callchain):
+        self.stream = stream
+        self.event_type = event_type
+        self.pid = pid
+        self.tid = tid
+        self.timestamp = timestamp
+        self.period = period
+        self.count = 1
+        self.callchain = callchain
+
+
+def send_sample(sample):
+    stream = sample.stream
+
+    if stream in delta_streams:
+        # Consecutive samples of a thread usually share long stack
+        # prefixes, so only the part of the callchain following
+        # the prefix shared with the previous one is sent
+        key = (sample.pid, sample.tid)
+        previous = previous_callchains.get(key, [])
+        limit = min(len(previous), len(sample.callchain))
+        common_prefix = 0
+
+        while common_prefix < limit and \
+              previous[common_prefix] == sample.callchain[common_prefix]:
+            common_prefix += 1
+
+        previous_callchains[key] = sample.callchain
+
+        write_record(stream,
+                     struct.pack('<B', RECORD_DELTA_SAMPLE) +
+                     encode_string(sample.event_type, '<B') +
+                     struct.pack('<iiQQII', sample.pid, sample.tid,
+                                 sample.timestamp, sample.period,
+                                 sample.count, common_prefix) +
+                     encode_callchain(sample.callchain[common_prefix:]))
+    elif stream in binary_streams:
+        if sample.count > 1:
+            header = struct.pack('<B', RECORD_AGGREGATED_SAMPLE) + \
+                encode_string(sample.event_type, '<B') + \
+                struct.pack('<iiQQI', sample.pid, sample.tid,
+                            sample.timestamp, sample.period, sample.count)
+        else:
+            header = struct.pack('<B', RECORD_SAMPLE) + \
+                encode_string(sample.event_type, '<B') + \
+                struct.pack('<iiQQ', sample.pid, sample.tid,
+                            sample.timestamp, sample.period)
+
+        write_record(stream, header + encode_callchain(sample.callchain))
+    else:
+        write(stream, json.dumps({
+            'type': 'sample',
+            'event_type': sample.event_type,
+            'pid': str(sample.pid),
+            'tid': str(sample.tid),
+            'time': sample.timestamp,
+            'period': sample.period,
+            'callchain': [(str(s), o) for s, o in sample.callchain]
+        }))
+
+
+# Sends the aggregated samples which have started at least aggregate_window
+# nanoseconds before a given timestamp, so that threads which are no longer
+# sampled do not hold their last samples back for too long. All of them
+# are sent if the timestamp is None.
+def flush_pending_samples(timestamp=None):
+    for key, sample in list(pending_samples.items()):
+        if timestamp is None or \
+           timestamp - sample.timestamp >= aggregate_window:
+            del pending_samples[key]
+            send_sample(sample)
+
+
+def get_event_stream(pid, tid):
+    key = (pid, tid)
+    index = thread_streams.get(key)
+
+    if index is None:
+        index = min(range(len(event_streams)),
+                    key=lambda i: (stream_loads[i], stream_stats[i]['threads']))
+        thread_streams[key] = index
+        visited_streams[key].add(index)
+        stream_stats[index]['threads'] += 1
+
+    thread_loads[key] += 1
+    stream_loads[index] += 1
+    stream_stats[index]['samples'] += 1
+
+    return event_streams[index]
+
+
+def move_thread(key, index):
+    # The samples of the thread waiting for aggregation belong to
+    # the previous stream and the next callchain must be sent in full,
+    # as the new stream has not seen any of the previous ones
+    pending = pending_samples.pop(key, None)
+
+    if pending is not None:
+        send_sample(pending)
+
+    previous_callchains.pop(key, None)
+
+    old_index = thread_streams[key]
+    stream_loads[old_index] -= thread_loads[key]
+    stream_loads[index] += thread_loads[key]
+    stream_stats[old_index]['moved_out'] += 1
+    stream_stats[index]['moved_in'] += 1
+    stream_stats[index]['threads'] += 1
+
+    thread_streams[key] = index
+    visited_streams[key].add(index)
+
+
+def rebalance_streams():
+    busiest = max(range(len(event_streams)), key=stream_loads.__getitem__)
+    idlest = min(range(len(event_streams)), key=stream_loads.__getitem__)
+
+    if stream_loads[busiest] > REBALANCE_THRESHOLD * stream_loads[idlest]:
+        # The thread bringing both loads closest to each other is moved
+        gap = stream_loads[busiest] - stream_loads[idlest]
+        best = None
+
+        for key, load in thread_loads.items():
+            if thread_streams[key] == busiest and load < gap and \
+               idlest not in visited_streams[key] and \
+               (best is None or abs(gap - 2 * load) <
+                abs(gap - 2 * thread_loads[best])):
+                best = key
+
+        if best is not None:
+            move_thread(best, idlest)
+
+    for i in range(len(stream_loads)):
+        stream_loads[i] //= 2
+
+    for key in list(thread_loads.keys()):
+        thread_loads[key] //= 2
+
+        if thread_loads[key] == 0:
+            del thread_loads[key]
 
 
 def process_event(param_dict):
-    global event_stream_dict, overall_event_type, perf_map_paths
+    global overall_event_type, perf_map_paths, next_aggregate_sweep, \
+        next_rebalance
 
     event_type = param_dict['ev_name']
     comm = param_dict['comm']
@@ -208,6 +363,14 @@ def process_event(param_dict):
     raw_callchain = param_dict['callchain']
 
     parsed_event_type = re.search(r'^([^/]+)', event_type).group(1)
+    if len(event_streams) > 1:
+        if next_rebalance is None:
+            next_rebalance = timestamp + REBALANCE_INTERVAL
+        elif timestamp >= next_rebalance:
+            rebalance_streams()
+            next_rebalance = timestamp + REBALANCE_INTERVAL
+
+    stream = get_event_stream(pid, tid)
 
     if overall_event_type is None:
         if parsed_event_type in ['task-clock', 'offcpu-time']:
@@ -219,10 +382,9 @@ def process_event(param_dict):
     # failure, an instruction address is put instead, along with
     # the name of an executable/library if available.
     #
-    # If obtained, symbol names are compressed to save memory.
-    # The dictionary mapping compressed names to full ones
-    # is saved at the end of profiling to <event type>_callchains.json
-    # (see reverse_callchain_dict in trace_end()).
+    # If obtained, symbol names are replaced with integer IDs to save
+    # memory (see get_symbol()). adaptyst-server saves the names of all
+    # symbols to callchains.json at the end of profiling.
     def process_callchain_elem(elem):
         sym_result = [f'[{elem["ip"]:#x}]', '']
         sym_result_set = False
@@ -258,7 +420,7 @@ def process_event(param_dict):
     callchain_tmp = tuple(map(process_callchain_elem, raw_callchain))
 
     if filter_settings is None:
-        callchain = [(symbol_dict[s], o) for s, o
+        callchain = [(get_symbol(stream, s), o) for s, o
                      in reversed(callchain_tmp)]
     else:
         callchain = []
@@ -318,39 +480,68 @@ def process_event(param_dict):
 
             if (filter_settings['type'] in ['python', 'allow'] and satisfied) or \
                (filter_settings['type'] == 'deny' and not satisfied):
-                callchain.append((symbol_dict[sym_result], off_result))
+                callchain.append((get_symbol(stream, sym_result), off_result))
                 last_cut = False
             elif filter_settings['mark'] and not last_cut:
-                callchain.append((symbol_dict[('(cut)', '')], ''))
+                callchain.append((get_symbol(stream, ('(cut)', '')), ''))
                 last_cut = True
 
         callchain = callchain[::-1]
 
-    write(event_stream_dict[pid][tid], json.dumps({
-        'type': 'sample',
-        'event_type': parsed_event_type,
-        'pid': str(pid),
-        'tid': str(tid),
-        'time': timestamp,
-        'period': period,
-        'callchain': callchain
-    }))
+    if aggregate_window > 0 and timestamp >= next_aggregate_sweep:
+        flush_pending_samples(timestamp)
+        next_aggregate_sweep = timestamp + aggregate_window
+
+    key = (pid, tid)
+    pending = pending_samples.get(key)
+
+    if pending is not None:
+        if pending.event_type == parsed_event_type and \
+           pending.callchain == callchain and \
+           timestamp - pending.timestamp < aggregate_window:
+            pending.period += period
+            pending.count += 1
+            return
+
+        del pending_samples[key]
+        send_sample(pending)
+
+    sample = PendingSample(stream, parsed_event_type, pid, tid, timestamp,
+                           period, callchain)
+
+    # The first sample of a stream is never aggregated, as adaptyst-server
+    # clips its period to the start of profiling. Off-CPU samples are
+    # never aggregated either, as each of them describes a separate
+    # off-CPU region.
+    if stream in aggregating_streams and stream in sampled_streams and \
+       parsed_event_type != 'offcpu-time':
+        pending_samples[key] = sample
+    else:
+        send_sample(sample)
+
+    sampled_streams.add(stream)
 
 
 def trace_end():
     global event_streams, callchain_dict, overall_event_type, perf_map_paths, \
         perf_maps
 
+    flush_pending_samples()
+
     for stream in event_streams:
-        write(stream, '<STOP>')
-        stream.close()
+        if stream in binary_streams:
+            write_record(stream, struct.pack('<B', RECORD_STOP))
+        else:
+            write(stream, '<STOP>')
 
-    if overall_event_type is not None:
-        reverse_symbol_dict = {v: k for k, v in symbol_dict.items()}
+        stream.close()
 
-        with open(f'{overall_event_type}_callchains.json', mode='w') as f:
-            f.write(json.dumps(reverse_symbol_dict) + '\n')
+    write(frontend_stream, json.dumps({
+        'type': 'stream_stats',
+        'data': stream_stats
+    }))
 
+    if overall_event_type is not None:
         write(frontend_stream, json.dumps({
             'type': 'sources',
             'data': {k: list(v) for k, v in dso_dict.items()}
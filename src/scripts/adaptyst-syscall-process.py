@@ -9,11 +9,14 @@ import os
 import sys
 import re
 import json
+import struct
 import subprocess
-import socket
 import importlib.util
 import select
 from cxxfilt import demangle
+from adaptyst_transport import RECORD_STOP, RECORD_SYSCALL, \
+    RECORD_SYSCALL_META, binary_streams, connect_server, write, \
+    write_record, encode_callchain, encode_string, get_symbol
 from bisect import bisect_left
 from pathlib import Path
 from collections import defaultdict
@@ -21,29 +24,11 @@ from collections import defaultdict
 sys.path.append(os.environ['PERF_EXEC_PATH'] +
                 '/scripts/python/Perf-Trace-Util/lib/Perf/Trace')
 
-cur_code_sym = [32]  # In ASCII
-
-def next_code(cur_code):
-    res = ''.join(map(chr, cur_code))
-
-    for i in range(len(cur_code)):
-        cur_code[i] += 1
-
-        if cur_code[i] <= 126:
-            break
-        else:
-            cur_code[i] = 32
-
-            if i == len(cur_code) - 1:
-                cur_code.append(32)
-
-    return res
-
+BINARY_PROTOCOL_VERSION = 1
 
 event_stream = None
 frontend_stream = None
 tid_dict = {}
-symbol_dict = defaultdict(lambda: next_code(cur_code_sym))
 dso_dict = defaultdict(set)
 perf_maps = {}
 filter_settings = None
@@ -59,18 +44,6 @@ def import_from_path(module_name, file_path):
     return module
 
 
-def write(stream, msg):
-    if isinstance(stream, socket.socket):
-        stream.sendall((msg + '\n').encode('utf-8'))
-    else:
-        if 'b' in stream.mode:
-            stream.write((msg + '\n').encode('utf-8'))
-        else:
-            stream.write(msg + '\n')
-
-        stream.flush()
-
-
 def find_in_map(map_path, map_id, ip):
     global perf_maps
 
@@ -144,10 +117,9 @@ def syscall_callback(stack, ret_value):
     # failure, an instruction address is put instead, along with
     # the name of an executable/library if available.
     #
-    # If obtained, symbol names are compressed to save memory.
-    # The dictionary mapping compressed names to full ones
-    # is saved at the end of profiling to syscall_callchains.json
-    # (see reverse_callchain_dict in trace_end()).
+    # If obtained, symbol names are replaced with integer IDs to save
+    # memory (see get_symbol()). adaptyst-server saves the names of all
+    # symbols to callchains.json at the end of profiling.
     def process_callchain_elem(elem):
         sym_result = [f'[{elem["ip"]:#x}]', '']
         sym_result_set = False
@@ -183,7 +155,7 @@ def syscall_callback(stack, ret_value):
     callchain_tmp = tuple(map(process_callchain_elem, stack))
 
     if filter_settings is None:
-        callchain = [(symbol_dict[s], o) for s, o in callchain_tmp]
+        callchain = [(get_symbol(event_stream, s), o) for s, o in callchain_tmp]
     else:
         callchain = []
 
@@ -242,30 +214,42 @@ def syscall_callback(stack, ret_value):
 
             if (filter_settings['type'] in ['python', 'allow'] and satisfied) or \
                (filter_settings['type'] == 'deny' and not satisfied):
-                callchain.append((symbol_dict[sym_result], off_result))
+                callchain.append((get_symbol(event_stream, sym_result), off_result))
                 last_cut = False
             elif filter_settings['mark'] and not last_cut:
-                callchain.append((symbol_dict[('(cut)', '')], ''))
+                callchain.append((get_symbol(event_stream, ('(cut)', '')), ''))
                 last_cut = True
 
-    write(event_stream, json.dumps({
-        'type': 'syscall',
-        'ret_value': str(ret_value),
-        'callchain': callchain
-    }))
+    if event_stream in binary_streams:
+        write_record(event_stream,
+                     struct.pack('<Bq', RECORD_SYSCALL, int(ret_value)) +
+                     encode_callchain(callchain))
+    else:
+        write(event_stream, json.dumps({
+            'type': 'syscall',
+            'ret_value': str(ret_value),
+            'callchain': [(str(s), o) for s, o in callchain]
+        }))
 
 
 def syscall_tree_callback(syscall_type, comm_name, pid, tid, time,
                           ret_value):
-    write(event_stream, json.dumps({
-        'type': 'syscall_meta',
-        'subtype': syscall_type,
-        'comm': comm_name,
-        'pid': str(pid),
-        'tid': str(tid),
-        'time': time,
-        'ret_value': str(ret_value)
-    }))
+    if event_stream in binary_streams:
+        write_record(event_stream,
+                     struct.pack('<B', RECORD_SYSCALL_META) +
+                     encode_string(syscall_type, '<B') +
+                     encode_string(comm_name, '<H') +
+                     struct.pack('<iiQq', pid, tid, time, int(ret_value)))
+    else:
+        write(event_stream, json.dumps({
+            'type': 'syscall_meta',
+            'subtype': syscall_type,
+            'comm': comm_name,
+            'pid': str(pid),
+            'tid': str(tid),
+            'time': time,
+            'ret_value': str(ret_value)
+        }))
 
 
 def trace_begin():
@@ -302,28 +286,19 @@ def trace_begin():
         stream_read.close()
 
     serv_connect = os.environ['ADAPTYST_SERV_CONNECT'].split(' ')
-    parts = serv_connect[1].split('_')
-
-    if serv_connect[0] == 'tcp':
-        event_stream = socket.socket()
-        event_stream.connect((parts[0],
-                              int(parts[1])))
-    elif serv_connect[0] == 'pipe':
-        event_stream = os.fdopen(int(parts[1]), 'wb')
-        event_stream.write('connect'.encode('ascii'))
-        event_stream.flush()
+    event_stream, _ = connect_server(serv_connect[0], serv_connect[1],
+                                     BINARY_PROTOCOL_VERSION)
 
 
 def trace_end():
     global event_stream, callchain_dict, perf_map_paths, perf_maps
 
-    write(event_stream, '<STOP>')
-    event_stream.close()
-
-    reverse_symbol_dict = {v: k for k, v in symbol_dict.items()}
+    if event_stream in binary_streams:
+        write_record(event_stream, struct.pack('<B', RECORD_STOP))
+    else:
+        write(event_stream, '<STOP>')
 
-    with open('syscall_callchains.json', mode='w') as f:
-        f.write(json.dumps(reverse_symbol_dict) + '\n')
+    event_stream.close()
 
     write(frontend_stream, json.dumps({
         'type': 'sources',
@@ -0,0 +1,344 @@
+# Adaptyst: a performance analysis tool
+# Copyright (C) CERN. See LICENSE for details.
+
+# Transport and binary protocol helpers shared by the "perf" scripts
+# sending data to adaptyst-server (adaptyst-process.py and
+# adaptyst-syscall-process.py).
+
+import os
+import json
+import struct
+import socket
+import select
+import mmap
+from collections import defaultdict
+
+NO_OFFSET = 2 ** 64 - 1
+
+# Record types of the binary protocol, see src/server/protocol.hpp
+RECORD_STOP = 0
+RECORD_SAMPLE = 1
+RECORD_SYSCALL = 2
+RECORD_SYSCALL_META = 3
+RECORD_SYMBOL = 4
+RECORD_AGGREGATED_SAMPLE = 5
+RECORD_DELTA_SAMPLE = 6
+
+# Layout of the shared-memory ring, see ShmConnection in
+# src/server/socket.hpp (header offsets are in 64-bit words)
+SHM_HEAD = 0
+SHM_TAIL = 8
+SHM_CONSUMER_WAITING = 16
+SHM_PRODUCER_WAITING = 24
+SHM_CLOSED = 32
+SHM_DATA_OFFSET = 4096
+SHM_POLL_INTERVAL = 0.01
+EVENTFD_ONE = struct.pack('=Q', 1)
+
+binary_streams = set()
+symbol_dict = {}
+sent_symbols = defaultdict(set)
+
+
+# A file-like writer to the shared-memory ring of ShmConnection.
+# Bytes are copied to the ring directly, without any system calls.
+# The server is woken up explicitly only when the ring is getting
+# full or the stream is closed, as it checks the ring every
+# SHM_POLL_INTERVAL seconds anyway. Header words are accessed through
+# a native 64-bit memoryview so that each of them is written and read
+# with a single aligned access.
+#
+# Python stores are not fenced, so the ring data are published to
+# the server only by the plain store of HEAD following them. This is
+# correct only if stores are not reordered with each other, which
+# x86-64 guarantees, so adaptyst offers the "shm" connection type only
+# on x86-64 and uses "pipe" elsewhere (see profiling.cpp).
+#
+# The store of HEAD in write() can still be reordered with
+# the following load of CONSUMER_WAITING (even on x86-64) and
+# the server may miss such a wakeup. This only delays the server
+# by at most SHM_POLL_INTERVAL. Once the ring is full, wait_for_space()
+# wakes the server up unconditionally instead, so that the producer
+# is never stalled by a missed wakeup.
+class ShmStream:
+    mode = 'wb'
+
+    def __init__(self, memfd, ring_size, data_fd, space_fd):
+        self.ring_size = ring_size
+        self.wakeup_threshold = ring_size // 2
+        self.data_fd = data_fd
+        self.space_fd = space_fd
+        self.mm = mmap.mmap(memfd, SHM_DATA_OFFSET + ring_size)
+        self.header = memoryview(self.mm)[:SHM_DATA_OFFSET].cast('Q')
+        self.data = memoryview(self.mm)[SHM_DATA_OFFSET:]
+        self.head = self.header[SHM_HEAD]
+        os.close(memfd)
+
+    def write(self, data):
+        size = len(data)
+        used = self.head - self.header[SHM_TAIL]
+        start = self.head % self.ring_size
+
+        if size > self.ring_size - used or start + size > self.ring_size:
+            self.write_slow(memoryview(data).cast('B'))
+            return
+
+        self.data[start:start + size] = data
+        self.head += size
+        self.header[SHM_HEAD] = self.head
+
+        if used + size >= self.wakeup_threshold and \
+           self.header[SHM_CONSUMER_WAITING] != 0:
+            os.write(self.data_fd, EVENTFD_ONE)
+
+    def write_slow(self, data):
+        pos = 0
+
+        while pos < len(data):
+            free = self.ring_size - (self.head - self.header[SHM_TAIL])
+
+            if free == 0:
+                self.wait_for_space()
+                continue
+
+            to_write = min(free, len(data) - pos)
+            start = self.head % self.ring_size
+            first_part = min(to_write, self.ring_size - start)
+
+            self.data[start:start + first_part] = \
+                data[pos:pos + first_part]
+            self.data[:to_write - first_part] = \
+                data[pos + first_part:pos + to_write]
+
+            pos += to_write
+            self.head += to_write
+            self.header[SHM_HEAD] = self.head
+
+    def wait_for_space(self):
+        self.header[SHM_PRODUCER_WAITING] = 1
+
+        # The system call also orders the store of PRODUCER_WAITING
+        # before the load of TAIL below, so either the server sees that
+        # the producer is waiting or the producer sees the freed space.
+        os.write(self.data_fd, EVENTFD_ONE)
+
+        if self.head - self.header[SHM_TAIL] == self.ring_size:
+            ready, _, _ = select.select([self.space_fd], [], [],
+                                        SHM_POLL_INTERVAL)
+
+            if len(ready) > 0:
+                os.read(self.space_fd, 8)
+
+        self.header[SHM_PRODUCER_WAITING] = 0
+
+    def flush(self):
+        pass
+
+    def close(self):
+        self.header[SHM_CLOSED] = 1
+        os.write(self.data_fd, EVENTFD_ONE)
+
+        self.header.release()
+        self.data.release()
+        self.mm.close()
+        os.close(self.data_fd)
+        os.close(self.space_fd)
+
+
+# A file-like writer compressing everything written to a socket into
+# a single zstd stream, decompressed by ZstdConnection in
+# src/server/socket.hpp. Compressed data are sent only when zstd has
+# a full block ready, when sync() is called, or when the stream is
+# closed, so that samples are compressed together.
+class ZstdStream:
+    mode = 'wb'
+
+    def __init__(self, sock, zstandard):
+        self.sock = sock
+        self.compressor = zstandard.ZstdCompressor(level=3).compressobj()
+        self.flush_block = zstandard.COMPRESSOBJ_FLUSH_BLOCK
+
+    def write(self, data):
+        compressed = self.compressor.compress(data)
+
+        if len(compressed) > 0:
+            self.sock.sendall(compressed)
+
+    def flush(self):
+        pass
+
+    def sync(self):
+        self.sock.sendall(self.compressor.flush(self.flush_block))
+
+    def close(self):
+        self.sock.sendall(self.compressor.flush())
+        self.sock.close()
+
+
+def write(stream, msg):
+    if isinstance(stream, socket.socket):
+        stream.sendall((msg + '\n').encode('utf-8'))
+    else:
+        if 'b' in stream.mode:
+            stream.write((msg + '\n').encode('utf-8'))
+        else:
+            stream.write(msg + '\n')
+
+        stream.flush()
+
+
+def read_socket_line(sock):
+    reply = b''
+
+    while not reply.endswith(b'\n'):
+        data = sock.recv(1)
+
+        if len(data) == 0:
+            break
+
+        reply += data
+
+    return reply.decode('utf-8')
+
+
+# Compression is used only for sockets (i.e. when adaptyst-server
+# may be on another machine) and only if the frontend has negotiated
+# it with adaptyst-server. The returned stream should be used instead
+# of the original one.
+def negotiate_compression(stream):
+    if os.environ.get('ADAPTYST_COMPRESSION') != 'zstd' or \
+       not isinstance(stream, socket.socket):
+        return stream
+
+    try:
+        import zstandard
+    except ImportError:
+        return stream
+
+    write(stream, '<COMPRESSION> zstd')
+
+    if read_socket_line(stream).strip() != '<COMPRESSION> zstd':
+        return stream
+
+    return ZstdStream(stream, zstandard)
+
+
+# The highest binary protocol version supported by the script is offered
+# to adaptyst-server. The negotiated version is returned, with 0 meaning
+# that JSON lines must be used.
+def negotiate_protocol(stream, stream_read, max_version):
+    if os.environ.get('ADAPTYST_PROTOCOL', 'binary') != 'binary':
+        return 0
+
+    write(stream, f'<PROTOCOL> binary {max_version}')
+
+    if isinstance(stream, ZstdStream):
+        stream.sync()
+        reply = read_socket_line(stream.sock)
+    elif isinstance(stream, socket.socket):
+        reply = read_socket_line(stream)
+    else:
+        reply = stream_read.readline()
+
+    parts = reply.strip().split(' ')
+
+    if len(parts) == 3 and parts[0] == '<PROTOCOL>' and \
+       parts[1] == 'binary' and parts[2].isdigit() and \
+       1 <= int(parts[2]) <= max_version:
+        return int(parts[2])
+
+    return 0
+
+
+# Connects to adaptyst-server using a connection type and one set of
+# instructions from ADAPTYST_SERV_CONNECT, negotiating compression and
+# the binary protocol (up to max_version). Returns the stream to be used
+# for sending data and the negotiated binary protocol version (see
+# negotiate_protocol()).
+def connect_server(connect_type, instrs, max_version):
+    parts = instrs.split('_')
+
+    if connect_type == 'tcp':
+        stream = socket.socket()
+        stream.connect((parts[0], int(parts[1])))
+        stream_read = None
+    elif connect_type == 'unix':
+        # The instructions are a socket path which is not split
+        # into fields
+        stream = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        stream.connect(instrs)
+        stream_read = None
+    elif connect_type == 'pipe':
+        stream = os.fdopen(int(parts[1]), 'wb')
+        stream.write('connect'.encode('ascii'))
+        stream.flush()
+        stream_read = os.fdopen(int(parts[0]), 'r')
+    elif connect_type == 'shm':
+        stream = ShmStream(int(parts[0]), int(parts[1]),
+                           int(parts[2]), int(parts[3]))
+        stream.write('connect'.encode('ascii'))
+        stream_read = os.fdopen(int(parts[4]), 'r')
+
+    stream = negotiate_compression(stream)
+    version = negotiate_protocol(stream, stream_read, max_version)
+
+    if version > 0:
+        binary_streams.add(stream)
+
+    if stream_read is not None:
+        stream_read.close()
+
+    return stream, version
+
+
+def write_record(stream, payload):
+    data = struct.pack('<I', len(payload)) + payload
+
+    if isinstance(stream, socket.socket):
+        stream.sendall(data)
+    else:
+        stream.write(data)
+        stream.flush()
+
+
+def encode_callchain(callchain):
+    values = []
+
+    for sym, off in callchain:
+        values.append(sym)
+        values.append(NO_OFFSET if off == '' else int(off, 16))
+
+    return struct.pack(f'<I{"IQ" * len(callchain)}', len(callchain),
+                       *values)
+
+
+def encode_string(value, length_format):
+    data = value.encode('utf-8')
+    return struct.pack(length_format, len(data)) + data
+
+
+# Symbol names are mapped to integer IDs, which are defined
+# per stream (before their first use) for adaptyst-server. The server
+# then maps them to the IDs shared by all profilers in the session.
+def get_symbol(stream, sym_result):
+    symbol = symbol_dict.get(sym_result)
+
+    if symbol is None:
+        symbol = len(symbol_dict)
+        symbol_dict[sym_result] = symbol
+
+    if symbol not in sent_symbols[stream]:
+        sent_symbols[stream].add(symbol)
+
+        if stream in binary_streams:
+            write_record(stream,
+                         struct.pack('<BI', RECORD_SYMBOL, symbol) +
+                         encode_string(json.dumps(sym_result), '<I'))
+        else:
+            write(stream, json.dumps({
+                'type': 'symbol',
+                'id': symbol,
+                'name': sym_result
+            }))
+
+    return symbol
@@ -0,0 +1,759 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "calltree.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace adaptyst {
+  /**
+     Gets the ID of a symbol name, assigning a new one if
+     the name hasn't been seen before.
+  */
+  std::uint32_t SymbolTable::intern(const std::string &name) {
+    {
+      std::shared_lock lock(this->mutex);
+      auto it = this->ids.find(name);
+
+      if (it != this->ids.end()) {
+        return it->second;
+      }
+    }
+
+    std::unique_lock lock(this->mutex);
+    auto result = this->ids.try_emplace(name, this->names.size());
+
+    if (result.second) {
+      this->names.push_back(name);
+    }
+
+    return result.first->second;
+  }
+
+  /**
+     Gets the symbol name corresponding to a given ID.
+
+     The returned reference stays valid for the lifetime of
+     the table.
+
+     @throw std::out_of_range When the ID is not known.
+  */
+  const std::string &SymbolTable::get_name(std::uint32_t id) {
+    std::shared_lock lock(this->mutex);
+    return this->names.at(id);
+  }
+
+  /**
+     Gets the number of interned symbol names.
+  */
+  std::uint32_t SymbolTable::size() {
+    std::shared_lock lock(this->mutex);
+    return this->names.size();
+  }
+
+  /**
+     Converts the table to a JSON object mapping symbol IDs
+     (as strings) to symbol names.
+  */
+  nlohmann::json SymbolTable::to_json() {
+    std::shared_lock lock(this->mutex);
+    nlohmann::json result = nlohmann::json::object();
+
+    for (std::uint32_t i = 0; i < this->names.size(); i++) {
+      try {
+        result[std::to_string(i)] = nlohmann::json::parse(this->names[i]);
+      } catch (nlohmann::json::exception &e) {
+        result[std::to_string(i)] = this->names[i];
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Constructs a CallTree object with the "all" root node only.
+
+     @param time_ordered Whether the tree should be time-ordered, i.e.
+                         whether a new node should be created every time
+                         a callchain diverges from the most recently
+                         added one rather than merging it with
+                         any matching earlier node.
+  */
+  CallTree::CallTree(bool time_ordered) {
+    this->time_ordered = time_ordered;
+    this->children_stale = false;
+
+    // Will switch to false as soon as on-CPU activity is encountered
+    this->nodes.push_back({0, true, 0, NONE, NONE, NONE});
+
+    // The root is the only node the first delta does not add
+    this->delta_values.push_back(0);
+  }
+
+  CallTree::NodeId CallTree::add_child(NodeId parent, std::uint32_t symbol,
+                                       bool cold) {
+    NodeId id = this->nodes.size();
+    this->nodes.push_back({symbol, cold, 0, NONE, NONE, NONE});
+
+    Node &parent_node = this->nodes[parent];
+
+    if (parent_node.last_child == NONE) {
+      parent_node.first_child = id;
+    } else {
+      this->nodes[parent_node.last_child].next_sibling = id;
+    }
+
+    parent_node.last_child = id;
+    return id;
+  }
+
+  /**
+     Adds a sample to the tree.
+
+     @param callchain     The callchain of the sample, starting from
+                          the outermost frame. It must not be empty.
+     @param period        The period of the sample.
+     @param offcpu        Whether the sample corresponds to off-CPU activity.
+     @param common_prefix The number of leading callchain elements known to
+                          be identical to those of the callchain passed to
+                          the previous add() call. If they are not the last
+                          element of either callchain and both samples are
+                          on-CPU or both are off-CPU, they lead to the same
+                          nodes as before, so these are reused rather than
+                          looked up again.
+  */
+  void CallTree::add(std::vector<protocol::CallchainElem> &callchain,
+                     std::uint64_t period, bool offcpu,
+                     std::size_t common_prefix) {
+    if (this->children_stale) {
+      this->rebuild_children();
+    }
+
+    std::size_t resumed = 0;
+
+    if (offcpu == this->path.offcpu && !this->path.nodes.empty()) {
+      resumed = std::min({common_prefix, this->path.nodes.size() - 1,
+                          callchain.size() - 1});
+    }
+
+    for (std::size_t i = 0; i < resumed; i++) {
+      this->nodes[this->path.nodes[i]].value += period;
+      *this->path.offsets[i] += period;
+    }
+
+    this->path.nodes.resize(resumed);
+    this->path.offsets.resize(resumed);
+    this->path.offcpu = offcpu;
+
+    NodeId cur = resumed == 0 ? ROOT : this->path.nodes[resumed - 1];
+
+    for (int i = resumed; i < callchain.size(); i++) {
+      std::uint32_t symbol = callchain[i].symbol;
+      bool last_block = i == callchain.size() - 1;
+      NodeId child;
+
+      if (!offcpu) {
+        this->nodes[cur].cold = false;
+      }
+
+      if (this->time_ordered) {
+        child = this->nodes[cur].last_child;
+
+        if (child == NONE || this->nodes[child].symbol != symbol ||
+            (last_block &&
+             this->nodes[child].cold != offcpu) ||
+            (last_block &&
+             this->nodes[child].first_child != NONE) ||
+            (!last_block &&
+             this->nodes[child].first_child == NONE)) {
+          child = this->add_child(cur, symbol, offcpu);
+        }
+      } else {
+        // There is at most one hot and one cold child with a given
+        // symbol, as a new child is added only when there is no match
+        std::uint64_t key = ((std::uint64_t)cur << 32) | symbol;
+        ChildEntry &entry =
+          this->children.try_emplace(key, ChildEntry{NONE, NONE}).first->second;
+
+        if (last_block) {
+          child = offcpu ? entry.cold : entry.hot;
+        } else if (entry.hot == NONE) {
+          child = entry.cold;
+        } else if (entry.cold == NONE) {
+          child = entry.hot;
+        } else {
+          child = offcpu ? entry.cold : entry.hot;
+        }
+
+        if (child == NONE) {
+          child = this->add_child(cur, symbol, offcpu);
+
+          if (offcpu) {
+            entry.cold = child;
+          } else {
+            entry.hot = child;
+          }
+        } else if (!last_block && !offcpu && child == entry.cold) {
+          // The child will be marked as hot in the next iteration
+          entry.cold = NONE;
+          entry.hot = child;
+        }
+      }
+
+      std::uint64_t &offset_value = this->offsets[{child, callchain[i].offset}];
+      this->nodes[child].value += period;
+      offset_value += period;
+
+      this->path.nodes.push_back(child);
+      this->path.offsets.push_back(&offset_value);
+
+      cur = child;
+    }
+  }
+
+  /**
+     Sets the value of the root node.
+  */
+  void CallTree::set_value(std::uint64_t value) {
+    this->nodes[ROOT].value = value;
+  }
+
+  /**
+     Gets the number of nodes in the tree, including the root.
+  */
+  std::size_t CallTree::get_node_count() {
+    return this->nodes.size();
+  }
+
+  /**
+     Gets the estimated number of bytes of memory taken by the tree,
+     including the hash tables used for building it.
+  */
+  std::size_t CallTree::get_memory_usage() {
+    // Every hash table element is assumed to be allocated separately
+    // with a pointer to the next element, alongside the bucket array
+    return this->nodes.capacity() * sizeof(Node) +
+      this->children.size() * (sizeof(std::pair<std::uint64_t, ChildEntry>) +
+                               2 * sizeof(void *)) +
+      this->children.bucket_count() * sizeof(void *) +
+      this->offsets.size() * (sizeof(std::pair<OffsetKey, std::uint64_t>) +
+                              2 * sizeof(void *)) +
+      this->offsets.bucket_count() * sizeof(void *) +
+      this->delta_values.capacity() * sizeof(std::uint64_t) +
+      this->delta_offsets.size() * (sizeof(std::pair<OffsetKey, std::uint64_t>) +
+                                    2 * sizeof(void *)) +
+      this->delta_offsets.bucket_count() * sizeof(void *) +
+      this->path.nodes.capacity() * sizeof(NodeId) +
+      this->path.offsets.capacity() * sizeof(std::uint64_t *);
+  }
+
+  /**
+     Saves the tree to a stream in a binary form which can be read back
+     by load() in the same process, so that samples can still be added
+     to it afterwards as if it had never been saved.
+  */
+  void CallTree::save(std::ostream &stream) {
+    auto save_offsets = [&](std::unordered_map<OffsetKey, std::uint64_t,
+                            OffsetKeyHash> &offsets) {
+      std::uint64_t offset_count = offsets.size();
+      stream.write((const char *)&offset_count, sizeof(std::uint64_t));
+
+      for (auto &pair : offsets) {
+        stream.write((const char *)&pair.first.node, sizeof(NodeId));
+        stream.write((const char *)&pair.first.offset, sizeof(std::uint64_t));
+        stream.write((const char *)&pair.second, sizeof(std::uint64_t));
+      }
+    };
+
+    std::uint64_t node_count = this->nodes.size();
+    std::uint64_t delta_value_count = this->delta_values.size();
+
+    stream.write((const char *)&this->time_ordered, sizeof(bool));
+    stream.write((const char *)&node_count, sizeof(std::uint64_t));
+    stream.write((const char *)this->nodes.data(), node_count * sizeof(Node));
+    save_offsets(this->offsets);
+
+    stream.write((const char *)&delta_value_count, sizeof(std::uint64_t));
+    stream.write((const char *)this->delta_values.data(),
+                 delta_value_count * sizeof(std::uint64_t));
+    save_offsets(this->delta_offsets);
+  }
+
+  /**
+     Replaces the tree with one saved by save().
+
+     @throw std::runtime_error When the stream ends prematurely.
+  */
+  void CallTree::load(std::istream &stream) {
+    auto check = [&]() {
+      if (!stream) {
+        throw std::runtime_error("Could not load a call tree: the data are truncated");
+      }
+    };
+
+    // The offset counters pointed to by the path cache are about
+    // to be replaced
+    this->path.clear();
+
+    auto load_offsets = [&](std::unordered_map<OffsetKey, std::uint64_t,
+                            OffsetKeyHash> &offsets) {
+      std::uint64_t offset_count = 0;
+      stream.read((char *)&offset_count, sizeof(std::uint64_t));
+      check();
+
+      offsets.clear();
+      offsets.reserve(offset_count);
+
+      for (std::uint64_t i = 0; i < offset_count; i++) {
+        OffsetKey key;
+        std::uint64_t value;
+        stream.read((char *)&key.node, sizeof(NodeId));
+        stream.read((char *)&key.offset, sizeof(std::uint64_t));
+        stream.read((char *)&value, sizeof(std::uint64_t));
+        check();
+
+        offsets[key] = value;
+      }
+    };
+
+    std::uint64_t node_count = 0, delta_value_count = 0;
+
+    stream.read((char *)&this->time_ordered, sizeof(bool));
+    stream.read((char *)&node_count, sizeof(std::uint64_t));
+    check();
+
+    if (node_count == 0) {
+      throw std::runtime_error("Could not load a call tree: the data are truncated");
+    }
+
+    std::vector<Node> nodes(node_count);
+    stream.read((char *)nodes.data(), node_count * sizeof(Node));
+    check();
+
+    this->nodes = std::move(nodes);
+    load_offsets(this->offsets);
+
+    stream.read((char *)&delta_value_count, sizeof(std::uint64_t));
+    check();
+
+    std::vector<std::uint64_t> delta_values(delta_value_count);
+    stream.read((char *)delta_values.data(),
+                delta_value_count * sizeof(std::uint64_t));
+    check();
+
+    this->delta_values = std::move(delta_values);
+    load_offsets(this->delta_offsets);
+
+    this->children.clear();
+    this->children_stale = true;
+  }
+
+  void CallTree::rebuild_children() {
+    this->children.clear();
+    this->children_stale = false;
+
+    if (this->time_ordered) {
+      return;
+    }
+
+    // Child lookup entries are not saved: a non-root node is always
+    // the hot entry of its (parent, symbol) pair if it is not cold and
+    // the cold entry otherwise (see add())
+    for (NodeId parent = 0; parent < this->nodes.size(); parent++) {
+      for (NodeId child = this->nodes[parent].first_child; child != NONE;
+           child = this->nodes[child].next_sibling) {
+        std::uint64_t key = ((std::uint64_t)parent << 32) | this->nodes[child].symbol;
+        ChildEntry &entry =
+          this->children.try_emplace(key, ChildEntry{NONE, NONE}).first->second;
+
+        if (this->nodes[child].cold) {
+          entry.cold = child;
+        } else {
+          entry.hot = child;
+        }
+      }
+    }
+  }
+
+  /**
+     Gets the changes made to the tree since the previous call to
+     take_delta() (or since the tree was constructed) as a JSON object
+     of form:
+     {"base": <number of nodes as of the previous call>,
+      "new_nodes": [[<parent ID>, <symbol ID>, <cold>, <value>], ...],
+      "changed": [[<node ID>, <cold>, <value increase>], ...],
+      "offsets": [[<node ID>, <offset string>, <value increase>], ...]}
+
+     New nodes are listed in the order of their IDs, starting from "base".
+     The root node is always listed in "changed".
+  */
+  nlohmann::json CallTree::take_delta() {
+    std::size_t base = this->delta_values.size();
+    std::vector<NodeId> parents(this->nodes.size() - base, NONE);
+
+    for (NodeId parent = 0; parent < this->nodes.size(); parent++) {
+      for (NodeId child = this->nodes[parent].first_child; child != NONE;
+           child = this->nodes[child].next_sibling) {
+        if (child >= base) {
+          parents[child - base] = parent;
+        }
+      }
+    }
+
+    nlohmann::json result;
+    result["base"] = base;
+    result["new_nodes"] = nlohmann::json::array();
+    result["changed"] = nlohmann::json::array();
+    result["offsets"] = nlohmann::json::array();
+
+    // The value of a non-root node always increases when its cold flag
+    // changes, as the flag is only cleared by a sample passing through it
+    for (NodeId id = 0; id < base; id++) {
+      Node &n = this->nodes[id];
+
+      if (id == ROOT || n.value != this->delta_values[id]) {
+        result["changed"].push_back({id, n.cold, n.value - this->delta_values[id]});
+      }
+    }
+
+    for (NodeId id = base; id < this->nodes.size(); id++) {
+      Node &n = this->nodes[id];
+      result["new_nodes"].push_back({parents[id - base], n.symbol, n.cold, n.value});
+    }
+
+    this->delta_values.resize(this->nodes.size());
+
+    for (NodeId id = 0; id < this->nodes.size(); id++) {
+      this->delta_values[id] = this->nodes[id].value;
+    }
+
+    for (auto &pair : this->offsets) {
+      std::uint64_t &old_value = this->delta_offsets[pair.first];
+
+      if (pair.second != old_value) {
+        result["offsets"].push_back({pair.first.node,
+                                     protocol::offset_to_string(pair.first.offset),
+                                     pair.second - old_value});
+        old_value = pair.second;
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Applies a delta returned by take_delta() of another tree. Applying
+     all deltas of a tree in order to an empty tree with the same
+     time-ordered mode results in a copy of the tree as of the most
+     recent take_delta() call.
+
+     @throw std::runtime_error When the delta is malformed or does not
+                               follow the deltas applied so far.
+  */
+  void CallTree::apply_delta(const nlohmann::json &delta) {
+    try {
+      if (delta["base"].get<std::size_t>() != this->nodes.size()) {
+        throw std::runtime_error("Could not apply a call tree delta: it does not "
+                                 "follow the previously applied one");
+      }
+
+      for (auto &node : delta["new_nodes"]) {
+        NodeId parent = node[0].get<NodeId>();
+
+        if (parent >= this->nodes.size()) {
+          throw std::runtime_error("Could not apply a call tree delta: "
+                                   "a node refers to an unknown parent");
+        }
+
+        NodeId id = this->add_child(parent, node[1].get<std::uint32_t>(),
+                                    node[2].get<bool>());
+        this->nodes[id].value = node[3].get<std::uint64_t>();
+      }
+
+      for (auto &node : delta["changed"]) {
+        NodeId id = node[0].get<NodeId>();
+
+        if (id >= this->nodes.size()) {
+          throw std::runtime_error("Could not apply a call tree delta: "
+                                   "a node is unknown");
+        }
+
+        this->nodes[id].cold = node[1].get<bool>();
+        this->nodes[id].value += node[2].get<std::uint64_t>();
+      }
+
+      for (auto &offset : delta["offsets"]) {
+        NodeId id = offset[0].get<NodeId>();
+
+        if (id >= this->nodes.size()) {
+          throw std::runtime_error("Could not apply a call tree delta: "
+                                   "an offset refers to an unknown node");
+        }
+
+        this->offsets[{id, protocol::offset_from_string(offset[1].get<std::string>())}] +=
+          offset[2].get<std::uint64_t>();
+      }
+    } catch (nlohmann::json::exception &e) {
+      throw std::runtime_error("Could not apply a call tree delta: " +
+                               std::string(e.what()));
+    }
+
+    this->children_stale = true;
+    this->path.clear();
+  }
+
+  void CallTree::merge(NodeId node, CallTree &other, NodeId other_node,
+                       std::vector<std::vector<std::pair<std::uint64_t,
+                                                         std::uint64_t> > > &other_offsets) {
+    Node &src = other.nodes[other_node];
+    this->nodes[node].value += src.value;
+    this->nodes[node].cold = this->nodes[node].cold && src.cold;
+
+    for (auto &offset : other_offsets[other_node]) {
+      this->offsets[{node, offset.first}] += offset.second;
+    }
+
+    for (NodeId child = src.first_child; child != NONE;
+         child = other.nodes[child].next_sibling) {
+      Node &src_child = other.nodes[child];
+      NodeId target = NONE;
+
+      if (this->time_ordered) {
+        // Only the first child can continue the most recently added
+        // path, following the same rules as add()
+        NodeId last = this->nodes[node].last_child;
+
+        if (child == src.first_child && last != NONE &&
+            this->nodes[last].symbol == src_child.symbol &&
+            (src_child.first_child == NONE) == (this->nodes[last].first_child == NONE) &&
+            (src_child.first_child != NONE || this->nodes[last].cold == src_child.cold)) {
+          target = last;
+        }
+
+        if (target == NONE) {
+          target = this->add_child(node, src_child.symbol, src_child.cold);
+        }
+      } else {
+        std::uint64_t key = ((std::uint64_t)node << 32) | src_child.symbol;
+        ChildEntry &entry =
+          this->children.try_emplace(key, ChildEntry{NONE, NONE}).first->second;
+        NodeId &match = src_child.cold ? entry.cold : entry.hot;
+
+        if (match == NONE) {
+          match = this->add_child(node, src_child.symbol, src_child.cold);
+        }
+
+        target = match;
+      }
+
+      this->merge(target, other, child, other_offsets);
+    }
+  }
+
+  /**
+     Merges another tree of the same kind into this one, as if
+     the samples of the other tree had been added after the ones
+     already in this tree. This is used for threads whose samples
+     have been received by more than one subclient.
+
+     In the time-ordered mode, the result is identical to a tree built
+     from all samples. In the non-time-ordered mode, nodes are matched
+     by their symbols and cold flags, so the only possible difference
+     is that off-CPU activity may be split between a hot and a cold
+     node where a single tree would have attributed it to one of them.
+
+     @param other The tree to merge. It is left unchanged.
+
+     @throw std::invalid_argument When the other tree is of the other
+                                  mode (time-ordered/non-time-ordered).
+  */
+  void CallTree::merge(CallTree &other) {
+    if (other.time_ordered != this->time_ordered) {
+      throw std::invalid_argument("Could not merge call trees: one is time-ordered "
+                                  "and the other is not");
+    }
+
+    if (this->children_stale) {
+      this->rebuild_children();
+    }
+
+    std::vector<std::vector<std::pair<std::uint64_t,
+                                      std::uint64_t> > > other_offsets(other.nodes.size());
+
+    for (auto &offset : other.offsets) {
+      other_offsets[offset.first.node].push_back({offset.first.offset, offset.second});
+    }
+
+    this->merge(ROOT, other, ROOT, other_offsets);
+    this->path.clear();
+  }
+
+  nlohmann::json CallTree::to_json(NodeId node,
+                                   std::vector<std::vector<std::pair<std::uint64_t,
+                                                                     std::uint64_t> > > &node_offsets) {
+    Node &n = this->nodes[node];
+    nlohmann::json result;
+
+    if (node == ROOT) {
+      result["name"] = "all";
+    } else {
+      result["name"] = std::to_string(n.symbol);
+      result["offsets"] = nlohmann::json::object();
+
+      for (auto &offset : node_offsets[node]) {
+        result["offsets"][protocol::offset_to_string(offset.first)] = offset.second;
+      }
+    }
+
+    result["value"] = n.value;
+    result["children"] = nlohmann::json::array();
+    result["cold"] = n.cold;
+
+    for (NodeId child = n.first_child; child != NONE;
+         child = this->nodes[child].next_sibling) {
+      result["children"].push_back(this->to_json(child, node_offsets));
+    }
+
+    return result;
+  }
+
+  /**
+     Converts the tree to the JSON format expected by the frontend.
+
+     Node names are symbol IDs converted to strings.
+  */
+  nlohmann::json CallTree::to_json() {
+    std::vector<std::vector<std::pair<std::uint64_t,
+                                      std::uint64_t> > > node_offsets(this->nodes.size());
+
+    for (auto &pair : this->offsets) {
+      node_offsets[pair.first.node].push_back(std::make_pair(pair.first.offset,
+                                                             pair.second));
+    }
+
+    return this->to_json(ROOT, node_offsets);
+  }
+
+  void CallTree::write_json(std::ostream &stream, NodeId node,
+                            std::vector<std::vector<std::pair<std::string,
+                                                              std::uint64_t> > > &node_offsets) {
+    Node &n = this->nodes[node];
+
+    // The keys are written in the same (alphabetical) order
+    // as nlohmann::json would use
+    stream << "{\"children\":[";
+
+    for (NodeId child = n.first_child; child != NONE;
+         child = this->nodes[child].next_sibling) {
+      if (child != n.first_child) {
+        stream << ",";
+      }
+
+      this->write_json(stream, child, node_offsets);
+    }
+
+    stream << "],\"cold\":" << (n.cold ? "true" : "false");
+
+    if (node == ROOT) {
+      stream << ",\"name\":\"all\"";
+    } else {
+      stream << ",\"name\":\"" << n.symbol << "\",\"offsets\":{";
+
+      std::sort(node_offsets[node].begin(), node_offsets[node].end());
+
+      for (int i = 0; i < node_offsets[node].size(); i++) {
+        if (i > 0) {
+          stream << ",";
+        }
+
+        stream << "\"" << node_offsets[node][i].first << "\":";
+        stream << node_offsets[node][i].second;
+      }
+
+      stream << "}";
+    }
+
+    stream << ",\"value\":" << n.value << "}";
+  }
+
+  /**
+     Writes the tree to a stream in the same JSON format as to_json(),
+     without building any JSON object in memory.
+  */
+  void CallTree::write_json(std::ostream &stream) {
+    std::vector<std::vector<std::pair<std::string,
+                                      std::uint64_t> > > node_offsets(this->nodes.size());
+
+    for (auto &pair : this->offsets) {
+      node_offsets[pair.first.node].push_back(
+        std::make_pair(protocol::offset_to_string(pair.first.offset), pair.second));
+    }
+
+    this->write_json(stream, ROOT, node_offsets);
+  }
+
+  void CallTree::to_columns(ResultsWriter &writer, struct tree_columns &columns,
+                            NodeId node,
+                            std::unordered_map<std::uint32_t, std::uint32_t> &name_ids,
+                            std::vector<std::vector<std::pair<std::string,
+                                                              std::uint64_t> > > &node_offsets) {
+    Node &n = this->nodes[node];
+    std::size_t index = columns.names.size();
+
+    if (node == ROOT) {
+      columns.names.push_back(writer.intern("all"));
+    } else {
+      auto name = name_ids.find(n.symbol);
+
+      if (name == name_ids.end()) {
+        name = name_ids.insert(std::make_pair(n.symbol,
+                                              writer.intern(std::to_string(n.symbol)))).first;
+      }
+
+      columns.names.push_back(name->second);
+    }
+
+    columns.values.push_back(n.value);
+    columns.subtree_ends.push_back(0);
+    columns.cold.push_back(n.cold ? 1 : 0);
+    columns.offset_starts.push_back(columns.offset_keys.size());
+
+    if (node != ROOT) {
+      std::sort(node_offsets[node].begin(), node_offsets[node].end());
+
+      for (auto &offset : node_offsets[node]) {
+        columns.offset_keys.push_back(writer.intern(offset.first));
+        columns.offset_values.push_back(offset.second);
+      }
+    }
+
+    for (NodeId child = n.first_child; child != NONE;
+         child = this->nodes[child].next_sibling) {
+      this->to_columns(writer, columns, child, name_ids, node_offsets);
+    }
+
+    columns.subtree_ends[index] = columns.names.size();
+  }
+
+  /**
+     Converts the tree to the columns of the binary results format,
+     with node names and offsets interned in the string table of
+     a given writer.
+
+     The tree has the same structure and values as the one
+     produced by to_json().
+  */
+  void CallTree::to_columns(ResultsWriter &writer, struct tree_columns &columns) {
+    std::vector<std::vector<std::pair<std::string,
+                                      std::uint64_t> > > node_offsets(this->nodes.size());
+
+    for (auto &pair : this->offsets) {
+      node_offsets[pair.first.node].push_back(
+        std::make_pair(protocol::offset_to_string(pair.first.offset), pair.second));
+    }
+
+    std::unordered_map<std::uint32_t, std::uint32_t> name_ids;
+    this->to_columns(writer, columns, ROOT, name_ids, node_offsets);
+    columns.offset_starts.push_back(columns.offset_keys.size());
+  }
+};
@@ -0,0 +1,179 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef CALLTREE_HPP_
+#define CALLTREE_HPP_
+
+#include "protocol.hpp"
+#include "results.hpp"
+#include <nlohmann/json.hpp>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <cstdint>
+
+namespace adaptyst {
+  /**
+     A thread-safe class interning symbol names, i.e. mapping them to
+     consecutive 32-bit integer IDs.
+
+     A single SymbolTable is shared by all subclients of a profiling
+     session, so that the same symbol has the same ID regardless of
+     the event type and the stream it has been received from.
+     Symbol names are JSON arrays of form [<symbol>, <executable/library>],
+     serialised to strings.
+  */
+  class SymbolTable {
+  private:
+    std::deque<std::string> names;
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::shared_mutex mutex;
+
+  public:
+    std::uint32_t intern(const std::string &name);
+    const std::string &get_name(std::uint32_t id);
+    std::uint32_t size();
+    nlohmann::json to_json();
+  };
+
+  /**
+     A class describing a flame-graph call tree.
+
+     Nodes are stored contiguously in an arena and refer to each other
+     by their indices. Child lookup is hashed by (parent, symbol ID) in
+     the non-time-ordered mode, while the time-ordered mode only ever
+     looks at the most recently added child (so that consecutive samples
+     with the same callchain prefix are merged, as in the JSON trees
+     previously built by StdSubclient).
+
+     The tree is converted to JSON only on demand (see to_json() and
+     write_json()), with node names being symbol IDs from a SymbolTable.
+     It can also be saved in the binary results format (see to_columns()).
+
+     A tree can be saved to a file and loaded back later (see save() and
+     load()) in order to free memory while it is not needed.
+
+     Changes made to the tree since the previous call to take_delta()
+     can be extracted as a delta, with a sequence of deltas rebuilding
+     an identical tree when applied to an empty one (see apply_delta()).
+
+     Trees built from consecutive parts of the samples of a thread can
+     be combined into one (see merge()).
+  */
+  class CallTree {
+  public:
+    typedef std::uint32_t NodeId;
+    static constexpr NodeId NONE = UINT32_MAX;
+    static constexpr NodeId ROOT = 0;
+
+  private:
+    struct Node {
+      std::uint32_t symbol;
+      bool cold;
+      std::uint64_t value;
+      NodeId first_child;
+      NodeId last_child;
+      NodeId next_sibling;
+    };
+
+    struct ChildEntry {
+      NodeId hot;
+      NodeId cold;
+    };
+
+    struct OffsetKey {
+      NodeId node;
+      std::uint64_t offset;
+
+      bool operator==(const OffsetKey &other) const {
+        return this->node == other.node && this->offset == other.offset;
+      }
+    };
+
+    struct OffsetKeyHash {
+      std::size_t operator()(const OffsetKey &key) const {
+        return std::hash<std::uint64_t>()(key.offset * 31 + key.node);
+      }
+    };
+
+    bool time_ordered;
+    std::vector<Node> nodes;
+    std::unordered_map<std::uint64_t, ChildEntry> children;
+    std::unordered_map<OffsetKey, std::uint64_t, OffsetKeyHash> offsets;
+
+    // Whether the child lookup entries have to be rebuilt
+    // before adding a sample (see load() and apply_delta())
+    bool children_stale;
+
+    // Node and offset values as of the most recent take_delta() call
+    std::vector<std::uint64_t> delta_values;
+    std::unordered_map<OffsetKey, std::uint64_t, OffsetKeyHash> delta_offsets;
+
+    // The nodes and offset counters visited by the most recent add() call,
+    // so that a callchain sharing a prefix with the previous one does not
+    // have to be walked from the root. As it points to the offset counters
+    // of a specific tree, it is emptied rather than carried over when
+    // a tree is copied or moved.
+    struct PathCache {
+      std::vector<NodeId> nodes;
+      std::vector<std::uint64_t *> offsets;
+      bool offcpu = false;
+
+      PathCache() { }
+      PathCache(const PathCache &) { }
+
+      PathCache &operator=(const PathCache &) {
+        this->clear();
+        return *this;
+      }
+
+      void clear() {
+        this->nodes.clear();
+        this->offsets.clear();
+      }
+    };
+
+    PathCache path;
+
+    NodeId add_child(NodeId parent, std::uint32_t symbol, bool cold);
+    void rebuild_children();
+    nlohmann::json to_json(NodeId node,
+                           std::vector<std::vector<std::pair<std::uint64_t,
+                                                             std::uint64_t> > > &node_offsets);
+    void write_json(std::ostream &stream, NodeId node,
+                    std::vector<std::vector<std::pair<std::string,
+                                                      std::uint64_t> > > &node_offsets);
+    void merge(NodeId node, CallTree &other, NodeId other_node,
+               std::vector<std::vector<std::pair<std::uint64_t,
+                                                 std::uint64_t> > > &other_offsets);
+    void to_columns(ResultsWriter &writer, struct tree_columns &columns, NodeId node,
+                    std::unordered_map<std::uint32_t, std::uint32_t> &name_ids,
+                    std::vector<std::vector<std::pair<std::string,
+                                                      std::uint64_t> > > &node_offsets);
+
+  public:
+    CallTree(bool time_ordered);
+    void add(std::vector<protocol::CallchainElem> &callchain,
+             std::uint64_t period, bool offcpu,
+             std::size_t common_prefix = 0);
+    void set_value(std::uint64_t value);
+    std::size_t get_node_count();
+    std::size_t get_memory_usage();
+    void save(std::ostream &stream);
+    void load(std::istream &stream);
+    nlohmann::json take_delta();
+    void apply_delta(const nlohmann::json &delta);
+    void merge(CallTree &other);
+    nlohmann::json to_json();
+    void write_json(std::ostream &stream);
+    void to_columns(ResultsWriter &writer, struct tree_columns &columns);
+  };
+};
+
+#endif
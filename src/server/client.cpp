@@ -5,26 +5,145 @@
 #include "archive.hpp"
 #include "common.hpp"
 #include <future>
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <regex>
 #include <cmath>
+#include <memory>
 #include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <string_view>
 #include <time.h>
 
 namespace adaptyst {
   namespace fs = std::filesystem;
 
+  /**
+     Splits a "<PID>_<TID>" key of a subclient result into PID and TID
+     without constructing a regex for every key.
+
+     @return Whether the key is in the expected format.
+  */
+  static bool split_pid_tid(const std::string &key,
+                            std::string_view &pid,
+                            std::string_view &tid) {
+    std::size_t pos = key.find('_');
+
+    if (pos == std::string::npos || pos == 0 || pos == key.size() - 1) {
+      return false;
+    }
+
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+
+    if (!std::all_of(key.begin(), key.begin() + pos, is_digit) ||
+        !std::all_of(key.begin() + pos + 1, key.end(), is_digit)) {
+      return false;
+    }
+
+    pid = std::string_view(key).substr(0, pos);
+    tid = std::string_view(key).substr(pos + 1);
+
+    return true;
+  }
+
+  /**
+     Merges the call trees of the same event type of a thread produced
+     by different subclients (i.e. when the thread has been moved between
+     them during profiling) into one, in the order of the first samples
+     of the parts. None of the trees may be spilled.
+  */
+  static void merge_thread_parts(std::vector<struct thread_trees> &trees) {
+    std::stable_sort(trees.begin(), trees.end(),
+                     [](const struct thread_trees &a,
+                        const struct thread_trees &b) {
+                       if (a.event_name != b.event_name) {
+                         return a.event_name < b.event_name;
+                       }
+
+                       return a.first_time < b.first_time;
+                     });
+
+    std::vector<struct thread_trees> merged;
+
+    for (auto &tree_pair : trees) {
+      if (!merged.empty() && merged.back().event_name == tree_pair.event_name) {
+        merged.back().output.merge(tree_pair.output);
+        merged.back().output_time_ordered.merge(tree_pair.output_time_ordered);
+      } else {
+        merged.push_back(std::move(tree_pair));
+      }
+    }
+
+    trees = std::move(merged);
+  }
+
+  /**
+     Opens a processed result file for writing.
+
+     @param path   The path to the file.
+     @param level  The zstd compression level. If it is greater than 0,
+                   the file is compressed, with ".zst" appended to its name.
+     @param size   The estimated size of the file, in bytes.
+     @param buffer The buffer to be used for writing an uncompressed file.
+  */
+  static std::unique_ptr<std::ostream> open_processed_file(fs::path path, int level,
+                                                           std::size_t size,
+                                                           std::vector<char> &buffer) {
+#ifdef ZSTD_AVAILABLE
+    if (level > 0) {
+      path += ZSTD_FILE_EXTENSION;
+      return std::make_unique<ZstdOutputStream>(path, level,
+                                                size >= ZSTD_MT_MIN_SIZE ?
+                                                ZSTD_FILE_WORKERS : 0);
+    }
+#endif
+
+    std::unique_ptr<std::ofstream> f = std::make_unique<std::ofstream>();
+    f->rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    f->open(path);
+
+    return f;
+  }
+
+  /**
+     Submits a task to a WorkerPool, with the result of the task or
+     any exception thrown by it passed to the returned future.
+  */
+  template<typename F>
+  static std::future<std::invoke_result_t<F> > submit_task(WorkerPool &pool, F func) {
+    auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()> >(std::move(func));
+    std::future<std::invoke_result_t<F> > future = task->get_future();
+    pool.submit([task]() { (*task)(); });
+    return future;
+  }
+
   StdClient::StdClient(std::shared_ptr<Subclient::Factory> &subclient_factory,
                        std::unique_ptr<Connection> &connection,
                        std::unique_ptr<Acceptor> &file_acceptor,
-                       unsigned long long file_timeout_seconds) : InitClient(subclient_factory,
-                                                                             connection,
-                                                                             file_acceptor,
-                                                                             file_timeout_seconds) {
+                       unsigned long long file_timeout_seconds,
+                       std::shared_ptr<WriterPool> &writer_pool,
+                       bool binary_results,
+                       int output_compression,
+                       std::size_t memory_budget,
+                       unsigned int snapshot_interval) : InitClient(subclient_factory,
+                                                                    connection,
+                                                                    file_acceptor,
+                                                                    file_timeout_seconds),
+                                                         memory_budget(memory_budget) {
     this->profile_start = false;
     this->accepted = 0;
+    this->compression = "none";
+    this->writer_pool = writer_pool;
+    this->binary_results = binary_results;
+    this->output_compression = output_compression;
+    this->snapshot_interval = snapshot_interval;
+    this->snapshot_symbols = 0;
+    this->snapshot_files = 0;
   }
 
   void StdClient::process(fs::path working_dir) {
@@ -33,6 +152,41 @@ namespace adaptyst {
 
       std::string msg = this->connection->read();
 
+      // The frontend may optionally ask for compressing the session
+      // data before starting it. The reply is the codec which will
+      // actually be accepted.
+      std::smatch compression_match;
+
+      if (std::regex_match(msg, compression_match,
+                           std::regex("^compression (\\S+)$"))) {
+#ifdef ZSTD_AVAILABLE
+        if (compression_match[1] == "zstd") {
+          this->compression = "zstd";
+        }
+#endif
+
+        this->connection->write("compression " + this->compression, true);
+        msg = this->connection->read();
+      }
+
+      // The frontend may also ask for saving processed result files
+      // compressed with zstd at a given level, overriding the server
+      // default. The reply is the level which will actually be used,
+      // with 0 meaning no compression.
+      if (std::regex_match(msg, compression_match,
+                           std::regex("^output_compression (\\d{1,2})$"))) {
+#ifdef ZSTD_AVAILABLE
+        this->output_compression = std::min(std::stoi(compression_match[1]),
+                                            ZSTD_maxCLevel());
+#else
+        this->output_compression = 0;
+#endif
+
+        this->connection->write("output_compression " +
+                                std::to_string(this->output_compression), true);
+        msg = this->connection->read();
+      }
+
       std::regex start_regex("^start([1-9]\\d*) (.+)$");
       std::smatch match;
 
@@ -60,14 +214,164 @@ namespace adaptyst {
         return;
       }
 
+      this->memory_budget.set_spill_dir(result_path / SPILL_DIR_NAME);
+      this->snapshot_path = processed_path / SNAPSHOT_DIR_NAME;
+
       std::string profiled_filename = this->connection->read();
       std::unique_ptr<Subclient> subclients[subclient_cnt];
-      std::shared_future<void> threads[subclient_cnt];
+
+      nlohmann::json final_output;
+      nlohmann::json metadata;
+
+      metadata["thread_tree"] = nlohmann::json::array();
+      metadata["callchains"] = nlohmann::json::object();
+      metadata["offcpu_regions"] = nlohmann::json::object();
+      metadata["sampled_times"] = nlohmann::json::object();
+
+      // Threads known from the syscall tree and threads seen
+      // in samples (TID -> "PID/TID"), respectively
+      std::unordered_set<std::string> tids;
+      std::vector<std::pair<std::string, std::string> > sampled_threads;
+      std::unordered_set<std::string> sampled_tids;
+      std::unordered_map<std::string, std::vector<struct thread_trees> > streamed_trees;
+      std::mutex merge_mutex;
+
+      // Every subclient result is merged as soon as the subclient
+      // finishes rather than after all of them have finished. The pool
+      // must outlive the subclient threads as they submit merges to it.
+      auto merge = [&](int index) {
+        std::vector<struct thread_trees> trees;
+        subclients[index]->take_trees(trees);
+
+        nlohmann::json &thread_result = subclients[index]->get_result();
+
+        // Everything is first moved into local objects so that only
+        // cheap swaps need to be done with merge_mutex locked
+        nlohmann::json thread_tree = nlohmann::json::array();
+        nlohmann::json callchains = nlohmann::json::object();
+        nlohmann::json sampled_times = nlohmann::json::object();
+        nlohmann::json offcpu_regions = nlohmann::json::object();
+        nlohmann::json output = nlohmann::json::object();
+        std::vector<std::string> new_tids;
+        std::vector<std::pair<std::string, std::string> > new_sampled_threads;
+
+        for (auto &elem : thread_result.items()) {
+          if (elem.key() == "syscall_meta") {
+            for (auto &tid : elem.value()[0]) {
+              std::string tid_str = tid.template get<std::string>();
+              thread_tree.push_back(nlohmann::json::object());
+              nlohmann::json &new_object = thread_tree.back();
+              new_object.swap(elem.value()[1][tid_str]);
+              new_object["identifier"] = tid;
+
+              new_tids.push_back(tid_str);
+            }
+          } else if (elem.key() == "syscall") {
+            for (auto &elem2 : elem.value().items()) {
+              callchains[elem2.key()].swap(elem2.value());
+            }
+          } else if (elem.key().rfind("sample", 0) == 0) {
+            for (auto &elem2 : elem.value().items()) {
+              std::string_view pid, tid;
+
+              if (!split_pid_tid(elem2.key(), pid, tid)) {
+                std::cerr << "Could not process PID/TID key " << elem2.key() << ", this should not happen!";
+                std::cerr << std::endl;
+                continue;
+              }
+
+              new_sampled_threads.push_back(std::make_pair(std::string(tid),
+                                                           std::string(pid) + "/" +
+                                                           std::string(tid)));
+
+              for (auto &elem3 : elem2.value().items()) {
+                if (elem3.key() == "sampled_time") {
+                  sampled_times[elem2.key()].swap(elem3.value());
+                } else if (elem3.key() == "offcpu_regions") {
+                  offcpu_regions[elem2.key()].swap(elem3.value());
+                } else if (elem3.key() != "first_time") {
+                  output[elem2.key()][elem3.key()].swap(elem3.value());
+                }
+              }
+            }
+          }
+        }
+
+        std::lock_guard merge_lock(merge_mutex);
+
+        for (auto &elem : thread_tree) {
+          metadata["thread_tree"].push_back(std::move(elem));
+        }
+
+        tids.insert(new_tids.begin(), new_tids.end());
+
+        for (auto &thread : new_sampled_threads) {
+          if (sampled_tids.insert(thread.first).second) {
+            sampled_threads.push_back(std::move(thread));
+          }
+        }
+
+        for (auto &elem : callchains.items()) {
+          metadata["callchains"][elem.key()].swap(elem.value());
+        }
+
+        // A thread moved between subclients has its sampled time and
+        // off-CPU regions split among them
+        for (auto &elem : sampled_times.items()) {
+          nlohmann::json &sampled_time = metadata["sampled_times"][elem.key()];
+
+          if (sampled_time.is_null()) {
+            sampled_time.swap(elem.value());
+          } else {
+            sampled_time = sampled_time.get<unsigned long long>() +
+              elem.value().get<unsigned long long>();
+          }
+        }
+
+        for (auto &elem : offcpu_regions.items()) {
+          nlohmann::json &regions = metadata["offcpu_regions"][elem.key()];
+
+          if (regions.is_null()) {
+            regions.swap(elem.value());
+          } else {
+            for (auto &region : elem.value()) {
+              regions.push_back(std::move(region));
+            }
+
+            std::sort(regions.begin(), regions.end(),
+                      [](const nlohmann::json &a, const nlohmann::json &b) {
+                        return a[0].get<unsigned long long>() <
+                          b[0].get<unsigned long long>();
+                      });
+          }
+        }
+
+        for (auto &elem : output.items()) {
+          for (auto &elem2 : elem.value().items()) {
+            final_output[elem.key()][elem2.key()].swap(elem2.value());
+          }
+        }
+
+        for (auto &tree_pair : trees) {
+          streamed_trees[tree_pair.pid_tid].push_back(std::move(tree_pair));
+        }
+      };
+
+      WorkerPool merge_pool(std::min((unsigned int)subclient_cnt,
+                                     std::max(1U, std::thread::hardware_concurrency())));
+
+      // Every subclient blocks in process() until profiling is over,
+      // so each of them needs its own thread of the pool
+      WorkerPool subclient_pool(subclient_cnt);
+      std::future<void> threads[subclient_cnt];
 
       for (int i = 0; i < subclient_cnt; i++) {
         subclients[i] = this->subclient_factory->make_subclient(*this, profiled_filename,
                                                                 this->connection->get_buf_size());
-        threads[i] = std::async(&Subclient::process, subclients[i].get());
+        threads[i] = submit_task(subclient_pool, [&subclients, &merge_pool, &merge, i]() {
+          subclients[i]->process();
+          merge_pool.submit([&merge, i]() { merge(i); });
+        });
       }
 
       std::string instr_msg = subclient_factory->get_type();
@@ -94,105 +398,233 @@ namespace adaptyst {
       }
 
       this->profile_start_tstamp = std::stoull(tstamp_msg);
+      this->profile_start_time = std::chrono::steady_clock::now();
       this->profile_start = true;
 
       this->connection->write("tstamp_ack", true);
 
-      nlohmann::json final_output;
-      nlohmann::json metadata;
+      for (int i = 0; i < subclient_cnt; i++) {
+        threads[i].get();
+      }
 
-      std::unordered_set<std::string> tids;
+      merge_pool.wait();
 
-      metadata["thread_tree"] = nlohmann::json::array();
-      metadata["callchains"] = nlohmann::json::object();
-      metadata["offcpu_regions"] = nlohmann::json::object();
-      metadata["sampled_times"] = nlohmann::json::object();
+      // Threads which have been sampled but are not in the syscall tree
+      // can only be determined once all results are merged
+      for (auto &thread : sampled_threads) {
+        if (tids.find(thread.first) == tids.end()) {
+          nlohmann::json new_elem;
+          new_elem["identifier"] = thread.first;
+          new_elem["parent"] = nullptr;
+          new_elem["tag"] = {"?", thread.second, -1, -1};
 
-      for (int i = 0; i < subclient_cnt; i++) {
-        threads[i].get();
-        nlohmann::json &thread_result = subclients[i]->get_result();
-        for (auto &elem : thread_result.items()) {
-          if (elem.key() == "syscall_meta") {
-            for (auto &tid : elem.value()[0]) {
-              std::string tid_str = tid.template get<std::string>();
-              metadata["thread_tree"].push_back(nlohmann::json::object());
-              nlohmann::json &new_object = metadata["thread_tree"].back();
-              new_object.swap(elem.value()[1][tid_str]);
-              new_object["identifier"] = tid;
+          metadata["thread_tree"].push_back(new_elem);
+        }
+      }
 
-              tids.insert(tid_str);
-            }
-          } else if (elem.key() == "syscall") {
-            for (auto &elem2 : elem.value().items()) {
-              metadata["callchains"][elem2.key()].swap(elem2.value());
+      for (auto &regions : metadata["offcpu_regions"].items()) {
+        for (int i = 0; i < regions.value().size(); i++) {
+          regions.value()[i][0] = (unsigned long long)regions.value()[i][0] - this->profile_start_tstamp;
+        }
+      }
+
+      int level = this->output_compression;
+
+      auto save = [level](fs::path path, nlohmann::json *output, std::size_t size) {
+        std::vector<char> buffer(JSON_WRITE_BUFFER_SIZE);
+        std::unique_ptr<std::ostream> f = open_processed_file(path, level, size, buffer);
+        *f << *output << std::endl;
+      };
+
+      // A per-thread file is written field by field: call trees are
+      // written straight from CallTree, so the JSON representation
+      // of the whole file is never built in memory
+      auto save_thread = [level](fs::path path, nlohmann::json *output,
+                                 std::vector<struct thread_trees> *trees,
+                                 ResultsWriter *results, std::size_t size) {
+        std::vector<char> buffer(JSON_WRITE_BUFFER_SIZE);
+        std::unique_ptr<std::ostream> stream = open_processed_file(path, level,
+                                                                   size, buffer);
+        std::ostream &f = *stream;
+        f << "{";
+
+        bool first = true;
+
+        if (trees != nullptr) {
+          for (auto &tree_pair : *trees) {
+            if (!tree_pair.spill_path.empty()) {
+              load_spilled_trees(tree_pair.spill_path, tree_pair.output,
+                                 tree_pair.output_time_ordered);
+              tree_pair.spill_path.clear();
             }
           }
+
+          merge_thread_parts(*trees);
         }
 
-        for (auto &elem : thread_result.items()) {
-          if (elem.key().rfind("sample", 0) == 0) {
-            for (auto &elem2 : elem.value().items()) {
-              std::regex pid_tid_regex("^(\\d+)_(\\d+)$");
-              std::smatch pid_tid_match;
+        if (output != nullptr) {
+          for (auto &elem : output->items()) {
+            f << (first ? "" : ",") << nlohmann::json(elem.key()) << ":" << elem.value();
+            first = false;
+          }
+        }
 
-              if (!std::regex_search(elem2.key(), pid_tid_match, pid_tid_regex)) {
-                std::cerr << "Could not process PID/TID key " << elem2.key() << ", this should not happen!";
-                std::cerr << std::endl;
-                continue;
-              }
+        if (trees != nullptr) {
+          for (auto &tree_pair : *trees) {
+            f << (first ? "" : ",") << nlohmann::json(tree_pair.event_name) << ":[";
+            tree_pair.output.write_json(f);
+            f << ",";
+            tree_pair.output_time_ordered.write_json(f);
+            f << "]";
+            first = false;
+          }
+        }
 
-              if (tids.find(pid_tid_match[2]) == tids.end()) {
-                nlohmann::json new_elem;
-                new_elem["identifier"] = pid_tid_match[2];
-                new_elem["parent"] = nullptr;
-                new_elem["tag"] = {
-                  "?", std::string(pid_tid_match[1]) + "/" + std::string(pid_tid_match[2]), -1, -1};
+        f << "}" << std::endl;
+        stream.reset();
 
-                metadata["thread_tree"].push_back(new_elem);
-              }
+        if (results != nullptr) {
+          std::vector<struct results_tree> binary_trees;
 
-              for (auto &elem3 : elem2.value().items()) {
-                if (elem3.key() == "sampled_time") {
-                  metadata["sampled_times"][elem2.key()].swap(elem3.value());
-                } else if (elem3.key() == "offcpu_regions") {
-                  metadata["offcpu_regions"][elem2.key()].swap(elem3.value());
-                } else if (elem3.key() != "first_time") {
-                  final_output[elem2.key()][elem3.key()].swap(elem3.value());
-                }
+          if (trees != nullptr) {
+            for (auto &tree_pair : *trees) {
+              for (int i = 0; i < 2; i++) {
+                struct results_tree tree;
+                tree.event_name = tree_pair.event_name;
+                tree.time_ordered = i == 1;
+
+                (i == 0 ? tree_pair.output :
+                 tree_pair.output_time_ordered).to_columns(*results, tree.columns);
+
+                binary_trees.push_back(std::move(tree));
               }
             }
           }
+
+          results->add_thread(path.stem().string(),
+                              output == nullptr ? "{}" : output->dump(),
+                              binary_trees);
         }
-      }
 
-      for (auto &regions : metadata["offcpu_regions"].items()) {
-        for (int i = 0; i < regions.value().size(); i++) {
-          regions.value()[i][0] = (unsigned long long)regions.value()[i][0] - this->profile_start_tstamp;
+        if (trees != nullptr) {
+          trees->clear();
         }
-      }
+      };
+
+      // Symbol IDs used in call trees are shared by all subclients,
+      // so they are resolved by a single file
+      nlohmann::json symbols = this->symbols.to_json();
+
+      // Files are written by a pool shared by all sessions of the server
+      // rather than by one thread per file, as there may be tens of
+      // thousands of them for workloads spawning many short-lived threads
+      auto thread_size = [](nlohmann::json *output,
+                            std::vector<struct thread_trees> *trees) {
+        std::size_t size = 0;
 
-      auto save = [](std::string path, nlohmann::json *output) {
-        std::ofstream f;
-        f.open(path);
-        f << *output << std::endl;
-        f.close();
+        if (output != nullptr) {
+          size += output->size() * JSON_ELEM_SIZE_ESTIMATE;
+        }
+
+        if (trees != nullptr) {
+          for (auto &tree_pair : *trees) {
+            size += (tree_pair.output.get_node_count() +
+                     tree_pair.output_time_ordered.get_node_count()) *
+              JSON_ELEM_SIZE_ESTIMATE;
+
+            // A spilled node takes roughly as much space as in JSON
+            if (!tree_pair.spill_path.empty()) {
+              size += fs::file_size(tree_pair.spill_path);
+            }
+          }
+        }
+
+        return size;
       };
 
-      std::shared_future<void> futures[final_output.size() + 1];
+      // The binary results file is written alongside the JSON files:
+      // threads are added by the writes below and all other files
+      // once the file transfer is over
+      std::unique_ptr<ResultsWriter> results;
+
+      if (this->binary_results) {
+        results = std::make_unique<ResultsWriter>(processed_path / RESULTS_FILE_NAME);
+      }
+
+      ResultsWriter *results_ptr = results.get();
+      std::vector<std::future<void> > futures;
 
-      futures[0] = std::async(save, processed_path / "metadata.json",
-                              &metadata);
+      std::size_t metadata_size = metadata.size() * JSON_ELEM_SIZE_ESTIMATE;
+      std::size_t symbols_size = this->symbols.size() * JSON_ELEM_SIZE_ESTIMATE;
 
-      int future_index = 1;
+      futures.push_back(this->writer_pool->submit(metadata_size, [&]() {
+        save(processed_path / "metadata.json", &metadata, metadata_size);
+      }));
+      futures.push_back(this->writer_pool->submit(symbols_size, [&]() {
+        save(processed_path / "callchains.json", &symbols, symbols_size);
+      }));
 
       for (auto &elem : final_output.items()) {
-        futures[future_index++] = std::async(save,
-                                             processed_path / (elem.key() + ".json"),
-                                             &elem.value());
+        auto trees = streamed_trees.find(elem.key());
+        fs::path path = processed_path / (elem.key() + ".json");
+        nlohmann::json *output = &elem.value();
+        std::vector<struct thread_trees> *trees_ptr =
+          trees == streamed_trees.end() ? nullptr : &trees->second;
+
+        std::size_t size = thread_size(output, trees_ptr);
+
+        futures.push_back(this->writer_pool->submit(
+          size, [save_thread, path, output, trees_ptr, results_ptr, size]() {
+            save_thread(path, output, trees_ptr, results_ptr, size);
+          }));
+      }
+
+      for (auto &elem : streamed_trees) {
+        if (!final_output.contains(elem.first)) {
+          fs::path path = processed_path / (elem.first + ".json");
+          std::vector<struct thread_trees> *trees_ptr = &elem.second;
+
+          std::size_t size = thread_size(nullptr, trees_ptr);
+
+          futures.push_back(this->writer_pool->submit(
+            size, [save_thread, path, trees_ptr, results_ptr, size]() {
+              save_thread(path, nullptr, trees_ptr, results_ptr, size);
+            }));
+        }
+      }
+
+      // All writes must be finished before any error is rethrown,
+      // as they refer to the local variables above
+      for (auto &future : futures) {
+        future.wait();
       }
 
-      for (int i = 0; i < final_output.size() + 1; i++) {
-        futures[i].get();
+      for (auto &future : futures) {
+        future.get();
+      }
+
+      // Snapshots are superseded by the complete results now
+      {
+        std::lock_guard lock(this->snapshot_mutex);
+
+        for (auto &future : this->snapshot_futures) {
+          future.wait();
+        }
+
+        this->snapshot_futures.clear();
+      }
+
+      std::error_code snapshot_error;
+      fs::remove_all(this->snapshot_path, snapshot_error);
+
+      struct spill_stats spill_stats = this->memory_budget.get_stats();
+
+      if (spill_stats.spilled > 0) {
+        std::cerr << "Call trees of " << result_dir << " exceeded the memory budget ";
+        std::cerr << "and have been spilled to disk " << spill_stats.spilled;
+        std::cerr << " time(s) (" << spill_stats.spilled_bytes / 1048576;
+        std::cerr << " MiB in total) and loaded back " << spill_stats.reloaded;
+        std::cerr << " time(s) before the end of profiling." << std::endl;
       }
 
       if (this->file_acceptor == nullptr) {
@@ -213,6 +645,75 @@ namespace adaptyst {
             break;
           }
 
+          std::smatch mux_match;
+
+          if (std::regex_match(x, mux_match, std::regex("^mux ([1-9]\\d{0,5})$"))) {
+            int stream_cnt = std::stoi(mux_match[1]);
+
+            if (stream_cnt > MAX_FILE_STREAMS) {
+              this->connection->write("error_mux", true);
+              continue;
+            }
+
+            this->connection->write("mux_ok", true);
+
+            // Every stream is processed as soon as it is accepted, so that
+            // the frontend can start sending files without waiting for
+            // the remaining connections to be established
+            std::unique_ptr<Connection> file_connections[stream_cnt];
+            std::future<std::vector<std::string> > streams[stream_cnt];
+            int accepted_cnt = 0;
+
+            // A stream is read until the frontend ends it, so every
+            // stream has its own thread of the pool
+            WorkerPool stream_pool(stream_cnt);
+
+            try {
+              for (; accepted_cnt < stream_cnt; accepted_cnt++) {
+                file_connections[accepted_cnt] =
+                  this->file_acceptor->accept(FILE_BUFFER_SIZE,
+                                              this->file_timeout_seconds);
+
+#ifdef ZSTD_AVAILABLE
+                if (this->compression == "zstd") {
+                  file_connections[accepted_cnt] =
+                    std::make_unique<ZstdConnection>(std::move(file_connections[accepted_cnt]),
+                                                     true, false);
+                }
+#endif
+
+                std::unique_ptr<Connection> &file_connection =
+                  file_connections[accepted_cnt];
+
+                streams[accepted_cnt] = submit_task(stream_pool, [this, &file_connection,
+                                                                  processed_path, out_path]() {
+                  return this->receive_file_stream(file_connection, processed_path, out_path);
+                });
+              }
+            } catch (TimeoutException &e) {
+              std::cerr << "Warning: only " << accepted_cnt << " out of " << stream_cnt;
+              std::cerr << " file transfer streams have been established." << std::endl;
+            }
+
+            std::vector<std::string> failed;
+
+            for (int i = 0; i < accepted_cnt; i++) {
+              std::vector<std::string> stream_failed = streams[i].get();
+              failed.insert(failed.end(), stream_failed.begin(), stream_failed.end());
+            }
+
+            // All acknowledgements are sent in one batch: only the transfers
+            // which have failed are listed, everything else is assumed to be
+            // correct by the frontend
+            this->connection->write("mux_done " + std::to_string(failed.size()), true);
+
+            for (auto &entry : failed) {
+              this->connection->write(entry, true);
+            }
+
+            continue;
+          }
+
           if (x.length() < 3) {
             this->connection->write("error_wrong_file_format", true);
             continue;
@@ -261,38 +762,12 @@ namespace adaptyst {
               Archive archive(processed_path / "src.zip");
               create_src_archive(archive, src_paths, true);
             } else {
-              std::ofstream f(path, std::ios_base::out | std::ios_base::binary);
-
-              if (!f) {
+              try {
+                file_connection->read(path, this->file_timeout_seconds);
+              } catch (std::runtime_error &e) {
                 std::cerr << "Error for " << type << " file " << path.filename() << ": ";
-                std::cerr << "Could not open the output stream." << std::endl;
-                this->connection->write("error_out_file", true);
-                continue;
-              }
-
-              std::unique_ptr<char> buf(new char[FILE_BUFFER_SIZE]);
-
-              int bytes_received = 0;
-              bool stop = false;
-
-              while (!stop && !error) {
-                bytes_received = file_connection->read(buf.get(),
-                                                       FILE_BUFFER_SIZE,
-                                                       this->file_timeout_seconds);
-
-                if (bytes_received == 0) {
-                  stop = true;
-                } else {
-                  f.write(buf.get(), bytes_received);
-
-                  if (!f) {
-                    std::cerr << "Error for " << type << " file "
-                              << path.filename() << ": ";
-                    std::cerr << "Could not write to the output stream."
-                              << std::endl;
-                    error = true;
-                  }
-                }
+                std::cerr << e.what() << std::endl;
+                error = true;
               }
             }
 
@@ -311,12 +786,174 @@ namespace adaptyst {
         }
       }
 
+#ifdef ZSTD_AVAILABLE
+      if (level > 0) {
+        // JSON files received from the frontend can only be compressed
+        // once the file transfer is over
+        std::vector<std::pair<fs::path, std::size_t> > received;
+        std::vector<std::future<void> > compress_futures;
+
+        for (auto &entry : fs::directory_iterator(processed_path)) {
+          if (entry.is_regular_file() && entry.path().extension() == ".json") {
+            received.push_back(std::make_pair(entry.path(), entry.file_size()));
+          }
+        }
+
+        for (auto &file : received) {
+          compress_futures.push_back(this->writer_pool->submit(file.second, [file, level]() {
+            compress_file(file.first, level,
+                          file.second >= ZSTD_MT_MIN_SIZE ? ZSTD_FILE_WORKERS : 0);
+          }));
+        }
+
+        for (auto &future : compress_futures) {
+          future.get();
+        }
+      }
+#endif
+
+      if (results) {
+        // Every other JSON file (e.g. metadata.json or the files
+        // received from the frontend) is stored verbatim, uncompressed
+        for (auto &entry : fs::directory_iterator(processed_path)) {
+          fs::path name = entry.path().filename();
+
+          if (name.extension() == ZSTD_FILE_EXTENSION) {
+            name = name.stem();
+          }
+
+          if (entry.is_regular_file() && name.extension() == ".json" &&
+              !is_thread_result(name.stem().string())) {
+            results->add_blob(name.string(),
+                              std::string_view(read_processed_file(processed_path / name)));
+          }
+        }
+
+        results->finish();
+      }
+
       this->connection->write("finished", true);
     } catch (...) {
       std::rethrow_exception(std::current_exception());
     }
   }
 
+  /**
+     Receives files multiplexed over a single file transfer connection
+     until "<END>" is received or the connection is closed.
+
+     Every file is preceded by a header line of form
+     "<p|o> <size in bytes> <file name>", where "p" and "o" denote
+     the "processed" and "out" result directories respectively. The file
+     contents follow the header immediately.
+
+     @param file_connection The file transfer connection.
+     @param processed_path  The path to the "processed" result directory.
+     @param out_path        The path to the "out" result directory.
+
+     @return Failed transfers, each of form "<error status> <p|o> <file name>".
+             A failure during reading file contents ends the stream, as
+             the position of the next header is no longer known.
+  */
+  std::vector<std::string> StdClient::receive_file_stream(std::unique_ptr<Connection> &file_connection,
+                                                          fs::path processed_path,
+                                                          fs::path out_path) {
+    std::vector<std::string> failed;
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+    std::regex header_regex("^([po]) (\\d{1,19}) (.+)$");
+
+    while (true) {
+      std::string_view header_view;
+
+      try {
+        if (!file_connection->read_line(header_view, this->file_timeout_seconds)) {
+          break;
+        }
+      } catch (TimeoutException &e) {
+        std::cerr << "Warning: timeout of " << this->file_timeout_seconds << " s has been ";
+        std::cerr << "reached while waiting for a file header, closing the stream." << std::endl;
+        break;
+      } catch (ConnectionException &e) {
+        break;
+      }
+
+      std::string header(header_view);
+
+      if (header == "<END>") {
+        break;
+      }
+
+      std::smatch match;
+
+      if (!std::regex_match(header, match, header_regex)) {
+        std::cerr << "Received an incorrect file header, closing the stream: ";
+        std::cerr << header << std::endl;
+        break;
+      }
+
+      bool processed = match[1] == "p";
+      unsigned long long remaining = std::stoull(match[2]);
+      std::string name = match[3];
+      std::string type = processed ? "processed" : "out";
+      bool error = false;
+
+      // The file must not escape the result directory
+      std::ofstream stream;
+
+      if (fs::path(name).filename() == name && name != "." && name != "..") {
+        stream.open((processed ? processed_path : out_path) / name,
+                    std::ios::out | std::ios::binary | std::ios::trunc);
+      }
+
+      if (!stream.is_open()) {
+        std::cerr << "Error for " << type << " file " << name << ": ";
+        std::cerr << "the file cannot be created." << std::endl;
+        error = true;
+      }
+
+      try {
+        while (remaining > 0) {
+          unsigned int to_read = std::min(remaining,
+                                          (unsigned long long)FILE_BUFFER_SIZE);
+          int bytes_read = file_connection->read(buf.get(), to_read,
+                                                 this->file_timeout_seconds);
+
+          if (bytes_read <= 0) {
+            throw ConnectionException();
+          }
+
+          if (stream.is_open()) {
+            stream.write(buf.get(), bytes_read);
+          }
+
+          remaining -= bytes_read;
+        }
+      } catch (TimeoutException &e) {
+        std::cerr << "Warning for " << type << " file " << name << ": ";
+        std::cerr << "Timeout of " << this->file_timeout_seconds << " s has been reached, ";
+        std::cerr << "some data may have been lost." << std::endl;
+        failed.push_back("error_out_file_timeout " + match[1].str() + " " + name);
+        break;
+      } catch (ConnectionException &e) {
+        std::cerr << "Error for " << type << " file " << name << ": ";
+        std::cerr << "the connection has been closed before the end of the file." << std::endl;
+        failed.push_back("error_out_file " + match[1].str() + " " + name);
+        break;
+      }
+
+      if (stream.is_open()) {
+        stream.close();
+        error = error || !stream;
+      }
+
+      if (error) {
+        failed.push_back("error_out_file " + match[1].str() + " " + name);
+      }
+    }
+
+    return failed;
+  }
+
   void StdClient::notify() {
     {
       std::lock_guard lock(this->accepted_mutex);
@@ -333,4 +970,88 @@ namespace adaptyst {
     *tstamp = this->profile_start_tstamp;
     return true;
   }
+
+  bool StdClient::get_profile_start_time(std::chrono::steady_clock::time_point *time) {
+    if (!this->profile_start || !time) {
+      return false;
+    }
+
+    *time = this->profile_start_time;
+    return true;
+  }
+
+  SymbolTable &StdClient::get_symbol_table() {
+    return this->symbols;
+  }
+
+  std::string StdClient::get_compression() {
+    return this->compression;
+  }
+
+  MemoryBudget &StdClient::get_memory_budget() {
+    return this->memory_budget;
+  }
+
+  unsigned int StdClient::get_snapshot_interval() {
+    return this->snapshot_interval;
+  }
+
+  void StdClient::save_snapshot(unsigned int index, nlohmann::json &snapshot) {
+    std::lock_guard lock(this->snapshot_mutex);
+
+    // Every symbol is saved once, alongside the first snapshot
+    // saved after it has been interned
+    std::uint32_t symbol_count = this->symbols.size();
+    nlohmann::json &symbols = snapshot["symbols"];
+    symbols = nlohmann::json::object();
+
+    for (std::uint32_t id = this->snapshot_symbols; id < symbol_count; id++) {
+      symbols[std::to_string(id)] = this->symbols.get_name(id);
+    }
+
+    this->snapshot_symbols = symbol_count;
+
+    std::size_t size = symbols.size() * JSON_ELEM_SIZE_ESTIMATE;
+
+    for (auto &thread : snapshot["threads"]) {
+      for (auto &deltas : thread["deltas"]) {
+        for (auto &delta : deltas) {
+          size += (delta["new_nodes"].size() + delta["changed"].size() +
+                   delta["offsets"].size()) * JSON_ELEM_SIZE_ESTIMATE;
+        }
+      }
+    }
+
+    fs::path path = this->snapshot_path / std::to_string(index) /
+      (std::to_string(this->snapshot_files++) + ".json");
+    std::shared_ptr<nlohmann::json> data =
+      std::make_shared<nlohmann::json>(std::move(snapshot));
+
+    std::erase_if(this->snapshot_futures, [](auto &future) {
+      return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+
+    // A snapshot is renamed to its final name only once it has been
+    // fully written, so that an interrupted write is never merged
+    this->snapshot_futures.push_back(this->writer_pool->submit(size, [path, data]() {
+      try {
+        fs::create_directories(path.parent_path());
+
+        fs::path tmp_path = path;
+        tmp_path += ".tmp";
+
+        std::ofstream stream(tmp_path);
+        stream << *data << std::endl;
+        stream.close();
+
+        if (!stream) {
+          throw std::runtime_error("the file cannot be written");
+        }
+
+        fs::rename(tmp_path, path);
+      } catch (std::exception &e) {
+        std::cerr << "Could not save snapshot " << path << ": " << e.what() << std::endl;
+      }
+    }));
+  }
 };
@@ -24,11 +24,29 @@ namespace adaptyst {
     unsigned short port = 5000;
     app.add_option("-p", port, "Port to bind to (default: 5000)");
 
+    std::string unix_path = "";
+    app.add_option("-u", unix_path,
+                   "Listen on a Unix domain socket at a given path "
+                   "instead of TCP (-a and -p are ignored then). "
+                   "The path must not contain whitespace. Subclient and "
+                   "file transfer sockets are created next to it.");
+
     unsigned int max_connections = 1;
     app.add_option("-m", max_connections,
                    "Max simultaneous connections to accept "
                    "(default: 1, use 0 to exit after the first client)");
 
+    unsigned int max_queued = 64;
+    app.add_option("-Q", max_queued,
+                   "Max connections waiting for a free slot when -m "
+                   "connections are already handled, any further ones "
+                   "are rejected (default: 64)");
+
+    std::string stats_path = "";
+    app.add_option("-S", stats_path,
+                   "Path to a JSON file where admission queue statistics "
+                   "(queue depth, wait times, rejections) are saved");
+
     unsigned int buf_size = 1024;
     app.add_option("-b", buf_size,
                    "Buffer size for communication with clients in bytes "
@@ -39,37 +57,109 @@ namespace adaptyst {
                    "Timeout for receiving file data from clients "
                    "in seconds (default: 30)");
 
+    unsigned int writer_threads = 0;
+    app.add_option("-w", writer_threads,
+                   "Max number of threads writing processed output files, "
+                   "shared by all connections (default: 0, i.e. the number "
+                   "of CPU cores)");
+
+    bool binary_results = false;
+    app.add_flag("-B", binary_results,
+                 "Also save processed results as a single binary file "
+                 "(processed/" RESULTS_FILE_NAME "), which can be converted "
+                 "to and from JSON files with adaptyst-results");
+
+    int output_compression = 0;
+    app.add_option("-Z", output_compression,
+                   "Save processed result files compressed with zstd "
+                   "at a given level (1-19, *.json.zst), unless the "
+                   "frontend asks otherwise (default: 0, i.e. no "
+                   "compression)")
+      ->check(CLI::Range(0, 19));
+
+    std::size_t memory_budget_mib = 0;
+    app.add_option("-M", memory_budget_mib,
+                   "Memory budget for the call trees of a single connection "
+                   "in MiB, beyond which the trees of the least recently "
+                   "sampled threads are spilled to disk until the end of "
+                   "profiling (default: 0, i.e. no limit)");
+
+    unsigned int snapshot_interval = 0;
+    app.add_option("-I", snapshot_interval,
+                   "Interval between partial-result snapshots saved during "
+                   "profiling in seconds, which can be combined with "
+                   "\"adaptyst-results snapshots\" while profiling is still "
+                   "running or after it has been stopped abruptly (default: "
+                   "0, i.e. no snapshots)");
+
     bool quiet = false;
     app.add_flag("-q", quiet, "Do not print anything except non-port-in-use errors");
 
     CLI11_PARSE(app, argc, argv);
 
+#ifndef ZSTD_AVAILABLE
+    if (output_compression > 0) {
+      std::cerr << "adaptyst-server has been compiled without zstd support, ";
+      std::cerr << "processed result files will be saved uncompressed." << std::endl;
+      output_compression = 0;
+    }
+#endif
+
     if (print_version) {
       std::cout << version << std::endl;
       return 0;
     } else {
       try {
-        TCPAcceptor::Factory factory(address, port, false);
-        std::unique_ptr<Acceptor> acceptor =
-          factory.make_acceptor(UNLIMITED_ACCEPTED);
-
-        std::unique_ptr<Acceptor::Factory> acceptor_factory =
-          std::make_unique<TCPAcceptor::Factory>(address,
-                                                 port + 1, true);
-        std::unique_ptr<Acceptor::Factory> file_acceptor_factory =
-          std::make_unique<TCPAcceptor::Factory>(address,
-                                                 port + 1, true);
+        std::unique_ptr<Acceptor> acceptor;
+        std::unique_ptr<Acceptor::Factory> acceptor_factory;
+        std::unique_ptr<Acceptor::Factory> file_acceptor_factory;
+
+        if (unix_path.empty()) {
+          TCPAcceptor::Factory factory(address, port, false);
+          acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+          acceptor_factory =
+            std::make_unique<TCPAcceptor::Factory>(address,
+                                                   port + 1, true);
+          file_acceptor_factory =
+            std::make_unique<TCPAcceptor::Factory>(address,
+                                                   port + 1, true);
+        } else {
+          UnixAcceptor::Factory factory(unix_path);
+          acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+          acceptor_factory =
+            std::make_unique<UnixAcceptor::Factory>(unix_path, true);
+          file_acceptor_factory =
+            std::make_unique<UnixAcceptor::Factory>(unix_path + ".file",
+                                                    true);
+        }
+
         std::unique_ptr<Subclient::Factory> subclient_factory =
           std::make_unique<StdSubclient::Factory>(acceptor_factory);
         std::unique_ptr<Client::Factory> client_factory =
-          std::make_unique<StdClient::Factory>(subclient_factory);
+          std::make_unique<StdClient::Factory>(subclient_factory,
+                                               writer_threads,
+                                               binary_results,
+                                               output_compression,
+                                               memory_budget_mib * 1048576,
+                                               snapshot_interval);
 
         Server server(acceptor, max_connections, buf_size,
-                      file_timeout_seconds);
+                      file_timeout_seconds, max_queued);
+
+        if (!stats_path.empty()) {
+          server.set_stats_path(stats_path);
+        }
 
         if (!quiet) {
-          std::cout << "Listening on " << address << ", port " << port;
-          std::cout << " (TCP)..." << std::endl;
+          if (unix_path.empty()) {
+            std::cout << "Listening on " << address << ", port " << port;
+            std::cout << " (TCP)..." << std::endl;
+          } else {
+            std::cout << "Listening on " << unix_path;
+            std::cout << " (Unix domain socket)..." << std::endl;
+          }
         }
 
         server.run(client_factory, file_acceptor_factory);
@@ -77,8 +167,13 @@ namespace adaptyst {
         return 0;
       } catch (AlreadyInUseException &e) {
         if (!quiet) {
-          std::cerr << address << ":" << port << " is in use! Please use a ";
-          std::cerr << "different address and/or port." << std::endl;
+          if (unix_path.empty()) {
+            std::cerr << address << ":" << port << " is in use! Please use a ";
+            std::cerr << "different address and/or port." << std::endl;
+          } else {
+            std::cerr << unix_path << " is in use! Please use a ";
+            std::cerr << "different path." << std::endl;
+          }
         }
 
         return 100;
@@ -0,0 +1,169 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "framer.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace adaptyst {
+  /**
+     Constructs a LineFramer object.
+
+     @param buf_size The size of the internal buffer, in bytes.
+  */
+  LineFramer::LineFramer(unsigned int buf_size) {
+    this->buf.reset(new char[buf_size]);
+    this->buf_size = buf_size;
+    this->start = 0;
+    this->end = 0;
+    this->scan_pos = 0;
+  }
+
+  /**
+     Gets the next complete non-empty line (without the newline
+     character) from the data committed so far.
+
+     The line is valid until the next call to any non-const method
+     of the framer.
+
+     Returns false if there is no complete line available.
+  */
+  bool LineFramer::next(std::string_view &line) {
+    while (true) {
+      char *newline = (char *)std::memchr(this->buf.get() + this->scan_pos,
+                                          '\n', this->end - this->scan_pos);
+
+      if (!newline) {
+        this->scan_pos = this->end;
+        return false;
+      }
+
+      unsigned int newline_pos = newline - this->buf.get();
+      unsigned int line_start = this->start;
+
+      this->start = newline_pos + 1;
+      this->scan_pos = this->start;
+
+      if (!this->overflow.empty()) {
+        this->long_line.swap(this->overflow);
+        this->long_line.append(this->buf.get() + line_start,
+                               newline_pos - line_start);
+        this->overflow.clear();
+        line = this->long_line;
+        return true;
+      } else if (newline_pos > line_start) {
+        line = std::string_view(this->buf.get() + line_start,
+                                newline_pos - line_start);
+        return true;
+      }
+    }
+  }
+
+  /**
+     Gets the pointer where new data should be written to. At most
+     get_write_space() bytes can be written there, after which commit()
+     must be called.
+
+     get_write_space() must be called before get_write_ptr().
+  */
+  char *LineFramer::get_write_ptr() {
+    return this->buf.get() + this->end;
+  }
+
+  /**
+     Gets the number of bytes that can be written to the pointer returned
+     by get_write_ptr(), making space in the internal buffer if needed.
+     The returned value is always greater than 0.
+  */
+  unsigned int LineFramer::get_write_space() {
+    if (this->start == this->end) {
+      // Everything has been consumed, so the whole buffer is free
+      this->start = 0;
+      this->end = 0;
+      this->scan_pos = 0;
+    } else if (this->buf_size - this->end < this->buf_size / 4) {
+      if (this->start > 0) {
+        // Only an incomplete line is moved here, so this is cheap
+        // compared to reading into a nearly full buffer
+        std::memmove(this->buf.get(), this->buf.get() + this->start,
+                     this->end - this->start);
+        this->end -= this->start;
+        this->scan_pos -= this->start;
+        this->start = 0;
+      } else if (this->end == this->buf_size) {
+        // The buffer is full with a line longer than it
+        this->overflow.append(this->buf.get(), this->end);
+        this->end = 0;
+        this->scan_pos = 0;
+      }
+    }
+
+    return this->buf_size - this->end;
+  }
+
+  /**
+     Marks a given number of bytes written to the pointer returned
+     by get_write_ptr() as received.
+  */
+  void LineFramer::commit(unsigned int bytes) {
+    this->end += bytes;
+  }
+
+  /**
+     Returns true if there is any data committed, but not returned yet
+     by next(), drain(), or take_remaining().
+  */
+  bool LineFramer::has_buffered_data() {
+    return !this->overflow.empty() || this->end > this->start;
+  }
+
+  /**
+     Moves at most len bytes of the data committed, but not returned yet,
+     to dest. This is used when switching from line-based reading to
+     raw reading.
+
+     Returns the number of bytes moved.
+  */
+  unsigned int LineFramer::drain(char *dest, unsigned int len) {
+    unsigned int copied = 0;
+
+    if (!this->overflow.empty()) {
+      copied = std::min((std::size_t)len, this->overflow.size());
+      std::memcpy(dest, this->overflow.data(), copied);
+      this->overflow.erase(0, copied);
+
+      if (copied == len) {
+        return copied;
+      }
+    }
+
+    unsigned int to_copy = std::min(len - copied, this->end - this->start);
+    std::memcpy(dest + copied, this->buf.get() + this->start, to_copy);
+    this->start += to_copy;
+    this->scan_pos = std::max(this->scan_pos, this->start);
+
+    if (this->start == this->end) {
+      this->start = 0;
+      this->end = 0;
+      this->scan_pos = 0;
+    }
+
+    return copied + to_copy;
+  }
+
+  /**
+     Returns all data committed, but not returned yet (i.e. an incomplete
+     last line), and clears the framer.
+  */
+  std::string LineFramer::take_remaining() {
+    std::string result;
+    result.swap(this->overflow);
+    result.append(this->buf.get() + this->start, this->end - this->start);
+
+    this->start = 0;
+    this->end = 0;
+    this->scan_pos = 0;
+
+    return result;
+  }
+};
@@ -0,0 +1,45 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef FRAMER_HPP_
+#define FRAMER_HPP_
+
+#include <string>
+#include <string_view>
+#include <memory>
+
+namespace adaptyst {
+  /**
+     A class splitting a byte stream into newline-terminated lines
+     without allocating memory per line.
+
+     Received data is written directly into the internal buffer (see
+     get_write_ptr(), get_write_space() and commit()) and complete lines
+     are returned as std::string_view objects pointing into that buffer.
+     Newlines are found with memchr() and every byte is scanned
+     only once. Lines longer than the buffer are accumulated in
+     a separate string.
+  */
+  class LineFramer {
+  private:
+    std::unique_ptr<char[]> buf;
+    unsigned int buf_size;
+    unsigned int start;
+    unsigned int end;
+    unsigned int scan_pos;
+    std::string overflow;
+    std::string long_line;
+
+  public:
+    LineFramer(unsigned int buf_size);
+    bool next(std::string_view &line);
+    char *get_write_ptr();
+    unsigned int get_write_space();
+    void commit(unsigned int bytes);
+    bool has_buffered_data();
+    unsigned int drain(char *dest, unsigned int len);
+    std::string take_remaining();
+  };
+};
+
+#endif
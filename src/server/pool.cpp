@@ -0,0 +1,287 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace adaptyst {
+  /**
+     Constructs a WorkerPool object and starts its threads.
+
+     @param thread_count The number of worker threads. 0 is treated as 1.
+  */
+  WorkerPool::WorkerPool(unsigned int thread_count) {
+    this->running = 0;
+    this->stopping = false;
+
+    for (unsigned int i = 0; i < std::max(1U, thread_count); i++) {
+      this->workers.push_back(std::thread(&WorkerPool::work, this));
+    }
+  }
+
+  /**
+     Destroys the WorkerPool object after all submitted tasks
+     are completed.
+  */
+  WorkerPool::~WorkerPool() {
+    {
+      std::lock_guard lock(this->mutex);
+      this->stopping = true;
+    }
+
+    this->task_cond.notify_all();
+
+    for (auto &worker : this->workers) {
+      worker.join();
+    }
+  }
+
+  void WorkerPool::work() {
+    while (true) {
+      std::function<void()> task;
+
+      {
+        std::unique_lock lock(this->mutex);
+
+        while (this->tasks.empty() && !this->stopping) {
+          this->task_cond.wait(lock);
+        }
+
+        if (this->tasks.empty()) {
+          return;
+        }
+
+        task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        this->running++;
+      }
+
+      try {
+        task();
+      } catch (std::exception &e) {
+        std::cerr << "Unhandled error in a worker thread: " << e.what() << std::endl;
+      } catch (...) {
+        std::cerr << "Unhandled unknown error in a worker thread." << std::endl;
+      }
+
+      // Whatever the task holds is released before the task is
+      // considered done
+      task = nullptr;
+
+      {
+        std::lock_guard lock(this->mutex);
+        this->running--;
+      }
+
+      this->done_cond.notify_all();
+    }
+  }
+
+  /**
+     Adds a task to the end of the queue. It is run as soon as
+     a worker thread is free.
+  */
+  void WorkerPool::submit(std::function<void()> task) {
+    {
+      std::lock_guard lock(this->mutex);
+      this->tasks.push_back(std::move(task));
+    }
+
+    this->task_cond.notify_one();
+  }
+
+  /**
+     Gets the number of tasks which are either queued or running.
+  */
+  unsigned int WorkerPool::get_pending_count() {
+    std::lock_guard lock(this->mutex);
+    return this->tasks.size() + this->running;
+  }
+
+  /**
+     Gets the number of worker threads.
+  */
+  unsigned int WorkerPool::get_thread_count() {
+    return this->workers.size();
+  }
+
+  /**
+     Waits until all submitted tasks are completed.
+  */
+  void WorkerPool::wait() {
+    std::unique_lock lock(this->mutex);
+
+    while (!this->tasks.empty() || this->running > 0) {
+      this->done_cond.wait(lock);
+    }
+  }
+
+  /**
+     Constructs a WriterPool object and starts its threads.
+
+     @param thread_count The number of worker threads, i.e. the maximum
+                         number of writes running at once. 0 means the
+                         number of CPU cores.
+  */
+  WriterPool::WriterPool(unsigned int thread_count) {
+    if (thread_count == 0) {
+      thread_count = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    this->active = 0;
+    this->limit = thread_count;
+    this->avg_latency = -1;
+    this->min_latency = -1;
+    this->window_min_latency = -1;
+    this->window_count = 0;
+    this->stopping = false;
+
+    for (unsigned int i = 0; i < thread_count; i++) {
+      this->workers.push_back(std::thread(&WriterPool::work, this));
+    }
+  }
+
+  /**
+     Destroys the WriterPool object after all submitted tasks
+     are completed.
+  */
+  WriterPool::~WriterPool() {
+    {
+      std::lock_guard lock(this->mutex);
+      this->stopping = true;
+    }
+
+    this->task_cond.notify_all();
+
+    for (auto &worker : this->workers) {
+      worker.join();
+    }
+  }
+
+  void WriterPool::work() {
+    while (true) {
+      std::vector<struct task> batch;
+      std::size_t batch_size = 0;
+
+      {
+        std::unique_lock lock(this->mutex);
+
+        while ((this->tasks.empty() || this->active >= this->limit) &&
+               !(this->stopping && this->tasks.empty())) {
+          this->task_cond.wait(lock);
+        }
+
+        if (this->tasks.empty()) {
+          return;
+        }
+
+        do {
+          batch_size += this->tasks.front().size;
+          batch.push_back(std::move(this->tasks.front()));
+          this->tasks.pop_front();
+        } while (batch_size < WRITER_SMALL_FILE_SIZE &&
+                 batch.size() < WRITER_BATCH_COUNT &&
+                 !this->tasks.empty() &&
+                 this->tasks.front().size < WRITER_SMALL_FILE_SIZE);
+
+        this->active++;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+
+      // Exceptions are stored in the futures returned by submit()
+      for (auto &task : batch) {
+        task.func();
+      }
+
+      std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - start;
+
+      batch.clear();
+
+      {
+        std::lock_guard lock(this->mutex);
+        this->active--;
+        this->record(batch_size, duration.count());
+      }
+
+      this->task_cond.notify_all();
+    }
+  }
+
+  void WriterPool::record(std::size_t size, double seconds) {
+    // Opening and closing a file costs about the same regardless
+    // of its size, so tiny writes are not compared per byte
+    double latency = seconds / std::max((std::size_t)WRITER_SMALL_FILE_SIZE, size);
+
+    if (this->avg_latency < 0) {
+      this->avg_latency = latency;
+      this->min_latency = latency;
+      this->window_min_latency = latency;
+      return;
+    }
+
+    this->avg_latency = 0.8 * this->avg_latency + 0.2 * latency;
+    this->min_latency = std::min(this->min_latency, this->avg_latency);
+    this->window_min_latency = std::min(this->window_min_latency,
+                                        this->avg_latency);
+
+    if (++this->window_count >= WRITER_LATENCY_WINDOW) {
+      // From now on, only the lowest average of the window which has
+      // just ended and of the next one is taken into account
+      this->min_latency = this->window_min_latency;
+      this->window_min_latency = this->avg_latency;
+      this->window_count = 0;
+    }
+
+    if (this->avg_latency > WRITER_LATENCY_FACTOR * this->min_latency) {
+      this->limit = std::max(1U, this->limit - 1);
+    } else if (this->avg_latency < (1 + WRITER_LATENCY_FACTOR) / 2 * this->min_latency &&
+               this->limit < this->workers.size()) {
+      this->limit++;
+    }
+  }
+
+  /**
+     Adds a task to the end of the queue. It is run as soon as
+     a worker thread is free and the current concurrency limit
+     allows it.
+
+     @param size An estimated number of bytes written by the task.
+     @param func The task.
+
+     @return A future which becomes ready when the task is completed,
+             rethrowing any exception thrown by the task.
+  */
+  std::future<void> WriterPool::submit(std::size_t size,
+                                       std::function<void()> func) {
+    std::packaged_task<void()> packaged(std::move(func));
+    std::future<void> future = packaged.get_future();
+
+    {
+      std::lock_guard lock(this->mutex);
+      this->tasks.push_back({size, std::move(packaged)});
+    }
+
+    this->task_cond.notify_one();
+
+    return future;
+  }
+
+  /**
+     Gets the number of worker threads.
+  */
+  unsigned int WriterPool::get_thread_count() {
+    return this->workers.size();
+  }
+
+  /**
+     Gets the number of writes currently allowed to run at once.
+  */
+  unsigned int WriterPool::get_limit() {
+    std::lock_guard lock(this->mutex);
+    return this->limit;
+  }
+};
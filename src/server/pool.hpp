@@ -0,0 +1,117 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef POOL_HPP_
+#define POOL_HPP_
+
+#include <functional>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+// Tasks of WriterPool with an estimated size below this value,
+// in bytes, are considered tiny and may be run in batches.
+#ifndef WRITER_SMALL_FILE_SIZE
+#define WRITER_SMALL_FILE_SIZE 65536
+#endif
+
+// The maximum number of tiny tasks run by one worker of
+// WriterPool in a single batch.
+#ifndef WRITER_BATCH_COUNT
+#define WRITER_BATCH_COUNT 32
+#endif
+
+// WriterPool lowers its concurrency when the average write latency
+// per byte exceeds the lowest recent one by this factor.
+#ifndef WRITER_LATENCY_FACTOR
+#define WRITER_LATENCY_FACTOR 2.0
+#endif
+
+// The number of completed writes after which WriterPool forgets
+// the lowest latency observed before the previous such window.
+#ifndef WRITER_LATENCY_WINDOW
+#define WRITER_LATENCY_WINDOW 64
+#endif
+
+namespace adaptyst {
+  /**
+     A class describing a fixed-size pool of worker threads
+     executing tasks from a FIFO queue.
+
+     Tasks must not throw: any exception escaping a task is
+     caught and printed to stderr.
+  */
+  class WorkerPool {
+  private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable task_cond;
+    std::condition_variable done_cond;
+    unsigned int running;
+    bool stopping;
+
+    void work();
+
+  public:
+    WorkerPool(unsigned int thread_count);
+    ~WorkerPool();
+    void submit(std::function<void()> task);
+    unsigned int get_pending_count();
+    unsigned int get_thread_count();
+    void wait();
+  };
+
+  /**
+     A class describing a fixed-size pool of worker threads writing
+     files, with the number of writes running at once adapted to
+     the observed write latency.
+
+     Every task comes with an estimated number of bytes it writes.
+     Consecutive tiny tasks (see WRITER_SMALL_FILE_SIZE) are run by
+     one worker in a single batch. Every time a task or a batch
+     completes, its latency per byte is added to a moving average:
+     if the average grows WRITER_LATENCY_FACTOR times above the lowest
+     one observed, one fewer write is allowed to run at once, and
+     one more otherwise (up to the number of threads). The lowest
+     average is taken over the last one or two windows of
+     WRITER_LATENCY_WINDOW writes, so that a baseline which is no
+     longer achievable (e.g. measured while the page cache was
+     absorbing the writes) cannot keep the concurrency at 1.
+  */
+  class WriterPool {
+  private:
+    struct task {
+      std::size_t size;
+      std::packaged_task<void()> func;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<struct task> tasks;
+    std::mutex mutex;
+    std::condition_variable task_cond;
+    unsigned int active;
+    unsigned int limit;
+    double avg_latency;
+    double min_latency;
+    double window_min_latency;
+    unsigned int window_count;
+    bool stopping;
+
+    void work();
+    void record(std::size_t size, double seconds);
+
+  public:
+    WriterPool(unsigned int thread_count = 0);
+    ~WriterPool();
+    std::future<void> submit(std::size_t size, std::function<void()> func);
+    unsigned int get_thread_count();
+    unsigned int get_limit();
+  };
+};
+
+#endif
@@ -0,0 +1,439 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "protocol.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+namespace adaptyst {
+  namespace protocol {
+    static void put_u8(std::string &out, std::uint8_t value) {
+      out.push_back((char)value);
+    }
+
+    static void put_u16(std::string &out, std::uint16_t value) {
+      for (int i = 0; i < 2; i++) {
+        out.push_back((char)((value >> (8 * i)) & 0xff));
+      }
+    }
+
+    static void put_u32(std::string &out, std::uint32_t value) {
+      for (int i = 0; i < 4; i++) {
+        out.push_back((char)((value >> (8 * i)) & 0xff));
+      }
+    }
+
+    static void put_u64(std::string &out, std::uint64_t value) {
+      for (int i = 0; i < 8; i++) {
+        out.push_back((char)((value >> (8 * i)) & 0xff));
+      }
+    }
+
+    static void put_callchain(std::string &out,
+                              const std::vector<CallchainElem> &callchain) {
+      put_u32(out, callchain.size());
+
+      for (auto &elem : callchain) {
+        put_u32(out, elem.symbol);
+        put_u64(out, elem.offset);
+      }
+    }
+
+    /**
+       Reserves the space for the payload length at the end of out
+       and returns its position.
+    */
+    static std::size_t begin_record(std::string &out, RecordType type) {
+      std::size_t pos = out.size();
+      put_u32(out, 0);
+      put_u8(out, type);
+      return pos;
+    }
+
+    static void end_record(std::string &out, std::size_t pos) {
+      std::uint32_t len = out.size() - pos - 4;
+
+      for (int i = 0; i < 4; i++) {
+        out[pos + i] = (char)((len >> (8 * i)) & 0xff);
+      }
+    }
+
+    /**
+       A helper class for reading little-endian values from
+       a record payload with bounds checking.
+    */
+    class PayloadParser {
+    private:
+      std::string_view payload;
+      std::size_t pos;
+
+    public:
+      PayloadParser(std::string_view payload) {
+        this->payload = payload;
+        this->pos = 1;
+      }
+
+      bool get(std::uint64_t &value, int bytes) {
+        if (this->pos + bytes > this->payload.size()) {
+          return false;
+        }
+
+        value = 0;
+
+        for (int i = 0; i < bytes; i++) {
+          value |= ((std::uint64_t)(unsigned char)this->payload[this->pos + i]) << (8 * i);
+        }
+
+        this->pos += bytes;
+        return true;
+      }
+
+      template<class T>
+      bool get(T &value) {
+        std::uint64_t tmp;
+
+        if (!this->get(tmp, sizeof(T))) {
+          return false;
+        }
+
+        value = (T)tmp;
+        return true;
+      }
+
+      bool get(std::string &value, int length_bytes) {
+        std::uint64_t length;
+
+        if (!this->get(length, length_bytes) ||
+            this->pos + length > this->payload.size()) {
+          return false;
+        }
+
+        value.assign(this->payload.data() + this->pos, length);
+        this->pos += length;
+        return true;
+      }
+
+      bool get(std::vector<CallchainElem> &callchain) {
+        std::uint32_t count;
+
+        if (!this->get(count) ||
+            this->pos + (std::size_t)count * 12 > this->payload.size()) {
+          return false;
+        }
+
+        callchain.resize(count);
+
+        for (std::uint32_t i = 0; i < count; i++) {
+          this->get(callchain[i].symbol);
+          this->get(callchain[i].offset);
+        }
+
+        return true;
+      }
+
+      bool finished() {
+        return this->pos == this->payload.size();
+      }
+    };
+
+    /**
+       Converts a numeric offset to the string form used in
+       JSON messages (e.g. "0x1f"). NO_OFFSET is converted to
+       an empty string.
+    */
+    std::string offset_to_string(std::uint64_t offset) {
+      if (offset == NO_OFFSET) {
+        return "";
+      }
+
+      char buf[19];
+      std::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)offset);
+      return std::string(buf);
+    }
+
+    /**
+       Converts an offset string used in JSON messages
+       (e.g. "0x1f") to its numeric form. An empty or invalid
+       string is converted to NO_OFFSET.
+    */
+    std::uint64_t offset_from_string(const std::string &offset) {
+      if (offset.empty()) {
+        return NO_OFFSET;
+      }
+
+      try {
+        return std::stoull(offset, nullptr, 16);
+      } catch (...) {
+        return NO_OFFSET;
+      }
+    }
+
+    /**
+       Appends a sample record to out, a delta sample record if
+       sample.delta is true, or an aggregated sample record if the sample
+       count is larger than 1.
+    */
+    void encode(const Sample &sample, std::string &out) {
+      RecordType type = sample.delta ? DELTA_SAMPLE :
+        (sample.count > 1 ? AGGREGATED_SAMPLE : SAMPLE);
+      std::size_t pos = begin_record(out, type);
+      put_u8(out, sample.event_type.size());
+      out += sample.event_type;
+      put_u32(out, sample.pid);
+      put_u32(out, sample.tid);
+      put_u64(out, sample.time);
+      put_u64(out, sample.period);
+
+      if (type != SAMPLE) {
+        put_u32(out, sample.count);
+      }
+
+      if (type == DELTA_SAMPLE) {
+        put_u32(out, sample.common_prefix);
+      }
+
+      put_callchain(out, sample.callchain);
+      end_record(out, pos);
+    }
+
+    /**
+       Appends a syscall record to out.
+    */
+    void encode(const Syscall &syscall, std::string &out) {
+      std::size_t pos = begin_record(out, SYSCALL);
+      put_u64(out, syscall.ret_value);
+      put_callchain(out, syscall.callchain);
+      end_record(out, pos);
+    }
+
+    /**
+       Appends a syscall tree record to out.
+    */
+    void encode(const SyscallMeta &meta, std::string &out) {
+      std::size_t pos = begin_record(out, SYSCALL_META);
+      put_u8(out, meta.subtype.size());
+      out += meta.subtype;
+      put_u16(out, meta.comm.size());
+      out += meta.comm;
+      put_u32(out, meta.pid);
+      put_u32(out, meta.tid);
+      put_u64(out, meta.time);
+      put_u64(out, meta.ret_value);
+      end_record(out, pos);
+    }
+
+    /**
+       Appends a symbol definition record to out.
+    */
+    void encode(const Symbol &symbol, std::string &out) {
+      std::size_t pos = begin_record(out, SYMBOL);
+      put_u32(out, symbol.id);
+      put_u32(out, symbol.name.size());
+      out += symbol.name;
+      end_record(out, pos);
+    }
+
+    /**
+       Appends a stop record (equivalent to the "<STOP>" line) to out.
+    */
+    void encode_stop(std::string &out) {
+      std::size_t pos = begin_record(out, STOP);
+      end_record(out, pos);
+    }
+
+    /**
+       Gets the type of a record payload returned by RecordReader::next().
+
+       @throw std::runtime_error When the payload is empty.
+    */
+    RecordType get_type(std::string_view payload) {
+      if (payload.empty()) {
+        throw std::runtime_error("Empty binary record payload.");
+      }
+
+      return (RecordType)payload[0];
+    }
+
+    /**
+       Decodes a sample, aggregated sample, or delta sample record
+       payload. Returns false if the payload is malformed.
+    */
+    bool decode(std::string_view payload, Sample &sample) {
+      PayloadParser parser(payload);
+
+      if (!parser.get(sample.event_type, 1) ||
+          !parser.get(sample.pid) || !parser.get(sample.tid) ||
+          !parser.get(sample.time) || !parser.get(sample.period)) {
+        return false;
+      }
+
+      RecordType type = get_type(payload);
+
+      if (type == SAMPLE) {
+        sample.count = 1;
+      } else if (!parser.get(sample.count) || sample.count == 0) {
+        return false;
+      }
+
+      sample.delta = type == DELTA_SAMPLE;
+      sample.common_prefix = 0;
+
+      if (sample.delta && !parser.get(sample.common_prefix)) {
+        return false;
+      }
+
+      return parser.get(sample.callchain) && parser.finished();
+    }
+
+    /**
+       Decodes a syscall record payload. Returns false if the payload
+       is malformed.
+    */
+    bool decode(std::string_view payload, Syscall &syscall) {
+      PayloadParser parser(payload);
+      return parser.get(syscall.ret_value) &&
+        parser.get(syscall.callchain) && parser.finished();
+    }
+
+    /**
+       Decodes a syscall tree record payload. Returns false if the payload
+       is malformed.
+    */
+    bool decode(std::string_view payload, SyscallMeta &meta) {
+      PayloadParser parser(payload);
+      return parser.get(meta.subtype, 1) && parser.get(meta.comm, 2) &&
+        parser.get(meta.pid) && parser.get(meta.tid) &&
+        parser.get(meta.time) && parser.get(meta.ret_value) &&
+        parser.finished();
+    }
+
+    /**
+       Decodes a symbol definition record payload. Returns false if
+       the payload is malformed.
+    */
+    bool decode(std::string_view payload, Symbol &symbol) {
+      PayloadParser parser(payload);
+      return parser.get(symbol.id) && parser.get(symbol.name, 4) &&
+        parser.finished();
+    }
+
+    /**
+       Constructs a RecordReader object.
+
+       @param connection The connection to read records from.
+       @param buf_size   The size of the internal buffer, in bytes. Records
+                         larger than that are still handled, but
+                         with an extra copy.
+    */
+    RecordReader::RecordReader(Connection &connection,
+                               unsigned int buf_size) : connection(connection) {
+      this->buf.reset(new char[buf_size]);
+      this->buf_size = buf_size;
+      this->start = 0;
+      this->end = 0;
+    }
+
+    /**
+       Makes sure that at least min_bytes bytes are available in
+       the internal buffer. Returns false if the connection has
+       been closed before that.
+
+       min_bytes must not be larger than the buffer size.
+    */
+    bool RecordReader::fill(unsigned int min_bytes) {
+      if (this->end - this->start >= min_bytes) {
+        return true;
+      }
+
+      if (this->start > 0) {
+        std::memmove(this->buf.get(), this->buf.get() + this->start,
+                     this->end - this->start);
+        this->end -= this->start;
+        this->start = 0;
+      }
+
+      while (this->end < min_bytes) {
+        int bytes = this->connection.read(this->buf.get() + this->end,
+                                          this->buf_size - this->end,
+                                          NO_TIMEOUT);
+
+        if (bytes < 0) {
+          throw ConnectionException();
+        } else if (bytes == 0) {
+          return false;
+        }
+
+        this->end += bytes;
+      }
+
+      return true;
+    }
+
+    /**
+       Reads the next record and sets payload to its content (without
+       the length prefix). The payload is valid until the next call
+       to next().
+
+       Returns false if the connection has been closed before
+       a complete record has been received.
+
+       @throw ConnectionException In case of any connection errors.
+       @throw std::runtime_error When the record length is larger than
+                                 MAX_RECORD_SIZE.
+    */
+    bool RecordReader::next(std::string_view &payload) {
+      if (!this->fill(4)) {
+        return false;
+      }
+
+      std::uint32_t len = 0;
+
+      for (int i = 0; i < 4; i++) {
+        len |= ((std::uint32_t)(unsigned char)this->buf[this->start + i]) << (8 * i);
+      }
+
+      if (len > MAX_RECORD_SIZE) {
+        throw std::runtime_error("Binary record of " + std::to_string(len) +
+                                 " bytes exceeds the maximum of " +
+                                 std::to_string(MAX_RECORD_SIZE) + " bytes.");
+      }
+
+      if (len <= this->buf_size - 4) {
+        if (!this->fill(4 + len)) {
+          return false;
+        }
+
+        payload = std::string_view(this->buf.get() + this->start + 4, len);
+        this->start += 4 + len;
+        return true;
+      }
+
+      // A record larger than the buffer is read straight into its
+      // own storage, so that it is copied only once
+      std::size_t received = this->end - this->start - 4;
+      this->oversized.resize(len);
+      std::memcpy(this->oversized.data(), this->buf.get() + this->start + 4,
+                  received);
+      this->start = 0;
+      this->end = 0;
+
+      while (received < len) {
+        int bytes = this->connection.read(this->oversized.data() + received,
+                                          len - received, NO_TIMEOUT);
+
+        if (bytes < 0) {
+          throw ConnectionException();
+        } else if (bytes == 0) {
+          return false;
+        }
+
+        received += bytes;
+      }
+
+      payload = this->oversized;
+      return true;
+    }
+  };
+};
@@ -0,0 +1,176 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef PROTOCOL_HPP_
+#define PROTOCOL_HPP_
+
+#include "socket.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <memory>
+
+#define BINARY_PROTOCOL_VERSION 3
+#define PROTOCOL_NEGOTIATION "<PROTOCOL>"
+#define COMPRESSION_NEGOTIATION "<COMPRESSION>"
+#define NO_OFFSET UINT64_MAX
+
+#ifndef BINARY_BUFFER_SIZE
+#define BINARY_BUFFER_SIZE 65536
+#endif
+
+#ifndef MAX_RECORD_SIZE
+#define MAX_RECORD_SIZE 67108864
+#endif
+
+namespace adaptyst {
+  /**
+     A namespace describing the binary record format which can be used
+     instead of JSON lines for sending data from the "perf" scripts to
+     StdSubclient.
+
+     The format is negotiated per connection: the sender writes the line
+     "<PROTOCOL> binary <highest supported version>" and waits for
+     the reply, which is either "<PROTOCOL> binary <version to use>" or
+     "<PROTOCOL> json" (in which case the sender must carry on with
+     JSON lines). Afterwards, every record is a little-endian
+     32-bit payload length followed by the payload. The first byte
+     of the payload is the record type (see RecordType).
+
+     All integers are little-endian. Strings are prefixed with their
+     length (8-bit for event types and syscall subtypes, 16-bit for
+     command names, 32-bit for symbol names). A callchain is a 32-bit
+     element count followed by (32-bit symbol ID, 64-bit offset)
+     pairs, where the offset equal to NO_OFFSET corresponds to
+     an empty offset string.
+
+     Symbol IDs are local to a stream: each ID must be defined by
+     a symbol record before it is first used in a callchain.
+
+     Version 2 adds aggregated sample records, which the sender may use
+     for consecutive samples of a thread with the same event type and
+     callchain. Such a record is a sample record with an extra 32-bit
+     sample count after the period, where the period is the sum of
+     the periods and the time is the one of the first sample.
+
+     Version 3 adds delta sample records, where a callchain is sent
+     relative to the previous sample of the same thread in the stream.
+     Such a record is an aggregated sample record (with a count of 1 if
+     the sample is not aggregated) with an extra 32-bit number K after
+     the count, stating that the callchain starts with the first
+     K elements of the previous callchain of the thread. Only the
+     remaining elements follow.
+  */
+  namespace protocol {
+    enum RecordType : std::uint8_t {
+      STOP = 0,
+      SAMPLE = 1,
+      SYSCALL = 2,
+      SYSCALL_META = 3,
+      SYMBOL = 4,
+      AGGREGATED_SAMPLE = 5,
+      DELTA_SAMPLE = 6
+    };
+
+    /**
+       A structure describing a callchain element.
+    */
+    struct CallchainElem {
+      std::uint32_t symbol;
+      std::uint64_t offset;
+    };
+
+    /**
+       A structure describing a sample record. If delta is true, it
+       describes a delta sample record, where callchain has only the
+       elements following the first common_prefix ones. Otherwise, if
+       count is larger than 1, it describes an aggregated sample record.
+    */
+    struct Sample {
+      std::string event_type;
+      std::int32_t pid;
+      std::int32_t tid;
+      std::uint64_t time;
+      std::uint64_t period;
+      std::uint32_t count = 1;
+      bool delta = false;
+      std::uint32_t common_prefix = 0;
+      std::vector<CallchainElem> callchain;
+    };
+
+    /**
+       A structure describing a syscall record (i.e. the callchain
+       of a syscall spawning a new thread/process).
+    */
+    struct Syscall {
+      std::int64_t ret_value;
+      std::vector<CallchainElem> callchain;
+    };
+
+    /**
+       A structure describing a syscall tree record (i.e. a new
+       thread/process, execve, or exit event).
+    */
+    struct SyscallMeta {
+      std::string subtype;
+      std::string comm;
+      std::int32_t pid;
+      std::int32_t tid;
+      std::uint64_t time;
+      std::int64_t ret_value;
+    };
+
+    /**
+       A structure describing a symbol definition record, i.e. the name
+       a symbol ID used in callchains of a stream refers to. The name
+       is a JSON array of form [<symbol>, <executable/library>].
+    */
+    struct Symbol {
+      std::uint32_t id;
+      std::string name;
+    };
+
+    std::string offset_to_string(std::uint64_t offset);
+    std::uint64_t offset_from_string(const std::string &offset);
+
+    void encode(const Sample &sample, std::string &out);
+    void encode(const Syscall &syscall, std::string &out);
+    void encode(const SyscallMeta &meta, std::string &out);
+    void encode(const Symbol &symbol, std::string &out);
+    void encode_stop(std::string &out);
+
+    RecordType get_type(std::string_view payload);
+    bool decode(std::string_view payload, Sample &sample);
+    bool decode(std::string_view payload, Syscall &syscall);
+    bool decode(std::string_view payload, SyscallMeta &meta);
+    bool decode(std::string_view payload, Symbol &symbol);
+
+    /**
+       A class reading length-prefixed binary records from a connection.
+
+       The connection must not have any data buffered by the line-based
+       Connection::read() at the time RecordReader is used, which is
+       guaranteed by the protocol negotiation (the sender does not
+       send any binary record before receiving the negotiation reply).
+    */
+    class RecordReader {
+    private:
+      Connection &connection;
+      std::unique_ptr<char[]> buf;
+      unsigned int buf_size;
+      unsigned int start;
+      unsigned int end;
+      std::string oversized;
+
+      bool fill(unsigned int min_bytes);
+
+    public:
+      RecordReader(Connection &connection,
+                   unsigned int buf_size = BINARY_BUFFER_SIZE);
+      bool next(std::string_view &payload);
+    };
+  };
+};
+
+#endif
@@ -0,0 +1,740 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "results.hpp"
+#include "zstdfile.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RESULTS_BYTE_ORDER 0x01020304
+
+namespace adaptyst {
+  static std::uint64_t align_up(std::uint64_t offset) {
+    return (offset + 7) & ~(std::uint64_t)7;
+  }
+
+  /**
+     Checks whether a file name stem is of form "<PID>_<TID>", i.e.
+     whether the file is a per-thread result file.
+  */
+  bool is_thread_result(const std::string &stem) {
+    std::size_t pos = stem.find('_');
+
+    if (pos == std::string::npos || pos == 0 || pos == stem.size() - 1) {
+      return false;
+    }
+
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+
+    return std::all_of(stem.begin(), stem.begin() + pos, is_digit) &&
+      std::all_of(stem.begin() + pos + 1, stem.end(), is_digit);
+  }
+
+  /**
+     Checks whether a JSON value is a call tree as saved by CallTree.
+  */
+  static bool is_tree(nlohmann::json &value) {
+    return value.is_object() && value.contains("children") &&
+      value.contains("name") && value.contains("value") &&
+      value.contains("cold") && value["children"].is_array();
+  }
+
+  /**
+     Constructs a ResultsWriter object and creates the file.
+
+     A file which has not been completed by finish() has an invalid
+     header and is rejected by ResultsFile.
+
+     @param path The path to the file.
+
+     @throw std::runtime_error When the file cannot be created.
+  */
+  ResultsWriter::ResultsWriter(fs::path path) {
+    this->finished = false;
+    this->stream.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if (!this->stream) {
+      throw std::runtime_error("Could not open " + path.string() + " for writing");
+    }
+
+    struct results::Header header;
+    std::memset(&header, 0, sizeof(header));
+    this->stream.write((char *)&header, sizeof(header));
+  }
+
+  ResultsWriter::~ResultsWriter() {
+    this->stream.close();
+  }
+
+  std::uint64_t ResultsWriter::align() {
+    std::uint64_t pos = this->stream.tellp();
+    std::uint64_t aligned = align_up(pos);
+
+    for (; pos < aligned; pos++) {
+      this->stream.put(0);
+    }
+
+    return aligned;
+  }
+
+  template<typename T> void ResultsWriter::write_array(const std::vector<T> &data) {
+    this->stream.write((const char *)data.data(), data.size() * sizeof(T));
+    this->align();
+  }
+
+  std::uint64_t ResultsWriter::write_tree(struct results_tree &tree) {
+    std::uint64_t offset = this->align();
+    struct tree_columns &columns = tree.columns;
+
+    this->write_array(columns.names);
+    this->write_array(columns.values);
+    this->write_array(columns.subtree_ends);
+    this->write_array(columns.cold);
+    this->write_array(columns.offset_starts);
+    this->write_array(columns.offset_keys);
+    this->write_array(columns.offset_values);
+
+    return offset;
+  }
+
+  /**
+     Gets the ID of a string in the string table of the file,
+     adding the string if it hasn't been seen before.
+  */
+  std::uint32_t ResultsWriter::intern(const std::string &str) {
+    std::lock_guard lock(this->strings_mutex);
+    auto result = this->string_ids.try_emplace(str, this->strings.size());
+
+    if (result.second) {
+      this->strings.push_back(str);
+    }
+
+    return result.first->second;
+  }
+
+  /**
+     Adds a file other than a per-thread one (e.g. metadata.json),
+     stored verbatim.
+
+     @param name The name of the file, e.g. "metadata.json".
+     @param data The contents of the file.
+  */
+  void ResultsWriter::add_blob(const std::string &name, std::string_view data) {
+    std::uint32_t name_id = this->intern(name);
+    std::lock_guard lock(this->mutex);
+
+    std::uint64_t offset = this->align();
+    this->stream.write(data.data(), data.size());
+    this->blobs.push_back({name_id, 0, offset, data.size()});
+  }
+
+  /**
+     Adds a file other than a per-thread one (e.g. metadata.json),
+     copied verbatim from a given path.
+
+     @param name The name of the file, e.g. "metadata.json".
+     @param path The path to the file.
+
+     @throw std::runtime_error When the file cannot be read.
+  */
+  void ResultsWriter::add_blob(const std::string &name, fs::path path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+
+    if (!file) {
+      throw std::runtime_error("Could not open " + path.string() + " for reading");
+    }
+
+    std::uint64_t size = fs::file_size(path);
+    std::uint32_t name_id = this->intern(name);
+    std::lock_guard lock(this->mutex);
+
+    std::uint64_t offset = this->align();
+
+    // Copying an empty stream buffer would set failbit
+    if (size > 0) {
+      this->stream << file.rdbuf();
+    }
+
+    this->blobs.push_back({name_id, 0, offset,
+                           (std::uint64_t)this->stream.tellp() - offset});
+  }
+
+  /**
+     Adds a per-thread file (i.e. processed/<pid_tid>.json).
+
+     @param name   The name of the thread ("<PID>_<TID>").
+     @param fields A JSON object, serialised to a string, with all
+                   fields of the file other than call trees.
+     @param trees  The call trees of the thread. Pairs of trees
+                   saved as a single field are expected to be
+                   consecutive, starting with the non-time-ordered one.
+  */
+  void ResultsWriter::add_thread(const std::string &name, const std::string &fields,
+                                 std::vector<struct results_tree> &trees) {
+    std::vector<struct results::TreeEntry> entries;
+    std::vector<std::uint32_t> event_names;
+
+    for (auto &tree : trees) {
+      event_names.push_back(this->intern(tree.event_name));
+    }
+
+    std::uint32_t name_id = this->intern(name);
+    std::lock_guard lock(this->mutex);
+
+    std::uint64_t fields_offset = this->align();
+    this->stream.write(fields.data(), fields.size());
+
+    for (std::size_t i = 0; i < trees.size(); i++) {
+      std::uint64_t offset = this->write_tree(trees[i]);
+      entries.push_back({event_names[i], trees[i].time_ordered ? 1U : 0U,
+                         trees[i].columns.names.size(),
+                         trees[i].columns.offset_keys.size(), offset});
+    }
+
+    std::uint64_t trees_offset = this->align();
+    this->write_array(entries);
+
+    this->threads.push_back({name_id, (std::uint32_t)trees.size(),
+                             fields_offset, fields.size(), trees_offset});
+  }
+
+  /**
+     Converts a call tree in the JSON format saved by CallTree
+     to the columns of the binary results format.
+  */
+  void ResultsWriter::tree_from_json(nlohmann::json &tree, struct tree_columns &columns) {
+    std::function<void(nlohmann::json &)> convert = [&](nlohmann::json &node) {
+      std::size_t index = columns.names.size();
+
+      columns.names.push_back(this->intern(node["name"].get<std::string>()));
+      columns.values.push_back(node["value"].get<std::uint64_t>());
+      columns.subtree_ends.push_back(0);
+      columns.cold.push_back(node["cold"].get<bool>() ? 1 : 0);
+      columns.offset_starts.push_back(columns.offset_keys.size());
+
+      if (node.contains("offsets")) {
+        for (auto &offset : node["offsets"].items()) {
+          columns.offset_keys.push_back(this->intern(offset.key()));
+          columns.offset_values.push_back(offset.value().get<std::uint64_t>());
+        }
+      }
+
+      for (auto &child : node["children"]) {
+        convert(child);
+      }
+
+      columns.subtree_ends[index] = columns.names.size();
+    };
+
+    convert(tree);
+    columns.offset_starts.push_back(columns.offset_keys.size());
+  }
+
+  /**
+     Writes the string table and the indices and completes the file.
+     Nothing can be added afterwards.
+
+     @throw std::runtime_error When the file cannot be written.
+  */
+  void ResultsWriter::finish() {
+    std::lock_guard lock(this->mutex);
+    std::lock_guard strings_lock(this->strings_mutex);
+
+    if (this->finished) {
+      return;
+    }
+
+    auto by_name = [this](auto &a, auto &b) {
+      return this->strings[a.name] < this->strings[b.name];
+    };
+
+    std::sort(this->blobs.begin(), this->blobs.end(), by_name);
+    std::sort(this->threads.begin(), this->threads.end(), by_name);
+
+    struct results::Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, RESULTS_MAGIC, sizeof(header.magic));
+    header.version = RESULTS_VERSION;
+    header.byte_order = RESULTS_BYTE_ORDER;
+
+    std::vector<std::uint64_t> string_offsets;
+    std::uint64_t string_offset = 0;
+
+    for (auto &str : this->strings) {
+      string_offsets.push_back(string_offset);
+      string_offset += str.size();
+    }
+
+    string_offsets.push_back(string_offset);
+
+    header.strings_offset = this->align();
+    header.strings_count = this->strings.size();
+    this->stream.write((char *)string_offsets.data(),
+                       string_offsets.size() * sizeof(std::uint64_t));
+
+    for (auto &str : this->strings) {
+      this->stream.write(str.data(), str.size());
+    }
+
+    header.blobs_offset = this->align();
+    header.blobs_count = this->blobs.size();
+    this->write_array(this->blobs);
+
+    header.threads_offset = this->align();
+    header.threads_count = this->threads.size();
+    this->write_array(this->threads);
+
+    this->stream.seekp(0);
+    this->stream.write((char *)&header, sizeof(header));
+    this->stream.close();
+
+    if (!this->stream) {
+      throw std::runtime_error("Could not write the binary results file");
+    }
+
+    this->finished = true;
+  }
+
+  /**
+     Constructs a ResultsFile object and memory-maps the file.
+
+     @param path The path to the file.
+
+     @throw std::runtime_error When the file cannot be read or is not
+                               a valid binary results file.
+  */
+  ResultsFile::ResultsFile(fs::path path) {
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+      throw std::runtime_error("Could not open " + path.string() + ": " +
+                               std::strerror(errno));
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < 0 ||
+        (std::size_t)st.st_size < sizeof(struct results::Header)) {
+      close(fd);
+      throw std::runtime_error(path.string() + " is not a binary results file");
+    }
+
+    this->size = st.st_size;
+    void *mapped = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("Could not map " + path.string() + ": " +
+                               std::strerror(errno));
+    }
+
+    this->data = (const char *)mapped;
+    this->header = (const struct results::Header *)this->data;
+
+    try {
+      if (std::memcmp(this->header->magic, RESULTS_MAGIC, sizeof(this->header->magic)) != 0 ||
+          this->header->byte_order != RESULTS_BYTE_ORDER) {
+        throw std::runtime_error(path.string() + " is not a binary results file "
+                                 "or has been written on a machine with "
+                                 "a different byte order");
+      }
+
+      if (this->header->version != RESULTS_VERSION) {
+        throw std::runtime_error(path.string() + " has an unsupported version " +
+                                 std::to_string(this->header->version));
+      }
+
+      // The string table has one offset more than there are strings
+      if (this->header->strings_count == UINT64_MAX) {
+        throw std::runtime_error("Binary results file is truncated or corrupted");
+      }
+
+      this->string_offsets = this->at<std::uint64_t>(this->header->strings_offset,
+                                                     this->header->strings_count + 1);
+      this->string_data = this->at<char>(this->header->strings_offset +
+                                         (this->header->strings_count + 1) *
+                                         sizeof(std::uint64_t),
+                                         this->string_offsets[this->header->strings_count]);
+      this->blobs = this->at<struct results::BlobEntry>(this->header->blobs_offset,
+                                                        this->header->blobs_count);
+      this->threads = this->at<struct results::ThreadEntry>(this->header->threads_offset,
+                                                            this->header->threads_count);
+    } catch (...) {
+      munmap((void *)this->data, this->size);
+      std::rethrow_exception(std::current_exception());
+    }
+  }
+
+  ResultsFile::~ResultsFile() {
+    munmap((void *)this->data, this->size);
+  }
+
+  template<typename T> const T *ResultsFile::at(std::uint64_t offset,
+                                                std::uint64_t count) {
+    if (offset > this->size || count > (this->size - offset) / sizeof(T)) {
+      throw std::runtime_error("Binary results file is truncated or corrupted");
+    }
+
+    return (const T *)(this->data + offset);
+  }
+
+  void ResultsFile::check_index(std::size_t index, std::uint64_t count) {
+    if (index >= count) {
+      throw std::runtime_error("Index " + std::to_string(index) +
+                               " is out of range of the binary results file");
+    }
+  }
+
+  /**
+     Gets a string from the string table.
+
+     @throw std::out_of_range When the ID is not known.
+  */
+  std::string_view ResultsFile::get_string(std::uint32_t id) {
+    if (id >= this->header->strings_count) {
+      throw std::out_of_range("Unknown string ID " + std::to_string(id));
+    }
+
+    return std::string_view(this->string_data + this->string_offsets[id],
+                            this->string_offsets[id + 1] - this->string_offsets[id]);
+  }
+
+  /**
+     Gets the number of files other than per-thread ones.
+  */
+  std::size_t ResultsFile::get_blob_count() {
+    return this->header->blobs_count;
+  }
+
+  /**
+     Gets the name of a file other than a per-thread one,
+     e.g. "metadata.json". Files are sorted by name.
+  */
+  std::string_view ResultsFile::get_blob_name(std::size_t index) {
+    this->check_index(index, this->header->blobs_count);
+    return this->get_string(this->blobs[index].name);
+  }
+
+  /**
+     Gets the contents of a file other than a per-thread one.
+  */
+  std::string_view ResultsFile::get_blob(std::size_t index) {
+    this->check_index(index, this->header->blobs_count);
+    return std::string_view(this->at<char>(this->blobs[index].offset,
+                                           this->blobs[index].size),
+                            this->blobs[index].size);
+  }
+
+  /**
+     Gets the index of a file other than a per-thread one by its name,
+     or RESULTS_NOT_FOUND if there is no such file.
+  */
+  std::size_t ResultsFile::find_blob(std::string_view name) {
+    const struct results::BlobEntry *end = this->blobs + this->header->blobs_count;
+    const struct results::BlobEntry *found =
+      std::lower_bound(this->blobs, end, name,
+                       [this](const struct results::BlobEntry &entry, std::string_view name) {
+                         return this->get_string(entry.name) < name;
+                       });
+
+    if (found == end || this->get_string(found->name) != name) {
+      return RESULTS_NOT_FOUND;
+    }
+
+    return found - this->blobs;
+  }
+
+  /**
+     Gets the number of threads.
+  */
+  std::size_t ResultsFile::get_thread_count() {
+    return this->header->threads_count;
+  }
+
+  /**
+     Gets the name ("<PID>_<TID>") of a thread. Threads are sorted by name.
+  */
+  std::string_view ResultsFile::get_thread_name(std::size_t index) {
+    this->check_index(index, this->header->threads_count);
+    return this->get_string(this->threads[index].name);
+  }
+
+  /**
+     Gets the index of a thread by its name ("<PID>_<TID>"),
+     or RESULTS_NOT_FOUND if there is no such thread.
+  */
+  std::size_t ResultsFile::find_thread(std::string_view name) {
+    const struct results::ThreadEntry *end = this->threads + this->header->threads_count;
+    const struct results::ThreadEntry *found =
+      std::lower_bound(this->threads, end, name,
+                       [this](const struct results::ThreadEntry &entry, std::string_view name) {
+                         return this->get_string(entry.name) < name;
+                       });
+
+    if (found == end || this->get_string(found->name) != name) {
+      return RESULTS_NOT_FOUND;
+    }
+
+    return found - this->threads;
+  }
+
+  /**
+     Gets the fields of a thread other than call trees, as
+     a JSON object serialised to a string.
+  */
+  std::string_view ResultsFile::get_thread_fields(std::size_t index) {
+    this->check_index(index, this->header->threads_count);
+    return std::string_view(this->at<char>(this->threads[index].fields_offset,
+                                           this->threads[index].fields_size),
+                            this->threads[index].fields_size);
+  }
+
+  /**
+     Gets the number of call trees of a thread.
+  */
+  std::size_t ResultsFile::get_tree_count(std::size_t thread) {
+    this->check_index(thread, this->header->threads_count);
+    return this->threads[thread].tree_count;
+  }
+
+  /**
+     Gets a call tree of a thread.
+
+     @param thread The index of the thread.
+     @param index  The index of the tree within the thread.
+  */
+  struct tree_view ResultsFile::get_tree(std::size_t thread, std::size_t index) {
+    this->check_index(thread, this->header->threads_count);
+    this->check_index(index, this->threads[thread].tree_count);
+
+    const struct results::TreeEntry &entry =
+      this->at<struct results::TreeEntry>(this->threads[thread].trees_offset,
+                                          this->threads[thread].tree_count)[index];
+
+    std::uint64_t n = entry.node_count;
+    std::uint64_t m = entry.offset_count;
+    std::uint64_t offset = entry.columns_offset;
+
+    // Every tree has at least the root node, and offset_starts
+    // has one element more than the other node columns
+    if (n == 0 || n == UINT64_MAX) {
+      throw std::runtime_error("Binary results file is truncated or corrupted");
+    }
+
+    struct tree_view view;
+    view.event_name = this->get_string(entry.event_name);
+    view.time_ordered = entry.time_ordered != 0;
+    view.node_count = n;
+
+    view.names = this->at<std::uint32_t>(offset, n);
+    offset = align_up(offset + n * sizeof(std::uint32_t));
+    view.values = this->at<std::uint64_t>(offset, n);
+    offset = align_up(offset + n * sizeof(std::uint64_t));
+    view.subtree_ends = this->at<std::uint32_t>(offset, n);
+    offset = align_up(offset + n * sizeof(std::uint32_t));
+    view.cold = this->at<std::uint8_t>(offset, n);
+    offset = align_up(offset + n * sizeof(std::uint8_t));
+    view.offset_starts = this->at<std::uint64_t>(offset, n + 1);
+    offset = align_up(offset + (n + 1) * sizeof(std::uint64_t));
+    view.offset_keys = this->at<std::uint32_t>(offset, m);
+    offset = align_up(offset + m * sizeof(std::uint32_t));
+    view.offset_values = this->at<std::uint64_t>(offset, m);
+
+    // The columns are walked without any further checks when the tree
+    // is written, so every subtree and every offset range must be
+    // within the columns
+    for (std::uint64_t i = 0; i < n; i++) {
+      if (view.subtree_ends[i] <= i || view.subtree_ends[i] > n ||
+          view.offset_starts[i] > view.offset_starts[i + 1]) {
+        throw std::runtime_error("Binary results file is truncated or corrupted");
+      }
+    }
+
+    if (view.offset_starts[n] > m) {
+      throw std::runtime_error("Binary results file is truncated or corrupted");
+    }
+
+    return view;
+  }
+
+  void ResultsFile::write_tree_json(std::ostream &stream, struct tree_view &tree,
+                                    std::uint64_t node) {
+    // The format is the same as the one of CallTree::write_json()
+    stream << "{\"children\":[";
+
+    for (std::uint64_t child = node + 1; child < tree.subtree_ends[node];
+         child = tree.subtree_ends[child]) {
+      if (child != node + 1) {
+        stream << ",";
+      }
+
+      this->write_tree_json(stream, tree, child);
+    }
+
+    stream << "],\"cold\":" << (tree.cold[node] ? "true" : "false");
+    stream << ",\"name\":" << nlohmann::json(this->get_string(tree.names[node]));
+
+    if (node > 0) {
+      stream << ",\"offsets\":{";
+
+      for (std::uint64_t i = tree.offset_starts[node];
+           i < tree.offset_starts[node + 1]; i++) {
+        if (i > tree.offset_starts[node]) {
+          stream << ",";
+        }
+
+        stream << nlohmann::json(this->get_string(tree.offset_keys[i])) << ":";
+        stream << tree.offset_values[i];
+      }
+
+      stream << "}";
+    }
+
+    stream << ",\"value\":" << tree.values[node] << "}";
+  }
+
+  /**
+     Writes a thread in the JSON format of processed/<pid_tid>.json.
+  */
+  void ResultsFile::write_thread_json(std::ostream &stream, std::size_t index) {
+    std::string_view fields = this->get_thread_fields(index);
+    bool first = true;
+
+    stream << "{";
+
+    // Only the contents of the object are needed, i.e. without
+    // the outer braces
+    if (fields.size() > 2) {
+      stream << fields.substr(1, fields.size() - 2);
+      first = false;
+    }
+
+    std::size_t tree_count = this->get_tree_count(index);
+
+    for (std::size_t i = 0; i < tree_count; i++) {
+      struct tree_view tree = this->get_tree(index, i);
+
+      if (i == 0 || tree.event_name != this->get_tree(index, i - 1).event_name) {
+        if (i > 0) {
+          stream << "]";
+        }
+
+        stream << (first ? "" : ",") << nlohmann::json(tree.event_name) << ":[";
+        first = false;
+      } else {
+        stream << ",";
+      }
+
+      this->write_tree_json(stream, tree, 0);
+    }
+
+    if (tree_count > 0) {
+      stream << "]";
+    }
+
+    stream << "}";
+  }
+
+  /**
+     Converts a "processed" result directory to a binary results file.
+
+     Every processed/<pid_tid>.json file becomes a thread, with every
+     field being a pair of call trees converted to columns. Every other
+     JSON file is stored verbatim. Files compressed with zstd
+     ("*.json.zst") are decompressed.
+
+     @param processed_dir The path to the "processed" directory.
+     @param output        The path to the binary results file.
+  */
+  void pack_results(fs::path processed_dir, fs::path output) {
+    std::vector<fs::path> paths;
+
+    // Files compressed with zstd are read as if they were uncompressed
+    for (auto &entry : fs::directory_iterator(processed_dir)) {
+      fs::path path = entry.path();
+
+      if (path.extension() == ZSTD_FILE_EXTENSION) {
+        path.replace_extension();
+      }
+
+      if (entry.is_regular_file() && path.extension() == ".json") {
+        paths.push_back(path);
+      }
+    }
+
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+    ResultsWriter writer(output);
+
+    for (auto &path : paths) {
+      std::string stem = path.stem().string();
+
+      if (!is_thread_result(stem)) {
+        writer.add_blob(path.filename().string(),
+                        std::string_view(read_processed_file(path)));
+        continue;
+      }
+
+      nlohmann::json thread = read_processed_json(path);
+      nlohmann::json fields = nlohmann::json::object();
+      std::vector<struct results_tree> trees;
+
+      for (auto &elem : thread.items()) {
+        nlohmann::json &value = elem.value();
+
+        if (value.is_array() && value.size() == 2 &&
+            is_tree(value[0]) && is_tree(value[1])) {
+          for (int i = 0; i < 2; i++) {
+            struct results_tree tree;
+            tree.event_name = elem.key();
+            tree.time_ordered = i == 1;
+            writer.tree_from_json(value[i], tree.columns);
+            trees.push_back(std::move(tree));
+          }
+        } else {
+          fields[elem.key()].swap(value);
+        }
+      }
+
+      writer.add_thread(stem, fields.dump(), trees);
+    }
+
+    writer.finish();
+  }
+
+  /**
+     Converts a binary results file back to JSON files in
+     a "processed" result directory.
+
+     @param input         The path to the binary results file.
+     @param processed_dir The path to the "processed" directory. It is
+                          created if it does not exist.
+  */
+  void unpack_results(fs::path input, fs::path processed_dir) {
+    ResultsFile file(input);
+    fs::create_directories(processed_dir);
+
+    for (std::size_t i = 0; i < file.get_blob_count(); i++) {
+      // Only plain file names are accepted, so that a crafted file
+      // cannot write outside the directory
+      fs::path name = fs::path(file.get_blob_name(i)).filename();
+      std::ofstream stream(processed_dir / name,
+                           std::ios::out | std::ios::binary);
+      std::string_view blob = file.get_blob(i);
+      stream.write(blob.data(), blob.size());
+    }
+
+    for (std::size_t i = 0; i < file.get_thread_count(); i++) {
+      std::string name(file.get_thread_name(i));
+      std::ofstream stream(processed_dir / (name + ".json"));
+      file.write_thread_json(stream, i);
+      stream << std::endl;
+    }
+  }
+};
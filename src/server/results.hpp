@@ -0,0 +1,225 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef RESULTS_HPP_
+#define RESULTS_HPP_
+
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#define RESULTS_MAGIC "ADPTRES"
+#define RESULTS_VERSION 1
+#define RESULTS_FILE_NAME "results.bin"
+#define RESULTS_NOT_FOUND SIZE_MAX
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  /**
+     A namespace describing the binary results format, i.e. a single
+     file storing everything normally saved as JSON files in the
+     "processed" result directory, which can be memory-mapped and read
+     without any parsing.
+
+     All integers are in the host byte order (checked by the reader
+     through results::Header::byte_order) and every section starts
+     at an offset aligned to 8 bytes. The file consists of:
+     * the header (see Header) at offset 0;
+     * the string table: (string count + 1) 64-bit offsets of
+       the strings relative to the end of the offset array, followed
+       by the concatenated strings (not null-terminated);
+     * the blob index: BlobEntry per non-per-thread JSON file (e.g.
+       metadata.json), sorted by name, with the file contents stored
+       verbatim elsewhere in the file;
+     * the thread index: ThreadEntry per processed/<pid_tid>.json
+       file, sorted by name. Fields other than call trees are stored
+       as JSON text, call trees are described by TreeEntry arrays;
+     * the call trees, stored column-wise (see TreeEntry).
+
+     Names of files, threads, event types, tree nodes, and offsets
+     are IDs in the string table.
+  */
+  namespace results {
+    struct Header {
+      char magic[8];
+      std::uint32_t version;
+      std::uint32_t byte_order;
+      std::uint64_t strings_offset;
+      std::uint64_t strings_count;
+      std::uint64_t blobs_offset;
+      std::uint64_t blobs_count;
+      std::uint64_t threads_offset;
+      std::uint64_t threads_count;
+    };
+
+    struct BlobEntry {
+      std::uint32_t name;
+      std::uint32_t reserved;
+      std::uint64_t offset;
+      std::uint64_t size;
+    };
+
+    struct ThreadEntry {
+      std::uint32_t name;
+      std::uint32_t tree_count;
+      std::uint64_t fields_offset;
+      std::uint64_t fields_size;
+      std::uint64_t trees_offset;
+    };
+
+    /**
+       A structure describing a call tree stored in the binary results
+       format.
+
+       Nodes are in pre-order, so the root is node 0 and the children
+       of node i are i + 1, subtree_ends[i + 1], subtree_ends[subtree_ends[i + 1]]
+       etc. until subtree_ends[i] is reached. Starting from columns_offset,
+       the following arrays are stored, each padded to 8 bytes:
+       * names (32-bit string IDs, node_count elements);
+       * values (64-bit, node_count elements);
+       * subtree_ends (32-bit, node_count elements);
+       * cold (8-bit, 0 or 1, node_count elements);
+       * offset_starts (64-bit, node_count + 1 elements): the offsets
+         of node i are offset_starts[i] to offset_starts[i + 1] - 1;
+       * offset_keys (32-bit string IDs, offset_count elements);
+       * offset_values (64-bit, offset_count elements).
+    */
+    struct TreeEntry {
+      std::uint32_t event_name;
+      std::uint32_t time_ordered;
+      std::uint64_t node_count;
+      std::uint64_t offset_count;
+      std::uint64_t columns_offset;
+    };
+  };
+
+  /**
+     A structure describing the columns of a call tree to be
+     saved in the binary results format (see results::TreeEntry).
+  */
+  struct tree_columns {
+    std::vector<std::uint32_t> names;
+    std::vector<std::uint64_t> values;
+    std::vector<std::uint32_t> subtree_ends;
+    std::vector<std::uint8_t> cold;
+    std::vector<std::uint64_t> offset_starts;
+    std::vector<std::uint32_t> offset_keys;
+    std::vector<std::uint64_t> offset_values;
+  };
+
+  /**
+     A structure describing a call tree to be saved as a part of
+     a thread in the binary results format.
+  */
+  struct results_tree {
+    std::string event_name;
+    bool time_ordered;
+    struct tree_columns columns;
+  };
+
+  /**
+     A structure describing a read-only view of a call tree
+     in a memory-mapped binary results file.
+  */
+  struct tree_view {
+    std::string_view event_name;
+    bool time_ordered;
+    std::uint64_t node_count;
+    const std::uint32_t *names;
+    const std::uint64_t *values;
+    const std::uint32_t *subtree_ends;
+    const std::uint8_t *cold;
+    const std::uint64_t *offset_starts;
+    const std::uint32_t *offset_keys;
+    const std::uint64_t *offset_values;
+  };
+
+  /**
+     A thread-safe class writing a binary results file.
+
+     Blobs and threads are written as soon as they are added, while
+     the string table and the indices are kept in memory until finish()
+     is called.
+  */
+  class ResultsWriter {
+  private:
+    std::ofstream stream;
+    std::mutex mutex;
+    std::mutex strings_mutex;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, std::uint32_t> string_ids;
+    std::vector<struct results::BlobEntry> blobs;
+    std::vector<struct results::ThreadEntry> threads;
+    bool finished;
+
+    std::uint64_t align();
+    template<typename T> void write_array(const std::vector<T> &data);
+    std::uint64_t write_tree(struct results_tree &tree);
+
+  public:
+    ResultsWriter(fs::path path);
+    ~ResultsWriter();
+    std::uint32_t intern(const std::string &str);
+    void add_blob(const std::string &name, std::string_view data);
+    void add_blob(const std::string &name, fs::path path);
+    void add_thread(const std::string &name, const std::string &fields,
+                    std::vector<struct results_tree> &trees);
+    void tree_from_json(nlohmann::json &tree, struct tree_columns &columns);
+    void finish();
+  };
+
+  /**
+     A class reading a binary results file through mmap.
+
+     Any thread, blob, or tree is accessed in O(1) by its index (or
+     in O(log n) by its name), without reading the rest of the file.
+  */
+  class ResultsFile {
+  private:
+    const char *data;
+    std::size_t size;
+    const struct results::Header *header;
+    const std::uint64_t *string_offsets;
+    const char *string_data;
+    const struct results::BlobEntry *blobs;
+    const struct results::ThreadEntry *threads;
+
+    template<typename T> const T *at(std::uint64_t offset, std::uint64_t count);
+    void check_index(std::size_t index, std::uint64_t count);
+    void write_tree_json(std::ostream &stream, struct tree_view &tree,
+                         std::uint64_t node);
+
+  public:
+    ResultsFile(fs::path path);
+    ~ResultsFile();
+    ResultsFile(const ResultsFile &) = delete;
+    ResultsFile &operator=(const ResultsFile &) = delete;
+    std::string_view get_string(std::uint32_t id);
+    std::size_t get_blob_count();
+    std::string_view get_blob_name(std::size_t index);
+    std::string_view get_blob(std::size_t index);
+    std::size_t find_blob(std::string_view name);
+    std::size_t get_thread_count();
+    std::string_view get_thread_name(std::size_t index);
+    std::size_t find_thread(std::string_view name);
+    std::string_view get_thread_fields(std::size_t index);
+    std::size_t get_tree_count(std::size_t thread);
+    struct tree_view get_tree(std::size_t thread, std::size_t index);
+    void write_thread_json(std::ostream &stream, std::size_t index);
+  };
+
+  bool is_thread_result(const std::string &stem);
+  void pack_results(fs::path processed_dir, fs::path output);
+  void unpack_results(fs::path input, fs::path processed_dir);
+};
+
+#endif
@@ -2,43 +2,59 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "server.hpp"
-#include <future>
+#include <algorithm>
 #include <iostream>
-#include <chrono>
+#include <fstream>
+#include <regex>
 
 namespace adaptyst {
-  using namespace std::chrono_literals;
-
   /**
      Constructs a Server object.
 
      @param acceptor             An acceptor for accepting new initial
                                  connections from the frontend.
      @param max_connections      A maximum number of simultaneous
-                                 connections to be handled by the server.
-                                 Use 0 to finish after the first connection
-                                 is completed.
+                                 connections to be handled by the server,
+                                 which is also the number of its worker
+                                 threads running sessions. Use 0 to finish
+                                 after the first connection is completed.
      @param buf_size             A buffer size for communication, in
                                  bytes.
      @param file_timeout_seconds A maximum number of seconds every client
                                  spawned by the server can wait for a next
                                  packet of data during file transfer between
                                  the client and the frontend.
+     @param max_queued           A maximum number of connections waiting
+                                 for a free slot when max_connections
+                                 connections are already handled. Any further
+                                 connections are rejected with "try_again".
   */
   Server::Server(std::unique_ptr<Acceptor> &acceptor,
                  unsigned int max_connections,
                  unsigned int buf_size,
-                 unsigned long long file_timeout_seconds) {
+                 unsigned long long file_timeout_seconds,
+                 unsigned int max_queued) {
     this->acceptor = std::move(acceptor);
     this->max_connections = max_connections;
+    this->max_queued = max_queued;
     this->buf_size = buf_size;
     this->file_timeout_seconds = file_timeout_seconds;
     this->interrupted = false;
+    this->next_seq = 0;
+    this->stats = {0, 0, 0, 0, 0, 0, 0};
   }
 
   /**
      Starts the server processing loop.
 
+     Every new connection may start with a "hello <priority>" line, in
+     which case the frontend is sent "queued <position>" whenever its
+     position in the admission queue changes and "admitted" when its
+     session starts. Sessions with a higher priority are started first,
+     and sessions with the same priority are started in the order of
+     arrival. Connections starting with anything else are queued with
+     priority 0 without any notifications.
+
      @param client_factory        A factory used for spawning new clients.
      @param file_acceptor_factory A factory used for spawning acceptors for
                                   establishing connections for file transfer
@@ -47,49 +63,52 @@ namespace adaptyst {
   void Server::run(std::unique_ptr<Client::Factory> &client_factory,
                    std::unique_ptr<Acceptor::Factory> &file_acceptor_factory) {
     try {
-      std::vector<std::unique_ptr<Client> > clients;
-      std::vector<std::future<void> > threads;
+      // Sessions are run by a fixed number of worker threads. A client
+      // (along with its file acceptor) is destroyed as soon as its
+      // session finishes, so that a long-running server does not
+      // accumulate threads, sockets, or memory.
+      WorkerPool pool(std::max(1U, this->max_connections));
 
-      while (!interrupted) {
-        std::unique_ptr<Connection> connection =
-          this->acceptor->accept(this->buf_size);
+      // The first lines of new connections are read by separate threads,
+      // so that a frontend which is slow to send it does not hold up
+      // accepting the others
+      WorkerPool handshakes(SERVER_HANDSHAKE_THREADS);
 
-        int working_count = 0;
-        for (int i = 0; i < threads.size(); i++) {
-          if (threads[i].wait_for(0ms) != std::future_status::ready) {
-            working_count++;
-          }
-        }
+      while (!this->interrupted) {
+        std::unique_ptr<Connection> connection;
 
-        if (working_count >= std::max(1U, this->max_connections)) {
-          connection->write("try_again", true);
-        } else {
-          std::unique_ptr<Acceptor> file_acceptor =
-            file_acceptor_factory->make_acceptor(UNLIMITED_ACCEPTED);
-
-          clients.push_back(client_factory->make_client(connection,
-                                                        file_acceptor,
-                                                        this->file_timeout_seconds));
+        try {
+          connection = this->acceptor->accept(this->buf_size,
+                                              SERVER_ACCEPT_TIMEOUT);
+        } catch (TimeoutException &e) {
+          // This lets interrupt() take effect without any new connection
+          continue;
+        }
 
-          Client *client = clients.back().get();
-          threads.push_back(std::async([client]() { client->process(); }));
+        std::shared_ptr<struct pending_frontend> frontend =
+          std::make_shared<struct pending_frontend>();
+        frontend->connection = std::move(connection);
+        frontend->notify = false;
+        frontend->position = 0;
+        frontend->last_position = 0;
 
-          if (this->max_connections == 0) {
+        if (this->max_connections == 0) {
+          if (this->admit(frontend, pool, *client_factory,
+                          *file_acceptor_factory)) {
             break;
           }
-        }
-      }
-
-      for (int i = 0; i < threads.size(); i++) {
-        try {
-          threads[i].get();
-        } catch (adaptyst::ConnectionException &e) {
-          std::cerr << "Warning: Connection error in client " << i << ", you will not ";
-          std::cerr << "get reliable results from them!" << std::endl;
 
-          std::cerr << "Error details: " << e.what() << std::endl;
+          continue;
         }
+
+        handshakes.submit([this, frontend, &pool, &client_factory,
+                           &file_acceptor_factory]() {
+          this->admit(frontend, pool, *client_factory, *file_acceptor_factory);
+        });
       }
+
+      handshakes.wait();
+      pool.wait();
     } catch (adaptyst::AlreadyInUseException &e) {
       throw e;
     } catch (adaptyst::ConnectionException &e) {
@@ -99,11 +118,301 @@ namespace adaptyst {
     }
   }
 
+  /**
+     Reads the first line of a new connection and puts the connection
+     in the admission queue, starting queued sessions if there are free
+     worker threads. The connection is sent "try_again" instead if
+     the queue is full or the server has been interrupted.
+
+     @param frontend              A new connection.
+     @param pool                  A pool of worker threads running sessions.
+     @param client_factory        A factory used for spawning new clients.
+     @param file_acceptor_factory A factory used for spawning acceptors for
+                                  file transfer.
+
+     @return Whether the connection has been queued.
+  */
+  bool Server::admit(std::shared_ptr<struct pending_frontend> frontend,
+                     WorkerPool &pool,
+                     Client::Factory &client_factory,
+                     Acceptor::Factory &file_acceptor_factory) {
+    int priority = 0;
+
+    try {
+      std::string_view line;
+
+      if (!frontend->connection->read_line(line, SERVER_HELLO_TIMEOUT)) {
+        return false;
+      }
+
+      std::string first_line(line);
+      std::smatch match;
+
+      if (std::regex_match(first_line, match,
+                           std::regex("^hello (-?\\d{1,9})$"))) {
+        priority = std::stoi(match[1]);
+        frontend->notify = true;
+      } else {
+        frontend->connection =
+          std::make_unique<PrefixedConnection>(std::move(frontend->connection),
+                                               first_line);
+      }
+    } catch (TimeoutException &e) {
+      return false;
+    } catch (ConnectionException &e) {
+      return false;
+    }
+
+    std::vector<std::shared_ptr<struct pending_frontend> > to_notify;
+
+    {
+      std::lock_guard lock(this->admission_mutex);
+
+      if (this->interrupted ||
+          (this->stats.running >= pool.get_thread_count() &&
+           this->queue.size() >= this->max_queued)) {
+        this->stats.rejected++;
+        this->save_stats();
+      } else {
+        // The queue is kept sorted by priority (descending), with
+        // the arrival order preserved within the same priority
+        auto it = std::find_if(this->queue.begin(), this->queue.end(),
+                               [priority](auto &session) {
+                                 return session.priority < priority;
+                               });
+
+        this->queue.insert(it, {priority, this->next_seq++,
+                                std::chrono::steady_clock::now(),
+                                frontend});
+
+        this->stats.max_queued = std::max(this->stats.max_queued,
+                                          (unsigned int)this->queue.size());
+
+        to_notify = this->start_sessions(pool, client_factory,
+                                         file_acceptor_factory);
+        frontend.reset();
+      }
+    }
+
+    if (frontend != nullptr) {
+      try {
+        frontend->connection->write("try_again", true);
+      } catch (ConnectionException &e) {
+        // The frontend has disconnected already
+      }
+
+      return false;
+    }
+
+    this->notify_queue_positions(to_notify);
+    return true;
+  }
+
+  /**
+     Starts queued sessions while there are free worker threads and
+     updates the positions of the remaining ones.
+
+     This must be called with admission_mutex locked. Nothing is sent
+     to the frontends here, so that a slow frontend cannot hold up
+     admission: the returned frontends should be passed to
+     notify_queue_positions() after admission_mutex is unlocked.
+
+     @return The frontends whose positions in the queue have changed
+             and which have asked for notifications.
+  */
+  std::vector<std::shared_ptr<struct Server::pending_frontend> >
+  Server::start_sessions(WorkerPool &pool,
+                         Client::Factory &client_factory,
+                         Acceptor::Factory &file_acceptor_factory) {
+    while (!this->queue.empty() &&
+           this->stats.running < pool.get_thread_count()) {
+      struct queued_session session = std::move(this->queue.front());
+      this->queue.erase(this->queue.begin());
+
+      unsigned long long wait_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - session.enqueue_time).count();
+
+      this->stats.admitted++;
+      this->stats.total_wait_ms += wait_ms;
+      this->stats.max_wait_ms = std::max(this->stats.max_wait_ms, wait_ms);
+
+      // The connection is taken from the frontend under its mutex, so
+      // that no "queued <position>" can be sent after this point
+      std::unique_ptr<Connection> connection;
+
+      {
+        std::lock_guard frontend_lock(session.frontend->mutex);
+        connection = std::move(session.frontend->connection);
+      }
+
+      bool notify = session.frontend->notify;
+
+      // The client owns the connection, which stays alive until
+      // the client is destroyed at the end of the session
+      Connection *client_connection = connection.get();
+
+      try {
+        std::unique_ptr<Acceptor> file_acceptor =
+          file_acceptor_factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+        std::shared_ptr<Client> client =
+          client_factory.make_client(connection,
+                                     file_acceptor,
+                                     this->file_timeout_seconds);
+
+        unsigned long long id = session.seq;
+        this->stats.running++;
+
+        pool.submit([this, client, client_connection, notify, id, &pool,
+                     &client_factory, &file_acceptor_factory]() mutable {
+          try {
+            if (notify) {
+              client_connection->write("admitted", true);
+            }
+
+            client->process();
+          } catch (adaptyst::ConnectionException &e) {
+            std::cerr << "Warning: Connection error in client " << id << ", you will not ";
+            std::cerr << "get reliable results from them!" << std::endl;
+
+            std::cerr << "Error details: " << e.what() << std::endl;
+          } catch (std::exception &e) {
+            std::cerr << "Error in client " << id << ": " << e.what() << std::endl;
+          }
+
+          client.reset();
+
+          // The slot is free now, so the next queued session
+          // can start straight away
+          std::vector<std::shared_ptr<struct pending_frontend> > to_notify;
+
+          {
+            std::lock_guard lock(this->admission_mutex);
+            this->stats.running--;
+            to_notify = this->start_sessions(pool, client_factory,
+                                             file_acceptor_factory);
+          }
+
+          this->notify_queue_positions(to_notify);
+        });
+      } catch (ConnectionException &e) {
+        std::cerr << "Could not start a queued session: " << e.what() << std::endl;
+      }
+    }
+
+    std::vector<std::shared_ptr<struct pending_frontend> > to_notify;
+
+    for (unsigned int i = 0; i < this->queue.size(); i++) {
+      struct queued_session &session = this->queue[i];
+
+      if (session.frontend->position.exchange(i + 1) != i + 1 &&
+          session.frontend->notify) {
+        to_notify.push_back(session.frontend);
+      }
+    }
+
+    this->save_stats();
+    return to_notify;
+  }
+
+  /**
+     Sends "queued <position>" to every given frontend whose position
+     in the admission queue has changed since it was last notified.
+     Frontends whose sessions have already started are skipped.
+
+     This must be called with admission_mutex unlocked.
+
+     @param frontends The frontends returned by start_sessions().
+  */
+  void Server::notify_queue_positions(std::vector<std::shared_ptr<struct pending_frontend> > &frontends) {
+    for (auto &frontend : frontends) {
+      // The position is read under the frontend mutex, so that
+      // a stale position cannot be sent after a newer one
+      std::lock_guard lock(frontend->mutex);
+      unsigned int position = frontend->position;
+
+      if (frontend->connection == nullptr ||
+          position == frontend->last_position) {
+        continue;
+      }
+
+      frontend->last_position = position;
+
+      try {
+        frontend->connection->write("queued " + std::to_string(position), true);
+      } catch (ConnectionException &e) {
+        // A disconnected frontend is dropped when its session starts
+      }
+    }
+  }
+
+  /**
+     Saves the admission queue statistics as JSON to the path set by
+     set_stats_path(), if any. The file is replaced atomically.
+
+     This must be called with admission_mutex locked.
+  */
+  void Server::save_stats() {
+    if (this->stats_path.empty()) {
+      return;
+    }
+
+    this->stats.queued = this->queue.size();
+
+    nlohmann::json json;
+    json["queued"] = this->stats.queued;
+    json["running"] = this->stats.running;
+    json["max_queued"] = this->stats.max_queued;
+    json["admitted"] = this->stats.admitted;
+    json["rejected"] = this->stats.rejected;
+    json["total_wait_ms"] = this->stats.total_wait_ms;
+    json["max_wait_ms"] = this->stats.max_wait_ms;
+    json["avg_wait_ms"] = this->stats.admitted == 0 ? 0 :
+      this->stats.total_wait_ms / this->stats.admitted;
+
+    fs::path tmp_path = this->stats_path;
+    tmp_path += ".tmp";
+
+    std::ofstream stream(tmp_path);
+
+    if (!stream) {
+      std::cerr << "Could not save the admission queue statistics to ";
+      std::cerr << tmp_path << "!" << std::endl;
+      return;
+    }
+
+    stream << json << std::endl;
+    stream.close();
+
+    std::error_code error;
+    fs::rename(tmp_path, this->stats_path, error);
+  }
+
+  /**
+     Sets the path where the admission queue statistics are saved
+     as JSON every time they change (see get_stats()).
+  */
+  void Server::set_stats_path(fs::path path) {
+    std::lock_guard lock(this->admission_mutex);
+    this->stats_path = path;
+  }
+
+  /**
+     Gets the current admission queue statistics.
+  */
+  struct admission_stats Server::get_stats() {
+    std::lock_guard lock(this->admission_mutex);
+    this->stats.queued = this->queue.size();
+    return this->stats;
+  }
+
   /**
      Interrupts the server processing loop.
 
-     After calling interrupt(), no new initial connections will be accepted, but
-     all the existing ones will carry executing until their completion.
+     After calling interrupt(), no new initial connections will be accepted
+     (and the ones which have not been queued yet will be sent "try_again"),
+     but all the existing ones will carry executing until their completion.
   */
   void Server::interrupt() {
     this->interrupted = true;
@@ -5,11 +5,55 @@
 #define SERVER_HPP_
 
 #include "socket.hpp"
+#include "calltree.hpp"
+#include "results.hpp"
+#include "zstdfile.hpp"
+#include "spill.hpp"
+#include "snapshot.hpp"
+#include "pool.hpp"
 #include <nlohmann/json.hpp>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <string>
 #include <vector>
+#include <filesystem>
+
+#ifndef MAX_FILE_STREAMS
+#define MAX_FILE_STREAMS 64
+#endif
+
+// The maximum time Server::run() waits for a new connection
+// before checking whether it has been interrupted, in seconds.
+#ifndef SERVER_ACCEPT_TIMEOUT
+#define SERVER_ACCEPT_TIMEOUT 1
+#endif
+
+// The maximum time Server::run() waits for the first line
+// of a new connection, in seconds.
+#ifndef SERVER_HELLO_TIMEOUT
+#define SERVER_HELLO_TIMEOUT 5
+#endif
+
+// The number of threads Server::run() uses for reading the first
+// lines of new connections.
+#ifndef SERVER_HANDSHAKE_THREADS
+#define SERVER_HANDSHAKE_THREADS 4
+#endif
+
+// The size of the output buffer used for writing every
+// processed/<pid_tid>.json file, in bytes.
+#ifndef JSON_WRITE_BUFFER_SIZE
+#define JSON_WRITE_BUFFER_SIZE 1048576
+#endif
+
+// The estimated number of bytes taken by one call tree node or
+// one other JSON element in a processed/<pid_tid>.json file, used
+// for scheduling the file writes.
+#ifndef JSON_ELEM_SIZE_ESTIMATE
+#define JSON_ELEM_SIZE_ESTIMATE 48
+#endif
 
 namespace adaptyst {
   /**
@@ -37,7 +81,8 @@ namespace adaptyst {
     class Factory {
     public:
       /**
-         Makes a Client-derived object.
+         Makes a Client-derived object. The client takes ownership of
+         the connection and the file acceptor.
 
          @param connection           A connection used for communicating between the
                                      client and the frontend.
@@ -80,6 +125,88 @@ namespace adaptyst {
                      should be stored. It can be null.
     */
     virtual bool get_profile_start_tstamp(unsigned long long *tstamp) = 0;
+
+    /**
+       Gets the time point of the server steady clock when the client has
+       been told that profiling has started and saves it to the variable
+       referenced by time if time is not null.
+
+       Returns false if profiling hasn't started yet, true otherwise.
+
+       The value referenced by time is unchanged if false is returned or
+       time is null.
+
+       @param time A pointer to the variable where the profiling start
+                   time point should be stored. It can be null.
+    */
+    virtual bool get_profile_start_time(std::chrono::steady_clock::time_point *time) = 0;
+
+    /**
+       Gets the symbol table shared by all subclients of the client.
+    */
+    virtual SymbolTable &get_symbol_table() = 0;
+
+    /**
+       Gets the compression codec negotiated with the frontend for
+       the profiling session ("zstd" or "none"). Subclient and file
+       transfer connections may be compressed only if it is not "none".
+    */
+    virtual std::string get_compression() = 0;
+
+    /**
+       Gets the memory budget shared by the call trees of all subclients
+       of the client, which spill them to disk when it is exceeded.
+    */
+    virtual MemoryBudget &get_memory_budget() = 0;
+
+    /**
+       Gets the interval between partial-result snapshots taken by
+       subclients during profiling, in seconds. 0 means that no snapshots
+       should be taken.
+
+       Subclients check whether a snapshot is due only while processing
+       samples (every SPILL_CHECK_INTERVAL samples), so snapshots can be
+       late and a subclient whose stream is idle takes no snapshots
+       until it receives enough new samples.
+    */
+    virtual unsigned int get_snapshot_interval() = 0;
+
+    /**
+       Saves a partial-result snapshot of a subclient without waiting
+       for it to be written (see snapshot.hpp for the format).
+
+       @param index    The number of the snapshot, i.e. the number of
+                       snapshot intervals elapsed since the start of
+                       profiling (see get_profile_start_time()), so
+                       that the snapshots of all subclients with
+                       the same index are taken at about the same time.
+       @param snapshot The snapshot without the "symbols" field, which
+                       is filled in by the client. It is moved from.
+    */
+    virtual void save_snapshot(unsigned int index, nlohmann::json &snapshot) = 0;
+  };
+
+  /**
+     A structure describing a pair of call trees (non-time-ordered
+     and time-ordered) of one event type in one thread, to be saved
+     as the "<event_name>" field of processed/<pid_tid>.json.
+
+     If spill_path is not empty, both trees are empty and must be
+     loaded from there first (see load_spilled_trees()).
+
+     A thread may have been moved between subclients during profiling,
+     in which case every subclient produces trees covering a part of
+     its samples. The parts are ordered by the timestamps of their first
+     samples and merged by the client (see CallTree::merge()).
+  */
+  struct thread_trees {
+    std::string msg_key;
+    std::string pid_tid;
+    std::string event_name;
+    CallTree output;
+    CallTree output_time_ordered;
+    fs::path spill_path;
+    unsigned long long first_time;
   };
 
   /**
@@ -131,6 +258,17 @@ namespace adaptyst {
     */
     virtual nlohmann::json &get_result() = 0;
 
+    /**
+       Moves the call trees produced after the call to process() finishes
+       to a given vector, so that they can be written to files directly
+       rather than converted to JSON. The moved trees are not part of
+       get_result() any longer.
+
+       The default implementation moves nothing, i.e. all trees are
+       returned by get_result().
+    */
+    virtual void take_trees(std::vector<struct thread_trees> & /* trees */) { }
+
     /**
        Gets a string describing how the frontend should connect to the
        subclient.
@@ -198,6 +336,12 @@ namespace adaptyst {
     virtual void process(fs::path working_dir) = 0;
     virtual void notify() = 0;
     virtual bool get_profile_start_tstamp(unsigned long long *tstamp) = 0;
+    virtual bool get_profile_start_time(std::chrono::steady_clock::time_point *time) = 0;
+    virtual SymbolTable &get_symbol_table() = 0;
+    virtual std::string get_compression() = 0;
+    virtual MemoryBudget &get_memory_budget() = 0;
+    virtual unsigned int get_snapshot_interval() = 0;
+    virtual void save_snapshot(unsigned int index, nlohmann::json &snapshot) = 0;
   };
 
   /**
@@ -208,17 +352,21 @@ namespace adaptyst {
   */
   class StdSubclient : public InitSubclient {
   private:
+    // The identifier of the subclient, unique within the server
+    // process, distinguishing the snapshots of the trees of
+    // the same thread made by different subclients
+    unsigned long long id;
+
     nlohmann::json json_result;
 
+    // Call trees which still need to be either converted to JSON
+    // and put into the result or taken by take_trees()
+    std::vector<struct thread_trees> pending;
+
     StdSubclient(Client &context,
                  std::unique_ptr<Acceptor> &acceptor,
                  std::string profiled_filename,
                  unsigned int buf_size);
-    void recurse(nlohmann::json &cur_elem,
-                 std::vector<std::pair<std::string, std::string> > &callchain_parts,
-                 int callchain_index,
-                 unsigned long long period,
-                 bool time_ordered, bool offcpu);
 
   public:
     /**
@@ -256,6 +404,7 @@ namespace adaptyst {
 
     void process();
     nlohmann::json &get_result();
+    void take_trees(std::vector<struct thread_trees> &trees);
   };
 
   /**
@@ -271,11 +420,33 @@ namespace adaptyst {
     std::condition_variable accepted_cond;
     bool profile_start;
     unsigned long long profile_start_tstamp;
+    std::chrono::steady_clock::time_point profile_start_time;
+    SymbolTable symbols;
+    std::string compression;
+    std::shared_ptr<WriterPool> writer_pool;
+    bool binary_results;
+    int output_compression;
+    MemoryBudget memory_budget;
+    unsigned int snapshot_interval;
+    fs::path snapshot_path;
+    std::mutex snapshot_mutex;
+    std::uint32_t snapshot_symbols;
+    unsigned long long snapshot_files;
+    std::vector<std::future<void> > snapshot_futures;
+
+    std::vector<std::string> receive_file_stream(std::unique_ptr<Connection> &file_connection,
+                                                 std::filesystem::path processed_path,
+                                                 std::filesystem::path out_path);
 
     StdClient(std::shared_ptr<Subclient::Factory> &subclient_factory,
               std::unique_ptr<Connection> &connection,
               std::unique_ptr<Acceptor> &file_acceptor,
-              unsigned long long file_timeout_seconds);
+              unsigned long long file_timeout_seconds,
+              std::shared_ptr<WriterPool> &writer_pool,
+              bool binary_results,
+              int output_compression,
+              std::size_t memory_budget,
+              unsigned int snapshot_interval);
 
   public:
     /**
@@ -284,16 +455,54 @@ namespace adaptyst {
     class Factory : public Client::Factory {
     private:
       std::shared_ptr<Subclient::Factory> factory;
+      std::shared_ptr<WriterPool> writer_pool;
+      bool binary_results;
+      int output_compression;
+      std::size_t memory_budget;
+      unsigned int snapshot_interval;
 
     public:
       /**
          Constructs a StdClient::Factory object.
 
-         @param factory A Subclient factory for spawning new
-                        subclients by the client.
+         @param factory        A Subclient factory for spawning new
+                               subclients by the client.
+         @param writer_threads The number of threads writing processed
+                               output files, shared by all clients made
+                               by the factory. 0 means the number of
+                               CPU cores.
+         @param binary_results Whether clients should also save all
+                               processed results as a single file in
+                               the binary results format (see results.hpp).
+         @param output_compression
+                               The zstd compression level of processed
+                               result files (with ".zst" appended to their
+                               names), 0 meaning no compression. The frontend
+                               can override it for its session. It must be 0
+                               if compiled without libzstd.
+         @param memory_budget  The maximum estimated number of bytes the
+                               call trees of a single client may take in
+                               memory before the least recently sampled
+                               ones are spilled to disk, 0 meaning
+                               no limit (see MemoryBudget).
+         @param snapshot_interval
+                               The interval between partial-result snapshots
+                               saved by clients during profiling to
+                               processed/snapshots, in seconds. 0 means
+                               that no snapshots are saved.
       */
-      Factory(std::unique_ptr<Subclient::Factory> &factory) {
+      Factory(std::unique_ptr<Subclient::Factory> &factory,
+              unsigned int writer_threads = 0,
+              bool binary_results = false,
+              int output_compression = 0,
+              std::size_t memory_budget = 0,
+              unsigned int snapshot_interval = 0) {
         this->factory = std::move(factory);
+        this->writer_pool = std::make_shared<WriterPool>(writer_threads);
+        this->binary_results = binary_results;
+        this->output_compression = output_compression;
+        this->memory_budget = memory_budget;
+        this->snapshot_interval = snapshot_interval;
       }
 
       std::unique_ptr<Client> make_client(std::unique_ptr<Connection> &connection,
@@ -303,13 +512,49 @@ namespace adaptyst {
           StdClient>(new StdClient(this->factory,
                                    connection,
                                    file_acceptor,
-                                   file_timeout_seconds));
+                                   file_timeout_seconds,
+                                   this->writer_pool,
+                                   this->binary_results,
+                                   this->output_compression,
+                                   this->memory_budget,
+                                   this->snapshot_interval));
       }
     };
 
     void process(fs::path working_dir);
     void notify();
     bool get_profile_start_tstamp(unsigned long long *tstamp);
+    bool get_profile_start_time(std::chrono::steady_clock::time_point *time);
+    SymbolTable &get_symbol_table();
+    std::string get_compression();
+    MemoryBudget &get_memory_budget();
+    unsigned int get_snapshot_interval();
+    void save_snapshot(unsigned int index, nlohmann::json &snapshot);
+  };
+
+  /**
+     A structure describing the statistics of the admission queue
+     of the server.
+  */
+  struct admission_stats {
+    // The number of sessions currently waiting in the queue
+    unsigned int queued;
+
+    // The number of sessions currently running
+    unsigned int running;
+
+    // The largest number of sessions waiting in the queue at once
+    unsigned int max_queued;
+
+    // The number of sessions started so far
+    unsigned long long admitted;
+
+    // The number of sessions rejected because the queue was full
+    unsigned long long rejected;
+
+    // The total and the longest time sessions have spent in the queue
+    unsigned long long total_wait_ms;
+    unsigned long long max_wait_ms;
   };
 
   /**
@@ -319,20 +564,59 @@ namespace adaptyst {
   */
   class Server {
   private:
+    // A connection from a frontend waiting for its session. It is
+    // shared with threads sending "queued <position>" outside
+    // admission_mutex, so the connection is guarded by its own mutex
+    // and is taken away when the session starts.
+    struct pending_frontend {
+      std::mutex mutex;
+      std::unique_ptr<Connection> connection;
+      bool notify;
+      std::atomic<unsigned int> position;
+      unsigned int last_position;
+    };
+
+    struct queued_session {
+      int priority;
+      unsigned long long seq;
+      std::chrono::steady_clock::time_point enqueue_time;
+      std::shared_ptr<struct pending_frontend> frontend;
+    };
+
     std::unique_ptr<Acceptor> acceptor;
     unsigned int max_connections;
+    unsigned int max_queued;
     unsigned int buf_size;
     unsigned long long file_timeout_seconds;
-    bool interrupted;
+    std::atomic<bool> interrupted;
+    std::mutex admission_mutex;
+    std::vector<struct queued_session> queue;
+    unsigned long long next_seq;
+    struct admission_stats stats;
+    fs::path stats_path;
+
+    bool admit(std::shared_ptr<struct pending_frontend> frontend,
+               WorkerPool &pool,
+               Client::Factory &client_factory,
+               Acceptor::Factory &file_acceptor_factory);
+    std::vector<std::shared_ptr<struct pending_frontend> >
+    start_sessions(WorkerPool &pool,
+                   Client::Factory &client_factory,
+                   Acceptor::Factory &file_acceptor_factory);
+    void notify_queue_positions(std::vector<std::shared_ptr<struct pending_frontend> > &frontends);
+    void save_stats();
 
   public:
     Server(std::unique_ptr<Acceptor> &acceptor,
            unsigned int max_connections,
            unsigned int buf_size,
-           unsigned long long file_timeout_seconds);
+           unsigned long long file_timeout_seconds,
+           unsigned int max_queued = 0);
     void run(std::unique_ptr<Client::Factory> &client_factory,
              std::unique_ptr<Acceptor::Factory> &file_acceptor_factory);
     void interrupt();
+    void set_stats_path(fs::path path);
+    struct admission_stats get_stats();
   };
 };
 
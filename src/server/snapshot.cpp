@@ -0,0 +1,253 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "snapshot.hpp"
+#include "calltree.hpp"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+
+namespace adaptyst {
+  /**
+     Combines the partial-result snapshots saved during profiling into
+     "processed"-style result files: <pid_tid>.json with the call trees of
+     every thread, callchains.json with the symbol names, and metadata.json
+     with the sampled times and off-CPU regions. Threads are not arranged
+     into a tree in metadata.json and syscall callchains are not available,
+     as snapshots do not cover them.
+
+     This can be used while profiling is still running or after it has
+     been stopped abruptly. Snapshots which have not been fully saved
+     yet are ignored.
+
+     @param processed_dir The "processed" result directory with
+                          the "snapshots" directory inside.
+     @param out_dir       The directory where the result files should be
+                          saved. It is created if it does not exist.
+     @param up_to         The number of the last snapshot to be combined.
+                          All snapshots are combined by default.
+
+     @return The number of snapshots combined.
+
+     @throw std::runtime_error When there are no snapshots or a snapshot
+                               is corrupted.
+  */
+  unsigned int merge_snapshots(fs::path processed_dir, fs::path out_dir,
+                               unsigned int up_to) {
+    struct merged_trees {
+      CallTree output;
+      CallTree output_time_ordered;
+      unsigned long long total_period = 0;
+      unsigned long long first_time = 0;
+
+      merged_trees() : output(false), output_time_ordered(true) { }
+    };
+
+    fs::path snapshot_dir = processed_dir / SNAPSHOT_DIR_NAME;
+
+    if (!fs::is_directory(snapshot_dir)) {
+      throw std::runtime_error("There are no snapshots in " + processed_dir.string());
+    }
+
+    std::vector<std::pair<unsigned int, fs::path> > snapshots;
+
+    for (auto &entry : fs::directory_iterator(snapshot_dir)) {
+      std::string name = entry.path().filename().string();
+
+      if (entry.is_directory() && !name.empty() &&
+          std::all_of(name.begin(), name.end(), ::isdigit)) {
+        snapshots.push_back(std::make_pair(std::stoul(name), entry.path()));
+      }
+    }
+
+    std::sort(snapshots.begin(), snapshots.end());
+
+    // Trees are rebuilt per PID/TID, event type, and subclient, as
+    // the deltas of different subclients refer to different trees
+    std::map<std::tuple<std::string, std::string, unsigned long long>,
+             struct merged_trees> trees;
+    std::map<std::string, nlohmann::json> offcpu_regions;
+
+    // Symbols are collected from all snapshots, as one referred to in
+    // a snapshot may have been saved alongside a slightly later one
+    // of a different subclient
+    nlohmann::json symbols = nlohmann::json::object();
+    unsigned long long start_time = 0;
+    unsigned int merged = 0;
+
+    for (auto &snapshot : snapshots) {
+      std::vector<fs::path> files;
+
+      for (auto &entry : fs::directory_iterator(snapshot.second)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".json") {
+          files.push_back(entry.path());
+        }
+      }
+
+      std::sort(files.begin(), files.end());
+
+      for (auto &file : files) {
+        nlohmann::json data;
+
+        try {
+          std::ifstream stream(file);
+          data = nlohmann::json::parse(stream);
+
+          for (auto &symbol : data["symbols"].items()) {
+            symbols[symbol.key()] = symbol.value();
+          }
+
+          if (snapshot.first > up_to) {
+            continue;
+          }
+
+          start_time = data["start_time"];
+          unsigned long long subclient = data.value("subclient", 0ULL);
+
+          for (auto &thread : data["threads"].items()) {
+            for (auto &entry : thread.value()) {
+              std::string event_name = entry["event_name"];
+              struct merged_trees &merged_thread =
+                trees[std::make_tuple(thread.key(), event_name, subclient)];
+
+              for (auto &delta : entry["deltas"]) {
+                merged_thread.output.apply_delta(delta[0]);
+                merged_thread.output_time_ordered.apply_delta(delta[1]);
+              }
+
+              merged_thread.total_period = entry["total_period"];
+              merged_thread.first_time = entry.value("first_time", 0ULL);
+
+              if (event_name == "walltime") {
+                nlohmann::json &regions = offcpu_regions[thread.key()];
+
+                if (regions.is_null()) {
+                  regions = nlohmann::json::array();
+                }
+
+                for (auto &region : entry["offcpu_regions"]) {
+                  regions.push_back(region);
+                }
+              }
+            }
+          }
+        } catch (std::exception &e) {
+          throw std::runtime_error("Snapshot " + file.string() +
+                                   " is corrupted: " + e.what());
+        }
+      }
+
+      if (!files.empty() && snapshot.first <= up_to) {
+        merged++;
+      }
+    }
+
+    fs::create_directories(out_dir);
+
+    nlohmann::json metadata;
+    metadata["thread_tree"] = nlohmann::json::array();
+    metadata["callchains"] = nlohmann::json::object();
+    metadata["offcpu_regions"] = nlohmann::json::object();
+    metadata["sampled_times"] = nlohmann::json::object();
+
+    // Trees are sorted by PID/TID, so all event types of a thread
+    // are next to each other
+    for (auto it = trees.begin(); it != trees.end();) {
+      std::string pid_tid = std::get<0>(it->first);
+      std::string pid = pid_tid.substr(0, pid_tid.find('_'));
+      std::string tid = pid_tid.substr(pid_tid.find('_') + 1);
+
+      nlohmann::json thread;
+      thread["identifier"] = tid;
+      thread["parent"] = nullptr;
+      thread["tag"] = {"?", pid + "/" + tid, -1, -1};
+      metadata["thread_tree"].push_back(thread);
+
+      std::ofstream stream(out_dir / (pid_tid + ".json"));
+      stream << "{";
+
+      for (bool first = true; it != trees.end() && std::get<0>(it->first) == pid_tid;
+           first = false) {
+        std::string event_name = std::get<1>(it->first);
+        std::vector<struct merged_trees *> parts;
+
+        for (; it != trees.end() && std::get<0>(it->first) == pid_tid &&
+               std::get<1>(it->first) == event_name; it++) {
+          it->second.output.set_value(it->second.total_period);
+          it->second.output_time_ordered.set_value(it->second.total_period);
+          parts.push_back(&it->second);
+        }
+
+        std::stable_sort(parts.begin(), parts.end(), [](auto a, auto b) {
+          return a->first_time < b->first_time;
+        });
+
+        struct merged_trees &merged_thread = *parts[0];
+
+        for (std::size_t i = 1; i < parts.size(); i++) {
+          merged_thread.output.merge(parts[i]->output);
+          merged_thread.output_time_ordered.merge(parts[i]->output_time_ordered);
+          merged_thread.total_period += parts[i]->total_period;
+        }
+
+        if (event_name == "walltime") {
+          metadata["sampled_times"][pid_tid] = merged_thread.total_period;
+        }
+
+        stream << (first ? "" : ",") << nlohmann::json(event_name) << ":[";
+        merged_thread.output.write_json(stream);
+        stream << ",";
+        merged_thread.output_time_ordered.write_json(stream);
+        stream << "]";
+      }
+
+      stream << "}" << std::endl;
+    }
+
+    for (auto &regions : offcpu_regions) {
+      std::sort(regions.second.begin(), regions.second.end(),
+                [](const nlohmann::json &a, const nlohmann::json &b) {
+                  return a[0].get<unsigned long long>() <
+                    b[0].get<unsigned long long>();
+                });
+
+      nlohmann::json relative = nlohmann::json::array();
+
+      // A region is computed as the time of a sample minus its period,
+      // so it may start before profiling has. Such a region is cut at
+      // the start of profiling.
+      for (auto &region : regions.second) {
+        unsigned long long region_start = region[0];
+        unsigned long long period = region[1];
+
+        if (region_start < start_time) {
+          if (region_start + period <= start_time) {
+            continue;
+          }
+
+          period -= start_time - region_start;
+          region_start = start_time;
+        }
+
+        relative.push_back({region_start - start_time, period});
+      }
+
+      metadata["offcpu_regions"][regions.first] = std::move(relative);
+    }
+
+    // Symbol names are stored as JSON arrays serialised to strings,
+    // in the same way as in SymbolTable
+    for (auto &symbol : symbols.items()) {
+      try {
+        symbol.value() = nlohmann::json::parse(symbol.value().get<std::string>());
+      } catch (nlohmann::json::exception &e) { }
+    }
+
+    std::ofstream(out_dir / "metadata.json") << metadata << std::endl;
+    std::ofstream(out_dir / "callchains.json") << symbols << std::endl;
+
+    return merged;
+  }
+};
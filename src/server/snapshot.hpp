@@ -0,0 +1,44 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include <filesystem>
+#include <climits>
+
+// The name of the directory inside "processed" where partial-result
+// snapshots are saved during profiling. Snapshot <n> is saved to
+// processed/snapshots/<n>/, where <n> is the number of snapshot intervals
+// elapsed since the start of profiling, as one file per subclient:
+//
+// {"start_time": <profiling start timestamp>,
+//  "subclient": <subclient identifier>,
+//  "symbols": {"<symbol ID>": "<symbol name>", ...},
+//  "threads": {"<pid_tid>": [{"event_name": "<event name>",
+//                             "total_period": <total period so far>,
+//                             "first_time": <first sample timestamp>,
+//                             "offcpu_regions": [[<timestamp>, <period>], ...],
+//                             "deltas": [[<delta>, <time-ordered delta>], ...]},
+//                            ...],
+//              ...}}
+//
+// with one array element per event type the thread has been sampled with.
+// Symbols, off-CPU regions, and call tree deltas (see CallTree::take_delta())
+// are only those which are new since the previous snapshot. The trees of
+// a thread moved between subclients are rebuilt separately per subclient
+// and merged in the order of their first samples.
+//
+// Snapshots are taken only while samples are being processed, so
+// a subclient saves nothing for the intervals when its stream is idle
+// and the snapshots with these numbers are missing for it.
+#define SNAPSHOT_DIR_NAME "snapshots"
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  unsigned int merge_snapshots(fs::path processed_dir, fs::path out_dir,
+                               unsigned int up_to = UINT_MAX);
+};
+
+#endif
@@ -4,22 +4,267 @@
 #include "socket.hpp"
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <unistd.h>
 #include <fstream>
 #include <poll.h>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <Poco/Buffer.h>
 #include <Poco/Net/NetException.h>
 #include <Poco/StreamCopier.h>
 #include <Poco/FileStream.h>
 #include <Poco/Net/SocketStream.h>
 
+#if BOOST_OS_LINUX
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
+
 namespace adaptyst {
-  class charstreambuf : public std::streambuf {
-  public:
-    charstreambuf(std::unique_ptr<char> &begin, unsigned int length) {
-      this->setg(begin.get(), begin.get(), begin.get() + length - 1);
+  static void write_all(int fd, const char *buf, std::size_t len) {
+    while (len > 0) {
+      ssize_t written = ::write(fd, buf, len);
+
+      if (written == -1 && errno == EINTR) {
+        continue;
+      } else if (written <= 0) {
+        throw std::runtime_error("Could not write to the output file, "
+                                 "code " + std::to_string(errno));
+      }
+
+      buf += written;
+      len -= written;
+    }
+  }
+
+#if BOOST_OS_LINUX
+  /**
+     Sends a file to a file descriptor with sendfile(2), which avoids
+     copying the file content to userspace.
+
+     Returns false if sendfile(2) is not supported for the file
+     descriptor, in which case nothing is sent.
+
+     @throw ConnectionException When the file cannot be opened or
+                                sending fails.
+  */
+  static bool send_file(int dst_fd, fs::path file) {
+    int src_fd = ::open(file.c_str(), O_RDONLY);
+
+    if (src_fd == -1) {
+      std::runtime_error err("Could not open the file " +
+                             file.string() + "!");
+      throw ConnectionException(err);
+    }
+
+    // The file is sent until EOF rather than up to its initial size,
+    // in the same way as when it is copied through a buffer
+    off_t offset = 0;
+
+    while (true) {
+      ssize_t sent = sendfile(dst_fd, src_fd, &offset, FILE_BUFFER_SIZE);
+
+      if (sent == 0) {
+        break;
+      } else if (sent == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        int error = errno;
+        ::close(src_fd);
+
+        if (offset == 0 && (error == EINVAL || error == ENOSYS)) {
+          return false;
+        }
+
+        std::runtime_error err("Could not send the file " + file.string() +
+                               ", code " + std::to_string(error));
+        throw ConnectionException(err);
+      }
+    }
+
+    ::close(src_fd);
+    return true;
+  }
+
+  /**
+     Moves data from a file descriptor to a file with splice(2) until EOF,
+     which avoids copying the data to userspace. If the source is not
+     a pipe, the data go through an intermediate pipe.
+
+     Returns false if splice(2) is not supported for the file descriptors,
+     in which case the rest of the data (if any) should be copied
+     in a different way.
+
+     @throw TimeoutException    In case of timeout.
+     @throw ConnectionException In case of connection errors.
+     @throw std::runtime_error  When the file cannot be written to.
+  */
+  static bool splice_to_file(int src_fd, bool src_is_pipe, int file_fd,
+                             long timeout_seconds) {
+    int pipe_fd[2];
+
+    if (!src_is_pipe && pipe(pipe_fd) != 0) {
+      return false;
+    }
+
+    if (!src_is_pipe) {
+      // A larger pipe means fewer splice(2) calls, but the default
+      // size is still fine if the limit doesn't allow that
+      fcntl(pipe_fd[1], F_SETPIPE_SZ, FILE_BUFFER_SIZE);
+    }
+
+    auto close_pipe = [&]() {
+      if (!src_is_pipe) {
+        ::close(pipe_fd[0]);
+        ::close(pipe_fd[1]);
+      }
+    };
+
+    bool first = true;
+
+    try {
+      while (true) {
+        if (timeout_seconds != NO_TIMEOUT) {
+          struct pollfd poll_struct;
+          poll_struct.fd = src_fd;
+          poll_struct.events = POLLIN;
+
+          int code = ::poll(&poll_struct, 1, 1000 * timeout_seconds);
+
+          if (code == -1 && errno != EINTR) {
+            throw ConnectionException();
+          } else if (code == 0) {
+            throw TimeoutException();
+          }
+        }
+
+        ssize_t received = splice(src_fd, nullptr,
+                                  src_is_pipe ? file_fd : pipe_fd[1], nullptr,
+                                  FILE_BUFFER_SIZE,
+                                  SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (received == 0) {
+          break;
+        } else if (received == -1) {
+          if (errno == EINTR) {
+            continue;
+          } else if (first && (errno == EINVAL || errno == ENOSYS)) {
+            close_pipe();
+            return false;
+          } else if (src_is_pipe) {
+            throw std::runtime_error("Could not splice data to the output "
+                                     "file, code " + std::to_string(errno));
+          }
+
+          throw ConnectionException();
+        }
+
+        first = false;
+
+        while (!src_is_pipe && received > 0) {
+          ssize_t written = splice(pipe_fd[0], nullptr, file_fd, nullptr,
+                                   received, SPLICE_F_MOVE);
+
+          if (written == -1 && errno == EINTR) {
+            continue;
+          } else if (written == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            // The output file does not support splice(2), so the data
+            // already in the pipe are copied in userspace
+            std::unique_ptr<char[]> buf(new char[received]);
+            ssize_t bytes = ::read(pipe_fd[0], buf.get(), received);
+
+            if (bytes != received) {
+              throw std::runtime_error("Could not read data back from "
+                                       "the intermediate pipe");
+            }
+
+            write_all(file_fd, buf.get(), bytes);
+            close_pipe();
+            return false;
+          } else if (written <= 0) {
+            throw std::runtime_error("Could not splice data to the output "
+                                     "file, code " + std::to_string(errno));
+          }
+
+          received -= written;
+        }
+      }
+    } catch (...) {
+      close_pipe();
+      throw;
+    }
+
+    close_pipe();
+    return true;
+  }
+#else
+  // sendfile(2) and splice(2) are Linux-specific, so files are always
+  // copied through a buffer on other systems
+  static bool send_file(int, fs::path) {
+    return false;
+  }
+
+  static bool splice_to_file(int, bool, int, long) {
+    return false;
+  }
+#endif
+
+  /**
+     Saves all data received from a connection to a file, using splice(2)
+     from src_fd where possible and falling back to reading the data
+     through a buffer.
+
+     @param connection      The connection to receive data from.
+     @param framer          The line framer of the connection, whose
+                            buffered data are saved first.
+     @param src_fd          The file descriptor the connection receives
+                            data from or -1 if splice(2) shouldn't be used.
+     @param src_is_pipe     Whether src_fd is a pipe.
+     @param file            The path to the file.
+     @param timeout_seconds A maximum number of seconds that can pass
+                            while waiting for a next portion of the data.
+  */
+  static void receive_file(Connection &connection, LineFramer &framer,
+                           int src_fd, bool src_is_pipe, fs::path file,
+                           long timeout_seconds) {
+    int file_fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (file_fd == -1) {
+      throw std::runtime_error("Could not open the output file, code " +
+                               std::to_string(errno));
+    }
+
+    try {
+      std::string buffered = framer.take_remaining();
+      write_all(file_fd, buffered.data(), buffered.size());
+
+      if (src_fd == -1 || !splice_to_file(src_fd, src_is_pipe, file_fd,
+                                          timeout_seconds)) {
+        std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+
+        while (true) {
+          int bytes_received = connection.read(buf.get(), FILE_BUFFER_SIZE,
+                                               timeout_seconds);
+
+          if (bytes_received == 0) {
+            break;
+          }
+
+          write_all(file_fd, buf.get(), bytes_received);
+        }
+      }
+    } catch (...) {
+      ::close(file_fd);
+      throw;
     }
-  };
+
+    ::close(file_fd);
+  }
 
   TCPAcceptor::TCPAcceptor(std::string address, unsigned short port,
                            int max_accepted,
@@ -64,6 +309,12 @@ namespace adaptyst {
   std::unique_ptr<Connection> TCPAcceptor::accept_connection(unsigned int buf_size,
                                                              long timeout) {
     try {
+      if (timeout != NO_TIMEOUT &&
+          !this->acceptor.poll(Poco::Timespan(timeout, 0),
+                               net::Socket::SELECT_READ)) {
+        throw TimeoutException();
+      }
+
       net::StreamSocket socket = this->acceptor.acceptConnection();
       return std::make_unique<TCPSocket>(socket, buf_size);
     } catch (net::NetException &e) {
@@ -93,11 +344,10 @@ namespace adaptyst {
                      the already-established TCP socket.
      @param buf_size The buffer size for communication, in bytes.
   */
-  TCPSocket::TCPSocket(net::StreamSocket & sock, unsigned int buf_size) {
+  TCPSocket::TCPSocket(net::StreamSocket & sock,
+                       unsigned int buf_size) : framer(buf_size) {
     this->socket = sock;
-    this->buf.reset(new char[buf_size]);
     this->buf_size = buf_size;
-    this->start_pos = 0;
   }
 
   TCPSocket::~TCPSocket() {
@@ -120,8 +370,15 @@ namespace adaptyst {
     this->socket.close();
   }
 
-  int TCPSocket::read(char *buf, unsigned int len, long timeout_seconds) {
+  /**
+     Receives data directly from the socket, bypassing the line framer.
+  */
+  int TCPSocket::receive(char *buf, unsigned int len, long timeout_seconds) {
     try {
+      if (timeout_seconds == NO_TIMEOUT) {
+        return this->socket.receiveBytes(buf, len);
+      }
+
       this->socket.setReceiveTimeout(Poco::Timespan(timeout_seconds, 0));
       int bytes = this->socket.receiveBytes(buf, len);
       this->socket.setReceiveTimeout(Poco::Timespan());
@@ -135,86 +392,44 @@ namespace adaptyst {
     }
   }
 
-  std::string TCPSocket::read(long timeout_seconds) {
-    try {
-      if (!this->buffered_msgs.empty()) {
-        std::string msg = this->buffered_msgs.front();
-        this->buffered_msgs.pop();
-        return msg;
-      }
-
-      std::string cur_msg = "";
-
-      while (true) {
-        int bytes_received;
-
-        if (timeout_seconds == NO_TIMEOUT) {
-          bytes_received =
-            this->socket.receiveBytes(this->buf.get() + this->start_pos,
-                                      this->buf_size - this->start_pos);
-        } else {
-          bytes_received =
-              this->read(this->buf.get() + this->start_pos,
-                         this->buf_size - this->start_pos, timeout_seconds);
-        }
-
-        if (bytes_received == 0) {
-          return std::string(this->buf.get(), this->start_pos);
-        }
-
-        bool first_msg_to_receive = true;
-        std::string first_msg;
-
-        charstreambuf buf(this->buf, bytes_received + this->start_pos);
-        std::istream in(&buf);
-
-        int cur_pos = 0;
-        bool last_is_newline = this->buf.get()[bytes_received + this->start_pos - 1] == '\n';
+  int TCPSocket::read(char *buf, unsigned int len, long timeout_seconds) {
+    // Data already received by read_line() must be returned first
+    if (this->framer.has_buffered_data()) {
+      return this->framer.drain(buf, len);
+    }
 
-        while (!in.eof()) {
-          std::string msg;
-          std::getline(in, msg);
+    return this->receive(buf, len, timeout_seconds);
+  }
 
-          if (in.eof() && !last_is_newline) {
-            int size = bytes_received + this->start_pos - cur_pos;
+  std::string TCPSocket::read(long timeout_seconds) {
+    std::string_view line;
 
-            if (size == this->buf_size) {
-              cur_msg += std::string(this->buf.get(), this->buf_size);
-              this->start_pos = 0;
-            } else {
-              std::memmove(this->buf.get(), this->buf.get() + cur_pos, size);
-              this->start_pos = size;
-            }
-          } else {
-            if (!cur_msg.empty() || !msg.empty()) {
-              if (first_msg_to_receive) {
-                first_msg = cur_msg + msg;
-                first_msg_to_receive = false;
-              } else {
-                this->buffered_msgs.push(cur_msg + msg);
-              }
-
-              cur_msg = "";
-            }
+    if (this->read_line(line, timeout_seconds)) {
+      return std::string(line);
+    }
 
-            cur_pos += msg.length() + 1;
-          }
-        }
+    return this->framer.take_remaining();
+  }
 
-        if (last_is_newline) {
-          this->start_pos = 0;
-        }
+  bool TCPSocket::read_line(std::string_view &line, long timeout_seconds) {
+    while (!this->framer.next(line)) {
+      unsigned int space = this->framer.get_write_space();
+      int bytes_received = this->receive(this->framer.get_write_ptr(),
+                                         space, timeout_seconds);
 
-        if (!first_msg_to_receive) {
-          return first_msg;
-        }
+      if (bytes_received == 0) {
+        return false;
       }
 
-      // Should not get here.
-      return "";
-    } catch (net::NetException &e) {
-      throw ConnectionException(e);
+      this->framer.commit(bytes_received);
     }
+
+    return true;
+  }
+
+  void TCPSocket::read(fs::path file, long timeout_seconds) {
+    receive_file(*this, this->framer, this->socket.impl()->sockfd(),
+                 false, file, timeout_seconds);
   }
 
   void TCPSocket::write(std::string msg, bool new_line) {
@@ -243,6 +458,10 @@ namespace adaptyst {
 
   void TCPSocket::write(fs::path file) {
     try {
+      if (send_file(this->socket.impl()->sockfd(), file)) {
+        return;
+      }
+
       net::SocketStream socket_stream(this->socket);
       Poco::FileInputStream stream(file, std::ios::in | std::ios::binary);
       Poco::StreamCopier::copyStream(stream, socket_stream);
@@ -269,6 +488,145 @@ namespace adaptyst {
   }
 
 #ifdef BOOST_OS_UNIX
+  /**
+     Constructs a UnixSocket object.
+
+     @param sock     The Poco::Net::StreamSocket object corresponding to
+                     the already-established Unix domain socket.
+     @param buf_size The buffer size for communication, in bytes.
+  */
+  UnixSocket::UnixSocket(net::StreamSocket &sock,
+                         unsigned int buf_size) : TCPSocket(sock, buf_size) {
+    this->path = sock.address().toString();
+  }
+
+  /**
+     Returns the path of the socket.
+  */
+  std::string UnixSocket::get_address() {
+    return this->path;
+  }
+
+  /**
+     Returns 0, as Unix domain sockets do not have ports.
+  */
+  unsigned short UnixSocket::get_port() {
+    return 0;
+  }
+
+  /**
+     Makes a new UnixAcceptor object.
+
+     @param max_accepted A maximum number of connections that
+                         the acceptor can accept during its lifetime.
+                         Use UNLIMITED_ACCEPTED for no limit.
+
+     @throw AlreadyInUseException When the socket path is used by
+                                  another running process.
+     @throw ConnectionException   In case of any other errors.
+  */
+  std::unique_ptr<Acceptor> UnixAcceptor::Factory::make_acceptor(int max_accepted) {
+    fs::path path = this->path;
+
+    if (this->unique_paths) {
+      path += "." + std::to_string(getpid()) + "." +
+        std::to_string(this->next_id++);
+    }
+
+    return std::unique_ptr<Acceptor>(new UnixAcceptor(path, max_accepted));
+  }
+
+  UnixAcceptor::UnixAcceptor(fs::path path,
+                             int max_accepted) : Acceptor(max_accepted) {
+    this->path = path;
+    net::SocketAddress address(net::SocketAddress::UNIX_LOCAL, path.string());
+
+    try {
+      this->acceptor.bind(address, false);
+    } catch (net::NetException &e) {
+      if (e.message().find("already in use") == std::string::npos) {
+        throw ConnectionException(e);
+      }
+
+      // The socket file may have been left by a server which hasn't
+      // exited cleanly, in which case nothing accepts connections there
+      bool alive = true;
+
+      try {
+        net::StreamSocket probe(address);
+        probe.close();
+      } catch (net::NetException &) {
+        alive = false;
+      }
+
+      std::error_code error;
+
+      if (alive || !fs::is_socket(path, error) || !fs::remove(path, error)) {
+        this->path.clear();
+        throw AlreadyInUseException();
+      }
+
+      try {
+        this->acceptor.bind(address, false);
+      } catch (net::NetException &e) {
+        this->path.clear();
+        throw ConnectionException(e);
+      }
+    }
+
+    try {
+      this->acceptor.listen();
+    } catch (net::NetException &e) {
+      this->close();
+      throw ConnectionException(e);
+    }
+  }
+
+  UnixAcceptor::~UnixAcceptor() {
+    this->close();
+  }
+
+  std::unique_ptr<Connection> UnixAcceptor::accept_connection(unsigned int buf_size,
+                                                              long timeout) {
+    try {
+      if (timeout != NO_TIMEOUT &&
+          !this->acceptor.poll(Poco::Timespan(timeout, 0),
+                               net::Socket::SELECT_READ)) {
+        throw TimeoutException();
+      }
+
+      net::StreamSocket socket = this->acceptor.acceptConnection();
+      return std::make_unique<UnixSocket>(socket, buf_size);
+    } catch (net::NetException &e) {
+      throw ConnectionException(e);
+    }
+  }
+
+  /**
+     Returns "<socket path>". Unlike in other acceptors, the path is not
+     split into fields, so it may contain underscores (but not whitespace).
+  */
+  std::string UnixAcceptor::get_connection_instructions() {
+    return this->path.string();
+  }
+
+  std::string UnixAcceptor::get_type() {
+    return "unix";
+  }
+
+  /**
+     Closes the acceptor and removes its socket file.
+  */
+  void UnixAcceptor::close() {
+    this->acceptor.close();
+
+    if (!this->path.empty()) {
+      std::error_code error;
+      fs::remove(this->path, error);
+      this->path.clear();
+    }
+  }
+
   /**
      Constructs a FileDescriptor object.
 
@@ -281,10 +639,8 @@ namespace adaptyst {
      @param buf_size The buffer size for communication, in bytes.
   */
   FileDescriptor::FileDescriptor(int read_fd[2], int write_fd[2],
-                                 unsigned int buf_size) {
-    this->buf.reset(new char[buf_size]);
+                                 unsigned int buf_size) : framer(buf_size) {
     this->buf_size = buf_size;
-    this->start_pos = 0;
 
     if (read_fd != nullptr) {
       this->read_fd[0] = read_fd[0];
@@ -319,102 +675,74 @@ namespace adaptyst {
     }
   }
 
-  int FileDescriptor::read(char *buf, unsigned int len, long timeout_seconds) {
-    struct pollfd poll_struct;
-    poll_struct.fd = this->read_fd[0];
-    poll_struct.events = POLLIN;
+  /**
+     Receives data directly from the read file descriptor, bypassing
+     the line framer.
+  */
+  int FileDescriptor::receive(char *buf, unsigned int len,
+                              long timeout_seconds) {
+    if (timeout_seconds != NO_TIMEOUT) {
+      struct pollfd poll_struct;
+      poll_struct.fd = this->read_fd[0];
+      poll_struct.events = POLLIN;
+
+      int code = ::poll(&poll_struct, 1, 1000 * timeout_seconds);
+
+      if (code == -1) {
+        throw ConnectionException();
+      } else if (code == 0) {
+        throw TimeoutException();
+      }
+    }
 
-    int code = ::poll(&poll_struct, 1, 1000 * timeout_seconds);
+    int bytes_received = ::read(this->read_fd[0], buf, len);
 
-    if (code == -1) {
+    if (bytes_received == -1) {
       throw ConnectionException();
-    } else if (code == 0) {
-      throw TimeoutException();
     }
 
-    return ::read(this->read_fd[0], buf, len);
+    return bytes_received;
   }
 
-  std::string FileDescriptor::read(long timeout_seconds) {
-    if (!this->buffered_msgs.empty()) {
-      std::string msg = this->buffered_msgs.front();
-      this->buffered_msgs.pop();
-      return msg;
+  int FileDescriptor::read(char *buf, unsigned int len, long timeout_seconds) {
+    // Data already received by read_line() must be returned first
+    if (this->framer.has_buffered_data()) {
+      return this->framer.drain(buf, len);
     }
 
-    std::string cur_msg = "";
-
-    while (true) {
-      int bytes_received;
-
-      if (timeout_seconds == NO_TIMEOUT) {
-        bytes_received =
-            ::read(this->read_fd[0], this->buf.get() + this->start_pos,
-                   this->buf_size - this->start_pos);
-
-        if (bytes_received == -1) {
-          throw ConnectionException();
-        }
-      } else {
-        bytes_received = this->read(this->buf.get() + this->start_pos,
-                                    this->buf_size - this->start_pos,
-                                    timeout_seconds);
-      }
-
-      if (bytes_received == 0) {
-        return std::string(this->buf.get(), this->start_pos);
-      }
-
-      bool first_msg_to_receive = true;
-      std::string first_msg;
-
-      charstreambuf buf(this->buf, bytes_received + this->start_pos);
-      std::istream in(&buf);
-
-      int cur_pos = 0;
-      bool last_is_newline = this->buf.get()[bytes_received + this->start_pos - 1] == '\n';
-
-      while (!in.eof()) {
-        std::string msg;
-        std::getline(in, msg);
+    return this->receive(buf, len, timeout_seconds);
+  }
 
-        if (in.eof() && !last_is_newline) {
-          int size = bytes_received + this->start_pos - cur_pos;
+  std::string FileDescriptor::read(long timeout_seconds) {
+    std::string_view line;
 
-          if (size == this->buf_size) {
-            cur_msg += std::string(this->buf.get(), this->buf_size);
-            this->start_pos = 0;
-          } else {
-            std::memmove(this->buf.get(), this->buf.get() + cur_pos, size);
-            this->start_pos = size;
-          }
-        } else {
-          if (!cur_msg.empty() || !msg.empty()) {
-            if (first_msg_to_receive) {
-              first_msg = cur_msg + msg;
-              first_msg_to_receive = false;
-            } else {
-              this->buffered_msgs.push(cur_msg + msg);
-            }
+    if (this->read_line(line, timeout_seconds)) {
+      return std::string(line);
+    }
 
-            cur_msg = "";
-          }
+    return this->framer.take_remaining();
+  }
 
-          cur_pos += msg.length() + 1;
-        }
-      }
+  bool FileDescriptor::read_line(std::string_view &line,
+                                 long timeout_seconds) {
+    while (!this->framer.next(line)) {
+      unsigned int space = this->framer.get_write_space();
+      int bytes_received = this->receive(this->framer.get_write_ptr(),
+                                         space, timeout_seconds);
 
-      if (last_is_newline) {
-        this->start_pos = 0;
+      if (bytes_received == 0) {
+        return false;
       }
 
-      if (!first_msg_to_receive) {
-        return first_msg;
-      }
+      this->framer.commit(bytes_received);
     }
 
-    // Should not get here.
-    return "";
+    return true;
+  }
+
+  void FileDescriptor::read(fs::path file, long timeout_seconds) {
+    receive_file(*this, this->framer, this->read_fd[0], true, file,
+                 timeout_seconds);
   }
 
   void FileDescriptor::write(std::string msg, bool new_line) {
@@ -437,6 +765,10 @@ namespace adaptyst {
   }
 
   void FileDescriptor::write(fs::path file) {
+    if (send_file(this->write_fd[1], file)) {
+      return;
+    }
+
     std::unique_ptr<char> buf(new char[FILE_BUFFER_SIZE]);
     std::ifstream file_stream(file, std::ios_base::in |
                               std::ios_base::binary);
@@ -561,4 +893,696 @@ namespace adaptyst {
     return "pipe";
   }
 #endif
+
+#if BOOST_OS_LINUX
+  /**
+     Constructs a ShmConnection object.
+
+     The object takes ownership of all file descriptors and
+     the memory mapping passed to it.
+
+     @param memfd     The memfd file descriptor of the shared-memory segment.
+     @param region    The shared-memory segment mapped to memory.
+     @param ring_size The size of the ring, in bytes.
+     @param data_fd   The eventfd file descriptor signalled by the producer
+                      when data are available.
+     @param space_fd  The eventfd file descriptor signalled by the consumer
+                      when space is available.
+     @param write_fd  The pair of file descriptors for write() as returned by
+                      the pipe system call.
+     @param buf_size  The buffer size for communication, in bytes.
+  */
+  ShmConnection::ShmConnection(int memfd, char *region,
+                               std::uint64_t ring_size,
+                               int data_fd, int space_fd, int write_fd[2],
+                               unsigned int buf_size) : writer(nullptr,
+                                                               write_fd,
+                                                               buf_size),
+                                                        framer(buf_size) {
+    this->memfd = memfd;
+    this->region = region;
+    this->ring_size = ring_size;
+    this->data_fd = data_fd;
+    this->space_fd = space_fd;
+    this->buf_size = buf_size;
+  }
+
+  ShmConnection::~ShmConnection() {
+    this->close();
+  }
+
+  void ShmConnection::close() {
+    if (this->region != nullptr) {
+      munmap(this->region, ShmConnection::DATA_OFFSET + this->ring_size);
+      this->region = nullptr;
+    }
+
+    if (this->memfd != -1) {
+      ::close(this->memfd);
+      this->memfd = -1;
+    }
+
+    if (this->data_fd != -1) {
+      ::close(this->data_fd);
+      this->data_fd = -1;
+    }
+
+    if (this->space_fd != -1) {
+      ::close(this->space_fd);
+      this->space_fd = -1;
+    }
+
+    this->writer.close();
+  }
+
+  std::uint64_t &ShmConnection::word(unsigned int offset) {
+    return *(std::uint64_t *)(this->region + offset);
+  }
+
+  /**
+     Receives data directly from the ring, bypassing the line framer.
+  */
+  int ShmConnection::receive(char *buf, unsigned int len,
+                             long timeout_seconds) {
+    std::atomic_ref<std::uint64_t> head(this->word(ShmConnection::HEAD_OFFSET));
+    std::atomic_ref<std::uint64_t> tail(this->word(ShmConnection::TAIL_OFFSET));
+    std::atomic_ref<std::uint64_t> consumer_waiting(
+      this->word(ShmConnection::CONSUMER_WAITING_OFFSET));
+    std::atomic_ref<std::uint64_t> producer_waiting(
+      this->word(ShmConnection::PRODUCER_WAITING_OFFSET));
+    std::atomic_ref<std::uint64_t> closed(this->word(ShmConnection::CLOSED_OFFSET));
+
+    auto deadline = std::chrono::steady_clock::now() +
+      std::chrono::seconds(timeout_seconds);
+    char *data = this->region + ShmConnection::DATA_OFFSET;
+
+    while (true) {
+      std::uint64_t cur_head = head.load(std::memory_order_acquire);
+      std::uint64_t cur_tail = tail.load(std::memory_order_relaxed);
+
+      if (cur_head != cur_tail) {
+        unsigned int to_copy = std::min((std::uint64_t)len,
+                                        cur_head - cur_tail);
+        std::uint64_t pos = cur_tail & (this->ring_size - 1);
+        unsigned int first_part = std::min((std::uint64_t)to_copy,
+                                           this->ring_size - pos);
+
+        std::memcpy(buf, data + pos, first_part);
+        std::memcpy(buf + first_part, data, to_copy - first_part);
+
+        tail.store(cur_tail + to_copy, std::memory_order_seq_cst);
+
+        if (producer_waiting.load(std::memory_order_seq_cst)) {
+          std::uint64_t value = 1;
+          ::write(this->space_fd, &value, sizeof(value));
+        }
+
+        return to_copy;
+      }
+
+      if (closed.load(std::memory_order_acquire)) {
+        if (head.load(std::memory_order_acquire) == cur_tail) {
+          return 0;
+        }
+
+        continue;
+      }
+
+      consumer_waiting.store(1, std::memory_order_seq_cst);
+
+      if (head.load(std::memory_order_seq_cst) == cur_tail &&
+          !closed.load(std::memory_order_seq_cst)) {
+        int wait_ms = SHM_POLL_INTERVAL_MS;
+
+        if (timeout_seconds != NO_TIMEOUT) {
+          auto remaining = std::chrono::duration_cast<
+            std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+          if (remaining.count() <= 0) {
+            consumer_waiting.store(0, std::memory_order_relaxed);
+            throw TimeoutException();
+          }
+
+          wait_ms = std::min((long)wait_ms, (long)remaining.count());
+        }
+
+        struct pollfd poll_struct;
+        poll_struct.fd = this->data_fd;
+        poll_struct.events = POLLIN;
+
+        int code = ::poll(&poll_struct, 1, wait_ms);
+
+        if (code == -1 && errno != EINTR) {
+          consumer_waiting.store(0, std::memory_order_relaxed);
+          throw ConnectionException();
+        } else if (code > 0) {
+          std::uint64_t value;
+          ::read(this->data_fd, &value, sizeof(value));
+        }
+      }
+
+      consumer_waiting.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  int ShmConnection::read(char *buf, unsigned int len, long timeout_seconds) {
+    // Data already received by read_line() must be returned first
+    if (this->framer.has_buffered_data()) {
+      return this->framer.drain(buf, len);
+    }
+
+    return this->receive(buf, len, timeout_seconds);
+  }
+
+  std::string ShmConnection::read(long timeout_seconds) {
+    std::string_view line;
+
+    if (this->read_line(line, timeout_seconds)) {
+      return std::string(line);
+    }
+
+    return this->framer.take_remaining();
+  }
+
+  bool ShmConnection::read_line(std::string_view &line,
+                                long timeout_seconds) {
+    while (!this->framer.next(line)) {
+      unsigned int space = this->framer.get_write_space();
+      int bytes_received = this->receive(this->framer.get_write_ptr(),
+                                         space, timeout_seconds);
+
+      if (bytes_received == 0) {
+        return false;
+      }
+
+      this->framer.commit(bytes_received);
+    }
+
+    return true;
+  }
+
+  void ShmConnection::read(fs::path file, long timeout_seconds) {
+    receive_file(*this, this->framer, -1, false, file, timeout_seconds);
+  }
+
+  void ShmConnection::write(std::string msg, bool new_line) {
+    this->writer.write(msg, new_line);
+  }
+
+  void ShmConnection::write(fs::path file) {
+    this->writer.write(file);
+  }
+
+  void ShmConnection::write(unsigned int len, char *buf) {
+    this->writer.write(len, buf);
+  }
+
+  unsigned int ShmConnection::get_buf_size() {
+    return this->buf_size;
+  }
+
+  /**
+     Constructs a ShmAcceptor object.
+
+     @param ring_size The size of the ring, in bytes. It must be a power of 2.
+
+     @throw std::runtime_error  When ring_size is not a power of 2.
+     @throw ConnectionException When the shared-memory segment, the eventfd
+                                file descriptors, or the pipe cannot
+                                be created.
+  */
+  ShmAcceptor::ShmAcceptor(std::uint64_t ring_size) : Acceptor(1) {
+    if (ring_size == 0 || (ring_size & (ring_size - 1)) != 0) {
+      throw std::runtime_error("The ring size for ShmConnection must be "
+                               "a power of 2");
+    }
+
+    this->ring_size = ring_size;
+    this->region = nullptr;
+    this->data_fd = -1;
+    this->space_fd = -1;
+    this->write_fd[0] = -1;
+    this->write_fd[1] = -1;
+    this->transferred = false;
+
+    this->memfd = memfd_create("adaptyst-shm", 0);
+
+    if (this->memfd == -1) {
+      std::runtime_error err("Could not create shared memory for ShmConnection, "
+                             "code " + std::to_string(errno));
+      throw ConnectionException(err);
+    }
+
+    std::uint64_t total_size = ShmConnection::DATA_OFFSET + ring_size;
+
+    if (ftruncate(this->memfd, total_size) != 0) {
+      std::runtime_error err("Could not resize shared memory for ShmConnection, "
+                             "code " + std::to_string(errno));
+      this->close();
+      throw ConnectionException(err);
+    }
+
+    void *region = mmap(nullptr, total_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, this->memfd, 0);
+
+    if (region == MAP_FAILED) {
+      std::runtime_error err("Could not map shared memory for ShmConnection, "
+                             "code " + std::to_string(errno));
+      this->close();
+      throw ConnectionException(err);
+    }
+
+    this->region = (char *)region;
+
+    this->data_fd = eventfd(0, 0);
+    this->space_fd = eventfd(0, 0);
+
+    if (this->data_fd == -1 || this->space_fd == -1) {
+      std::runtime_error err("Could not create eventfd for ShmConnection, "
+                             "code " + std::to_string(errno));
+      this->close();
+      throw ConnectionException(err);
+    }
+
+    if (pipe(this->write_fd) != 0) {
+      std::runtime_error err("Could not open write pipe for ShmConnection, "
+                             "code " + std::to_string(errno));
+      this->close();
+      throw ConnectionException(err);
+    }
+  }
+
+  ShmAcceptor::~ShmAcceptor() {
+    this->close();
+  }
+
+  std::unique_ptr<Connection> ShmAcceptor::accept_connection(unsigned int buf_size,
+                                                             long timeout) {
+    std::unique_ptr<Connection> connection(new ShmConnection(this->memfd,
+                                                             this->region,
+                                                             this->ring_size,
+                                                             this->data_fd,
+                                                             this->space_fd,
+                                                             this->write_fd,
+                                                             buf_size));
+    this->transferred = true;
+
+    std::string expected = "connect";
+    const int size = expected.size();
+
+    char buf[size];
+    int bytes_received = 0;
+
+    while (bytes_received < size) {
+      int received = connection->read(buf + bytes_received,
+                                      size - bytes_received, timeout);
+
+      if (received <= 0) {
+        break;
+      }
+
+      bytes_received += received;
+    }
+
+    std::string msg(buf, bytes_received);
+
+    if (msg != expected) {
+      std::runtime_error err("Message received from shared memory when "
+                             "establishing connection is \"" + msg +
+                             "\" instead of \"" + expected + "\".");
+      throw ConnectionException(err);
+    }
+
+    return connection;
+  }
+
+  /**
+     Releases the shared-memory segment and the file descriptors
+     unless they have been passed to a ShmConnection object.
+  */
+  void ShmAcceptor::close() {
+    if (this->transferred) {
+      return;
+    }
+
+    if (this->region != nullptr) {
+      munmap(this->region, ShmConnection::DATA_OFFSET + this->ring_size);
+      this->region = nullptr;
+    }
+
+    for (int *fd : {&this->memfd, &this->data_fd, &this->space_fd,
+                    &this->write_fd[0], &this->write_fd[1]}) {
+      if (*fd != -1) {
+        ::close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  /**
+     Returns "<memfd file descriptor>_<ring size>_<data eventfd file descriptor>_
+     <space eventfd file descriptor>_<file descriptor for reading by the other end>".
+  */
+  std::string ShmAcceptor::get_connection_instructions() {
+    return std::to_string(this->memfd) + "_" + std::to_string(this->ring_size) +
+      "_" + std::to_string(this->data_fd) + "_" + std::to_string(this->space_fd) +
+      "_" + std::to_string(this->write_fd[0]);
+  }
+
+  std::string ShmAcceptor::get_type() {
+    return "shm";
+  }
+#endif
+
+  /**
+     Constructs a PrefixedConnection object.
+
+     @param inner The underlying connection.
+     @param line  The line (without the newline character) to be returned
+                  before any data from the underlying connection.
+  */
+  PrefixedConnection::PrefixedConnection(std::unique_ptr<Connection> inner,
+                                         std::string line) {
+    this->inner = std::move(inner);
+    this->prefix = line + "\n";
+    this->prefix_pos = 0;
+  }
+
+  /**
+     Does nothing, the underlying connection is closed when it is destroyed.
+  */
+  void PrefixedConnection::close() {
+
+  }
+
+  int PrefixedConnection::read(char *buf, unsigned int len, long timeout_seconds) {
+    if (this->prefix_pos < this->prefix.size()) {
+      unsigned int to_copy = std::min((std::size_t)len,
+                                      this->prefix.size() - this->prefix_pos);
+      std::memcpy(buf, this->prefix.data() + this->prefix_pos, to_copy);
+      this->prefix_pos += to_copy;
+      return to_copy;
+    }
+
+    return this->inner->read(buf, len, timeout_seconds);
+  }
+
+  std::string PrefixedConnection::read(long timeout_seconds) {
+    std::string_view line;
+
+    if (this->read_line(line, timeout_seconds)) {
+      return std::string(line);
+    }
+
+    return this->inner->read(timeout_seconds);
+  }
+
+  bool PrefixedConnection::read_line(std::string_view &line, long timeout_seconds) {
+    if (this->prefix_pos < this->prefix.size()) {
+      // The prefix always ends with a newline character
+      std::size_t start = this->prefix_pos;
+      this->prefix_pos = this->prefix.size();
+
+      if (this->prefix.size() - start > 1) {
+        line = std::string_view(this->prefix).substr(start,
+                                                     this->prefix.size() - start - 1);
+        return true;
+      }
+    }
+
+    return this->inner->read_line(line, timeout_seconds);
+  }
+
+  void PrefixedConnection::read(fs::path file, long timeout_seconds) {
+    if (this->prefix_pos >= this->prefix.size()) {
+      this->inner->read(file, timeout_seconds);
+      return;
+    }
+
+    std::ofstream stream(file, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open the output file");
+    }
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+
+    while (true) {
+      int bytes_received = this->read(buf.get(), FILE_BUFFER_SIZE, timeout_seconds);
+
+      if (bytes_received == 0) {
+        break;
+      }
+
+      if (!stream.write(buf.get(), bytes_received)) {
+        throw std::runtime_error("Could not write to the output file");
+      }
+    }
+  }
+
+  void PrefixedConnection::write(std::string msg, bool new_line) {
+    this->inner->write(msg, new_line);
+  }
+
+  void PrefixedConnection::write(fs::path file) {
+    this->inner->write(file);
+  }
+
+  void PrefixedConnection::write(unsigned int len, char *buf) {
+    this->inner->write(len, buf);
+  }
+
+  unsigned int PrefixedConnection::get_buf_size() {
+    return this->inner->get_buf_size();
+  }
+
+#ifdef ZSTD_AVAILABLE
+  /**
+     Constructs a ZstdConnection object.
+
+     @param inner            The underlying connection.
+     @param decompress_reads Whether data received from the other end
+                             are compressed.
+     @param compress_writes  Whether data sent to the other end should be
+                             compressed.
+
+     @throw ConnectionException When zstd streams cannot be created.
+  */
+  ZstdConnection::ZstdConnection(std::shared_ptr<Connection> inner,
+                                 bool decompress_reads,
+                                 bool compress_writes) : framer(inner->get_buf_size()) {
+    this->inner = inner;
+    this->decompress_reads = decompress_reads;
+    this->compress_writes = compress_writes;
+    this->closed = false;
+    this->dstream = nullptr;
+    this->cstream = nullptr;
+    this->in_buf_size = ZSTD_DStreamInSize();
+    this->in_buf.reset(new char[this->in_buf_size]);
+    this->in = {this->in_buf.get(), 0, 0};
+    this->out_buf_size = ZSTD_CStreamOutSize();
+    this->out_buf.reset(new char[this->out_buf_size]);
+
+    if (decompress_reads) {
+      this->dstream = ZSTD_createDStream();
+
+      if (this->dstream == nullptr) {
+        std::runtime_error err("Could not create a zstd decompression stream");
+        throw ConnectionException(err);
+      }
+    }
+
+    if (compress_writes) {
+      this->cstream = ZSTD_createCStream();
+
+      if (this->cstream == nullptr) {
+        ZSTD_freeDStream(this->dstream);
+        std::runtime_error err("Could not create a zstd compression stream");
+        throw ConnectionException(err);
+      }
+
+      ZSTD_CCtx_setParameter(this->cstream, ZSTD_c_compressionLevel,
+                             ZSTD_LEVEL);
+    }
+  }
+
+  ZstdConnection::~ZstdConnection() {
+    this->close();
+    ZSTD_freeDStream(this->dstream);
+    ZSTD_freeCStream(this->cstream);
+  }
+
+  /**
+     Finishes the compressed stream to the other end, if any.
+     The underlying connection is closed when it is destroyed.
+  */
+  void ZstdConnection::close() {
+    if (this->closed) {
+      return;
+    }
+
+    this->closed = true;
+
+    if (this->compress_writes) {
+      try {
+        this->compress(nullptr, 0, ZSTD_e_end);
+      } catch (ConnectionException &e) {
+        // The other end will see a truncated stream
+      }
+    }
+  }
+
+  int ZstdConnection::receive(char *buf, unsigned int len, long timeout_seconds) {
+    if (!this->decompress_reads) {
+      return this->inner->read(buf, len, timeout_seconds);
+    }
+
+    if (len == 0) {
+      return 0;
+    }
+
+    while (true) {
+      // zstd may still hold decompressed data from previous input
+      // even if all of it has been consumed, so decompression is
+      // always attempted before receiving more
+      ZSTD_outBuffer out = {buf, len, 0};
+      std::size_t ret = ZSTD_decompressStream(this->dstream, &out, &this->in);
+
+      if (ZSTD_isError(ret)) {
+        std::runtime_error err("Could not decompress received data: " +
+                               std::string(ZSTD_getErrorName(ret)));
+        throw ConnectionException(err);
+      }
+
+      if (out.pos > 0) {
+        return out.pos;
+      }
+
+      int bytes_received = this->inner->read(this->in_buf.get(),
+                                             this->in_buf_size,
+                                             timeout_seconds);
+
+      if (bytes_received == 0) {
+        return 0;
+      }
+
+      this->in = {this->in_buf.get(), (std::size_t)bytes_received, 0};
+    }
+  }
+
+  void ZstdConnection::compress(const char *buf, std::size_t len,
+                                ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {buf, len, 0};
+    bool finished = false;
+
+    while (!finished) {
+      ZSTD_outBuffer output = {this->out_buf.get(), this->out_buf_size, 0};
+      std::size_t remaining = ZSTD_compressStream2(this->cstream, &output,
+                                                   &input, mode);
+
+      if (ZSTD_isError(remaining)) {
+        std::runtime_error err("Could not compress data: " +
+                               std::string(ZSTD_getErrorName(remaining)));
+        throw ConnectionException(err);
+      }
+
+      if (output.pos > 0) {
+        this->inner->write(output.pos, this->out_buf.get());
+      }
+
+      finished = mode == ZSTD_e_continue ? input.pos == input.size :
+        remaining == 0;
+    }
+  }
+
+  int ZstdConnection::read(char *buf, unsigned int len, long timeout_seconds) {
+    // Data already received by read_line() must be returned first
+    if (this->framer.has_buffered_data()) {
+      return this->framer.drain(buf, len);
+    }
+
+    return this->receive(buf, len, timeout_seconds);
+  }
+
+  std::string ZstdConnection::read(long timeout_seconds) {
+    std::string_view line;
+
+    if (this->read_line(line, timeout_seconds)) {
+      return std::string(line);
+    }
+
+    return this->framer.take_remaining();
+  }
+
+  bool ZstdConnection::read_line(std::string_view &line, long timeout_seconds) {
+    while (!this->framer.next(line)) {
+      unsigned int space = this->framer.get_write_space();
+      int bytes_received = this->receive(this->framer.get_write_ptr(),
+                                         space, timeout_seconds);
+
+      if (bytes_received == 0) {
+        return false;
+      }
+
+      this->framer.commit(bytes_received);
+    }
+
+    return true;
+  }
+
+  void ZstdConnection::read(fs::path file, long timeout_seconds) {
+    if (this->decompress_reads) {
+      receive_file(*this, this->framer, -1, false, file, timeout_seconds);
+    } else {
+      this->inner->read(file, timeout_seconds);
+    }
+  }
+
+  void ZstdConnection::write(std::string msg, bool new_line) {
+    if (!this->compress_writes) {
+      this->inner->write(msg, new_line);
+      return;
+    }
+
+    if (new_line) {
+      msg += "\n";
+    }
+
+    this->compress(msg.data(), msg.size(), ZSTD_e_continue);
+  }
+
+  void ZstdConnection::write(fs::path file) {
+    if (!this->compress_writes) {
+      this->inner->write(file);
+      return;
+    }
+
+    std::ifstream stream(file, std::ios::in | std::ios::binary);
+
+    if (!stream) {
+      std::runtime_error err("Could not open " + file.string());
+      throw ConnectionException(err);
+    }
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+
+    while (stream) {
+      stream.read(buf.get(), FILE_BUFFER_SIZE);
+      this->compress(buf.get(), stream.gcount(), ZSTD_e_continue);
+    }
+  }
+
+  void ZstdConnection::write(unsigned int len, char *buf) {
+    if (!this->compress_writes) {
+      this->inner->write(len, buf);
+      return;
+    }
+
+    this->compress(buf, len, ZSTD_e_continue);
+  }
+
+  unsigned int ZstdConnection::get_buf_size() {
+    return this->inner->get_buf_size();
+  }
+#endif
 }
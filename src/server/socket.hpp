@@ -4,14 +4,21 @@
 #ifndef SOCKET_HPP_
 #define SOCKET_HPP_
 
+#include "framer.hpp"
 #include <string>
-#include <queue>
+#include <string_view>
 #include <memory>
 #include <iostream>
 #include <filesystem>
+#include <cstdint>
+#include <atomic>
 #include <Poco/Net/ServerSocket.h>
 #include <boost/predef.h>
 
+#ifdef ZSTD_AVAILABLE
+#include <zstd.h>
+#endif
+
 #define UNLIMITED_ACCEPTED -1
 #define NO_TIMEOUT -1
 
@@ -19,6 +26,23 @@
 #define FILE_BUFFER_SIZE 1048576
 #endif
 
+// The size of the shared-memory ring used by ShmConnection, in bytes.
+// It must be a power of 2.
+#ifndef SHM_RING_SIZE
+#define SHM_RING_SIZE 4194304
+#endif
+
+// The maximum time ShmConnection sleeps for before checking the ring
+// again when no wakeup has been received, in milliseconds.
+#ifndef SHM_POLL_INTERVAL_MS
+#define SHM_POLL_INTERVAL_MS 10
+#endif
+
+// The zstd compression level used by ZstdConnection.
+#ifndef ZSTD_LEVEL
+#define ZSTD_LEVEL 3
+#endif
+
 namespace adaptyst {
   namespace net = Poco::Net;
   namespace fs = std::filesystem;
@@ -89,6 +113,44 @@ namespace adaptyst {
     */
     virtual std::string read(long timeout_seconds = NO_TIMEOUT) = 0;
 
+    /**
+       Reads a non-empty line from the connection without copying it.
+
+       line is set to the line content (without the newline character)
+       and stays valid until the next read call on the connection.
+
+       Returns false if the connection has been closed before a complete
+       line has been received. The incomplete line, if any, is lost
+       in this case.
+
+       @param line            A string view where the line should be stored.
+       @param timeout_seconds A maximum number of seconds that can pass
+                              while waiting for the data. Use NO_TIMEOUT for
+                              no timeout.
+
+       @throw TimeoutException    In case of timeout (see timeout_seconds).
+       @throw ConnectionException In case of any other errors.
+    */
+    virtual bool read_line(std::string_view &line,
+                           long timeout_seconds = NO_TIMEOUT) = 0;
+
+    /**
+       Reads data from the connection until the other end closes it
+       and saves them to a file, which is created or truncated.
+
+       @param file            The path to the file where data should
+                              be saved.
+       @param timeout_seconds A maximum number of seconds that can pass
+                              while waiting for a next portion of the data.
+                              Use NO_TIMEOUT for no timeout.
+
+       @throw TimeoutException    In case of timeout (see timeout_seconds).
+       @throw ConnectionException In case of connection errors.
+       @throw std::runtime_error  When the file cannot be opened or
+                                  written to.
+    */
+    virtual void read(fs::path file, long timeout_seconds) = 0;
+
     /**
        Writes a string to the connection.
 
@@ -148,6 +210,9 @@ namespace adaptyst {
     virtual unsigned int get_buf_size() = 0;
     virtual int read(char *buf, unsigned int len, long timeout_seconds) = 0;
     virtual std::string read(long timeout_seconds = NO_TIMEOUT) = 0;
+    virtual bool read_line(std::string_view &line,
+                           long timeout_seconds = NO_TIMEOUT) = 0;
+    virtual void read(fs::path file, long timeout_seconds) = 0;
     virtual void write(std::string msg, bool new_line = true) = 0;
     virtual void write(fs::path file) = 0;
     virtual void write(unsigned int len, char *buf) = 0;
@@ -271,10 +336,10 @@ namespace adaptyst {
   class TCPSocket : public Socket {
   private:
     net::StreamSocket socket;
-    std::unique_ptr<char> buf;
     unsigned int buf_size;
-    int start_pos;
-    std::queue<std::string> buffered_msgs;
+    LineFramer framer;
+
+    int receive(char *buf, unsigned int len, long timeout_seconds);
 
   protected:
     void close();
@@ -287,6 +352,9 @@ namespace adaptyst {
     unsigned int get_buf_size();
     int read(char *buf, unsigned int len, long timeout_seconds);
     std::string read(long timeout_seconds = NO_TIMEOUT);
+    bool read_line(std::string_view &line,
+                   long timeout_seconds = NO_TIMEOUT);
+    void read(fs::path file, long timeout_seconds);
     void write(std::string msg, bool new_line);
     void write(fs::path file);
     void write(unsigned int len, char *buf);
@@ -355,6 +423,80 @@ namespace adaptyst {
   };
 
 #ifdef BOOST_OS_UNIX
+  /**
+     A class describing a Unix domain socket.
+     This is available only when compiled for Unix-based platforms.
+
+     Poco stream sockets behave the same way regardless of their
+     address family, so only the address-related methods differ
+     from TCPSocket.
+  */
+  class UnixSocket : public TCPSocket {
+  private:
+    std::string path;
+
+  public:
+    UnixSocket(net::StreamSocket &sock, unsigned int buf_size);
+    std::string get_address();
+    unsigned short get_port();
+  };
+
+  /**
+     A class describing a Unix domain socket acceptor.
+     This is available only when compiled for Unix-based platforms.
+  */
+  class UnixAcceptor : public Acceptor {
+  private:
+    net::ServerSocket acceptor;
+    fs::path path;
+
+    UnixAcceptor(fs::path path, int max_accepted);
+
+  protected:
+    std::unique_ptr<Connection> accept_connection(unsigned int buf_size,
+                                                  long timeout);
+    void close();
+
+  public:
+    /**
+       A UnixAcceptor factory.
+    */
+    class Factory : public Acceptor::Factory {
+    private:
+      fs::path path;
+      bool unique_paths;
+      std::atomic<unsigned int> next_id;
+
+    public:
+      /**
+         Constructs a UnixAcceptor::Factory object.
+
+         @param path         A path where the Unix domain socket should be
+                             created.
+         @param unique_paths Indicates whether every acceptor should get
+                             its own socket path, formed by appending
+                             a unique suffix to path. This is the Unix domain
+                             socket counterpart of trying subsequent ports
+                             in TCPAcceptor::Factory.
+      */
+      Factory(fs::path path, bool unique_paths = false) {
+        this->path = path;
+        this->unique_paths = unique_paths;
+        this->next_id = 0;
+      }
+
+      std::unique_ptr<Acceptor> make_acceptor(int max_accepted);
+
+      std::string get_type() {
+        return "unix";
+      }
+    };
+
+    ~UnixAcceptor();
+    std::string get_connection_instructions();
+    std::string get_type();
+  };
+
   /**
      A class describing a file-descriptor-based connection.
      This is available only when compiled for Unix-based platforms.
@@ -364,9 +506,9 @@ namespace adaptyst {
     int read_fd[2];
     int write_fd[2];
     unsigned int buf_size;
-    std::queue<std::string> buffered_msgs;
-    std::unique_ptr<char> buf;
-    int start_pos;
+    LineFramer framer;
+
+    int receive(char *buf, unsigned int len, long timeout_seconds);
 
   public:
     FileDescriptor(int read_fd[2],
@@ -375,6 +517,9 @@ namespace adaptyst {
     ~FileDescriptor();
     int read(char *buf, unsigned int len, long timeout_seconds);
     std::string read(long timeout_seconds = NO_TIMEOUT);
+    bool read_line(std::string_view &line,
+                   long timeout_seconds = NO_TIMEOUT);
+    void read(fs::path file, long timeout_seconds);
     void write(std::string msg, bool new_line);
     void write(fs::path file);
     void write(unsigned int len, char *buf);
@@ -428,6 +573,215 @@ namespace adaptyst {
     std::string get_type();
   };
 #endif
+
+#if BOOST_OS_LINUX
+  /**
+     A class describing a connection where data from the other end
+     is received through a lock-free single-producer/single-consumer
+     ring buffer in a memfd shared-memory segment, with eventfd wakeups.
+     Data to the other end is sent through a pipe, as with FileDescriptor.
+     This is available only when compiled for Linux.
+
+     The segment starts with a header of 64-bit words, each in
+     a separate cache line:
+     * byte 0: the total number of bytes written by the producer
+       ("head"),
+     * byte 64: the total number of bytes read by the consumer
+       ("tail"),
+     * byte 128: non-zero if the consumer is waiting for data,
+     * byte 192: non-zero if the producer is waiting for space,
+     * byte 256: non-zero if the producer has closed the connection.
+
+     The ring data starts at byte DATA_OFFSET. The eventfds are written
+     to only when the other end is waiting (the producer may additionally
+     defer waking the consumer up until the ring is getting full), so
+     no system calls are made per message. Both ends wake up every
+     SHM_POLL_INTERVAL_MS milliseconds when waiting, so that a deferred
+     or missed wakeup only adds latency.
+  */
+  class ShmConnection : public Connection {
+  private:
+    char *region;
+    std::uint64_t ring_size;
+    int memfd;
+    int data_fd;
+    int space_fd;
+    FileDescriptor writer;
+    unsigned int buf_size;
+    LineFramer framer;
+
+    std::uint64_t &word(unsigned int offset);
+    int receive(char *buf, unsigned int len, long timeout_seconds);
+
+  public:
+    static const unsigned int HEAD_OFFSET = 0;
+    static const unsigned int TAIL_OFFSET = 64;
+    static const unsigned int CONSUMER_WAITING_OFFSET = 128;
+    static const unsigned int PRODUCER_WAITING_OFFSET = 192;
+    static const unsigned int CLOSED_OFFSET = 256;
+    static const unsigned int DATA_OFFSET = 4096;
+
+    ShmConnection(int memfd, char *region, std::uint64_t ring_size,
+                  int data_fd, int space_fd, int write_fd[2],
+                  unsigned int buf_size);
+    ~ShmConnection();
+    int read(char *buf, unsigned int len, long timeout_seconds);
+    std::string read(long timeout_seconds = NO_TIMEOUT);
+    bool read_line(std::string_view &line,
+                   long timeout_seconds = NO_TIMEOUT);
+    void read(fs::path file, long timeout_seconds);
+    void write(std::string msg, bool new_line);
+    void write(fs::path file);
+    void write(unsigned int len, char *buf);
+    unsigned int get_buf_size();
+    void close();
+  };
+
+  /**
+     A class describing a shared-memory ring acceptor (see ShmConnection).
+     This is available only when compiled for Linux.
+  */
+  class ShmAcceptor : public Acceptor {
+  private:
+    int memfd;
+    char *region;
+    std::uint64_t ring_size;
+    int data_fd;
+    int space_fd;
+    int write_fd[2];
+    bool transferred;
+
+    ShmAcceptor(std::uint64_t ring_size);
+
+  protected:
+    std::unique_ptr<Connection> accept_connection(unsigned int buf_size,
+                                                  long timeout);
+    void close();
+
+  public:
+    /**
+       A ShmAcceptor factory.
+    */
+    class Factory : public Acceptor::Factory {
+    private:
+      std::uint64_t ring_size;
+
+    public:
+      /**
+         Constructs a ShmAcceptor::Factory object.
+
+         @param ring_size The size of the shared-memory ring, in bytes.
+                          It must be a power of 2.
+      */
+      Factory(std::uint64_t ring_size = SHM_RING_SIZE) {
+        this->ring_size = ring_size;
+      }
+
+      /**
+         Makes a new ShmAcceptor object.
+
+         @param max_accepted Must be set to 1.
+
+         @throw std::runtime_error  When max_accepted is not 1.
+         @throw ConnectionException In case of any other errors.
+      */
+      std::unique_ptr<Acceptor> make_acceptor(int max_accepted) {
+        if (max_accepted != 1) {
+          throw std::runtime_error("max_accepted can only be 1 for ShmConnection");
+        }
+
+        return std::unique_ptr<Acceptor>(new ShmAcceptor(this->ring_size));
+      }
+
+      std::string get_type() {
+        return "shm";
+      }
+    };
+
+    ~ShmAcceptor();
+    std::string get_connection_instructions();
+    std::string get_type();
+  };
+#endif
+
+  /**
+     A class describing a connection on top of another one, where
+     a line already received from the underlying connection is returned
+     again before any further data. This is useful when the first line
+     of a connection has to be inspected before deciding who handles
+     the connection.
+  */
+  class PrefixedConnection : public Connection {
+  private:
+    std::unique_ptr<Connection> inner;
+    std::string prefix;
+    std::size_t prefix_pos;
+
+  protected:
+    void close();
+
+  public:
+    PrefixedConnection(std::unique_ptr<Connection> inner, std::string line);
+    int read(char *buf, unsigned int len, long timeout_seconds);
+    std::string read(long timeout_seconds = NO_TIMEOUT);
+    bool read_line(std::string_view &line,
+                   long timeout_seconds = NO_TIMEOUT);
+    void read(fs::path file, long timeout_seconds);
+    void write(std::string msg, bool new_line);
+    void write(fs::path file);
+    void write(unsigned int len, char *buf);
+    unsigned int get_buf_size();
+  };
+
+#ifdef ZSTD_AVAILABLE
+  /**
+     A class describing a connection on top of another one, with data
+     compressed by zstd in one or both directions. Data going in
+     a compressed direction form a single zstd stream, which is
+     finished when ZstdConnection is closed.
+
+     Compressed data are written to the underlying connection only when
+     the internal zstd buffer is full or the connection is closed, so
+     ZstdConnection should not be used for compressing request/response
+     exchanges. This is available only when compiled with libzstd.
+  */
+  class ZstdConnection : public Connection {
+  private:
+    std::shared_ptr<Connection> inner;
+    bool decompress_reads;
+    bool compress_writes;
+    bool closed;
+    ZSTD_DStream *dstream;
+    ZSTD_CStream *cstream;
+    std::unique_ptr<char[]> in_buf;
+    std::size_t in_buf_size;
+    ZSTD_inBuffer in;
+    std::unique_ptr<char[]> out_buf;
+    std::size_t out_buf_size;
+    LineFramer framer;
+
+    int receive(char *buf, unsigned int len, long timeout_seconds);
+    void compress(const char *buf, std::size_t len, ZSTD_EndDirective mode);
+
+  protected:
+    void close();
+
+  public:
+    ZstdConnection(std::shared_ptr<Connection> inner,
+                   bool decompress_reads,
+                   bool compress_writes);
+    ~ZstdConnection();
+    int read(char *buf, unsigned int len, long timeout_seconds);
+    std::string read(long timeout_seconds = NO_TIMEOUT);
+    bool read_line(std::string_view &line,
+                   long timeout_seconds = NO_TIMEOUT);
+    void read(fs::path file, long timeout_seconds);
+    void write(std::string msg, bool new_line);
+    void write(fs::path file);
+    void write(unsigned int len, char *buf);
+    unsigned int get_buf_size();
+  };
+#endif
 }
 
 #endif
@@ -0,0 +1,182 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "spill.hpp"
+#include <fstream>
+#include <stdexcept>
+
+namespace adaptyst {
+  /**
+     Constructs a MemoryBudget object.
+
+     @param budget The maximum estimated number of bytes all call trees
+                   of a session may take in memory. 0 means no limit,
+                   i.e. nothing is ever spilled.
+  */
+  MemoryBudget::MemoryBudget(std::size_t budget) {
+    this->budget = budget;
+    this->dir_created = false;
+    this->usage = 0;
+    this->max_usage = 0;
+    this->spilled = 0;
+    this->spilled_bytes = 0;
+    this->reloaded = 0;
+    this->next_id = 0;
+  }
+
+  /**
+     Destroys a MemoryBudget object, removing the spill directory
+     if it has been created.
+  */
+  MemoryBudget::~MemoryBudget() {
+    if (this->dir_created) {
+      std::error_code error;
+      fs::remove_all(this->spill_dir, error);
+    }
+  }
+
+  /**
+     Sets the directory where spilled call trees are saved. It is
+     created only when something is spilled for the first time.
+
+     This must be called before any spilling takes place.
+  */
+  void MemoryBudget::set_spill_dir(fs::path dir) {
+    std::lock_guard lock(this->dir_mutex);
+    this->spill_dir = dir;
+  }
+
+  /**
+     Changes the estimated memory usage of all call trees of the session.
+
+     @param delta The number of bytes to add (if positive)
+                  or subtract (if negative).
+  */
+  void MemoryBudget::add_usage(long long delta) {
+    long long usage = this->usage.fetch_add(delta) + delta;
+
+    if (usage > 0) {
+      std::size_t max_usage = this->max_usage;
+
+      while ((std::size_t)usage > max_usage &&
+             !this->max_usage.compare_exchange_weak(max_usage, usage)) { }
+    }
+  }
+
+  /**
+     Returns whether the estimated memory usage of all call trees
+     of the session exceeds the budget.
+  */
+  bool MemoryBudget::is_exceeded() {
+    return this->budget > 0 && this->usage > (long long)this->budget;
+  }
+
+  /**
+     Returns whether the estimated memory usage of all call trees of
+     the session exceeds SPILL_LOW_WATERMARK percent of the budget, i.e.
+     whether spilling should continue after the budget has been exceeded.
+  */
+  bool MemoryBudget::is_above_low_watermark() {
+    return this->budget > 0 &&
+      this->usage > (long long)(this->budget / 100 * SPILL_LOW_WATERMARK);
+  }
+
+  /**
+     Saves the pair of call trees of a thread to a new file in the spill
+     directory and replaces them with empty trees.
+
+     The memory usage is not changed by this method, i.e. the caller
+     should subtract the usage of the trees by calling add_usage().
+
+     @param output              The non-time-ordered call tree.
+     @param output_time_ordered The time-ordered call tree.
+
+     @return The path to the file the trees have been saved to.
+
+     @throw std::runtime_error When the file cannot be written.
+  */
+  fs::path MemoryBudget::spill(CallTree &output, CallTree &output_time_ordered) {
+    fs::path path;
+
+    {
+      std::lock_guard lock(this->dir_mutex);
+
+      if (!this->dir_created) {
+        fs::create_directories(this->spill_dir);
+        this->dir_created = true;
+      }
+
+      path = this->spill_dir / (std::to_string(this->next_id++) + ".tree");
+    }
+
+    std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    output.save(stream);
+    output_time_ordered.save(stream);
+    stream.close();
+
+    if (!stream) {
+      throw std::runtime_error("Could not spill call trees to " + path.string());
+    }
+
+    this->spilled++;
+    this->spilled_bytes += fs::file_size(path);
+
+    output = CallTree(false);
+    output_time_ordered = CallTree(true);
+
+    return path;
+  }
+
+  /**
+     Loads back the pair of call trees saved by spill() because new
+     samples have arrived for their thread. The file is removed afterwards.
+
+     See load_spilled_trees() for the description of the parameters
+     and the exceptions thrown.
+  */
+  void MemoryBudget::reload(fs::path path, CallTree &output,
+                            CallTree &output_time_ordered) {
+    load_spilled_trees(path, output, output_time_ordered);
+    this->reloaded++;
+  }
+
+  /**
+     Gets the spilling statistics of the session.
+  */
+  struct spill_stats MemoryBudget::get_stats() {
+    struct spill_stats stats;
+    stats.spilled = this->spilled;
+    stats.spilled_bytes = this->spilled_bytes;
+    stats.reloaded = this->reloaded;
+    stats.max_usage = this->max_usage;
+
+    return stats;
+  }
+
+  /**
+     Loads the pair of call trees saved by MemoryBudget::spill()
+     and removes the file.
+
+     @param path                The path to the file.
+     @param output              The non-time-ordered call tree to be replaced.
+     @param output_time_ordered The time-ordered call tree to be replaced.
+
+     @throw std::runtime_error When the file cannot be read.
+  */
+  void load_spilled_trees(fs::path path, CallTree &output,
+                          CallTree &output_time_ordered) {
+    {
+      std::ifstream stream(path, std::ios::in | std::ios::binary);
+
+      if (!stream) {
+        throw std::runtime_error("Could not open spilled call trees in " +
+                                 path.string());
+      }
+
+      output.load(stream);
+      output_time_ordered.load(stream);
+    }
+
+    fs::remove(path);
+  }
+};
@@ -0,0 +1,89 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef SPILL_HPP_
+#define SPILL_HPP_
+
+#include "calltree.hpp"
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <cstddef>
+
+// Once the memory budget of a session is exceeded, call trees are
+// spilled to disk until their memory usage drops to this percentage
+// of the budget, so that spilling does not start again straight away.
+#ifndef SPILL_LOW_WATERMARK
+#define SPILL_LOW_WATERMARK 75
+#endif
+
+// The number of samples a subclient processes between checks
+// of whether the memory budget of its session is exceeded.
+#ifndef SPILL_CHECK_INTERVAL
+#define SPILL_CHECK_INTERVAL 256
+#endif
+
+#define SPILL_DIR_NAME ".spill"
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+  /**
+     A structure describing the statistics of spilling call trees
+     to disk in a profiling session.
+  */
+  struct spill_stats {
+    // The number of times the trees of a thread have been spilled
+    unsigned long long spilled;
+
+    // The number of bytes written by spilling
+    unsigned long long spilled_bytes;
+
+    // The number of times spilled trees have been loaded back
+    // because new samples have arrived for their thread
+    unsigned long long reloaded;
+
+    // The largest estimated memory usage of all call trees at once
+    std::size_t max_usage;
+  };
+
+  /**
+     A thread-safe class tracking the estimated memory usage of all call
+     trees of a profiling session against a budget, and spilling the trees
+     of a thread to disk on behalf of a subclient when the budget is
+     exceeded.
+
+     Spilled trees are loaded back as soon as their thread is sampled again
+     (so that the result is exactly the same as without spilling) or once
+     they are needed for writing the results (see load_spilled_trees()).
+  */
+  class MemoryBudget {
+  private:
+    std::size_t budget;
+    fs::path spill_dir;
+    std::mutex dir_mutex;
+    bool dir_created;
+    std::atomic<long long> usage;
+    std::atomic<std::size_t> max_usage;
+    std::atomic<unsigned long long> spilled;
+    std::atomic<unsigned long long> spilled_bytes;
+    std::atomic<unsigned long long> reloaded;
+    std::atomic<unsigned long long> next_id;
+
+  public:
+    MemoryBudget(std::size_t budget = 0);
+    ~MemoryBudget();
+    void set_spill_dir(fs::path dir);
+    void add_usage(long long delta);
+    bool is_exceeded();
+    bool is_above_low_watermark();
+    fs::path spill(CallTree &output, CallTree &output_time_ordered);
+    void reload(fs::path path, CallTree &output, CallTree &output_time_ordered);
+    struct spill_stats get_stats();
+  };
+
+  void load_spilled_trees(fs::path path, CallTree &output,
+                          CallTree &output_time_ordered);
+};
+
+#endif
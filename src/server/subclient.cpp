@@ -2,100 +2,18 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "server.hpp"
+#include "protocol.hpp"
+#include <sstream>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <unordered_set>
 #include <unordered_map>
 
 namespace adaptyst {
-  void StdSubclient::recurse(nlohmann::json &cur_elem,
-                             std::vector<std::pair<std::string, std::string> > &callchain_parts,
-                             int callchain_index,
-                             unsigned long long period,
-                             bool time_ordered, bool offcpu) {
-    std::pair<std::string, std::string> p = callchain_parts[callchain_index];
-    nlohmann::json &arr = cur_elem["children"];
-    nlohmann::json *elem;
-
-    bool last_block = callchain_index == callchain_parts.size() - 1;
-
-    if (!offcpu) {
-      cur_elem["cold"] = false;
-    }
-
-    if (time_ordered) {
-      if (arr.empty() || arr.back()["name"] != p.first ||
-          (last_block &&
-           arr.back()["cold"] != offcpu) ||
-          (last_block &&
-           !arr.back()["children"].empty()) ||
-          (!last_block &&
-           arr.back()["children"].empty())) {
-        nlohmann::json new_elem;
-        new_elem["name"] = p.first;
-        new_elem["offsets"] = nlohmann::json::object();
-        new_elem["value"] = 0;
-        new_elem["children"] = nlohmann::json::array();
-        new_elem["cold"] = offcpu;
-        arr.push_back(new_elem);
-      }
-
-      elem = &arr.back();
-    } else {
-      bool found = false;
-      int cold_index = -1;
-      int hot_index = -1;
-
-      for (int i = 0; i < arr.size(); i++) {
-        if (arr[i]["name"] == p.first &&
-            (!last_block || arr[i]["cold"] == offcpu)) {
-          found = true;
-
-          if (arr[i]["cold"]) {
-            cold_index = i;
-          } else {
-            hot_index = i;
-          }
-        }
-      }
-
-      if (found) {
-        if (cold_index == -1) {
-          elem = &arr[hot_index];
-        } else if (hot_index == -1) {
-          elem = &arr[cold_index];
-        } else if (offcpu) {
-          elem = &arr[cold_index];
-        } else {
-          elem = &arr[hot_index];
-        }
-      } else {
-        nlohmann::json new_elem;
-        new_elem["name"] = p.first;
-        new_elem["offsets"] = nlohmann::json::object();
-        new_elem["value"] = 0;
-        new_elem["children"] = nlohmann::json::array();
-        new_elem["cold"] = offcpu;
-
-        arr.push_back(new_elem);
-        elem = &arr.back();
-      }
-    }
-
-    (*elem)["value"] = (unsigned long long)(*elem)["value"] + period;
-
-    unsigned long long old_value = 0;
-
-    if ((*elem)["offsets"].contains(p.second)) {
-      old_value = (unsigned long long)(*elem)["offsets"][p.second];
-    }
-
-    (*elem)["offsets"][p.second] = old_value + period;
-
-    if (!last_block) {
-      recurse(*elem, callchain_parts, callchain_index + 1, period,
-              time_ordered, offcpu);
-    }
-  }
+  static std::atomic<unsigned long long> subclient_count(0);
 
   StdSubclient::StdSubclient(Client &context,
                              std::unique_ptr<Acceptor> &acceptor,
@@ -104,6 +22,7 @@ namespace adaptyst {
                                                                     acceptor,
                                                                     profiled_filename,
                                                                     buf_size) {
+    this->id = subclient_count++;
     this->json_result = nlohmann::json::object();
   }
 
@@ -115,49 +34,455 @@ namespace adaptyst {
 
     struct sample_result {
       std::string event_type;
-      nlohmann::json output;
-      nlohmann::json output_time_ordered;
+      CallTree output;
+      CallTree output_time_ordered;
       unsigned long long total_period = 0;
       std::vector<struct offcpu_region> offcpu_regions;
+
+      // The timestamp of the first sample of the thread received
+      // by the subclient
+      unsigned long long first_time = 0;
+
+      // The memory usage of the trees accounted in MemoryBudget,
+      // the sequence number of the most recent sample of the thread,
+      // and the file the trees have been spilled to (if any)
+      std::size_t memory = 0;
+      unsigned long long last_sampled = 0;
+      fs::path spill_path;
+
+      // Call tree deltas taken for the next snapshot before the trees
+      // have been spilled, and the number of off-CPU regions which
+      // have been included in the previous snapshots
+      nlohmann::json pending_deltas = nlohmann::json::array();
+      std::size_t offcpu_regions_saved = 0;
+
+      sample_result() : output(false), output_time_ordered(true) { }
+    };
+
+    struct previous_callchain {
+      std::vector<protocol::CallchainElem> callchain;
+      bool added = false;
+      std::string event_name;
     };
 
     try {
       std::unordered_set<std::string> messages_received;
       std::unordered_map<std::string, std::vector<std::pair<std::string, std::string> > > tid_dict;
+
+      // The sample results per event type ("" for on-CPU/off-CPU
+      // samples, i.e. walltime), PID, and TID, as samples of several
+      // events can be sent over one connection
       std::unordered_map<
         std::string,
         std::unordered_map<
           std::string,
-          struct sample_result > > subprocesses;
+          std::unordered_map<
+            std::string,
+            struct sample_result > > > subprocesses;
       std::unordered_map<std::string, std::string> combo_dict;
       std::unordered_map<std::string, unsigned long long> exit_time_dict;
       std::unordered_map<std::string, std::vector<std::pair<std::string, unsigned long long> > > name_time_dict;
       std::unordered_map<std::string, std::string> tree;
 
-      std::string extra_event_name = "";
+      // The most recent callchain of every thread, which delta-encoded
+      // callchains are relative to, along with whether it has been added
+      // to the call trees of the thread (and of which event type)
+      std::unordered_map<std::string, struct previous_callchain> previous_callchains;
+
       bool first_event_received = false;
       std::vector<std::pair<unsigned long long, std::string> > added_list;
 
       unsigned long long start_time = 0;
       bool start_time_set = false;
 
+      SymbolTable &symbols = this->context.get_symbol_table();
+
+      // Symbol IDs sent by the script are mapped to the session-wide
+      // IDs in the symbol table shared by all subclients
+      std::vector<std::uint32_t> symbol_map;
+      bool unknown_symbol_warned = false;
+
+      auto on_symbol = [&](std::uint32_t id, const std::string &name) {
+        if (id >= symbol_map.size()) {
+          symbol_map.resize(id + 1, CallTree::NONE);
+        }
+
+        symbol_map[id] = symbols.intern(name);
+      };
+
+      auto map_symbols = [&](std::vector<protocol::CallchainElem> &callchain) {
+        for (auto &elem : callchain) {
+          if (elem.symbol >= symbol_map.size() ||
+              symbol_map[elem.symbol] == CallTree::NONE) {
+            if (!unknown_symbol_warned) {
+              std::cerr << "A callchain refers to symbol " << elem.symbol;
+              std::cerr << " which has not been defined, it will be ";
+              std::cerr << "marked as unknown." << std::endl;
+              unknown_symbol_warned = true;
+            }
+
+            elem.symbol = symbols.intern("[\"(unknown)\", \"\"]");
+          } else {
+            elem.symbol = symbol_map[elem.symbol];
+          }
+        }
+      };
+
+      auto on_syscall = [&](std::string &ret_value,
+                            std::vector<protocol::CallchainElem> &callchain) {
+        messages_received.insert("syscall");
+        map_symbols(callchain);
+
+        std::vector<std::pair<std::string, std::string> > &result = tid_dict[ret_value];
+        result.clear();
+
+        for (auto &elem : callchain) {
+          result.push_back(std::make_pair(std::to_string(elem.symbol),
+                                          protocol::offset_to_string(elem.offset)));
+        }
+      };
+
+      auto on_syscall_meta = [&](std::string &syscall_type, std::string &comm_name,
+                                 std::string &pid, std::string &tid,
+                                 unsigned long long time, std::string &ret_value) {
+        messages_received.insert("syscall_meta");
+
+        std::string pid_tid = pid + "/" + tid;
+        bool added_to_name_time_dict = false;
+
+        if (tree.find(tid) == tree.end()) {
+          tree[tid] = "";
+          added_list.push_back(std::make_pair(time, tid));
+
+          name_time_dict[tid].push_back(std::make_pair(comm_name, time));
+          added_to_name_time_dict = true;
+        }
+
+        combo_dict[tid] = pid + "/" + tid;
+
+        if (syscall_type == "new_proc") {
+          if (tree.find(ret_value) == tree.end()) {
+            added_list.push_back(std::make_pair(time, ret_value));
+          }
+
+          tree[ret_value] = tid;
+          combo_dict[ret_value] = "?/" + ret_value;
+          name_time_dict[ret_value].push_back(std::make_pair(comm_name, time));
+        } else if (syscall_type == "execve" && !added_to_name_time_dict) {
+          name_time_dict[tid].push_back(std::make_pair(comm_name, time));
+        } else if (syscall_type == "exit") {
+          exit_time_dict[tid] = time;
+        }
+      };
+
+      std::uint32_t no_callchain_symbol =
+        symbols.intern("[\"(just thread/process)\", \"\"]");
+
+      MemoryBudget &budget = this->context.get_memory_budget();
+      unsigned long long sample_count = 0;
+      bool spill_failed = false;
+
+      unsigned int snapshot_interval = this->context.get_snapshot_interval();
+      std::chrono::steady_clock::time_point profile_start_time;
+      unsigned int next_snapshot = 1;
+      unsigned long long snapshot_sample_count = 0;
+
+      // A snapshot consists of what has changed in the threads sampled
+      // since the previous snapshot. It is written by the client in the
+      // background, so ingestion only stops for extracting the changes.
+      auto take_snapshot = [&](unsigned int index) {
+        nlohmann::json snapshot;
+        snapshot["start_time"] = start_time;
+        snapshot["subclient"] = this->id;
+        snapshot["threads"] = nlohmann::json::object();
+
+        for (auto &event : subprocesses) {
+          for (auto &elem : event.second) {
+            for (auto &elem2 : elem.second) {
+              struct sample_result &res = elem2.second;
+              bool sampled = res.last_sampled > snapshot_sample_count;
+
+              if (!sampled && res.pending_deltas.empty()) {
+                continue;
+              }
+
+              nlohmann::json &threads = snapshot["threads"][elem.first + "_" + elem2.first];
+
+              if (threads.is_null()) {
+                threads = nlohmann::json::array();
+              }
+
+              nlohmann::json thread;
+              thread["event_name"] = event.first == "" ? "walltime" : event.first;
+              thread["total_period"] = res.total_period;
+              thread["first_time"] = res.first_time;
+              thread["offcpu_regions"] = nlohmann::json::array();
+
+              for (std::size_t i = res.offcpu_regions_saved; i < res.offcpu_regions.size(); i++) {
+                thread["offcpu_regions"].push_back({res.offcpu_regions[i].timestamp,
+                                                    res.offcpu_regions[i].period});
+              }
+
+              res.offcpu_regions_saved = res.offcpu_regions.size();
+
+              // Spilled trees have had their deltas taken before spilling
+              if (sampled && res.spill_path.empty()) {
+                res.pending_deltas.push_back({res.output.take_delta(),
+                                              res.output_time_ordered.take_delta()});
+              }
+
+              thread["deltas"] = std::move(res.pending_deltas);
+              res.pending_deltas = nlohmann::json::array();
+              threads.push_back(std::move(thread));
+            }
+          }
+        }
+
+        snapshot_sample_count = sample_count;
+
+        if (!snapshot["threads"].empty()) {
+          this->context.save_snapshot(index, snapshot);
+        }
+      };
+
+      // When the memory budget of the session is exceeded, the trees of
+      // the least recently sampled threads of this subclient are spilled
+      // to disk until the usage drops below the low watermark. The trees
+      // of the thread which has just been sampled are kept, as they would
+      // most likely have to be loaded back straight away.
+      auto spill_coldest = [&](struct sample_result &current) {
+        std::vector<struct sample_result *> candidates;
+
+        for (auto &event : subprocesses) {
+          for (auto &elem : event.second) {
+            for (auto &elem2 : elem.second) {
+              struct sample_result &res = elem2.second;
+
+              if (&res != &current && res.spill_path.empty() && res.memory > 0) {
+                candidates.push_back(&res);
+              }
+            }
+          }
+        }
+
+        std::sort(candidates.begin(), candidates.end(),
+                  [] (auto a, auto b) { return a->last_sampled < b->last_sampled; });
+
+        for (auto res : candidates) {
+          if (!budget.is_above_low_watermark()) {
+            break;
+          }
+
+          // Spilled trees do not get any new samples before being
+          // loaded back, so their final value is known already
+          res->output.set_value(res->total_period);
+          res->output_time_ordered.set_value(res->total_period);
+
+          if (snapshot_interval > 0 && res->last_sampled > snapshot_sample_count) {
+            res->pending_deltas.push_back({res->output.take_delta(),
+                                           res->output_time_ordered.take_delta()});
+          }
+
+          try {
+            res->spill_path = budget.spill(res->output, res->output_time_ordered);
+          } catch (std::exception &e) {
+            std::cerr << "Could not spill call trees to disk, the memory budget ";
+            std::cerr << "will be ignored from now on: " << e.what() << std::endl;
+            spill_failed = true;
+            return;
+          }
+
+          budget.add_usage(-(long long)res->memory);
+          res->memory = 0;
+        }
+      };
+
+      auto on_sample = [&](std::string &event_type, std::string &pid,
+                           std::string &tid, unsigned long long timestamp,
+                           unsigned long long period,
+                           std::vector<protocol::CallchainElem> &callchain,
+                           long long common_prefix) {
+        map_symbols(callchain);
+
+        std::string event_name =
+          event_type == "offcpu-time" || event_type == "task-clock" ? "" : event_type;
+
+        // A delta-encoded callchain (i.e. common_prefix >= 0) only has
+        // the elements following the first common_prefix ones of
+        // the previous callchain of the thread. If the previous callchain
+        // has been added to the trees of the same event type, they can
+        // resume from the nodes of these elements rather than descend
+        // from the root again.
+        struct previous_callchain *previous = nullptr;
+        std::size_t tree_prefix = 0;
+
+        if (common_prefix >= 0) {
+          previous = &previous_callchains[pid + "_" + tid];
+
+          if ((std::size_t)common_prefix > previous->callchain.size()) {
+            std::cerr << "The recently received sample refers to more elements ";
+            std::cerr << "of the previous callchain than there are, ignoring." << std::endl;
+            return;
+          }
+
+          callchain.insert(callchain.begin(), previous->callchain.begin(),
+                           previous->callchain.begin() + common_prefix);
+          previous->callchain = callchain;
+
+          if (previous->added && previous->event_name == event_name) {
+            tree_prefix = common_prefix;
+          }
+
+          previous->added = false;
+        }
+
+        // Delta-encoded samples received before the start of profiling
+        // is known are ignored only at this point, as the following
+        // ones may refer to their callchains
+        if (!start_time_set) {
+          return;
+        }
+
+        messages_received.insert("sample");
+
+        if (!first_event_received) {
+          first_event_received = true;
+
+          if (event_name == "" && timestamp - period < start_time) {
+            period = timestamp - start_time;
+          }
+        }
+
+        struct sample_result &res = subprocesses[event_name][pid][tid];
+
+        if (!res.spill_path.empty()) {
+          budget.reload(res.spill_path, res.output, res.output_time_ordered);
+          res.spill_path.clear();
+        }
+
+        if (callchain.empty()) {
+          callchain.push_back({no_callchain_symbol, NO_OFFSET});
+        }
+
+        if (res.last_sampled == 0) {
+          res.first_time = timestamp;
+        }
+
+        if (event_type == "offcpu-time") {
+          struct offcpu_region reg;
+          reg.timestamp = timestamp - period;
+          reg.period = period;
+          res.offcpu_regions.push_back(reg);
+        }
+
+        res.output.add(callchain, period, event_type == "offcpu-time",
+                       tree_prefix);
+        res.output_time_ordered.add(callchain, period,
+                                    event_type == "offcpu-time", tree_prefix);
+
+        if (previous != nullptr) {
+          previous->added = true;
+          previous->event_name = event_name;
+        }
+
+        res.total_period += period;
+
+        std::size_t memory = res.output.get_memory_usage() +
+          res.output_time_ordered.get_memory_usage();
+        budget.add_usage((long long)memory - (long long)res.memory);
+        res.memory = memory;
+        res.last_sampled = ++sample_count;
+
+        if (sample_count % SPILL_CHECK_INTERVAL == 0 && !spill_failed &&
+            budget.is_exceeded()) {
+          spill_coldest(res);
+        }
+
+        // Like the memory budget, the clock is only checked every
+        // SPILL_CHECK_INTERVAL samples rather than on every sample.
+        // Snapshots are numbered from the start of profiling rather
+        // than from the connection of the subclient, so that all
+        // subclients agree on what a given snapshot covers.
+        if (snapshot_interval > 0 && sample_count % SPILL_CHECK_INTERVAL == 0 &&
+            this->context.get_profile_start_time(&profile_start_time)) {
+          unsigned int index = (std::chrono::steady_clock::now() - profile_start_time) /
+            std::chrono::seconds(snapshot_interval);
+
+          if (index >= next_snapshot) {
+            take_snapshot(index);
+            next_snapshot = index + 1;
+          }
+        }
+      };
+
       {
         std::shared_ptr<Connection> connection = this->acceptor->accept(this->buf_size);
         this->context.notify();
 
+        bool binary = false;
+
+        // A JSON callchain is a list of [<symbol ID>, <offset>] string pairs
+        auto parse_callchain = [](nlohmann::json &arr) {
+          std::vector<protocol::CallchainElem> callchain;
+
+          for (auto &elem : arr.template get<
+                 std::vector<std::pair<std::string, std::string> > >()) {
+            callchain.push_back({(std::uint32_t)std::stoul(elem.first),
+                                 protocol::offset_from_string(elem.second)});
+          }
+
+          return callchain;
+        };
+
         while (true) {
-          std::string line = connection->read();
+          std::string_view line;
 
-          if (line == "<STOP>") {
+          if (!connection->read_line(line) || line == "<STOP>") {
             break;
           }
 
+          if (line.starts_with(COMPRESSION_NEGOTIATION " ")) {
+            // Everything sent by the other end after a successful
+            // negotiation is compressed, replies are not
+            std::string codec(line.substr(std::strlen(COMPRESSION_NEGOTIATION " ")));
+
+#ifdef ZSTD_AVAILABLE
+            if (codec == "zstd" && this->context.get_compression() == "zstd") {
+              connection->write(COMPRESSION_NEGOTIATION " zstd", true);
+              connection = std::make_shared<ZstdConnection>(connection, true, false);
+              continue;
+            }
+#endif
+
+            connection->write(COMPRESSION_NEGOTIATION " none", true);
+            continue;
+          }
+
+          if (line.starts_with(PROTOCOL_NEGOTIATION " ")) {
+            std::istringstream stream{std::string(line)};
+            std::string tag, protocol;
+            int version = 0;
+            stream >> tag >> protocol >> version;
+
+            if (protocol == "binary" && version >= 1) {
+              connection->write(PROTOCOL_NEGOTIATION " binary " +
+                                std::to_string(std::min(version,
+                                                        BINARY_PROTOCOL_VERSION)),
+                                true);
+              binary = true;
+              break;
+            }
+
+            connection->write(PROTOCOL_NEGOTIATION " json", true);
+            continue;
+          }
+
           start_time_set = this->context.get_profile_start_tstamp(&start_time);
 
           nlohmann::json obj;
 
           try {
-            obj = nlohmann::json::parse(line);
+            obj = nlohmann::json::parse(line.begin(), line.end());
           } catch (...) {
             std::cerr << "Could not parse the recently-received line to JSON, ignoring." << std::endl;
             continue;
@@ -171,22 +496,33 @@ namespace adaptyst {
           }
 
           std::string type = obj["type"].template get<std::string>();
-          messages_received.insert(type);
 
-          if (type == "syscall") {
+          if (type == "symbol") {
+            std::uint32_t id;
+            std::string name;
+
+            try {
+              id = obj["id"];
+              name = obj["name"].dump();
+            } catch (...) {
+              std::cerr << "The recently-received symbol JSON is invalid, ignoring." << std::endl;
+              continue;
+            }
+
+            on_symbol(id, name);
+          } else if (type == "syscall") {
             std::string ret_value;
-            std::vector<std::pair<std::string, std::string> > callchain;
+            std::vector<protocol::CallchainElem> callchain;
 
             try {
               ret_value = obj["ret_value"];
-              callchain = obj["callchain"].template get<
-                std::vector<std::pair<std::string, std::string> > >();
+              callchain = parse_callchain(obj["callchain"]);
             } catch (...) {
               std::cerr << "The recently-received syscall JSON is invalid, ignoring." << std::endl;
               continue;
             }
 
-            tid_dict[ret_value] = callchain;
+            on_syscall(ret_value, callchain);
           } else if (type == "syscall_meta") {
             std::string syscall_type, comm_name, pid, tid, ret_value;
             unsigned long long time;
@@ -203,111 +539,114 @@ namespace adaptyst {
               continue;
             }
 
-            std::string pid_tid = pid + "/" + tid;
-            bool added_to_name_time_dict = false;
-
-            if (tree.find(tid) == tree.end()) {
-              tree[tid] = "";
-              added_list.push_back(std::make_pair(time, tid));
-
-              name_time_dict[tid].push_back(std::make_pair(comm_name, time));
-              added_to_name_time_dict = true;
-            }
-
-            combo_dict[tid] = pid + "/" + tid;
-
-            if (syscall_type == "new_proc") {
-              if (tree.find(ret_value) == tree.end()) {
-                added_list.push_back(std::make_pair(time, ret_value));
-              }
-
-              tree[ret_value] = tid;
-              combo_dict[ret_value] = "?/" + ret_value;
-              name_time_dict[ret_value].push_back(std::make_pair(comm_name, time));
-            } else if (syscall_type == "execve" && !added_to_name_time_dict) {
-              name_time_dict[tid].push_back(std::make_pair(comm_name, time));
-            } else if (syscall_type == "exit") {
-              exit_time_dict[tid] = time;
-            }
+            on_syscall_meta(syscall_type, comm_name, pid, tid, time, ret_value);
           } else if (type == "sample" && start_time_set) {
             std::string event_type, pid, tid;
             unsigned long long timestamp, period;
-            std::vector<std::pair<std::string, std::string> > callchain;
+            std::vector<protocol::CallchainElem> callchain;
             try {
               event_type = obj["event_type"];
               pid = obj["pid"];
               tid = obj["tid"];
               timestamp = obj["time"];
               period = obj["period"];
-              callchain = obj["callchain"].template get<
-                std::vector<std::pair<std::string, std::string> > >();
+              callchain = parse_callchain(obj["callchain"]);
             } catch (...) {
               std::cerr << "The recently received sample JSON is invalid, ignoring." << std::endl;
               continue;
             }
 
-            if (!first_event_received) {
-              first_event_received = true;
-
-              if (event_type == "offcpu-time" || event_type == "task-clock") {
-                extra_event_name = "";
+            on_sample(event_type, pid, tid, timestamp, period, callchain, -1);
+          } else {
+            messages_received.insert(type);
+          }
+        }
 
-                if (timestamp - period < start_time) {
-                  period = timestamp - start_time;
-                }
-              } else {
-                extra_event_name = event_type;
-              }
-            } else if ((extra_event_name != "" && event_type != extra_event_name) ||
-                       (extra_event_name == "" && event_type != "offcpu-time" && event_type != "task-clock")) {
-              std::cerr << "The recently received sample JSON is of different event type than expected ";
-              std::cerr << "(received: " << event_type << ", expected: ";
-              std::cerr << (extra_event_name == "" ? "task-clock or offcpu-time" : extra_event_name);
-              std::cerr << "), ignoring." << std::endl;
+        if (binary) {
+          // buf_size is meant for JSON lines, which are much shorter
+          // than the batches of binary records sent at once
+          protocol::RecordReader reader(*connection,
+                                        std::max(this->buf_size,
+                                                 (unsigned int)BINARY_BUFFER_SIZE));
+          std::string_view payload;
+
+          protocol::Symbol symbol;
+          protocol::Sample sample;
+          protocol::Syscall syscall;
+          protocol::SyscallMeta meta;
+
+          while (reader.next(payload)) {
+            if (payload.empty()) {
+              std::cerr << "The recently-received binary record is empty, ignoring." << std::endl;
               continue;
             }
 
-            if (subprocesses.find(pid) == subprocesses.end()) {
-              std::unordered_map<std::string, struct sample_result > new_map;
-              subprocesses[pid] = new_map;
-            }
+            protocol::RecordType type = protocol::get_type(payload);
 
-            if (subprocesses[pid].find(tid) == subprocesses[pid].end()) {
-              subprocesses[pid][tid] = {};
-              struct sample_result &res = subprocesses[pid][tid];
-
-              res.output["name"] = "all";
-              res.output["value"] = 0;
-              res.output["children"] = nlohmann::json::array();
-              // Will switch to false as soon as on-CPU activity is encountered
-              res.output["cold"] = true;
-
-              res.output_time_ordered["name"] = "all";
-              res.output_time_ordered["value"] = 0;
-              res.output_time_ordered["children"] = nlohmann::json::array();
-              // Will switch to false as soon as on-CPU activity is encountered
-              res.output_time_ordered["cold"] = true;
+            if (type == protocol::STOP) {
+              break;
             }
 
-            struct sample_result &res = subprocesses[pid][tid];
+            start_time_set = this->context.get_profile_start_tstamp(&start_time);
 
-            if (callchain.empty()) {
-              callchain.push_back(std::make_pair("(just thread/process)", ""));
-            }
+            if (type == protocol::SYMBOL) {
+              std::string name;
 
-            if (event_type == "offcpu-time") {
-              struct offcpu_region reg;
-              reg.timestamp = timestamp - period;
-              reg.period = period;
-              res.offcpu_regions.push_back(reg);
-            }
+              try {
+                if (!protocol::decode(payload, symbol)) {
+                  throw std::runtime_error("");
+                }
 
-            recurse(res.output, callchain, 0, period, false,
-                    event_type == "offcpu-time");
-            recurse(res.output_time_ordered, callchain, 0, period,
-                    true, event_type == "offcpu-time");
+                // Names are normalised so that they are the same as in
+                // the JSON protocol
+                name = nlohmann::json::parse(symbol.name).dump();
+              } catch (...) {
+                std::cerr << "The recently-received symbol record is invalid, ignoring." << std::endl;
+                continue;
+              }
 
-            res.total_period += period;
+              on_symbol(symbol.id, name);
+            } else if (type == protocol::SYSCALL) {
+              if (!protocol::decode(payload, syscall)) {
+                std::cerr << "The recently-received syscall record is invalid, ignoring." << std::endl;
+                continue;
+              }
+
+              std::string ret_value = std::to_string(syscall.ret_value);
+              on_syscall(ret_value, syscall.callchain);
+            } else if (type == protocol::SYSCALL_META) {
+              if (!protocol::decode(payload, meta)) {
+                std::cerr << "The recently-received syscall tree record is invalid, ignoring." << std::endl;
+                continue;
+              }
+
+              std::string pid = std::to_string(meta.pid);
+              std::string tid = std::to_string(meta.tid);
+              std::string ret_value = std::to_string(meta.ret_value);
+              on_syscall_meta(meta.subtype, meta.comm, pid, tid, meta.time,
+                              ret_value);
+            } else if (((type == protocol::SAMPLE ||
+                         type == protocol::AGGREGATED_SAMPLE) && start_time_set) ||
+                       type == protocol::DELTA_SAMPLE) {
+              if (!protocol::decode(payload, sample)) {
+                std::cerr << "The recently received sample record is invalid, ignoring." << std::endl;
+                continue;
+              }
+
+              // The samples of an aggregated (or delta) record are
+              // consecutive within their thread, so adding their summed
+              // period at once results in the same trees (including
+              // the time-ordered one) as adding them one by one
+              std::string pid = std::to_string(sample.pid);
+              std::string tid = std::to_string(sample.tid);
+              on_sample(sample.event_type, pid, tid, sample.time,
+                        sample.period, sample.callchain,
+                        sample.delta ? (long long)sample.common_prefix : -1);
+            } else if (type != protocol::SAMPLE &&
+                       type != protocol::AGGREGATED_SAMPLE) {
+              std::cerr << "The recently-received binary record is of unknown type ";
+              std::cerr << (int)type << ", ignoring." << std::endl;
+            }
           }
         }
       }
@@ -320,12 +659,7 @@ namespace adaptyst {
                 [] (auto &a, auto &b) { return a.first < b.first; });
 
       for (auto &msg : messages_received) {
-        std::string msg_key;
-        if (msg == "sample" && extra_event_name != "") {
-          msg_key = "sample " + extra_event_name;
-        } else {
-          msg_key = msg;
-        }
+        std::string msg_key = msg;
 
         if (msg == "syscall") {
           this->json_result[msg_key] = tid_dict;
@@ -395,35 +729,38 @@ namespace adaptyst {
             }
           }
         } else if (msg == "sample") {
-          for (auto &elem : subprocesses) {
-            for (auto &elem2 : elem.second) {
-              struct sample_result &res = elem2.second;
-              res.output["value"] = res.total_period;
-              res.output_time_ordered["value"] = res.total_period;
-
-              nlohmann::json &pid_tid_result = this->json_result[msg_key][elem.first + "_" + elem2.first];
-              std::string event_name;
-
-              if (extra_event_name == "") {
-                event_name = "walltime";
-                pid_tid_result["sampled_time"] = res.total_period;
-                pid_tid_result["offcpu_regions"] = nlohmann::json::array();
-
-                for (int i = 0; i < res.offcpu_regions.size(); i++) {
-                  nlohmann::json offcpu_arr = {
-                    res.offcpu_regions[i].timestamp,
-                    res.offcpu_regions[i].period
-                  };
-
-                  pid_tid_result["offcpu_regions"].push_back(offcpu_arr);
+          for (auto &event : subprocesses) {
+            std::string event_name = event.first == "" ? "walltime" : event.first;
+            msg_key = event.first == "" ? "sample" : "sample " + event.first;
+
+            for (auto &elem : event.second) {
+              for (auto &elem2 : elem.second) {
+                struct sample_result &res = elem2.second;
+                res.output.set_value(res.total_period);
+                res.output_time_ordered.set_value(res.total_period);
+
+                std::string pid_tid = elem.first + "_" + elem2.first;
+                nlohmann::json &pid_tid_result = this->json_result[msg_key][pid_tid];
+
+                if (event.first == "") {
+                  pid_tid_result["sampled_time"] = res.total_period;
+                  pid_tid_result["offcpu_regions"] = nlohmann::json::array();
+
+                  for (int i = 0; i < res.offcpu_regions.size(); i++) {
+                    nlohmann::json offcpu_arr = {
+                      res.offcpu_regions[i].timestamp,
+                      res.offcpu_regions[i].period
+                    };
+
+                    pid_tid_result["offcpu_regions"].push_back(offcpu_arr);
+                  }
                 }
-              } else {
-                event_name = extra_event_name;
-              }
 
-              pid_tid_result[event_name] = nlohmann::json::array();
-              pid_tid_result[event_name].push_back(res.output);
-              pid_tid_result[event_name].push_back(res.output_time_ordered);
+                this->pending.push_back({msg_key, pid_tid, event_name,
+                                         std::move(res.output),
+                                         std::move(res.output_time_ordered),
+                                         res.spill_path, res.first_time});
+              }
             }
           }
         }
@@ -434,6 +771,30 @@ namespace adaptyst {
   }
 
   nlohmann::json & StdSubclient::get_result() {
+    // Call trees are converted to JSON only here, as their JSON
+    // representation is much larger than CallTree
+    for (auto &trees : this->pending) {
+      if (!trees.spill_path.empty()) {
+        load_spilled_trees(trees.spill_path, trees.output, trees.output_time_ordered);
+        trees.spill_path.clear();
+      }
+
+      nlohmann::json &arr =
+        this->json_result[trees.msg_key][trees.pid_tid][trees.event_name];
+      arr = nlohmann::json::array();
+      arr.push_back(trees.output.to_json());
+      arr.push_back(trees.output_time_ordered.to_json());
+    }
+
+    this->pending.clear();
     return this->json_result;
   }
+
+  void StdSubclient::take_trees(std::vector<struct thread_trees> &trees) {
+    for (auto &pair : this->pending) {
+      trees.push_back(std::move(pair));
+    }
+
+    this->pending.clear();
+  }
 };
@@ -0,0 +1,258 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "zstdfile.hpp"
+#include <memory>
+#include <stdexcept>
+
+namespace adaptyst {
+#ifdef ZSTD_AVAILABLE
+  /**
+     Constructs a ZstdFileBuf object and creates the file.
+
+     @param path    The path to the file.
+     @param level   The zstd compression level.
+     @param workers The number of zstd worker threads. 0 means compressing
+                    in the thread writing to the buffer. If libzstd has been
+                    built without multithreading support, this is ignored.
+
+     @throw std::runtime_error When the file cannot be created.
+  */
+  ZstdFileBuf::ZstdFileBuf(fs::path path, int level, int workers) {
+    this->closed = false;
+    this->file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if (!this->file) {
+      throw std::runtime_error("Could not open " + path.string() + " for writing");
+    }
+
+    this->cctx = ZSTD_createCCtx();
+
+    if (this->cctx == nullptr) {
+      throw std::runtime_error("Could not create a zstd compression context");
+    }
+
+    ZSTD_CCtx_setParameter(this->cctx, ZSTD_c_compressionLevel, level);
+
+    if (workers > 0) {
+      ZSTD_CCtx_setParameter(this->cctx, ZSTD_c_nbWorkers, workers);
+    }
+
+    this->in_buf.resize(ZSTD_CStreamInSize());
+    this->out_buf.resize(ZSTD_CStreamOutSize());
+    this->setp(this->in_buf.data(), this->in_buf.data() + this->in_buf.size());
+  }
+
+  ZstdFileBuf::~ZstdFileBuf() {
+    this->close();
+    ZSTD_freeCCtx(this->cctx);
+  }
+
+  bool ZstdFileBuf::compress(ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {this->pbase(), (std::size_t)(this->pptr() - this->pbase()), 0};
+    bool finished = false;
+
+    while (!finished) {
+      ZSTD_outBuffer output = {this->out_buf.data(), this->out_buf.size(), 0};
+      std::size_t remaining = ZSTD_compressStream2(this->cctx, &output,
+                                                   &input, mode);
+
+      if (ZSTD_isError(remaining)) {
+        return false;
+      }
+
+      this->file.write(this->out_buf.data(), output.pos);
+
+      finished = mode == ZSTD_e_continue ? input.pos == input.size :
+        remaining == 0;
+    }
+
+    this->setp(this->in_buf.data(), this->in_buf.data() + this->in_buf.size());
+    return (bool)this->file;
+  }
+
+  int ZstdFileBuf::overflow(int c) {
+    if (this->closed || !this->compress(ZSTD_e_continue)) {
+      return traits_type::eof();
+    }
+
+    if (c != traits_type::eof()) {
+      *this->pptr() = c;
+      this->pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+  }
+
+  int ZstdFileBuf::sync() {
+    // Flushing a zstd stream in the middle makes it compress worse,
+    // so the data are only flushed at the end (see close())
+    return 0;
+  }
+
+  /**
+     Finishes the zstd frame and closes the file.
+
+     @return Whether all data have been written successfully.
+  */
+  bool ZstdFileBuf::close() {
+    if (this->closed) {
+      return true;
+    }
+
+    this->closed = true;
+    bool result = this->compress(ZSTD_e_end);
+    this->file.close();
+
+    return result && (bool)this->file;
+  }
+
+  /**
+     Constructs a ZstdOutputStream object and creates the file.
+
+     See ZstdFileBuf::ZstdFileBuf() for the description
+     of the parameters.
+  */
+  ZstdOutputStream::ZstdOutputStream(fs::path path, int level,
+                                     int workers) : std::ostream(nullptr),
+                                                    buf(path, level, workers) {
+    this->rdbuf(&this->buf);
+  }
+
+  /**
+     Finishes the zstd frame and closes the file. failbit is set
+     if not all data have been written successfully.
+  */
+  void ZstdOutputStream::close() {
+    if (!this->buf.close()) {
+      this->setstate(std::ios::failbit);
+    }
+  }
+
+  /**
+     Compresses a file with zstd into a new file with ".zst" appended
+     to its name and removes the original file.
+
+     @param path    The path to the file.
+     @param level   The zstd compression level.
+     @param workers The number of zstd worker threads (see ZstdFileBuf).
+
+     @throw std::runtime_error When the file cannot be read or
+                               the compressed file cannot be written.
+  */
+  void compress_file(fs::path path, int level, int workers) {
+    fs::path compressed_path = path;
+    compressed_path += ZSTD_FILE_EXTENSION;
+
+    {
+      std::ifstream input(path, std::ios::in | std::ios::binary);
+
+      if (!input) {
+        throw std::runtime_error("Could not open " + path.string() + " for reading");
+      }
+
+      ZstdOutputStream output(compressed_path, level, workers);
+
+      // Copying an empty stream buffer would set failbit
+      if (fs::file_size(path) > 0) {
+        output << input.rdbuf();
+      }
+
+      output.close();
+
+      if (!output) {
+        throw std::runtime_error("Could not write " + compressed_path.string());
+      }
+    }
+
+    fs::remove(path);
+  }
+#endif
+
+  /**
+     Reads a processed result file, regardless of whether it has been
+     saved compressed with zstd or not.
+
+     @param path The path to the uncompressed file, e.g.
+                 "processed/metadata.json". If it does not exist, the same
+                 path with ".zst" appended is read and decompressed instead.
+
+     @throw std::runtime_error When neither file can be read, the file
+                               is not a valid zstd file, or the file is
+                               compressed and Adaptyst has been compiled
+                               without zstd support.
+  */
+  std::string read_processed_file(fs::path path) {
+    fs::path compressed_path = path;
+    compressed_path += ZSTD_FILE_EXTENSION;
+
+    if (fs::exists(path) || !fs::exists(compressed_path)) {
+      std::ifstream stream(path, std::ios::in | std::ios::binary);
+
+      if (!stream) {
+        throw std::runtime_error("Could not open " + path.string() + " for reading");
+      }
+
+      return std::string((std::istreambuf_iterator<char>(stream)),
+                         std::istreambuf_iterator<char>());
+    }
+
+#ifdef ZSTD_AVAILABLE
+    std::ifstream stream(compressed_path, std::ios::in | std::ios::binary);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + compressed_path.string() +
+                               " for reading");
+    }
+
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                             ZSTD_freeDCtx);
+    std::vector<char> in_buf(ZSTD_DStreamInSize());
+    std::vector<char> out_buf(ZSTD_DStreamOutSize());
+    std::string result;
+    std::size_t last_ret = 0;
+
+    while (stream) {
+      stream.read(in_buf.data(), in_buf.size());
+      ZSTD_inBuffer input = {in_buf.data(), (std::size_t)stream.gcount(), 0};
+
+      // Some decompressed data may still be buffered by zstd
+      // if the output buffer has been filled up
+      bool output_full = true;
+
+      while (input.pos < input.size || output_full) {
+        ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+        last_ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+
+        if (ZSTD_isError(last_ret)) {
+          throw std::runtime_error("Could not decompress " + compressed_path.string() +
+                                   ": " + ZSTD_getErrorName(last_ret));
+        }
+
+        result.append(out_buf.data(), output.pos);
+        output_full = output.pos == output.size;
+      }
+    }
+
+    if (last_ret != 0) {
+      throw std::runtime_error(compressed_path.string() + " is truncated");
+    }
+
+    return result;
+#else
+    throw std::runtime_error(compressed_path.string() + " is compressed with zstd, "
+                             "but Adaptyst has been compiled without zstd support");
+#endif
+  }
+
+  /**
+     Reads and parses a processed result JSON file, regardless of
+     whether it has been saved compressed with zstd or not.
+
+     See read_processed_file() for the description of the parameter
+     and the exceptions thrown.
+  */
+  nlohmann::json read_processed_json(fs::path path) {
+    return nlohmann::json::parse(read_processed_file(path));
+  }
+};
@@ -0,0 +1,84 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef ZSTDFILE_HPP_
+#define ZSTDFILE_HPP_
+
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifdef ZSTD_AVAILABLE
+#include <zstd.h>
+#endif
+
+#define ZSTD_FILE_EXTENSION ".zst"
+
+// The number of zstd worker threads used for compressing a single
+// processed file of at least ZSTD_MT_MIN_SIZE bytes. Smaller files
+// are compressed by the calling thread only.
+#ifndef ZSTD_FILE_WORKERS
+#define ZSTD_FILE_WORKERS 4
+#endif
+
+#ifndef ZSTD_MT_MIN_SIZE
+#define ZSTD_MT_MIN_SIZE 4194304
+#endif
+
+namespace adaptyst {
+  namespace fs = std::filesystem;
+
+#ifdef ZSTD_AVAILABLE
+  /**
+     A class describing a stream buffer compressing everything
+     written to it with zstd into a file, as a single zstd frame.
+
+     This is available only when compiled with libzstd.
+  */
+  class ZstdFileBuf : public std::streambuf {
+  private:
+    std::ofstream file;
+    ZSTD_CCtx *cctx;
+    std::vector<char> in_buf;
+    std::vector<char> out_buf;
+    bool closed;
+
+    bool compress(ZSTD_EndDirective mode);
+
+  protected:
+    int overflow(int c);
+    int sync();
+
+  public:
+    ZstdFileBuf(fs::path path, int level, int workers);
+    ~ZstdFileBuf();
+    bool close();
+  };
+
+  /**
+     A class describing an output stream writing a zstd-compressed
+     file (see ZstdFileBuf).
+
+     This is available only when compiled with libzstd.
+  */
+  class ZstdOutputStream : public std::ostream {
+  private:
+    ZstdFileBuf buf;
+
+  public:
+    ZstdOutputStream(fs::path path, int level, int workers = 0);
+    void close();
+  };
+
+  void compress_file(fs::path path, int level, int workers = 0);
+#endif
+
+  std::string read_processed_file(fs::path path);
+  nlohmann::json read_processed_json(fs::path path);
+};
+
+#endif
@@ -0,0 +1,81 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "server/results.hpp"
+#include "server/snapshot.hpp"
+#include "cmd.hpp"
+#include <iostream>
+
+namespace adaptyst {
+  extern const char *version;
+};
+
+/**
+   Entry point to adaptyst-results, converting the "processed" result
+   directory between the JSON files and the binary results format, and
+   combining partial-result snapshots.
+*/
+int main(int argc, char **argv) {
+  CLI::App app("adaptyst-results: converter between the JSON and binary "
+               "formats of Adaptyst processed results");
+
+  app.formatter(std::make_shared<adaptyst::PrettyFormatter>());
+  app.require_subcommand(0, 1);
+
+  bool print_version = false;
+  app.add_flag("-v,--version", print_version, "Print version and exit");
+
+  std::string processed_dir, binary_path;
+
+  CLI::App *pack = app.add_subcommand("pack", "Convert a \"processed\" directory "
+                                      "to a binary results file");
+  pack->add_option("DIR", processed_dir, "\"processed\" directory")->required();
+  pack->add_option("-o", binary_path, "Output file (default: DIR/"
+                   RESULTS_FILE_NAME ")");
+
+  CLI::App *unpack = app.add_subcommand("unpack", "Convert a binary results file "
+                                        "to JSON files");
+  unpack->add_option("FILE", binary_path, "Binary results file")->required();
+  unpack->add_option("DIR", processed_dir, "Output \"processed\" directory")->required();
+
+  std::string out_dir;
+  unsigned int up_to = UINT_MAX;
+
+  CLI::App *snapshots = app.add_subcommand("snapshots", "Combine partial-result "
+                                           "snapshots saved by adaptyst-server -I "
+                                           "into JSON files");
+  snapshots->add_option("DIR", processed_dir, "\"processed\" directory")->required();
+  snapshots->add_option("OUT_DIR", out_dir, "Output directory")->required();
+  snapshots->add_option("-n", up_to, "Number of the last snapshot to combine "
+                        "(default: all)");
+
+  CLI11_PARSE(app, argc, argv);
+
+  if (print_version) {
+    std::cout << adaptyst::version << std::endl;
+    return 0;
+  }
+
+  try {
+    if (*pack) {
+      if (binary_path.empty()) {
+        binary_path = (adaptyst::fs::path(processed_dir) / RESULTS_FILE_NAME).string();
+      }
+
+      adaptyst::pack_results(processed_dir, binary_path);
+    } else if (*unpack) {
+      adaptyst::unpack_results(binary_path, processed_dir);
+    } else if (*snapshots) {
+      unsigned int merged = adaptyst::merge_snapshots(processed_dir, out_dir, up_to);
+      std::cout << merged << " snapshot(s) combined." << std::endl;
+    } else {
+      std::cout << app.help() << std::flush;
+      return 1;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,511 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "decoder.hpp"
+#include "parallel.hpp"
+#include "ring.hpp"
+#include <gtest/gtest.h>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <unistd.h>
+
+using namespace testing;
+using namespace adaptyst;
+using namespace adaptyst::decoder;
+
+extern "C" __attribute__((noinline)) int decoder_test_function(int x) {
+  return x * 3 + 1;
+}
+
+namespace test {
+  /**
+     A builder of "perf record -o -" output.
+  */
+  class PerfStreamBuilder {
+  private:
+    std::string data;
+
+    template<class T>
+    void put(T value) {
+      this->data.append((const char *)&value, sizeof(T));
+    }
+
+    void put_record(std::uint32_t type, std::uint16_t misc, std::string payload) {
+      payload.resize((payload.size() + 7) & ~7ULL, '\0');
+
+      perf_event_header header;
+      header.type = type;
+      header.misc = misc;
+      header.size = sizeof(header) + payload.size();
+      this->put(header);
+      this->data += payload;
+    }
+
+  public:
+    PerfStreamBuilder() {
+      this->data = "PERFILE2";
+      this->put<std::uint64_t>(16);
+    }
+
+    void add_event(std::uint64_t id, std::string name) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP |
+        PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD |
+        PERF_SAMPLE_CALLCHAIN;
+
+      std::string payload((const char *)&attr, sizeof(attr));
+      payload.append((const char *)&id, sizeof(id));
+      this->put_record(HEADER_ATTR, 0, payload);
+
+      std::uint64_t update[2] = {2, id};
+      this->put_record(EVENT_UPDATE, 0,
+                       std::string((const char *)update, sizeof(update)) + name);
+    }
+
+    void add_mmap(std::int32_t pid, std::uint64_t start, std::uint64_t len,
+                  std::uint64_t pgoff, std::string filename) {
+      std::uint32_t ids[2] = {(std::uint32_t)pid, (std::uint32_t)pid};
+      std::uint64_t range[3] = {start, len, pgoff};
+
+      std::string payload((const char *)ids, sizeof(ids));
+      payload.append((const char *)range, sizeof(range));
+      payload.append(32, '\0');
+      payload += filename;
+      this->put_record(PERF_RECORD_MMAP2, PERF_RECORD_MISC_USER, payload);
+    }
+
+    void add_exec(std::int32_t pid, std::string comm) {
+      std::uint32_t ids[2] = {(std::uint32_t)pid, (std::uint32_t)pid};
+
+      std::string payload((const char *)ids, sizeof(ids));
+      payload += comm;
+      payload += '\0';
+      this->put_record(PERF_RECORD_COMM, PERF_RECORD_MISC_COMM_EXEC, payload);
+    }
+
+    void add_sample(std::uint64_t id, std::int32_t pid, std::int32_t tid,
+                    std::uint64_t time, std::uint64_t period,
+                    std::vector<std::uint64_t> callchain) {
+      std::string payload;
+      std::uint32_t ids[2] = {(std::uint32_t)pid, (std::uint32_t)tid};
+
+      payload.append((const char *)&id, 8);
+      payload.append((const char *)&callchain.back(), 8);
+      payload.append((const char *)ids, 8);
+      payload.append((const char *)&time, 8);
+      payload.append((const char *)&period, 8);
+
+      std::uint64_t nr = callchain.size();
+      payload.append((const char *)&nr, 8);
+      payload.append((const char *)callchain.data(), nr * 8);
+
+      this->put_record(PERF_RECORD_SAMPLE, PERF_RECORD_MISC_USER, payload);
+    }
+
+    std::string get() {
+      return this->data;
+    }
+  };
+
+  /**
+     A structure describing everything sent to adaptyst-server
+     by SampleSender, with symbol IDs replaced by symbol names.
+  */
+  struct ServerOutput {
+    std::vector<protocol::Sample> samples;
+    std::unordered_map<std::uint32_t, std::string> symbols;
+    bool stopped;
+
+    std::string get_name(const protocol::CallchainElem &elem) {
+      return nlohmann::json::parse(this->symbols[elem.symbol])[0];
+    }
+  };
+
+  /**
+     A structure describing the pipes of a connection to
+     adaptyst-server, with the protocol negotiation reply
+     already written.
+  */
+  struct ServerPipes {
+    int data[2];
+    int reply[2];
+
+    ServerPipes() {
+      EXPECT_EQ(pipe(this->data), 0);
+      EXPECT_EQ(pipe(this->reply), 0);
+
+      std::string negotiation = "<PROTOCOL> binary 3\n";
+      EXPECT_EQ(write(this->reply[1], negotiation.data(), negotiation.size()),
+                negotiation.size());
+    }
+
+    std::string get_instructions() {
+      return std::to_string(this->reply[0]) + "_" + std::to_string(this->data[1]);
+    }
+
+    std::string read_all() {
+      close(this->reply[1]);
+
+      std::string received;
+      char buf[4096];
+      ssize_t bytes;
+
+      while ((bytes = read(this->data[0], buf, sizeof(buf))) > 0) {
+        received.append(buf, bytes);
+      }
+
+      close(this->data[0]);
+      return received;
+    }
+  };
+
+  int make_input(std::string &stream) {
+    int input[2];
+    EXPECT_EQ(pipe(input), 0);
+    EXPECT_EQ(write(input[1], stream.data(), stream.size()), stream.size());
+    close(input[1]);
+    return input[0];
+  }
+
+  ServerOutput parse_output(std::string received);
+
+  /**
+     Decodes a stream with a SampleSender connected through pipes
+     (i.e. as adaptyst-server would see it with pipe connections).
+  */
+  ServerOutput decode(std::string stream, Symbolizer &symbolizer,
+                      std::unique_ptr<CallchainFilter> filter) {
+    int input = make_input(stream);
+    ServerPipes pipes;
+
+    std::vector<std::unique_ptr<ServerStream> > connections =
+      ServerStream::connect("pipe " + pipes.get_instructions(), false);
+    SampleSender sender(connections, true, 0);
+    Decoder decoder(symbolizer, sender, filter, 1024);
+    PerfStream perf_stream(input);
+
+    perf_stream.process(decoder);
+    sender.close();
+    close(input);
+
+    return parse_output(pipes.read_all());
+  }
+
+  /**
+     Decodes a stream with ParallelDecoder connected through a given
+     number of pipe connections.
+  */
+  std::vector<ServerOutput> decode_parallel(std::string stream,
+                                            Symbolizer &symbolizer,
+                                            unsigned int count) {
+    int input = make_input(stream);
+    std::vector<ServerPipes> pipes(count);
+    std::string instrs = "pipe";
+
+    for (auto &p : pipes) {
+      instrs += " " + p.get_instructions();
+    }
+
+    std::vector<std::unique_ptr<ServerStream> > connections =
+      ServerStream::connect(instrs, false);
+    ParallelDecoder decoder(symbolizer, connections, true, 0, nullptr, 1024);
+    PerfStream perf_stream(input);
+
+    perf_stream.process(decoder);
+    decoder.close();
+    close(input);
+
+    std::vector<ServerOutput> outputs;
+
+    for (auto &p : pipes) {
+      outputs.push_back(parse_output(p.read_all()));
+    }
+
+    return outputs;
+  }
+
+  /**
+     Parses everything sent to adaptyst-server over a connection.
+  */
+  ServerOutput parse_output(std::string received) {
+    std::string prefix = "connect<PROTOCOL> binary 3\n";
+    EXPECT_EQ(received.substr(0, prefix.size()), prefix);
+
+    ServerOutput output;
+    output.stopped = false;
+
+    std::size_t pos = prefix.size();
+    std::vector<protocol::CallchainElem> previous;
+
+    while (pos + 4 <= received.size()) {
+      std::uint32_t len;
+      std::memcpy(&len, received.data() + pos, 4);
+      std::string_view payload(received.data() + pos + 4, len);
+      pos += 4 + len;
+
+      switch (protocol::get_type(payload)) {
+      case protocol::SYMBOL: {
+        protocol::Symbol symbol;
+        EXPECT_TRUE(protocol::decode(payload, symbol));
+        output.symbols[symbol.id] = symbol.name;
+        break;
+      }
+
+      case protocol::DELTA_SAMPLE: {
+        protocol::Sample sample;
+        EXPECT_TRUE(protocol::decode(payload, sample));
+        sample.callchain.insert(sample.callchain.begin(), previous.begin(),
+                                previous.begin() + sample.common_prefix);
+        previous = sample.callchain;
+        output.samples.push_back(sample);
+        break;
+      }
+
+      case protocol::STOP:
+        output.stopped = true;
+        break;
+
+      default:
+        ADD_FAILURE() << "Unexpected record type";
+      }
+    }
+
+    return output;
+  }
+
+  /**
+     Finds the executable mapping of the test binary.
+  */
+  void find_text_mapping(std::uint64_t &start, std::uint64_t &end,
+                         std::uint64_t &pgoff, std::string &path) {
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    std::uint64_t ip = (std::uint64_t)&decoder_test_function;
+
+    while (std::getline(maps, line)) {
+      std::istringstream stream(line);
+      std::string range, perms, dev, inode;
+      stream >> range >> perms >> std::hex >> pgoff >> dev >> inode >> path;
+
+      start = std::stoull(range.substr(0, range.find('-')), nullptr, 16);
+      end = std::stoull(range.substr(range.find('-') + 1), nullptr, 16);
+
+      if (perms[2] == 'x' && ip >= start && ip < end) {
+        return;
+      }
+    }
+
+    FAIL() << "The mapping of the test binary has not been found";
+  }
+};
+
+TEST(DecoderTest, SymbolizesSamples) {
+  std::uint64_t start, end, pgoff;
+  std::string path;
+  test::find_text_mapping(start, end, pgoff, path);
+  ASSERT_EQ(decoder_test_function(1), 4);
+
+  std::ofstream("test_decoder_kallsyms") <<
+    "ffffffff81000000 T _stext\n"
+    "ffffffff81001000 T do_syscall_64\n"
+    "ffffffff81002000 t helper_fn [some_module]\n";
+
+  std::uint64_t ip = (std::uint64_t)&decoder_test_function + 1;
+
+  test::PerfStreamBuilder builder;
+  builder.add_event(7, "cycles/period=1000/");
+  builder.add_event(8, "offcpu-time");
+  builder.add_mmap(100, start, end - start, pgoff, path);
+  builder.add_sample(7, 100, 101, 1000, 10,
+                     {PERF_CONTEXT_KERNEL, 0xffffffff81002010,
+                      0xffffffff81001100, PERF_CONTEXT_USER, ip, 0x1234});
+  builder.add_sample(8, 100, 101, 2000, 20,
+                     {PERF_CONTEXT_USER, ip, 0x1234});
+  builder.add_sample(7, 200, 200, 3000, 30, {PERF_CONTEXT_USER, ip});
+
+  Symbolizer symbolizer("test_decoder_kallsyms");
+  test::ServerOutput output = test::decode(builder.get(), symbolizer, nullptr);
+
+  ASSERT_TRUE(output.stopped);
+  ASSERT_EQ(output.samples.size(), 3);
+
+  protocol::Sample &first = output.samples[0];
+  ASSERT_EQ(first.event_type, "cycles");
+  ASSERT_EQ(first.pid, 100);
+  ASSERT_EQ(first.tid, 101);
+  ASSERT_EQ(first.time, 1000);
+  ASSERT_EQ(first.period, 10);
+  ASSERT_EQ(first.callchain.size(), 4);
+
+  // Callchains are sent starting from the outermost call
+  ASSERT_EQ(output.get_name(first.callchain[0]), "[0x1234]");
+  ASSERT_EQ(first.callchain[0].offset, 0x1234);
+  ASSERT_EQ(output.get_name(first.callchain[1]), "decoder_test_function");
+  ASSERT_EQ(first.callchain[1].offset, ip - start + pgoff);
+  ASSERT_EQ(output.symbols[first.callchain[1].symbol],
+            nlohmann::json::array({"decoder_test_function", path}).dump());
+  ASSERT_EQ(output.symbols[first.callchain[2].symbol],
+            "[\"do_syscall_64\",\"[kernel.kallsyms]\"]");
+  ASSERT_EQ(output.symbols[first.callchain[3].symbol],
+            "[\"helper_fn\",\"[some_module]\"]");
+
+  protocol::Sample &second = output.samples[1];
+  ASSERT_EQ(second.event_type, "offcpu-time");
+  ASSERT_EQ(second.callchain.size(), 2);
+  ASSERT_EQ(second.common_prefix, 2);
+
+  // PID 200 has no mappings
+  protocol::Sample &third = output.samples[2];
+  ASSERT_EQ(third.callchain.size(), 1);
+  ASSERT_EQ(output.get_name(third.callchain[0]),
+            "[" + protocol::offset_to_string(ip) + "]");
+
+  ASSERT_EQ(symbolizer.get_sources()[path],
+            std::unordered_set<std::uint64_t>({ip - start + pgoff}));
+
+  fs::remove("test_decoder_kallsyms");
+}
+
+TEST(DecoderTest, FiltersCallchains) {
+  std::uint64_t start, end, pgoff;
+  std::string path;
+  test::find_text_mapping(start, end, pgoff, path);
+
+  std::uint64_t ip = (std::uint64_t)&decoder_test_function;
+
+  test::PerfStreamBuilder builder;
+  builder.add_event(1, "task-clock");
+  builder.add_mmap(100, start, end - start, pgoff, path);
+  builder.add_sample(1, 100, 100, 1000, 10,
+                     {PERF_CONTEXT_USER, 0x10, ip, 0x20, 0x30});
+
+  nlohmann::json settings = {{"type", "deny"}, {"mark", true},
+                             {"conditions", {{"SYM ^\\[0x"}}}};
+
+  Symbolizer symbolizer;
+  test::ServerOutput output =
+    test::decode(builder.get(), symbolizer,
+                 std::make_unique<CallchainFilter>(settings));
+
+  ASSERT_EQ(output.samples.size(), 1);
+
+  std::vector<protocol::CallchainElem> &callchain = output.samples[0].callchain;
+  ASSERT_EQ(callchain.size(), 3);
+  ASSERT_EQ(output.get_name(callchain[0]), "(cut)");
+  ASSERT_EQ(callchain[0].offset, NO_OFFSET);
+  ASSERT_EQ(output.get_name(callchain[1]), "decoder_test_function");
+  ASSERT_EQ(output.get_name(callchain[2]), "(cut)");
+
+  nlohmann::json python = {{"type", "python"}, {"mark", false},
+                           {"script", "filter.py"}};
+  ASSERT_THROW(CallchainFilter filter(python), std::runtime_error);
+}
+
+TEST(SymbolizerTest, ReplacesOverlappingMappings) {
+  Symbolizer symbolizer;
+  symbolizer.add_mapping(1, 0x1000, 0x3000, 0, "/nonexistent/a");
+  symbolizer.add_mapping(1, 0x2000, 0x1000, 0x5000, "/nonexistent/b");
+  symbolizer.add_mapping(1, 0x10000, 0x1000, 0, "//anon");
+
+  ResolvedIp result = symbolizer.resolve(1, 0x1010, false);
+  ASSERT_EQ(result.symbol->name, "[/nonexistent/a]");
+  ASSERT_EQ(result.offset, 0x10);
+
+  result = symbolizer.resolve(1, 0x2010, false);
+  ASSERT_EQ(result.symbol->dso, "/nonexistent/b");
+  ASSERT_EQ(result.offset, 0x5010);
+
+  // The tail of the first mapping keeps its file offsets
+  result = symbolizer.resolve(1, 0x3010, false);
+  ASSERT_EQ(result.symbol->dso, "/nonexistent/a");
+  ASSERT_EQ(result.offset, 0x2010);
+
+  // Anonymous executable memory is described by a "perf" symbol map
+  result = symbolizer.resolve(1, 0x10010, false);
+  ASSERT_EQ(result.symbol->name, "[/tmp/perf-1.map]");
+  ASSERT_EQ(result.offset, 0x10010);
+  ASSERT_EQ(symbolizer.get_missing_maps(),
+            std::vector<std::string>({"/tmp/perf-1.map"}));
+
+  // A new process inherits the mappings, a new thread has them already
+  symbolizer.fork(2, 1);
+  ASSERT_EQ(symbolizer.resolve(2, 0x1010, false).symbol,
+            symbolizer.resolve(1, 0x1010, false).symbol);
+
+  symbolizer.exec(2);
+  ASSERT_EQ(symbolizer.resolve(2, 0x1010, false).symbol->name, "[0x1010]");
+}
+
+TEST(ParallelDecoderTest, SplitsThreadsAcrossConnections) {
+  std::uint64_t start, end, pgoff;
+  std::string path;
+  test::find_text_mapping(start, end, pgoff, path);
+
+  std::uint64_t ip = (std::uint64_t)&decoder_test_function;
+
+  test::PerfStreamBuilder builder;
+  builder.add_event(1, "task-clock");
+  builder.add_mmap(100, start, end - start, pgoff, path);
+
+  for (int i = 0; i < 400; i++) {
+    builder.add_sample(1, 100, 100 + i % 4, 1000 + i, 1,
+                       {PERF_CONTEXT_USER, ip});
+  }
+
+  // Samples decoded before the exec must be symbolized with
+  // the mappings from before the exec
+  builder.add_exec(100, "new");
+  builder.add_sample(1, 100, 100, 5000, 1, {PERF_CONTEXT_USER, ip});
+
+  Symbolizer symbolizer;
+  std::vector<test::ServerOutput> outputs =
+    test::decode_parallel(builder.get(), symbolizer, 2);
+
+  ASSERT_EQ(outputs.size(), 2);
+
+  std::unordered_map<std::int32_t, unsigned int> owners;
+  std::unordered_map<std::int32_t, std::uint64_t> last_times;
+  unsigned int count = 0;
+
+  for (unsigned int i = 0; i < outputs.size(); i++) {
+    ASSERT_TRUE(outputs[i].stopped);
+
+    for (auto &sample : outputs[i].samples) {
+      // All samples of a thread go to one connection, in the time order
+      ASSERT_EQ(owners.try_emplace(sample.tid, i).first->second, i);
+      ASSERT_LT(last_times[sample.tid], sample.time);
+      last_times[sample.tid] = sample.time;
+
+      ASSERT_EQ(sample.callchain.size(), 1);
+      ASSERT_EQ(outputs[i].get_name(sample.callchain[0]),
+                sample.time == 5000 ? "[" + protocol::offset_to_string(ip) + "]" :
+                "decoder_test_function");
+      count++;
+    }
+
+    // Both connections are used
+    ASSERT_FALSE(outputs[i].samples.empty());
+  }
+
+  ASSERT_EQ(count, 401);
+}
+
+TEST(RingTest, ParsesEvents) {
+  perf_event_attr attr = parse_event("cycles");
+  ASSERT_EQ(attr.type, PERF_TYPE_HARDWARE);
+  ASSERT_EQ(attr.config, PERF_COUNT_HW_CPU_CYCLES);
+
+  attr = parse_event("task-clock");
+  ASSERT_EQ(attr.type, PERF_TYPE_SOFTWARE);
+  ASSERT_EQ(attr.config, PERF_COUNT_SW_TASK_CLOCK);
+
+  attr = parse_event("r01c2");
+  ASSERT_EQ(attr.type, PERF_TYPE_RAW);
+  ASSERT_EQ(attr.config, 0x1c2);
+
+  ASSERT_THROW(parse_event("nonexistent-event"), std::runtime_error);
+}
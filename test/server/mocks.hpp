@@ -63,7 +63,7 @@ namespace test {
         this->call_constructor = call_constructor;
       }
 
-      std::unique_ptr<Subclient> make_subclient(adaptyst::Notifiable &context,
+      std::unique_ptr<Subclient> make_subclient(adaptyst::Client &context,
                                                 std::string profiled_filename,
                                                 unsigned int buf_size) {
         std::unique_ptr<StrictMock<MockSubclient> > subclient(new StrictMock<MockSubclient>(context));
@@ -97,6 +97,8 @@ namespace test {
   class MockClient : public adaptyst::Client {
   private:
     volatile bool *interrupted = nullptr;
+    std::unique_ptr<adaptyst::Connection> connection;
+    std::unique_ptr<adaptyst::Acceptor> file_acceptor;
 
   protected:
     MockClient() { }
@@ -126,6 +128,9 @@ namespace test {
                             file_timeout_speed);
         }
 
+        // Like real clients, the mock takes ownership of both
+        client->connection = std::move(connection);
+        client->file_acceptor = std::move(file_acceptor);
         return client;
       }
     };
@@ -135,6 +140,14 @@ namespace test {
                                   unsigned long long));
     MOCK_METHOD(void, real_process, (fs::path));
     MOCK_METHOD(void, notify, (), (override));
+    MOCK_METHOD(bool, get_profile_start_tstamp, (unsigned long long *), (override));
+    MOCK_METHOD(bool, get_profile_start_time, (std::chrono::steady_clock::time_point *),
+                (override));
+    MOCK_METHOD(adaptyst::SymbolTable &, get_symbol_table, (), (override));
+    MOCK_METHOD(std::string, get_compression, (), (override));
+    MOCK_METHOD(adaptyst::MemoryBudget &, get_memory_budget, (), (override));
+    MOCK_METHOD(unsigned int, get_snapshot_interval, (), (override));
+    MOCK_METHOD(void, save_snapshot, (unsigned int, nlohmann::json &), (override));
 
     void set_interrupt_ptr(volatile bool *interrupted) {
       this->interrupted = interrupted;
@@ -157,8 +170,11 @@ namespace test {
     MOCK_METHOD(void, close, (), (override));
     MOCK_METHOD(int, read, (char *, unsigned int, long), (override));
     MOCK_METHOD(std::string, read, (long), (override));
+    MOCK_METHOD(bool, read_line, (std::string_view &, long), (override));
+    MOCK_METHOD(void, read, (fs::path, long), (override));
     MOCK_METHOD(void, write, (std::string, bool), (override));
     MOCK_METHOD(void, write, (fs::path), (override));
+    MOCK_METHOD(void, write, (unsigned int, char *), (override));
   };
 
   class MockAcceptor : public adaptyst::Acceptor {
@@ -171,7 +187,8 @@ namespace test {
       this->connection_init = connection_init;
     }
 
-    std::unique_ptr<adaptyst::Connection> accept_connection(unsigned int buf_size) {
+    std::unique_ptr<adaptyst::Connection> accept_connection(unsigned int buf_size,
+                                                            long timeout) {
       this->real_accept(buf_size);
 
       std::unique_ptr<MockConnection> connection = std::make_unique<MockConnection>();
@@ -0,0 +1,447 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "calltree.hpp"
+#include "spill.hpp"
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  /**
+     The reference algorithm building nlohmann::json call trees
+     directly, as done by StdSubclient before CallTree was introduced.
+  */
+  void recurse(nlohmann::json &cur_elem,
+               std::vector<std::pair<std::string, std::string> > &callchain_parts,
+               int callchain_index,
+               unsigned long long period,
+               bool time_ordered, bool offcpu) {
+    std::pair<std::string, std::string> p = callchain_parts[callchain_index];
+    nlohmann::json &arr = cur_elem["children"];
+    nlohmann::json *elem;
+
+    bool last_block = callchain_index == callchain_parts.size() - 1;
+
+    if (!offcpu) {
+      cur_elem["cold"] = false;
+    }
+
+    if (time_ordered) {
+      if (arr.empty() || arr.back()["name"] != p.first ||
+          (last_block &&
+           arr.back()["cold"] != offcpu) ||
+          (last_block &&
+           !arr.back()["children"].empty()) ||
+          (!last_block &&
+           arr.back()["children"].empty())) {
+        nlohmann::json new_elem;
+        new_elem["name"] = p.first;
+        new_elem["offsets"] = nlohmann::json::object();
+        new_elem["value"] = 0;
+        new_elem["children"] = nlohmann::json::array();
+        new_elem["cold"] = offcpu;
+        arr.push_back(new_elem);
+      }
+
+      elem = &arr.back();
+    } else {
+      bool found = false;
+      int cold_index = -1;
+      int hot_index = -1;
+
+      for (int i = 0; i < arr.size(); i++) {
+        if (arr[i]["name"] == p.first &&
+            (!last_block || arr[i]["cold"] == offcpu)) {
+          found = true;
+
+          if (arr[i]["cold"]) {
+            cold_index = i;
+          } else {
+            hot_index = i;
+          }
+        }
+      }
+
+      if (found) {
+        if (cold_index == -1) {
+          elem = &arr[hot_index];
+        } else if (hot_index == -1) {
+          elem = &arr[cold_index];
+        } else if (offcpu) {
+          elem = &arr[cold_index];
+        } else {
+          elem = &arr[hot_index];
+        }
+      } else {
+        nlohmann::json new_elem;
+        new_elem["name"] = p.first;
+        new_elem["offsets"] = nlohmann::json::object();
+        new_elem["value"] = 0;
+        new_elem["children"] = nlohmann::json::array();
+        new_elem["cold"] = offcpu;
+
+        arr.push_back(new_elem);
+        elem = &arr.back();
+      }
+    }
+
+    (*elem)["value"] = (unsigned long long)(*elem)["value"] + period;
+
+    unsigned long long old_value = 0;
+
+    if ((*elem)["offsets"].contains(p.second)) {
+      old_value = (unsigned long long)(*elem)["offsets"][p.second];
+    }
+
+    (*elem)["offsets"][p.second] = old_value + period;
+
+    if (!last_block) {
+      recurse(*elem, callchain_parts, callchain_index + 1, period,
+              time_ordered, offcpu);
+    }
+  }
+
+  /**
+     Adds a given number of random samples to all given trees, with
+     a given share of them being off-CPU.
+  */
+  void add_random(std::mt19937 &gen, std::vector<CallTree *> trees, int count,
+                  double offcpu_share = 0.3) {
+    std::uniform_int_distribution<int> len_dist(1, 6);
+    std::uniform_int_distribution<int> sym_dist(0, 4);
+    std::uniform_int_distribution<int> off_dist(0, 3);
+    std::uniform_int_distribution<int> period_dist(1, 1000);
+    std::bernoulli_distribution offcpu_dist(offcpu_share);
+
+    for (int i = 0; i < count; i++) {
+      int len = len_dist(gen);
+      std::vector<protocol::CallchainElem> callchain;
+
+      for (int j = 0; j < len; j++) {
+        int off = off_dist(gen);
+        callchain.push_back({(std::uint32_t)sym_dist(gen),
+                             off == 0 ? NO_OFFSET : (std::uint64_t)off * 16});
+      }
+
+      unsigned long long period = period_dist(gen);
+      bool offcpu = offcpu_dist(gen);
+
+      for (auto tree : trees) {
+        tree->add(callchain, period, offcpu);
+      }
+    }
+  }
+};
+
+TEST(CallTreeTest, EmptyTree) {
+  CallTree tree(false);
+  tree.set_value(0);
+
+  nlohmann::json expected = {
+    {"name", "all"},
+    {"value", 0},
+    {"children", nlohmann::json::array()},
+    {"cold", true}
+  };
+
+  ASSERT_EQ(tree.to_json(), expected);
+}
+
+TEST(CallTreeTest, SymbolTable) {
+  SymbolTable symbols;
+  ASSERT_EQ(symbols.intern("a"), 0);
+  ASSERT_EQ(symbols.intern("b"), 1);
+  ASSERT_EQ(symbols.intern("a"), 0);
+  ASSERT_EQ(symbols.get_name(1), "b");
+  ASSERT_EQ(symbols.size(), 2);
+
+  nlohmann::json expected = {{"0", "a"}, {"1", "b"}};
+  ASSERT_EQ(symbols.to_json(), expected);
+
+  symbols.intern("[\"main\", \"/usr/bin/test\"]");
+  ASSERT_EQ(symbols.to_json()["2"], nlohmann::json::parse("[\"main\", \"/usr/bin/test\"]"));
+}
+
+TEST(CallTreeTest, MatchesJSONReference) {
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<int> len_dist(1, 6);
+  std::uniform_int_distribution<int> sym_dist(0, 4);
+  std::uniform_int_distribution<int> off_dist(0, 3);
+  std::uniform_int_distribution<int> period_dist(1, 1000);
+  std::bernoulli_distribution offcpu_dist(0.3);
+
+  for (bool time_ordered : {false, true}) {
+    SymbolTable symbols;
+    CallTree tree(time_ordered);
+
+    nlohmann::json reference;
+    reference["name"] = "all";
+    reference["value"] = 0;
+    reference["children"] = nlohmann::json::array();
+    reference["cold"] = true;
+
+    unsigned long long total = 0;
+
+    for (int i = 0; i < 2000; i++) {
+      int len = len_dist(gen);
+      std::vector<std::pair<std::string, std::string> > callchain;
+      std::vector<protocol::CallchainElem> callchain_ids;
+
+      for (int j = 0; j < len; j++) {
+        std::uint32_t symbol = symbols.intern("[\"sym" + std::to_string(sym_dist(gen)) +
+                                              "\", \"\"]");
+        int off = off_dist(gen);
+        std::string off_str = off == 0 ? "" : protocol::offset_to_string(off * 16);
+
+        callchain.push_back(std::make_pair(std::to_string(symbol), off_str));
+        callchain_ids.push_back({symbol, protocol::offset_from_string(off_str)});
+      }
+
+      unsigned long long period = period_dist(gen);
+      bool offcpu = offcpu_dist(gen);
+
+      test::recurse(reference, callchain, 0, period, time_ordered, offcpu);
+      tree.add(callchain_ids, period, offcpu);
+      total += period;
+    }
+
+    reference["value"] = total;
+    tree.set_value(total);
+
+    ASSERT_EQ(tree.to_json(), reference);
+
+    std::stringstream stream;
+    tree.write_json(stream);
+    ASSERT_EQ(stream.str(), reference.dump());
+  }
+}
+
+TEST(CallTreeTest, SaveLoadContinues) {
+  std::mt19937 gen(5678);
+
+  for (bool time_ordered : {false, true}) {
+    CallTree tree(time_ordered);
+    CallTree saved_tree(time_ordered);
+    test::add_random(gen, {&tree, &saved_tree}, 1000);
+
+    std::size_t memory = saved_tree.get_memory_usage();
+    ASSERT_GT(memory, saved_tree.get_node_count() * sizeof(std::uint64_t));
+
+    std::stringstream stream;
+    saved_tree.save(stream);
+
+    // The time-ordered flag is loaded as well
+    CallTree loaded_tree(!time_ordered);
+    loaded_tree.load(stream);
+
+    test::add_random(gen, {&tree, &loaded_tree}, 1000);
+    tree.set_value(1);
+    loaded_tree.set_value(1);
+
+    ASSERT_EQ(loaded_tree.to_json(), tree.to_json());
+  }
+
+  std::stringstream truncated("\x01\x05");
+  CallTree tree(false);
+  ASSERT_THROW(tree.load(truncated), std::runtime_error);
+}
+
+TEST(CallTreeTest, DeltasRebuildTree) {
+  std::mt19937 gen(1213);
+
+  for (bool time_ordered : {false, true}) {
+    CallTree tree(time_ordered);
+    CallTree rebuilt(time_ordered);
+
+    for (int phase = 0; phase < 5; phase++) {
+      test::add_random(gen, {&tree}, 200);
+
+      if (phase == 2) {
+        // Delta baselines survive saving and loading, e.g. when
+        // the tree is spilled
+        std::stringstream stream;
+        tree.save(stream);
+        tree = CallTree(!time_ordered);
+        tree.load(stream);
+      }
+
+      nlohmann::json delta = tree.take_delta();
+      rebuilt.apply_delta(nlohmann::json::parse(delta.dump()));
+
+      // Samples can still be added to a tree built from deltas
+      CallTree continued = rebuilt;
+      test::add_random(gen, {&continued}, 10);
+
+      tree.set_value(phase);
+      rebuilt.set_value(phase);
+      ASSERT_EQ(rebuilt.to_json(), tree.to_json());
+    }
+
+    // Nothing has changed except for the root
+    nlohmann::json empty_delta = tree.take_delta();
+    ASSERT_TRUE(empty_delta["new_nodes"].empty());
+    ASSERT_EQ(empty_delta["changed"].size(), 1);
+    ASSERT_TRUE(empty_delta["offsets"].empty());
+
+    // A delta must be applied on top of the tree it has been taken after
+    CallTree other(time_ordered);
+    test::add_random(gen, {&tree}, 10);
+    ASSERT_THROW(other.apply_delta(tree.take_delta()), std::runtime_error);
+  }
+}
+
+TEST(CallTreeTest, CommonPrefixMatchesFullWalk) {
+  std::mt19937 gen(1617);
+  std::uniform_int_distribution<int> len_dist(1, 8);
+  std::uniform_int_distribution<int> sym_dist(0, 3);
+  std::uniform_int_distribution<int> off_dist(0, 2);
+  std::uniform_int_distribution<int> period_dist(1, 1000);
+  std::bernoulli_distribution offcpu_dist(0.2);
+
+  for (bool time_ordered : {false, true}) {
+    CallTree tree(time_ordered);
+    CallTree reference(time_ordered);
+    std::vector<protocol::CallchainElem> previous;
+
+    for (int i = 0; i < 3000; i++) {
+      // Callchains are mostly derived from the previous one by
+      // replacing its end, as consecutive stacks of a thread would be
+      std::vector<protocol::CallchainElem> callchain(
+        previous.begin(),
+        previous.begin() + std::uniform_int_distribution<std::size_t>(0, previous.size())(gen));
+      int len = len_dist(gen);
+
+      while (callchain.size() < len) {
+        int off = off_dist(gen);
+        callchain.push_back({(std::uint32_t)sym_dist(gen),
+                             off == 0 ? NO_OFFSET : (std::uint64_t)off * 16});
+      }
+
+      if (callchain.size() > len) {
+        callchain.resize(len);
+      }
+
+      std::size_t common_prefix = 0;
+
+      while (common_prefix < std::min(callchain.size(), previous.size()) &&
+             callchain[common_prefix].symbol == previous[common_prefix].symbol &&
+             callchain[common_prefix].offset == previous[common_prefix].offset) {
+        common_prefix++;
+      }
+
+      unsigned long long period = period_dist(gen);
+      bool offcpu = offcpu_dist(gen);
+
+      tree.add(callchain, period, offcpu, common_prefix);
+      reference.add(callchain, period, offcpu);
+      previous = callchain;
+
+      if (i == 1000) {
+        // The cached path is not valid in a loaded tree
+        std::stringstream stream;
+        tree.save(stream);
+        tree.load(stream);
+      } else if (i == 2000) {
+        // Nor is it in a copy
+        CallTree copy = tree;
+        tree = copy;
+      }
+    }
+
+    tree.set_value(1);
+    reference.set_value(1);
+    ASSERT_EQ(tree.to_json(), reference.to_json());
+  }
+}
+
+TEST(CallTreeTest, MergesSplitTrees) {
+  std::mt19937 gen(2425);
+
+  // Non-time-ordered trees are identical only if there is no off-CPU
+  // activity to be split between hot and cold nodes
+  for (bool time_ordered : {false, true}) {
+    double offcpu_share = time_ordered ? 0.3 : 0;
+    CallTree whole(time_ordered);
+    CallTree first(time_ordered);
+    CallTree second(time_ordered);
+    CallTree third(time_ordered);
+
+    test::add_random(gen, {&whole, &first}, 500, offcpu_share);
+    test::add_random(gen, {&whole, &second}, 500, offcpu_share);
+    test::add_random(gen, {&whole, &third}, 500, offcpu_share);
+
+    // Merging into a loaded tree must work as well
+    std::stringstream stream;
+    first.save(stream);
+    first.load(stream);
+
+    first.merge(second);
+    first.merge(third);
+
+    whole.set_value(1);
+    first.set_value(1);
+    ASSERT_EQ(first.to_json(), whole.to_json());
+
+    // The merged tree can still get new samples
+    test::add_random(gen, {&whole, &first}, 100, offcpu_share);
+    ASSERT_EQ(first.to_json(), whole.to_json());
+  }
+
+  CallTree tree(false);
+  CallTree other(true);
+  ASSERT_THROW(tree.merge(other), std::invalid_argument);
+}
+
+TEST(CallTreeTest, MemoryBudgetSpillReload) {
+  std::mt19937 gen(91011);
+  fs::path spill_dir = "test_spill_dir";
+
+  CallTree output(false), output_time_ordered(true);
+  test::add_random(gen, {&output, &output_time_ordered}, 500);
+
+  nlohmann::json expected = output.to_json();
+  nlohmann::json expected_time_ordered = output_time_ordered.to_json();
+  fs::path path;
+
+  {
+    MemoryBudget budget(1000);
+    budget.set_spill_dir(spill_dir);
+    ASSERT_FALSE(budget.is_exceeded());
+
+    budget.add_usage(1500);
+    ASSERT_TRUE(budget.is_exceeded());
+    ASSERT_TRUE(budget.is_above_low_watermark());
+
+    path = budget.spill(output, output_time_ordered);
+    budget.add_usage(-800);
+    ASSERT_TRUE(fs::exists(path));
+    ASSERT_EQ(output.get_node_count(), 1);
+    ASSERT_EQ(output_time_ordered.get_node_count(), 1);
+    ASSERT_FALSE(budget.is_exceeded());
+    ASSERT_FALSE(budget.is_above_low_watermark());
+
+    budget.reload(path, output, output_time_ordered);
+    ASSERT_FALSE(fs::exists(path));
+    ASSERT_EQ(output.to_json(), expected);
+    ASSERT_EQ(output_time_ordered.to_json(), expected_time_ordered);
+
+    budget.spill(output, output_time_ordered);
+
+    struct spill_stats stats = budget.get_stats();
+    ASSERT_EQ(stats.spilled, 2);
+    ASSERT_EQ(stats.reloaded, 1);
+    ASSERT_EQ(stats.max_usage, 1500);
+    ASSERT_GT(stats.spilled_bytes, 0);
+  }
+
+  // The spill directory is removed along with the budget
+  ASSERT_FALSE(fs::exists(spill_dir));
+
+  MemoryBudget unlimited;
+  unlimited.add_usage(1ULL << 40);
+  ASSERT_FALSE(unlimited.is_exceeded());
+}
@@ -5,6 +5,8 @@
 #include "consts.hpp"
 #include <gtest/gtest.h>
 #include <cmath>
+#include <cstring>
+#include <sstream>
 
 // Repeating each test multiple times increases the chance of
 // detecting race-condition-related bugs if all other
@@ -43,7 +45,7 @@ TEST_F(StdClientTest, StandardCommTest) {
 
         switch (created_subclients) {
         case 0:
-          result_str = "{\"<SYSCALL_TREE>\": [12894, [\"300\", \"301\", \"302\", "
+          result_str = "{\"syscall_meta\": [[\"300\", \"301\", \"302\", "
             "\"305\"],{\"300\": {\"parent\": null, \"tag\": "
             "[\"test_command\", \"300/300\", 0, 568]}, "
             "\"301\": {\"parent\": \"300\", \"tag\": "
@@ -56,7 +58,7 @@ TEST_F(StdClientTest, StandardCommTest) {
 
         case 1:
           result_str =
-            "{\"<SAMPLE>\": {"
+            "{\"sample\": {"
             "\"300_300\": {\"first_time\": 12894, \"sampled_time\": 18284, "
             "\"offcpu_regions\": "
             "[[12895, 5], [13594, 999], [15894, 128]], "
@@ -65,9 +67,6 @@ TEST_F(StdClientTest, StandardCommTest) {
             "3}}, "
             "\"401_402\": {\"first_time\": 15681, \"sampled_time\": 1782, "
             "\"offcpu_regions\": [], "
-            "\"walltime\": {}}, "
-            "\"278_288\": {\"first_time\": 14, \"sampled_time\": 2, "
-            "\"offcpu_regions\": [], "
             "\"walltime\": {}}}}";
           break;
 
@@ -77,9 +76,9 @@ TEST_F(StdClientTest, StandardCommTest) {
 
         case 3:
           result_str =
-            "{\"<SYSCALL>\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
+            "{\"syscall\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
             "[\"@\"], \"302\": [\"y\", \"*\"]}, "
-            "\"<SAMPLE>\": {"
+            "\"sample\": {"
             "\"302_302\": {\"first_time\": 13000, \"sampled_time\": 100, "
             "\"offcpu_regions\": [], \"walltime\": [\"dummy11\"], "
             "\"page-faults\": []}, \"300_305\": {\"first_time\": 13001,"
@@ -118,64 +117,37 @@ TEST_F(StdClientTest, StandardCommTest) {
     }, [&](test::MockConnection &connection) {
       InSequence seq;
 
+      // Each file is received by the connection into the given path
+      auto receive = [](std::string content) {
+        return [content](fs::path path, long) {
+          std::ofstream(path, std::ios::out | std::ios::binary) << content;
+        };
+      };
+
       switch (connection_index++) {
       case 0:
-        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(2)
-          .WillOnce([&](char *buf, unsigned int bytes, long timeout) {
-            buf[0] = 'a';
-            buf[1] = 'b';
-            buf[2] = 'c';
-            buf[3] = 'd';
-            buf[4] = 'e';
-            buf[5] = '1';
-            buf[6] = '2';
-            buf[7] = '3';
-            buf[8] = '4';
-            buf[9] = '5';
-            return 10;
-          })
-          .WillOnce(Return(0));
+        EXPECT_CALL(connection, read(_, file_timeout_seconds)).Times(1)
+          .WillOnce(receive("abcde12345"));
         break;
 
       case 1:
-        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(2)
-          .WillOnce([&](char *buf, unsigned int bytes, long timeout) {
-            buf[0] = ' ';
-            buf[1] = '!';
-            return 2;
-          })
-          .WillOnce(Return(0));
+        EXPECT_CALL(connection, read(_, file_timeout_seconds)).Times(1)
+          .WillOnce(receive(" !"));
         break;
 
       case 2:
-        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(1)
-          .WillOnce(Return(0));
+        EXPECT_CALL(connection, read(_, file_timeout_seconds)).Times(1)
+          .WillOnce(receive(""));
         break;
 
       case 3:
-        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(2)
-          .WillOnce([&](char *buf, unsigned int bytes, long timeout) {
-            buf[0] = 'X';
-            buf[1] = '@';
-            buf[2] = '?';
-            return 3;
-          })
-          .WillOnce(Return(0));
+        EXPECT_CALL(connection, read(_, file_timeout_seconds)).Times(1)
+          .WillOnce(receive("X@?"));
         break;
 
       case 4:
-        EXPECT_CALL(connection, read(_, _, file_timeout_seconds))
-          .Times(2)
-          .WillOnce([&](char *buf, unsigned int bytes, long timeout) {
-            buf[0] = 'O';
-            buf[1] = 'p';
-            buf[2] = '%';
-            buf[3] = '%';
-            buf[4] = 'b';
-            buf[5] = '+';
-            return 6;
-          })
-          .WillOnce(Return(0));
+        EXPECT_CALL(connection, read(_, file_timeout_seconds)).Times(1)
+          .WillOnce(receive("Op%%b+"));
         break;
       }
 
@@ -199,6 +171,9 @@ TEST_F(StdClientTest, StandardCommTest) {
         .WillOnce(Return(profiled_filename));
       EXPECT_CALL(connection, write("mock 1 2 3 4", true)).Times(1);
       EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
       EXPECT_CALL(connection, write("out_files", true)).Times(1);
       EXPECT_CALL(connection, write("mock mock_mock", true)).Times(1);
 
@@ -254,7 +229,6 @@ TEST_F(StdClientTest, StandardCommTest) {
     ASSERT_TRUE(fs::is_regular_file(result_path / "processed" / "302_302.json"));
     ASSERT_TRUE(fs::is_regular_file(result_path / "processed" / "300_305.json"));
     ASSERT_TRUE(fs::is_regular_file(result_path / "processed" / "401_402.json"));
-    ASSERT_FALSE(fs::is_regular_file(result_path / "processed" / "278_288.json"));
 
     test::assert_file_equals(result_path / "out" / "out1.dat", "abcde12345", false);
     test::assert_file_equals(result_path / "out" / "out2.dat", "", false);
@@ -301,7 +275,7 @@ TEST_F(StdClientTest, StandardCommTestNoValidFiles) {
         switch (created_subclients) {
         case 0:
           result_str =
-            "{\"<SYSCALL_TREE>\": [12894, [\"300\", \"301\", \"302\", \"305\"], {"
+            "{\"syscall_meta\": [[\"300\", \"301\", \"302\", \"305\"], {"
             "\"300\": {\"parent\": null, \"tag\": "
             "[\"test_command\", \"300/300\", 0, 568]}, "
             "\"301\": {\"parent\": \"300\", \"tag\": "
@@ -314,7 +288,7 @@ TEST_F(StdClientTest, StandardCommTestNoValidFiles) {
 
         case 1:
           result_str =
-            "{\"<SAMPLE>\": {"
+            "{\"sample\": {"
             "\"300_300\": {\"first_time\": 12894, \"sampled_time\": 18284, "
             "\"offcpu_regions\": [[12895, 5], [13594, 999], [15894, 128]], "
             "\"walltime\": [\"dummy4\", \"dummy5\", \"dummy6\", \"dummy7\"], "
@@ -327,9 +301,9 @@ TEST_F(StdClientTest, StandardCommTestNoValidFiles) {
 
         case 3:
           result_str =
-            "{\"<SYSCALL>\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
+            "{\"syscall\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
             "[\"@\"], \"302\": [\"y\", \"*\"]}, "
-            "\"<SAMPLE>\": {"
+            "\"sample\": {"
             "\"302_302\": {\"first_time\": 13000, \"sampled_time\": 100, "
             "\"offcpu_regions\": [], \"walltime\": [\"dummy11\"], "
             "\"page-faults\": []}, \"300_305\": {\"first_time\": 13001,"
@@ -384,6 +358,9 @@ TEST_F(StdClientTest, StandardCommTestNoValidFiles) {
         .WillOnce(Return(profiled_filename));
       EXPECT_CALL(connection, write("mock 1 2 3 4 5", true)).Times(1);
       EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
       EXPECT_CALL(connection, write("out_files", true)).Times(1);
       EXPECT_CALL(connection, write("mock mock_mock", true)).Times(1);
       EXPECT_CALL(connection, read(NO_TIMEOUT))
@@ -470,7 +447,7 @@ TEST_F(StdClientTest, StandardCommTestNoFileTransfer) {
         switch (created_subclients) {
         case 0:
           result_str =
-            "{\"<SYSCALL_TREE>\": [12894, [\"300\", \"301\", \"302\", \"305\"], {"
+            "{\"syscall_meta\": [[\"300\", \"301\", \"302\", \"305\"], {"
             "\"300\": {\"parent\": null, \"tag\": "
             "[\"test_command\", \"300/300\", 0, 568]}, "
             "\"301\": {\"parent\": \"300\", \"tag\": "
@@ -483,7 +460,7 @@ TEST_F(StdClientTest, StandardCommTestNoFileTransfer) {
 
         case 1:
           result_str =
-            "{\"<SAMPLE>\": {"
+            "{\"sample\": {"
             "\"300_300\": {\"first_time\": 12894, \"sampled_time\": 18284, "
             "\"offcpu_regions\": [[12895, 5], [13594, 999], [15894, 128]], "
             "\"walltime\": [\"dummy4\", \"dummy5\", \"dummy6\", \"dummy7\"], "
@@ -496,9 +473,9 @@ TEST_F(StdClientTest, StandardCommTestNoFileTransfer) {
 
         case 3:
           result_str =
-            "{\"<SYSCALL>\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
+            "{\"syscall\": {\"300\": [\"x\", \"y\", \"z\"], \"305\": "
             "[\"@\"], \"302\": [\"y\", \"*\"]}, "
-            "\"<SAMPLE>\": {"
+            "\"sample\": {"
             "\"302_302\": {\"first_time\": 13000, \"sampled_time\": 100, "
             "\"offcpu_regions\": [], \"walltime\": [\"dummy11\"], "
             "\"page-faults\": []}, \"300_305\": {\"first_time\": 13001,"
@@ -544,6 +521,9 @@ TEST_F(StdClientTest, StandardCommTestNoFileTransfer) {
         .WillOnce(Return(profiled_filename));
       EXPECT_CALL(connection, write("mock 1 2 3 4 5", true)).Times(1);
       EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
       EXPECT_CALL(connection, write("profiling_finished", true)).Times(1);
       EXPECT_CALL(connection, write("finished", true)).Times(1);
       EXPECT_CALL(connection, close).Times(1);
@@ -819,3 +799,335 @@ TEST_F(StdClientTest, InvalidCommTest6) {
     ASSERT_EQ(created_subclients, 0);
   }
 }
+
+TEST_F(StdClientTest, MuxFileTransferTest) {
+  for (int i = 0; i < CLIENT_TEST_REPEAT; i++) {
+    const fs::path result_path("test_result_dir");
+    const unsigned long long file_timeout_seconds = 124941;
+    const std::string result_dir = result_path.filename();
+    const std::string profiled_filename = "test_command123";
+    const unsigned int buf_size = 1024;
+
+    nlohmann::json result = nlohmann::json::object();
+
+    std::unique_ptr<adaptyst::Subclient::Factory> subclient_factory =
+      std::make_unique<test::MockSubclient::Factory>([&](test::MockSubclient &s) {
+        EXPECT_CALL(s, construct(_, profiled_filename, buf_size)).Times(1);
+        EXPECT_CALL(s, real_process).Times(1);
+        EXPECT_CALL(s, get_connection_instructions).Times(1)
+          .WillRepeatedly(Return("1"));
+        EXPECT_CALL(s, get_result).Times(1).WillRepeatedly(ReturnRef(result));
+      }, true);
+
+    std::unique_ptr<adaptyst::Connection> mock_connection =
+      std::make_unique<StrictMock<test::MockConnection> >();
+
+    int connection_index = 0;
+
+    // "mux 2" gets both of its streams, while only one of the streams
+    // of "mux 3" is established before the timeout
+    test::MockAcceptor::Factory mock_file_acceptor_factory([&](test::MockAcceptor &a) {
+      {
+        InSequence seq;
+        EXPECT_CALL(a, real_accept(FILE_BUFFER_SIZE)).Times(3);
+        EXPECT_CALL(a, real_accept(FILE_BUFFER_SIZE)).Times(1)
+          .WillOnce(Throw(adaptyst::TimeoutException()));
+      }
+
+      EXPECT_CALL(a, get_connection_instructions).Times(1)
+        .WillRepeatedly(Return("mock_mock"));
+      EXPECT_CALL(a, close).Times(1);
+    }, [&](test::MockConnection &connection) {
+      InSequence seq;
+
+      // Every stream sends headers followed by the file contents
+      auto header = [](const char *line) {
+        return [line](std::string_view &view, long) {
+          view = line;
+          return true;
+        };
+      };
+
+      auto data = [](std::string content) {
+        return [content](char *buf, unsigned int size, long) {
+          std::size_t to_copy = std::min((std::size_t)size, content.size());
+          std::memcpy(buf, content.data(), to_copy);
+          return (int)to_copy;
+        };
+      };
+
+      switch (connection_index++) {
+      case 0:
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(header("o 5 out1.dat"));
+        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(1)
+          .WillOnce(data("abcde"));
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(header("p 2 proc1.dat"));
+        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(1)
+          .WillOnce(data(" !"));
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(header("<END>"));
+        break;
+
+      case 1:
+        // A file outside the result directory is read but not saved
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(header("o 3 ../escape.dat"));
+        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(1)
+          .WillOnce(data("X@?"));
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(Return(false));
+        break;
+
+      case 2:
+        // The connection is closed in the middle of a file
+        EXPECT_CALL(connection, read_line(_, file_timeout_seconds)).Times(1)
+          .WillOnce(header("p 6 proc2.dat"));
+        EXPECT_CALL(connection, read(_, _, file_timeout_seconds)).Times(2)
+          .WillOnce(data("Op%"))
+          .WillOnce(Return(0));
+        break;
+      }
+
+      EXPECT_CALL(connection, close).Times(AtLeast(1));
+    }, false);
+
+    std::unique_ptr<adaptyst::Acceptor> mock_file_acceptor =
+      mock_file_acceptor_factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+    test::MockConnection &connection = *((test::MockConnection *)
+                                         mock_connection.get());
+
+    EXPECT_CALL(connection, get_buf_size).Times(AtLeast(1))
+      .WillRepeatedly(Return(buf_size));
+
+    {
+      InSequence sequence;
+      EXPECT_CALL(connection, read(NO_TIMEOUT))
+        .Times(2)
+        .WillOnce(Return("start1 " + result_dir))
+        .WillOnce(Return(profiled_filename));
+      EXPECT_CALL(connection, write("mock 1", true)).Times(1);
+      EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
+      EXPECT_CALL(connection, write("out_files", true)).Times(1);
+      EXPECT_CALL(connection, write("mock mock_mock", true)).Times(1);
+
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("mux 2"));
+      EXPECT_CALL(connection, write("mux_ok", true)).Times(1);
+      EXPECT_CALL(connection, write("mux_done 1", true)).Times(1);
+      EXPECT_CALL(connection, write("error_out_file o ../escape.dat", true)).Times(1);
+
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("mux 3"));
+      EXPECT_CALL(connection, write("mux_ok", true)).Times(1);
+      EXPECT_CALL(connection, write("mux_done 1", true)).Times(1);
+      EXPECT_CALL(connection, write("error_out_file p proc2.dat", true)).Times(1);
+
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("<STOP>"));
+
+      EXPECT_CALL(connection, write("finished", true)).Times(1);
+      EXPECT_CALL(connection, close).Times(1);
+    }
+
+    // A separate scope is needed for ensuring the correct order
+    // of destructor calls (gmock may seg fault otherwise).
+    {
+      adaptyst::StdClient::Factory factory(subclient_factory);
+      std::unique_ptr<adaptyst::Client> client = factory.make_client(mock_connection,
+                                                                  mock_file_acceptor,
+                                                                  file_timeout_seconds);
+      client->process();
+    }
+
+    ASSERT_EQ(connection_index, 3);
+    ASSERT_FALSE(fs::exists(result_path / "escape.dat"));
+
+    test::assert_file_equals(result_path / "out" / "out1.dat", "abcde", false);
+    test::assert_file_equals(result_path / "processed" / "proc1.dat", " !", false);
+    test::assert_file_equals(result_path / "processed" / "proc2.dat", "Op%", false);
+
+    fs::remove_all(result_path);
+  }
+}
+
+TEST_F(StdClientTest, OutputCompressionTest) {
+#ifdef ZSTD_AVAILABLE
+  const int level = 3;
+#else
+  const int level = 0;
+#endif
+
+  for (int i = 0; i < CLIENT_TEST_REPEAT; i++) {
+    const fs::path result_path("test_result_dir");
+    const unsigned long long file_timeout_seconds = 124941;
+    const std::string result_dir = result_path.filename();
+    const std::string profiled_filename = "test_command123";
+    const unsigned int buf_size = 1024;
+
+    nlohmann::json result =
+      nlohmann::json::parse("{\"sample\": {"
+                            "\"300_300\": {\"first_time\": 12894, \"sampled_time\": 18284, "
+                            "\"offcpu_regions\": [[12895, 5]], "
+                            "\"walltime\": [\"dummy4\", \"dummy5\"]}}}");
+
+    std::unique_ptr<adaptyst::Subclient::Factory> subclient_factory =
+      std::make_unique<test::MockSubclient::Factory>([&](test::MockSubclient &s) {
+        EXPECT_CALL(s, construct(_, profiled_filename, buf_size)).Times(1);
+        EXPECT_CALL(s, real_process).Times(1);
+        EXPECT_CALL(s, get_connection_instructions).Times(1)
+          .WillRepeatedly(Return("1"));
+        EXPECT_CALL(s, get_result).Times(1).WillRepeatedly(ReturnRef(result));
+      }, true);
+
+    std::unique_ptr<adaptyst::Acceptor> mock_file_acceptor = nullptr;
+
+    std::unique_ptr<adaptyst::Connection> mock_connection =
+      std::make_unique<StrictMock<test::MockConnection> >();
+
+    test::MockConnection &connection = *((test::MockConnection *)mock_connection.get());
+
+    EXPECT_CALL(connection, get_buf_size).Times(AtLeast(1)).WillRepeatedly(Return(buf_size));
+
+    {
+      InSequence sequence;
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("output_compression 3"));
+      EXPECT_CALL(connection, write("output_compression " + std::to_string(level),
+                                    true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT))
+        .Times(2)
+        .WillOnce(Return("start1 " + result_dir))
+        .WillOnce(Return(profiled_filename));
+      EXPECT_CALL(connection, write("mock 1", true)).Times(1);
+      EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
+      EXPECT_CALL(connection, write("profiling_finished", true)).Times(1);
+      EXPECT_CALL(connection, write("finished", true)).Times(1);
+      EXPECT_CALL(connection, close).Times(1);
+    }
+
+    // A separate scope is needed for ensuring the correct order
+    // of destructor calls (gmock may seg fault otherwise).
+    {
+      adaptyst::StdClient::Factory factory(subclient_factory);
+      std::unique_ptr<adaptyst::Client> client = factory.make_client(mock_connection,
+                                                                  mock_file_acceptor,
+                                                                  file_timeout_seconds);
+      client->process();
+    }
+
+    fs::path processed_path = result_path / "processed";
+
+    for (std::string name : {"300_300.json", "metadata.json"}) {
+      fs::path compressed_path = processed_path / name;
+      compressed_path += ZSTD_FILE_EXTENSION;
+
+      ASSERT_EQ(fs::exists(compressed_path), level > 0);
+      ASSERT_EQ(fs::exists(processed_path / name), level == 0);
+    }
+
+    ASSERT_EQ(adaptyst::read_processed_json(processed_path / "300_300.json"),
+              nlohmann::json::parse("{\"walltime\": [\"dummy4\", \"dummy5\"]}"));
+    ASSERT_EQ(adaptyst::read_processed_json(processed_path / "metadata.json")["sampled_times"],
+              nlohmann::json::parse("{\"300_300\": 18284}"));
+
+    fs::remove_all(result_path);
+  }
+}
+
+TEST_F(StdClientTest, BinaryResultsTest) {
+  for (int i = 0; i < CLIENT_TEST_REPEAT; i++) {
+    const fs::path result_path("test_result_dir");
+    const unsigned long long file_timeout_seconds = 124941;
+    const std::string result_dir = result_path.filename();
+    const std::string profiled_filename = "test_command123";
+    const unsigned int buf_size = 1024;
+
+    nlohmann::json result =
+      nlohmann::json::parse("{\"sample\": {"
+                            "\"300_300\": {\"first_time\": 12894, \"sampled_time\": 18284, "
+                            "\"offcpu_regions\": [], \"walltime\": [\"dummy4\"]}, "
+                            "\"300_305\": {\"first_time\": 13001, \"sampled_time\": 585, "
+                            "\"offcpu_regions\": [], \"page-faults\": {}}}}");
+
+    std::unique_ptr<adaptyst::Subclient::Factory> subclient_factory =
+      std::make_unique<test::MockSubclient::Factory>([&](test::MockSubclient &s) {
+        EXPECT_CALL(s, construct(_, profiled_filename, buf_size)).Times(1);
+        EXPECT_CALL(s, real_process).Times(1);
+        EXPECT_CALL(s, get_connection_instructions).Times(1)
+          .WillRepeatedly(Return("1"));
+        EXPECT_CALL(s, get_result).Times(1).WillRepeatedly(ReturnRef(result));
+      }, true);
+
+    std::unique_ptr<adaptyst::Acceptor> mock_file_acceptor = nullptr;
+
+    std::unique_ptr<adaptyst::Connection> mock_connection =
+      std::make_unique<StrictMock<test::MockConnection> >();
+
+    test::MockConnection &connection = *((test::MockConnection *)mock_connection.get());
+
+    EXPECT_CALL(connection, get_buf_size).Times(AtLeast(1)).WillRepeatedly(Return(buf_size));
+
+    {
+      InSequence sequence;
+      EXPECT_CALL(connection, read(NO_TIMEOUT))
+        .Times(2)
+        .WillOnce(Return("start1 " + result_dir))
+        .WillOnce(Return(profiled_filename));
+      EXPECT_CALL(connection, write("mock 1", true)).Times(1);
+      EXPECT_CALL(connection, write("start_profile", true)).Times(1);
+      EXPECT_CALL(connection, read(NO_TIMEOUT)).Times(1)
+        .WillOnce(Return("12894"));
+      EXPECT_CALL(connection, write("tstamp_ack", true)).Times(1);
+      EXPECT_CALL(connection, write("profiling_finished", true)).Times(1);
+      EXPECT_CALL(connection, write("finished", true)).Times(1);
+      EXPECT_CALL(connection, close).Times(1);
+    }
+
+    // A separate scope is needed for ensuring the correct order
+    // of destructor calls (gmock may seg fault otherwise).
+    {
+      adaptyst::StdClient::Factory factory(subclient_factory, 0, true);
+      std::unique_ptr<adaptyst::Client> client = factory.make_client(mock_connection,
+                                                                  mock_file_acceptor,
+                                                                  file_timeout_seconds);
+      client->process();
+    }
+
+    fs::path processed_path = result_path / "processed";
+
+    // The binary results file holds the same data as the JSON files
+    {
+      adaptyst::ResultsFile file(processed_path / RESULTS_FILE_NAME);
+
+      ASSERT_EQ(file.get_thread_count(), 2);
+      ASSERT_EQ(file.get_thread_name(0), "300_300");
+      ASSERT_EQ(file.get_thread_name(1), "300_305");
+
+      for (int j = 0; j < 2; j++) {
+        std::string name(file.get_thread_name(j));
+        std::stringstream stream;
+        file.write_thread_json(stream, j);
+
+        ASSERT_EQ(nlohmann::json::parse(stream.str()),
+                  adaptyst::read_processed_json(processed_path / (name + ".json")));
+      }
+
+      std::size_t metadata_index = file.find_blob("metadata.json");
+      ASSERT_NE(metadata_index, RESULTS_NOT_FOUND);
+      ASSERT_EQ(nlohmann::json::parse(file.get_blob(metadata_index)),
+                adaptyst::read_processed_json(processed_path / "metadata.json"));
+      ASSERT_NE(file.find_blob("callchains.json"), RESULTS_NOT_FOUND);
+    }
+
+    fs::remove_all(result_path);
+  }
+}
@@ -0,0 +1,124 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "framer.hpp"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  /**
+     Feeds data to a LineFramer in chunks of at most chunk_size bytes
+     and returns all lines produced, followed by the remaining data.
+  */
+  std::vector<std::string> frame(std::string data, unsigned int buf_size,
+                                 unsigned int chunk_size) {
+    LineFramer framer(buf_size);
+    std::vector<std::string> result;
+    std::size_t pos = 0;
+    std::string_view line;
+
+    while (true) {
+      while (framer.next(line)) {
+        result.push_back(std::string(line));
+      }
+
+      if (pos == data.size()) {
+        break;
+      }
+
+      unsigned int space = framer.get_write_space();
+      unsigned int to_write = std::min({space, chunk_size,
+                                        (unsigned int)(data.size() - pos)});
+      std::memcpy(framer.get_write_ptr(), data.data() + pos, to_write);
+      framer.commit(to_write);
+      pos += to_write;
+    }
+
+    result.push_back(framer.take_remaining());
+    return result;
+  }
+
+  TEST(LineFramerTest, SplitsLines) {
+    std::vector<std::string> expected = {"abc", "de", "f", ""};
+
+    for (unsigned int chunk_size : {1, 2, 3, 100}) {
+      ASSERT_EQ(frame("abc\nde\nf\n", 16, chunk_size), expected);
+    }
+  }
+
+  TEST(LineFramerTest, SkipsEmptyLines) {
+    std::vector<std::string> expected = {"abc", "de", ""};
+    ASSERT_EQ(frame("\n\nabc\n\n\nde\n\n", 16, 5), expected);
+  }
+
+  TEST(LineFramerTest, KeepsIncompleteLine) {
+    std::vector<std::string> expected = {"abc", "xyz"};
+    ASSERT_EQ(frame("abc\nxyz", 16, 3), expected);
+  }
+
+  TEST(LineFramerTest, HandlesLinesLongerThanBuffer) {
+    std::string long_line(1000, 'x');
+    std::string longer_line(2500, 'y');
+    std::vector<std::string> expected = {"a", long_line, "b", longer_line,
+                                         "c", std::string(300, 'z')};
+
+    for (unsigned int chunk_size : {1, 7, 64, 4096}) {
+      ASSERT_EQ(frame("a\n" + long_line + "\nb\n" + longer_line + "\nc\n" +
+                      std::string(300, 'z'), 64, chunk_size), expected);
+    }
+  }
+
+  TEST(LineFramerTest, DrainsBufferedData) {
+    LineFramer framer(16);
+    std::string data = "abc\ndefgh";
+    ASSERT_GE(framer.get_write_space(), data.size());
+    std::memcpy(framer.get_write_ptr(), data.data(), data.size());
+    framer.commit(data.size());
+
+    std::string_view line;
+    ASSERT_TRUE(framer.next(line));
+    ASSERT_EQ(line, "abc");
+    ASSERT_TRUE(framer.has_buffered_data());
+
+    char buf[3];
+    ASSERT_EQ(framer.drain(buf, 3), 3);
+    ASSERT_EQ(std::string(buf, 3), "def");
+    ASSERT_EQ(framer.drain(buf, 3), 2);
+    ASSERT_EQ(std::string(buf, 2), "gh");
+    ASSERT_FALSE(framer.has_buffered_data());
+  }
+
+  TEST(LineFramerTest, OffersFullBufferAfterConsumingAllLines) {
+    LineFramer framer(16);
+    std::string data = "abcdef\nghijkl\n";
+    ASSERT_EQ(framer.get_write_space(), 16);
+    std::memcpy(framer.get_write_ptr(), data.data(), data.size());
+    framer.commit(data.size());
+
+    std::string_view line;
+    ASSERT_TRUE(framer.next(line));
+    ASSERT_EQ(line, "abcdef");
+    ASSERT_TRUE(framer.next(line));
+    ASSERT_EQ(line, "ghijkl");
+    ASSERT_FALSE(framer.next(line));
+    ASSERT_EQ(framer.get_write_space(), 16);
+
+    // An incomplete line at the end of a nearly full buffer is moved
+    // to its beginning
+    data = "mnopqrstuvwxy\nz";
+    std::memcpy(framer.get_write_ptr(), data.data(), data.size());
+    framer.commit(data.size());
+    ASSERT_TRUE(framer.next(line));
+    ASSERT_EQ(line, "mnopqrstuvwxy");
+    ASSERT_EQ(framer.get_write_space(), 15);
+    std::memcpy(framer.get_write_ptr(), "\n", 1);
+    framer.commit(1);
+    ASSERT_TRUE(framer.next(line));
+    ASSERT_EQ(line, "z");
+  }
+};
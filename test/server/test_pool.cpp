@@ -0,0 +1,207 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "pool.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+using namespace testing;
+using namespace adaptyst;
+using namespace std::chrono_literals;
+
+TEST(WorkerPoolTest, AllTasksAreRun) {
+  std::atomic<int> counter = 0;
+
+  {
+    WorkerPool pool(4);
+
+    for (int i = 0; i < 1000; i++) {
+      pool.submit([&]() { counter++; });
+    }
+  }
+
+  ASSERT_EQ(counter, 1000);
+}
+
+TEST(WorkerPoolTest, ConcurrencyIsBounded) {
+  std::atomic<int> current = 0;
+  std::atomic<int> max_seen = 0;
+
+  WorkerPool pool(3);
+  ASSERT_EQ(pool.get_thread_count(), 3);
+
+  for (int i = 0; i < 30; i++) {
+    pool.submit([&]() {
+      int now = ++current;
+      int prev = max_seen;
+
+      while (now > prev && !max_seen.compare_exchange_weak(prev, now)) { }
+
+      std::this_thread::sleep_for(2ms);
+      current--;
+    });
+  }
+
+  pool.wait();
+
+  ASSERT_EQ(pool.get_pending_count(), 0);
+  ASSERT_LE(max_seen, 3);
+  ASSERT_GE(max_seen, 1);
+}
+
+TEST(WorkerPoolTest, TaskResourcesAreReleased) {
+  WorkerPool pool(2);
+  std::shared_ptr<int> resource = std::make_shared<int>(5);
+  std::weak_ptr<int> weak = resource;
+
+  pool.submit([resource]() { });
+  resource.reset();
+  pool.wait();
+
+  ASSERT_TRUE(weak.expired());
+}
+
+TEST(WorkerPoolTest, ThrowingTaskDoesNotStopPool) {
+  std::atomic<int> counter = 0;
+  WorkerPool pool(1);
+
+  pool.submit([]() { throw std::runtime_error("test"); });
+  pool.submit([&]() { counter++; });
+  pool.wait();
+
+  ASSERT_EQ(counter, 1);
+}
+
+TEST(WriterPoolTest, AllTasksAreRun) {
+  std::atomic<int> counter = 0;
+  std::vector<std::future<void> > futures;
+
+  WriterPool pool(4);
+  ASSERT_EQ(pool.get_thread_count(), 4);
+
+  for (int i = 0; i < 1000; i++) {
+    futures.push_back(pool.submit(i % 2 == 0 ? 16 : 10 * WRITER_SMALL_FILE_SIZE,
+                                  [&]() { counter++; }));
+  }
+
+  for (auto &future : futures) {
+    future.get();
+  }
+
+  ASSERT_EQ(counter, 1000);
+}
+
+TEST(WriterPoolTest, DefaultThreadCountIsPositive) {
+  WriterPool pool;
+  ASSERT_GE(pool.get_thread_count(), 1);
+  ASSERT_EQ(pool.get_limit(), pool.get_thread_count());
+}
+
+TEST(WriterPoolTest, ConcurrencyIsBounded) {
+  std::atomic<int> current = 0;
+  std::atomic<int> max_seen = 0;
+  std::vector<std::future<void> > futures;
+
+  WriterPool pool(3);
+
+  for (int i = 0; i < 30; i++) {
+    futures.push_back(pool.submit(WRITER_SMALL_FILE_SIZE, [&]() {
+      int now = ++current;
+      int prev = max_seen;
+
+      while (now > prev && !max_seen.compare_exchange_weak(prev, now)) { }
+
+      std::this_thread::sleep_for(2ms);
+      current--;
+    }));
+  }
+
+  for (auto &future : futures) {
+    future.get();
+  }
+
+  ASSERT_LE(max_seen, 3);
+  ASSERT_GE(max_seen, 1);
+}
+
+TEST(WriterPoolTest, TinyTasksAreBatched) {
+  std::mutex mutex;
+  std::set<std::thread::id> ids;
+  std::vector<std::future<void> > futures;
+
+  WriterPool pool(2);
+
+  // Both workers are kept busy until all tiny tasks are queued,
+  // so the first one to become free takes all of them at once
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::vector<std::future<void> > blockers;
+
+  for (int i = 0; i < 2; i++) {
+    blockers.push_back(pool.submit(WRITER_SMALL_FILE_SIZE,
+                                   [released]() { released.wait(); }));
+  }
+
+  std::this_thread::sleep_for(20ms);
+
+  for (int i = 0; i < WRITER_BATCH_COUNT; i++) {
+    futures.push_back(pool.submit(1, [&]() {
+      std::lock_guard lock(mutex);
+      ids.insert(std::this_thread::get_id());
+      std::this_thread::sleep_for(1ms);
+    }));
+  }
+
+  release.set_value();
+
+  for (auto &future : blockers) {
+    future.get();
+  }
+
+  for (auto &future : futures) {
+    future.get();
+  }
+
+  ASSERT_EQ(ids.size(), 1);
+}
+
+TEST(WriterPoolTest, ExceptionIsPassedToFuture) {
+  WriterPool pool(1);
+
+  std::future<void> failing = pool.submit(1, []() { throw std::runtime_error("test"); });
+  std::future<void> next = pool.submit(1, []() { });
+
+  ASSERT_THROW(failing.get(), std::runtime_error);
+  ASSERT_NO_THROW(next.get());
+}
+
+TEST(WriterPoolTest, LimitRecoversAfterLatencyIncrease) {
+  WriterPool pool(2);
+
+  // Writes become much slower after a while and stay like that
+  for (int i = 0; i < 10; i++) {
+    pool.submit(WRITER_SMALL_FILE_SIZE, []() { }).get();
+  }
+
+  unsigned int lowest_limit = pool.get_limit();
+
+  for (int i = 0; i < 3 * WRITER_LATENCY_WINDOW; i++) {
+    pool.submit(WRITER_SMALL_FILE_SIZE, []() {
+      std::this_thread::sleep_for(2ms);
+    }).get();
+
+    lowest_limit = std::min(lowest_limit, pool.get_limit());
+  }
+
+  // The concurrency is lowered first, but the slower writes become
+  // the new baseline eventually
+  ASSERT_EQ(lowest_limit, 1);
+  ASSERT_EQ(pool.get_limit(), 2);
+}
@@ -0,0 +1,280 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "protocol.hpp"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstring>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  /**
+     A connection returning preset data in chunks of at most
+     chunk_size bytes per read() call.
+  */
+  class ChunkedConnection : public Connection {
+  private:
+    std::string data;
+    unsigned int pos;
+    unsigned int chunk_size;
+
+  protected:
+    void close() { }
+
+  public:
+    ChunkedConnection(std::string data, unsigned int chunk_size) {
+      this->data = data;
+      this->pos = 0;
+      this->chunk_size = chunk_size;
+    }
+
+    int read(char *buf, unsigned int len, long timeout_seconds) {
+      unsigned int to_read = std::min({len, this->chunk_size,
+                                       (unsigned int)(this->data.size() - this->pos)});
+      std::memcpy(buf, this->data.data() + this->pos, to_read);
+      this->pos += to_read;
+      return to_read;
+    }
+
+    std::string read(long timeout_seconds) { return ""; }
+    bool read_line(std::string_view &line, long timeout_seconds) { return false; }
+    void read(fs::path file, long timeout_seconds) { }
+    void write(std::string msg, bool new_line) { }
+    void write(fs::path file) { }
+    void write(unsigned int len, char *buf) { }
+    unsigned int get_buf_size() { return 0; }
+  };
+};
+
+TEST(ProtocolTest, OffsetConversion) {
+  ASSERT_EQ(protocol::offset_to_string(0x1f), "0x1f");
+  ASSERT_EQ(protocol::offset_to_string(0), "0x0");
+  ASSERT_EQ(protocol::offset_to_string(NO_OFFSET), "");
+  ASSERT_EQ(protocol::offset_from_string("0x7f00ab"), 0x7f00ab);
+  ASSERT_EQ(protocol::offset_from_string(""), NO_OFFSET);
+}
+
+TEST(ProtocolTest, SampleRoundTrip) {
+  protocol::Sample sample;
+  sample.event_type = "offcpu-time";
+  sample.pid = 1234;
+  sample.tid = -1;
+  sample.time = 1234567890123ULL;
+  sample.period = 500;
+  sample.callchain = {{0, 0x10}, {70000, NO_OFFSET}};
+
+  std::string buf;
+  protocol::encode(sample, buf);
+
+  std::string_view payload(buf.data() + 4, buf.size() - 4);
+  protocol::Sample decoded;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::SAMPLE);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_EQ(decoded.event_type, sample.event_type);
+  ASSERT_EQ(decoded.pid, sample.pid);
+  ASSERT_EQ(decoded.tid, sample.tid);
+  ASSERT_EQ(decoded.time, sample.time);
+  ASSERT_EQ(decoded.period, sample.period);
+  ASSERT_EQ(decoded.callchain.size(), 2);
+  ASSERT_EQ(decoded.callchain[1].symbol, 70000);
+  ASSERT_EQ(decoded.callchain[1].offset, NO_OFFSET);
+
+  ASSERT_FALSE(protocol::decode(payload.substr(0, payload.size() - 1),
+                                decoded));
+}
+
+TEST(ProtocolTest, AggregatedSampleRoundTrip) {
+  protocol::Sample sample;
+  sample.event_type = "task-clock";
+  sample.pid = 1234;
+  sample.tid = 1235;
+  sample.time = 1234567890123ULL;
+  sample.period = 500000;
+  sample.count = 1000;
+  sample.callchain = {{3, 0x20}};
+
+  std::string buf;
+  protocol::encode(sample, buf);
+
+  std::string_view payload(buf.data() + 4, buf.size() - 4);
+  protocol::Sample decoded;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::AGGREGATED_SAMPLE);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_EQ(decoded.period, sample.period);
+  ASSERT_EQ(decoded.count, 1000);
+  ASSERT_EQ(decoded.callchain.size(), 1);
+  ASSERT_EQ(decoded.callchain[0].offset, 0x20);
+
+  // A regular sample decoded into the same structure has a count of 1
+  sample.count = 1;
+  buf.clear();
+  protocol::encode(sample, buf);
+  payload = std::string_view(buf.data() + 4, buf.size() - 4);
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::SAMPLE);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_EQ(decoded.count, 1);
+
+  // An aggregated sample of no samples is malformed
+  sample.count = 2;
+  buf.clear();
+  protocol::encode(sample, buf);
+  buf[4 + 1 + 1 + sample.event_type.size() + 24] = 0;
+  buf[4 + 1 + 1 + sample.event_type.size() + 25] = 0;
+  payload = std::string_view(buf.data() + 4, buf.size() - 4);
+
+  ASSERT_FALSE(protocol::decode(payload, decoded));
+}
+
+TEST(ProtocolTest, DeltaSampleRoundTrip) {
+  protocol::Sample sample;
+  sample.event_type = "task-clock";
+  sample.pid = 1234;
+  sample.tid = 1235;
+  sample.time = 1234567890123ULL;
+  sample.period = 500;
+  sample.delta = true;
+  sample.common_prefix = 700;
+  sample.callchain = {{3, 0x20}, {4, NO_OFFSET}};
+
+  std::string buf;
+  protocol::encode(sample, buf);
+
+  std::string_view payload(buf.data() + 4, buf.size() - 4);
+  protocol::Sample decoded;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::DELTA_SAMPLE);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_TRUE(decoded.delta);
+  ASSERT_EQ(decoded.count, 1);
+  ASSERT_EQ(decoded.common_prefix, 700);
+  ASSERT_EQ(decoded.callchain.size(), 2);
+  ASSERT_EQ(decoded.callchain[1].symbol, 4);
+
+  // Decoding a regular sample afterwards resets the delta fields
+  sample.delta = false;
+  buf.clear();
+  protocol::encode(sample, buf);
+  payload = std::string_view(buf.data() + 4, buf.size() - 4);
+
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_FALSE(decoded.delta);
+  ASSERT_EQ(decoded.common_prefix, 0);
+}
+
+TEST(ProtocolTest, SyscallRoundTrip) {
+  protocol::Syscall syscall;
+  syscall.ret_value = 4321;
+  syscall.callchain = {{5, 0xabc}};
+
+  protocol::SyscallMeta meta;
+  meta.subtype = "new_proc";
+  meta.comm = "test";
+  meta.pid = 10;
+  meta.tid = 11;
+  meta.time = 99;
+  meta.ret_value = 4321;
+
+  std::string buf;
+  protocol::encode(syscall, buf);
+  std::string_view payload(buf.data() + 4, buf.size() - 4);
+  protocol::Syscall decoded;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::SYSCALL);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_EQ(decoded.ret_value, 4321);
+  ASSERT_EQ(decoded.callchain.size(), 1);
+
+  buf.clear();
+  protocol::encode(meta, buf);
+  payload = std::string_view(buf.data() + 4, buf.size() - 4);
+  protocol::SyscallMeta decoded_meta;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::SYSCALL_META);
+  ASSERT_TRUE(protocol::decode(payload, decoded_meta));
+  ASSERT_EQ(decoded_meta.subtype, "new_proc");
+  ASSERT_EQ(decoded_meta.comm, "test");
+  ASSERT_EQ(decoded_meta.tid, 11);
+  ASSERT_EQ(decoded_meta.time, 99);
+}
+
+TEST(ProtocolTest, SymbolRoundTrip) {
+  protocol::Symbol symbol;
+  symbol.id = 42;
+  symbol.name = "[\"main\", \"/usr/bin/test\"]";
+
+  std::string buf;
+  protocol::encode(symbol, buf);
+  std::string_view payload(buf.data() + 4, buf.size() - 4);
+  protocol::Symbol decoded;
+
+  ASSERT_EQ(protocol::get_type(payload), protocol::SYMBOL);
+  ASSERT_TRUE(protocol::decode(payload, decoded));
+  ASSERT_EQ(decoded.id, 42);
+  ASSERT_EQ(decoded.name, symbol.name);
+}
+
+TEST(ProtocolTest, RecordReaderChunksAndOversizedRecords) {
+  protocol::Sample small, big;
+  small.event_type = "task-clock";
+  small.pid = 1;
+  small.tid = 2;
+  small.time = 3;
+  small.period = 4;
+  small.callchain = {{1, 1}};
+
+  big = small;
+
+  for (int i = 0; i < 100; i++) {
+    big.callchain.push_back({(std::uint32_t)i, (std::uint64_t)i});
+  }
+
+  std::string data;
+  protocol::encode(small, data);
+  protocol::encode(big, data);
+  protocol::encode(small, data);
+  protocol::encode_stop(data);
+
+  for (unsigned int chunk_size : {1, 7, 4096}) {
+    test::ChunkedConnection connection(data, chunk_size);
+    protocol::RecordReader reader(connection, 64);
+    std::string_view payload;
+    protocol::Sample decoded;
+
+    ASSERT_TRUE(reader.next(payload));
+    ASSERT_TRUE(protocol::decode(payload, decoded));
+    ASSERT_EQ(decoded.callchain.size(), 1);
+
+    ASSERT_TRUE(reader.next(payload));
+    ASSERT_TRUE(protocol::decode(payload, decoded));
+    ASSERT_EQ(decoded.callchain.size(), 101);
+
+    ASSERT_TRUE(reader.next(payload));
+    ASSERT_TRUE(protocol::decode(payload, decoded));
+    ASSERT_EQ(decoded.callchain.size(), 1);
+
+    ASSERT_TRUE(reader.next(payload));
+    ASSERT_EQ(protocol::get_type(payload), protocol::STOP);
+
+    ASSERT_FALSE(reader.next(payload));
+  }
+
+  std::string too_large;
+  std::uint32_t len = MAX_RECORD_SIZE + 1;
+
+  for (int i = 0; i < 4; i++) {
+    too_large += (char)((len >> (8 * i)) & 0xff);
+  }
+
+  too_large += (char)protocol::SAMPLE;
+
+  test::ChunkedConnection connection(too_large, 4096);
+  protocol::RecordReader reader(connection, 64);
+  std::string_view payload;
+
+  ASSERT_THROW(reader.next(payload), std::runtime_error);
+}
@@ -0,0 +1,188 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "calltree.hpp"
+#include "results.hpp"
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  void fill_tree(CallTree &tree, unsigned int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> len_dist(1, 6);
+    std::uniform_int_distribution<int> sym_dist(0, 20);
+    std::uniform_int_distribution<int> off_dist(0, 3);
+    std::uniform_int_distribution<int> period_dist(1, 1000);
+    std::bernoulli_distribution offcpu_dist(0.3);
+
+    unsigned long long total = 0;
+
+    for (int i = 0; i < 500; i++) {
+      int len = len_dist(gen);
+      std::vector<protocol::CallchainElem> callchain;
+
+      for (int j = 0; j < len; j++) {
+        int off = off_dist(gen);
+        callchain.push_back({(std::uint32_t)sym_dist(gen),
+                             off == 0 ? NO_OFFSET : (std::uint64_t)off * 16});
+      }
+
+      unsigned long long period = period_dist(gen);
+      tree.add(callchain, period, offcpu_dist(gen));
+      total += period;
+    }
+
+    tree.set_value(total);
+  }
+};
+
+class ResultsTest : public Test {
+protected:
+  fs::path dir;
+  ResultsTest() : dir("test_results_dir") { fs::create_directories(this->dir); }
+  ~ResultsTest() { fs::remove_all(this->dir); }
+};
+
+TEST_F(ResultsTest, CallTreeRoundTrip) {
+  CallTree tree(false);
+  CallTree tree_time_ordered(true);
+  test::fill_tree(tree, 1);
+  test::fill_tree(tree_time_ordered, 2);
+
+  nlohmann::json fields = {{"sampled_time", 123}};
+
+  {
+    ResultsWriter writer(this->dir / RESULTS_FILE_NAME);
+    std::vector<struct results_tree> trees(2);
+    trees[0].event_name = "walltime";
+    trees[0].time_ordered = false;
+    tree.to_columns(writer, trees[0].columns);
+    trees[1].event_name = "walltime";
+    trees[1].time_ordered = true;
+    tree_time_ordered.to_columns(writer, trees[1].columns);
+
+    std::vector<struct results_tree> no_trees;
+    writer.add_thread("5_6", "{}", no_trees);
+    writer.add_thread("1_2", fields.dump(), trees);
+    writer.add_blob("metadata.json", std::string_view("{\"a\":1}"));
+    writer.finish();
+  }
+
+  ResultsFile file(this->dir / RESULTS_FILE_NAME);
+
+  ASSERT_EQ(file.get_thread_count(), 2);
+  ASSERT_EQ(file.get_thread_name(0), "1_2");
+  ASSERT_EQ(file.find_thread("5_6"), 1);
+  ASSERT_EQ(file.find_thread("7_8"), RESULTS_NOT_FOUND);
+  ASSERT_EQ(file.get_blob(file.find_blob("metadata.json")), "{\"a\":1}");
+
+  ASSERT_EQ(file.get_tree_count(0), 2);
+  struct tree_view view = file.get_tree(0, 1);
+  ASSERT_EQ(view.event_name, "walltime");
+  ASSERT_TRUE(view.time_ordered);
+  ASSERT_EQ(view.node_count, tree_time_ordered.get_node_count());
+  ASSERT_EQ(file.get_string(view.names[0]), "all");
+
+  std::stringstream stream;
+  file.write_thread_json(stream, 0);
+
+  nlohmann::json expected = fields;
+  expected["walltime"] = {tree.to_json(), tree_time_ordered.to_json()};
+  ASSERT_EQ(nlohmann::json::parse(stream.str()), expected);
+
+  std::stringstream empty_stream;
+  file.write_thread_json(empty_stream, 1);
+  ASSERT_EQ(empty_stream.str(), "{}");
+}
+
+TEST_F(ResultsTest, PackUnpack) {
+  fs::path processed = this->dir / "processed";
+  fs::path unpacked = this->dir / "unpacked";
+  fs::create_directories(processed);
+
+  CallTree tree(false);
+  CallTree tree_time_ordered(true);
+  test::fill_tree(tree, 3);
+  test::fill_tree(tree_time_ordered, 4);
+
+  nlohmann::json thread = {{"sampled_time", 5}};
+  thread["page-faults"] = {tree.to_json(), tree_time_ordered.to_json()};
+
+  std::ofstream(processed / "10_11.json") << thread << std::endl;
+  std::ofstream(processed / "metadata.json") << "{\"thread_tree\":[]}" << std::endl;
+  std::ofstream(processed / "sources.json") << "";
+  std::ofstream(processed / "src.zip") << "not json";
+
+  pack_results(processed, this->dir / RESULTS_FILE_NAME);
+  unpack_results(this->dir / RESULTS_FILE_NAME, unpacked);
+
+  ASSERT_FALSE(fs::exists(unpacked / "src.zip"));
+  ASSERT_TRUE(fs::exists(unpacked / "sources.json"));
+  ASSERT_EQ(fs::file_size(unpacked / "sources.json"), 0);
+
+  std::ifstream metadata(unpacked / "metadata.json");
+  std::string metadata_str((std::istreambuf_iterator<char>(metadata)),
+                           std::istreambuf_iterator<char>());
+  ASSERT_EQ(metadata_str, "{\"thread_tree\":[]}\n");
+
+  std::ifstream thread_stream(unpacked / "10_11.json");
+  ASSERT_EQ(nlohmann::json::parse(thread_stream), thread);
+}
+
+TEST_F(ResultsTest, UnfinishedFileIsRejected) {
+  {
+    ResultsWriter writer(this->dir / RESULTS_FILE_NAME);
+    writer.add_blob("metadata.json", std::string_view("{}"));
+  }
+
+  ASSERT_THROW(ResultsFile(this->dir / RESULTS_FILE_NAME), std::runtime_error);
+}
+
+TEST_F(ResultsTest, CorruptedTreeIsRejected) {
+  {
+    ResultsWriter writer(this->dir / RESULTS_FILE_NAME);
+    std::uint32_t name = writer.intern("all");
+    std::vector<struct results_tree> trees(3);
+
+    for (auto &tree : trees) {
+      tree.event_name = "walltime";
+      tree.time_ordered = false;
+      tree.columns.names = {name, name, name};
+      tree.columns.values = {2, 1, 1};
+      tree.columns.subtree_ends = {3, 2, 3};
+      tree.columns.cold = {0, 0, 0};
+      tree.columns.offset_starts = {0, 0, 0, 0};
+    }
+
+    // A child pointing back to itself, a subtree ending past
+    // the last node, and offsets going backwards
+    trees[0].columns.subtree_ends[1] = 1;
+    trees[1].columns.subtree_ends[2] = 4;
+    trees[2].columns.offset_starts = {0, 1, 0, 0};
+    trees[2].columns.offset_keys = {name};
+    trees[2].columns.offset_values = {16};
+
+    writer.add_thread("1_2", "{}", trees);
+    writer.finish();
+  }
+
+  ResultsFile file(this->dir / RESULTS_FILE_NAME);
+
+  ASSERT_EQ(file.get_tree_count(0), 3);
+  ASSERT_THROW(file.get_tree(0, 0), std::runtime_error);
+  ASSERT_THROW(file.get_tree(0, 1), std::runtime_error);
+  ASSERT_THROW(file.get_tree(0, 2), std::runtime_error);
+  ASSERT_THROW(file.get_tree(0, 3), std::runtime_error);
+  ASSERT_THROW(file.get_thread_name(1), std::runtime_error);
+  ASSERT_THROW(file.get_tree_count(1), std::runtime_error);
+  ASSERT_THROW(file.get_blob(0), std::runtime_error);
+
+  std::stringstream stream;
+  ASSERT_THROW(file.write_thread_json(stream, 0), std::runtime_error);
+}
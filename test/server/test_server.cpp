@@ -2,6 +2,7 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "mocks.hpp"
+#include <atomic>
 #include <thread>
 #include <chrono>
 #include <future>
@@ -40,6 +41,9 @@ TEST(ServerTest, ZeroMaxConnections) {
     }, [&](test::MockConnection &connection) {
       created_connections++;
       last_connection = &connection;
+      EXPECT_CALL(connection, read_line(_, SERVER_HELLO_TIMEOUT))
+        .WillOnce(DoAll(SetArgReferee<0>(std::string_view("hello 0")), Return(true)));
+      EXPECT_CALL(connection, write("admitted", true)).Times(1);
       EXPECT_CALL(connection, write("try_again", true)).Times(0);
       EXPECT_CALL(connection, close).Times(1);
     }, false);
@@ -88,11 +92,10 @@ TEST(ServerTest, TwoMaxConnections) {
     unsigned long long file_timeout_speed = 5758;
     volatile bool interrupted = false;
 
-    int try_again_cnt = 0;
+    std::atomic<int> try_again_cnt = 0;
     int created_connections = 0;
     int created_file_acceptors = 0;
     int created_clients = 0;
-    adaptyst::Connection *last_connection = nullptr;
     adaptyst::Acceptor *last_file_acceptor = nullptr;
 
     test::MockAcceptor::Factory factory([&](test::MockAcceptor &acceptor) {
@@ -100,8 +103,13 @@ TEST(ServerTest, TwoMaxConnections) {
         EXPECT_CALL(acceptor, close).Times(1);
       }, [&](test::MockConnection &connection) {
         created_connections++;
-        last_connection = &connection;
-        EXPECT_CALL(connection, write("try_again", true)).Times(AtLeast(0))
+
+        // Connections are admitted asynchronously, so a client
+        // may be made after later connections have been accepted
+        EXPECT_CALL(connection, read_line(_, SERVER_HELLO_TIMEOUT))
+          .WillOnce(DoAll(SetArgReferee<0>(std::string_view("hello 0")), Return(true)));
+        EXPECT_CALL(connection, write("admitted", true)).Times(AtMost(1));
+        EXPECT_CALL(connection, write("try_again", true)).Times(AtMost(1))
           .WillRepeatedly(InvokeWithoutArgs([&]() {
             interrupted = true;
             try_again_cnt++;
@@ -121,7 +129,7 @@ TEST(ServerTest, TwoMaxConnections) {
         std::make_unique<test::MockClient::Factory>([&](test::MockClient &client) {
           created_clients++;
 
-          EXPECT_CALL(client, construct(last_connection,
+          EXPECT_CALL(client, construct(NotNull(),
                                         last_file_acceptor,
                                         file_timeout_speed)).Times(1);
           client.set_interrupt_ptr(&interrupted);
@@ -155,3 +163,68 @@ TEST(ServerTest, TwoMaxConnections) {
     ASSERT_EQ(try_again_cnt, created_connections - created_clients);
   }
 }
+
+TEST(ServerTest, SilentConnectionDoesNotBlockAdmission) {
+  unsigned int buf_size = 1024;
+  unsigned long long file_timeout_speed = 100;
+  std::atomic<int> created_connections = 0;
+  std::atomic<bool> admitted = false;
+  auto start = std::chrono::steady_clock::now();
+
+  test::MockAcceptor::Factory factory([&](test::MockAcceptor &acceptor) {
+    EXPECT_CALL(acceptor, real_accept(buf_size)).Times(AtLeast(2));
+    EXPECT_CALL(acceptor, close).Times(1);
+  }, [&](test::MockConnection &connection) {
+    int index = created_connections++;
+
+    if (index == 0) {
+      // The first frontend does not send anything until the timeout
+      EXPECT_CALL(connection, read_line(_, SERVER_HELLO_TIMEOUT))
+        .WillOnce(InvokeWithoutArgs([]() {
+          std::this_thread::sleep_for(2s);
+          return false;
+        }));
+    } else if (index == 1) {
+      EXPECT_CALL(connection, read_line(_, SERVER_HELLO_TIMEOUT))
+        .WillOnce(DoAll(SetArgReferee<0>(std::string_view("hello 0")), Return(true)));
+      EXPECT_CALL(connection, write("admitted", true)).Times(1);
+    } else {
+      EXPECT_CALL(connection, read_line(_, SERVER_HELLO_TIMEOUT))
+        .WillRepeatedly(Return(false));
+    }
+
+    EXPECT_CALL(connection, close).Times(AtLeast(1));
+  }, false);
+
+  std::unique_ptr<adaptyst::Acceptor> acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+  // A separate scope is needed for ensuring the correct order
+  // of destructor calls (gmock will seg fault otherwise).
+  {
+    adaptyst::Server server(acceptor, 1, buf_size, file_timeout_speed);
+
+    std::unique_ptr<adaptyst::Client::Factory> client_factory =
+      std::make_unique<test::MockClient::Factory>([&](test::MockClient &client) {
+        EXPECT_CALL(client, construct(NotNull(), NotNull(),
+                                      file_timeout_speed)).Times(1);
+        EXPECT_CALL(client, real_process(_)).Times(1).WillOnce([&]() {
+          ASSERT_LT(std::chrono::steady_clock::now() - start, 1s);
+          admitted = true;
+          server.interrupt();
+        });
+      }, true);
+
+    std::unique_ptr<adaptyst::Acceptor::Factory> file_acceptor_factory =
+      std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+        EXPECT_CALL(a, construct(UNLIMITED_ACCEPTED)).Times(1);
+        EXPECT_CALL(a, close).Times(1);
+      }, [&](test::MockConnection &c) { }, true);
+
+    std::future<void> async_future = std::async([&]() {
+      server.run(client_factory, file_acceptor_factory);
+    });
+    ASSERT_EQ(async_future.wait_for(SERVER_TEST_TIMEOUT), std::future_status::ready);
+  }
+
+  ASSERT_TRUE(admitted);
+}
@@ -0,0 +1,162 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "socket.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <sstream>
+#include <vector>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  /**
+     A producer writing to the ring of ShmConnection, following
+     the same protocol as ShmStream in the "perf" scripts (but waking
+     the consumer up eagerly).
+  */
+  class ShmProducer {
+  private:
+    char *region;
+    std::uint64_t ring_size;
+    int data_fd;
+    int space_fd;
+    std::uint64_t head;
+
+    std::atomic_ref<std::uint64_t> word(unsigned int offset) {
+      return std::atomic_ref<std::uint64_t>(*(std::uint64_t *)(this->region + offset));
+    }
+
+  public:
+    ShmProducer(std::string instructions) {
+      std::vector<std::string> parts;
+      std::stringstream stream(instructions);
+      std::string part;
+
+      while (std::getline(stream, part, '_')) {
+        parts.push_back(part);
+      }
+
+      this->ring_size = std::stoull(parts[1]);
+      this->data_fd = std::stoi(parts[2]);
+      this->space_fd = std::stoi(parts[3]);
+      this->region = (char *)mmap(nullptr,
+                                  ShmConnection::DATA_OFFSET + this->ring_size,
+                                  PROT_READ | PROT_WRITE, MAP_SHARED,
+                                  std::stoi(parts[0]), 0);
+      this->head = 0;
+    }
+
+    ~ShmProducer() {
+      munmap(this->region, ShmConnection::DATA_OFFSET + this->ring_size);
+    }
+
+    void write(std::string data) {
+      std::size_t pos = 0;
+
+      while (pos < data.size()) {
+        std::uint64_t tail = this->word(ShmConnection::TAIL_OFFSET).load();
+        std::uint64_t free = this->ring_size - (this->head - tail);
+
+        if (free == 0) {
+          this->word(ShmConnection::PRODUCER_WAITING_OFFSET).store(1);
+
+          if (this->word(ShmConnection::TAIL_OFFSET).load() == tail) {
+            struct pollfd poll_struct;
+            poll_struct.fd = this->space_fd;
+            poll_struct.events = POLLIN;
+
+            if (poll(&poll_struct, 1, 10) > 0) {
+              std::uint64_t value;
+              ::read(this->space_fd, &value, sizeof(value));
+            }
+          }
+
+          this->word(ShmConnection::PRODUCER_WAITING_OFFSET).store(0);
+          continue;
+        }
+
+        std::uint64_t to_write = std::min(free, data.size() - pos);
+
+        for (std::uint64_t i = 0; i < to_write; i++) {
+          this->region[ShmConnection::DATA_OFFSET +
+                       (this->head + i) % this->ring_size] = data[pos + i];
+        }
+
+        pos += to_write;
+        this->head += to_write;
+        this->word(ShmConnection::HEAD_OFFSET).store(this->head);
+
+        if (this->word(ShmConnection::CONSUMER_WAITING_OFFSET).load()) {
+          std::uint64_t value = 1;
+          ::write(this->data_fd, &value, sizeof(value));
+        }
+      }
+    }
+
+    void close() {
+      this->word(ShmConnection::CLOSED_OFFSET).store(1);
+      std::uint64_t value = 1;
+      ::write(this->data_fd, &value, sizeof(value));
+    }
+  };
+
+  TEST(ShmConnectionTest, TransfersLinesThroughRing) {
+    ShmAcceptor::Factory factory(4096);
+    std::unique_ptr<Acceptor> acceptor = factory.make_acceptor(1);
+
+    ASSERT_EQ(factory.get_type(), "shm");
+
+    std::vector<std::string> expected;
+
+    for (int i = 0; i < 2000; i++) {
+      expected.push_back(std::string(1 + (i * 37) % 700, 'a' + i % 26));
+    }
+
+    ShmProducer producer(acceptor->get_connection_instructions());
+
+    std::thread producer_thread([&]() {
+      producer.write("connect");
+
+      for (auto &line : expected) {
+        producer.write(line + "\n");
+      }
+
+      producer.write("incomplete");
+      producer.close();
+    });
+
+    std::unique_ptr<Connection> connection = acceptor->accept(64, 10);
+    std::string_view line;
+
+    for (auto &expected_line : expected) {
+      ASSERT_TRUE(connection->read_line(line));
+      ASSERT_EQ(line, expected_line);
+    }
+
+    ASSERT_EQ(connection->read(), "incomplete");
+
+    char buf[16];
+    ASSERT_EQ(connection->read(buf, sizeof(buf), NO_TIMEOUT), 0);
+
+    producer_thread.join();
+  }
+
+  TEST(ShmConnectionTest, TimesOut) {
+    ShmAcceptor::Factory factory(4096);
+    std::unique_ptr<Acceptor> acceptor = factory.make_acceptor(1);
+
+    ASSERT_THROW(acceptor->accept(64, 1), TimeoutException);
+  }
+
+  TEST(ShmConnectionTest, RejectsInvalidRingSize) {
+    ShmAcceptor::Factory factory(1000);
+    ASSERT_THROW(factory.make_acceptor(1), std::runtime_error);
+  }
+};
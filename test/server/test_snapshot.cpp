@@ -0,0 +1,231 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "calltree.hpp"
+#include "snapshot.hpp"
+#include <gtest/gtest.h>
+#include <random>
+#include <fstream>
+#include <stdexcept>
+
+using namespace testing;
+using namespace adaptyst;
+
+namespace test {
+  void add_random(std::mt19937 &gen, CallTree &output,
+                  CallTree &output_time_ordered, int count) {
+    std::uniform_int_distribution<int> len_dist(1, 6);
+    std::uniform_int_distribution<int> sym_dist(0, 4);
+    std::uniform_int_distribution<int> period_dist(1, 1000);
+
+    for (int i = 0; i < count; i++) {
+      int len = len_dist(gen);
+      std::vector<protocol::CallchainElem> callchain;
+
+      for (int j = 0; j < len; j++) {
+        callchain.push_back({(std::uint32_t)sym_dist(gen), NO_OFFSET});
+      }
+
+      unsigned long long period = period_dist(gen);
+      output.add(callchain, period, false);
+      output_time_ordered.add(callchain, period, false);
+    }
+  }
+
+  void write_snapshot(fs::path dir, std::string name, nlohmann::json &snapshot) {
+    fs::create_directories(dir);
+    std::ofstream(dir / name) << snapshot;
+  }
+};
+
+TEST(SnapshotTest, MergesDeltas) {
+  std::mt19937 gen(1415);
+  fs::path processed_dir = "test_snapshot_processed";
+  fs::path out_dir = "test_snapshot_out";
+  fs::path snapshot_dir = processed_dir / SNAPSHOT_DIR_NAME;
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+
+  ASSERT_THROW(merge_snapshots(processed_dir, out_dir), std::runtime_error);
+
+  CallTree output(false), output_time_ordered(true);
+  std::vector<nlohmann::json> expected;
+
+  for (unsigned int index = 1; index <= 3; index++) {
+    test::add_random(gen, output, output_time_ordered, 100);
+
+    nlohmann::json snapshot;
+    snapshot["start_time"] = 1000;
+    snapshot["symbols"] = {{std::to_string(index - 1),
+                            nlohmann::json::array({"f" + std::to_string(index),
+                                                   "lib"}).dump()}};
+    nlohmann::json offcpu_regions = {{1000 + index, 10}};
+
+    if (index == 1) {
+      // Regions starting before profiling are cut or dropped
+      offcpu_regions.push_back({995, 10});
+      offcpu_regions.push_back({980, 10});
+    }
+
+    snapshot["threads"]["5_6"] = nlohmann::json::array();
+    snapshot["threads"]["5_6"].push_back({{"event_name", "walltime"},
+                                          {"total_period", 100 * index},
+                                          {"offcpu_regions", offcpu_regions},
+                                          {"deltas", {{output.take_delta(),
+                                                       output_time_ordered.take_delta()}}}});
+
+    // Snapshot numbers need not be contiguous, e.g. when no samples
+    // have arrived during an interval
+    test::write_snapshot(snapshot_dir / std::to_string(index * 2), "0.json", snapshot);
+
+    output.set_value(100 * index);
+    output_time_ordered.set_value(100 * index);
+    expected.push_back({{"walltime", {output.to_json(),
+                                      output_time_ordered.to_json()}}});
+  }
+
+  // Incomplete snapshots are ignored
+  test::write_snapshot(snapshot_dir / "8", "0.json.tmp", expected[0]);
+
+  ASSERT_EQ(merge_snapshots(processed_dir, out_dir, 4), 2);
+  nlohmann::json result = nlohmann::json::parse(std::ifstream(out_dir / "5_6.json"));
+  ASSERT_EQ(result, expected[1]);
+
+  ASSERT_EQ(merge_snapshots(processed_dir, out_dir), 3);
+  result = nlohmann::json::parse(std::ifstream(out_dir / "5_6.json"));
+  ASSERT_EQ(result, expected[2]);
+
+  nlohmann::json metadata = nlohmann::json::parse(std::ifstream(out_dir / "metadata.json"));
+  ASSERT_EQ(metadata["sampled_times"]["5_6"], 300);
+  ASSERT_EQ(metadata["offcpu_regions"]["5_6"],
+            nlohmann::json({{0, 5}, {1, 10}, {2, 10}, {3, 10}}));
+  ASSERT_EQ(metadata["thread_tree"].size(), 1);
+  ASSERT_EQ(metadata["thread_tree"][0]["identifier"], "6");
+
+  nlohmann::json symbols = nlohmann::json::parse(std::ifstream(out_dir / "callchains.json"));
+  ASSERT_EQ(symbols["2"], nlohmann::json({"f3", "lib"}));
+
+  // A snapshot which cannot be parsed is reported
+  std::ofstream(snapshot_dir / "2" / "1.json") << "{\"threads\": ";
+  ASSERT_THROW(merge_snapshots(processed_dir, out_dir), std::runtime_error);
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+}
+
+TEST(SnapshotTest, MergesEventTypes) {
+  std::mt19937 gen(9265);
+  fs::path processed_dir = "test_snapshot_events_processed";
+  fs::path out_dir = "test_snapshot_events_out";
+  fs::path snapshot_dir = processed_dir / SNAPSHOT_DIR_NAME;
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+
+  CallTree walltime(false), walltime_time_ordered(true);
+  CallTree cycles(false), cycles_time_ordered(true);
+  test::add_random(gen, walltime, walltime_time_ordered, 50);
+  test::add_random(gen, cycles, cycles_time_ordered, 50);
+
+  // A thread sampled with several event types has one entry per type
+  nlohmann::json snapshot;
+  snapshot["start_time"] = 1000;
+  snapshot["symbols"] = nlohmann::json::object();
+  snapshot["threads"]["5_6"] = nlohmann::json::array();
+  snapshot["threads"]["5_6"].push_back({{"event_name", "walltime"},
+                                        {"total_period", 100},
+                                        {"offcpu_regions", {{1001, 10}}},
+                                        {"deltas", {{walltime.take_delta(),
+                                                     walltime_time_ordered.take_delta()}}}});
+  snapshot["threads"]["5_6"].push_back({{"event_name", "cycles"},
+                                        {"total_period", 200},
+                                        {"offcpu_regions", nlohmann::json::array()},
+                                        {"deltas", {{cycles.take_delta(),
+                                                     cycles_time_ordered.take_delta()}}}});
+  test::write_snapshot(snapshot_dir / "1", "0.json", snapshot);
+
+  walltime.set_value(100);
+  walltime_time_ordered.set_value(100);
+  cycles.set_value(200);
+  cycles_time_ordered.set_value(200);
+
+  ASSERT_EQ(merge_snapshots(processed_dir, out_dir), 1);
+
+  nlohmann::json result = nlohmann::json::parse(std::ifstream(out_dir / "5_6.json"));
+  ASSERT_EQ(result, nlohmann::json({{"walltime", {walltime.to_json(),
+                                                  walltime_time_ordered.to_json()}},
+                                    {"cycles", {cycles.to_json(),
+                                                cycles_time_ordered.to_json()}}}));
+
+  nlohmann::json metadata = nlohmann::json::parse(std::ifstream(out_dir / "metadata.json"));
+  ASSERT_EQ(metadata["sampled_times"]["5_6"], 100);
+  ASSERT_EQ(metadata["offcpu_regions"]["5_6"], nlohmann::json({{1, 10}}));
+  ASSERT_EQ(metadata["thread_tree"].size(), 1);
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+}
+
+TEST(SnapshotTest, MergesMovedThreads) {
+  std::mt19937 gen(3589);
+  fs::path processed_dir = "test_snapshot_moved_processed";
+  fs::path out_dir = "test_snapshot_moved_out";
+  fs::path snapshot_dir = processed_dir / SNAPSHOT_DIR_NAME;
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+
+  // The thread is sampled first by subclient 3 and then by subclient 1
+  CallTree whole(false), whole_time_ordered(true);
+  CallTree first(false), first_time_ordered(true);
+  CallTree second(false), second_time_ordered(true);
+
+  for (int i = 0; i < 2; i++) {
+    std::mt19937 part_gen = gen;
+    test::add_random(part_gen, whole, whole_time_ordered, 50);
+    test::add_random(gen, i == 0 ? first : second,
+                     i == 0 ? first_time_ordered : second_time_ordered, 50);
+  }
+
+  auto make_snapshot = [](unsigned long long subclient,
+                          unsigned long long first_time,
+                          unsigned long long total_period,
+                          CallTree &output, CallTree &output_time_ordered) {
+    nlohmann::json snapshot;
+    snapshot["start_time"] = 1000;
+    snapshot["subclient"] = subclient;
+    snapshot["symbols"] = nlohmann::json::object();
+    snapshot["threads"]["5_6"] = nlohmann::json::array();
+    snapshot["threads"]["5_6"].push_back({{"event_name", "walltime"},
+                                          {"total_period", total_period},
+                                          {"first_time", first_time},
+                                          {"offcpu_regions", {{first_time + 1, 10}}},
+                                          {"deltas", {{output.take_delta(),
+                                                       output_time_ordered.take_delta()}}}});
+    return snapshot;
+  };
+
+  nlohmann::json snapshot = make_snapshot(1, 5000, 200, second, second_time_ordered);
+  test::write_snapshot(snapshot_dir / "1", "0.json", snapshot);
+  snapshot = make_snapshot(3, 2000, 100, first, first_time_ordered);
+  test::write_snapshot(snapshot_dir / "1", "1.json", snapshot);
+
+  whole.set_value(300);
+  whole_time_ordered.set_value(300);
+
+  ASSERT_EQ(merge_snapshots(processed_dir, out_dir), 1);
+
+  nlohmann::json result = nlohmann::json::parse(std::ifstream(out_dir / "5_6.json"));
+  ASSERT_EQ(result, nlohmann::json({{"walltime", {whole.to_json(),
+                                                  whole_time_ordered.to_json()}}}));
+
+  nlohmann::json metadata = nlohmann::json::parse(std::ifstream(out_dir / "metadata.json"));
+  ASSERT_EQ(metadata["sampled_times"]["5_6"], 300);
+  ASSERT_EQ(metadata["offcpu_regions"]["5_6"],
+            nlohmann::json({{1001, 10}, {4001, 10}}));
+  ASSERT_EQ(metadata["thread_tree"].size(), 1);
+
+  fs::remove_all(processed_dir);
+  fs::remove_all(out_dir);
+}
@@ -5,8 +5,12 @@
 #include "consts.hpp"
 #include <gtest/gtest.h>
 #include <future>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
 
 using namespace testing;
+namespace fs = std::filesystem;
 
 class TCPAcceptorTestWithSocket : public Test {
 protected:
@@ -129,6 +133,21 @@ TEST(TCPAcceptorTest, GetInstrWithSubsequentPorts) {
   ASSERT_EQ(acceptor->get_connection_instructions(), "127.0.0.1_" + std::to_string(port + 2));
 }
 
+TEST(TCPAcceptorTest, AcceptTimesOutWhenFewerConnect) {
+  const unsigned short port = 4127;
+  adaptyst::TCPAcceptor::Factory factory("127.0.0.1", port, false);
+  std::unique_ptr<adaptyst::Acceptor> acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+  // Three connections are expected, but only two are made
+  Poco::Net::StreamSocket socket1, socket2;
+  socket1.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+  socket2.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+
+  ASSERT_NE(acceptor->accept(16, 1), nullptr);
+  ASSERT_NE(acceptor->accept(16, 1), nullptr);
+  ASSERT_THROW(acceptor->accept(16, 1), adaptyst::TimeoutException);
+}
+
 TEST_F(TCPAcceptorTestWithSocket, AcceptWithTwoMaxAccepted) {
   const unsigned int buf_size1 = 1024;
   const unsigned int buf_size2 = 2048;
@@ -219,3 +238,115 @@ TEST_F(TCPSocketTest, SocketCorrectnessBufSize16) {
 TEST_F(TCPSocketTest, SocketCorrectnessBufSize10001) {
   test_socket_correctness(10001, port, interrupted, future);
 }
+
+TEST(UnixAcceptorTest, GetInstrWithUniquePaths) {
+  fs::path path = fs::temp_directory_path() / "adaptyst-test-unix.sock";
+  adaptyst::UnixAcceptor::Factory factory(path, true);
+
+  std::unique_ptr<adaptyst::Acceptor> acceptor1 = factory.make_acceptor(1);
+  std::unique_ptr<adaptyst::Acceptor> acceptor2 = factory.make_acceptor(1);
+
+  ASSERT_EQ(factory.get_type(), "unix");
+  ASSERT_NE(acceptor1->get_connection_instructions(),
+            acceptor2->get_connection_instructions());
+  ASSERT_EQ(acceptor1->get_connection_instructions().rfind(path.string(), 0), 0);
+  ASSERT_TRUE(fs::is_socket(acceptor1->get_connection_instructions()));
+
+  std::string instr = acceptor1->get_connection_instructions();
+  acceptor1.reset();
+  ASSERT_FALSE(fs::exists(instr));
+}
+
+TEST(UnixAcceptorTest, ReplacesStaleSocket) {
+  fs::path path = fs::temp_directory_path() / "adaptyst-test-stale.sock";
+  fs::remove(path);
+
+  {
+    // A socket file which nothing listens on
+    Poco::Net::ServerSocket stale;
+    stale.bind(Poco::Net::SocketAddress(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                        path.string()));
+  }
+
+  ASSERT_TRUE(fs::is_socket(path));
+
+  adaptyst::UnixAcceptor::Factory factory(path);
+  std::unique_ptr<adaptyst::Acceptor> acceptor =
+    factory.make_acceptor(UNLIMITED_ACCEPTED);
+  ASSERT_EQ(acceptor->get_connection_instructions(), path.string());
+
+  adaptyst::UnixAcceptor::Factory factory2(path);
+  ASSERT_THROW(factory2.make_acceptor(UNLIMITED_ACCEPTED),
+               adaptyst::AlreadyInUseException);
+}
+
+TEST(UnixAcceptorTest, AcceptAndRead) {
+  fs::path path = fs::temp_directory_path() / "adaptyst-test-accept.sock";
+  adaptyst::UnixAcceptor::Factory factory(path);
+  std::unique_ptr<adaptyst::Acceptor> acceptor = factory.make_acceptor(1);
+
+  std::future<void> future = std::async([&]() {
+    Poco::Net::StreamSocket socket(
+      Poco::Net::SocketAddress(Poco::Net::SocketAddress::UNIX_LOCAL,
+                               path.string()));
+    std::string msg = SOCKET_LOREM_IPSUM1 "\n";
+    socket.sendBytes(msg.c_str(), msg.size());
+  });
+
+  std::unique_ptr<adaptyst::Connection> connection = acceptor->accept(16, 5);
+  ASSERT_EQ(connection->read(5), SOCKET_LOREM_IPSUM1);
+
+  future.get();
+}
+
+TEST(PrefixedConnectionTest, LineIsReadBeforeInnerData) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  std::unique_ptr<adaptyst::Connection> writer =
+    std::make_unique<adaptyst::FileDescriptor>(nullptr, fds, 16);
+  std::unique_ptr<adaptyst::Connection> reader =
+    std::make_unique<adaptyst::FileDescriptor>(fds, nullptr, 16);
+
+  writer->write(SOCKET_LOREM_IPSUM1, true);
+  writer->write("second", true);
+  writer.reset();
+
+  adaptyst::PrefixedConnection connection(std::move(reader), "first");
+  ASSERT_EQ(connection.read(5), "first");
+  ASSERT_EQ(connection.read(5), SOCKET_LOREM_IPSUM1);
+
+  std::string_view line;
+  ASSERT_TRUE(connection.read_line(line, 5));
+  ASSERT_EQ(line, "second");
+}
+
+TEST(FileDescriptorTest, FileIsReceivedAfterBufferedData) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  std::unique_ptr<adaptyst::Connection> writer =
+    std::make_unique<adaptyst::FileDescriptor>(nullptr, fds, 16);
+  std::unique_ptr<adaptyst::Connection> reader =
+    std::make_unique<adaptyst::FileDescriptor>(fds, nullptr, 16);
+
+  // The header and the start of the file arrive in one read, so
+  // the latter is buffered by the framer when the header is returned
+  std::string content = SOCKET_LOREM_IPSUM1;
+  writer->write("header\n" + content, false);
+  writer.reset();
+
+  std::string_view line;
+  ASSERT_TRUE(reader->read_line(line, 5));
+  ASSERT_EQ(line, "header");
+
+  fs::path path = fs::temp_directory_path() / "adaptyst-test-receive.dat";
+  reader->read(path, 5);
+
+  std::ifstream stream(path, std::ios::in | std::ios::binary);
+  std::string received((std::istreambuf_iterator<char>(stream)),
+                       std::istreambuf_iterator<char>());
+  ASSERT_EQ(received, content);
+
+  fs::remove(path);
+}
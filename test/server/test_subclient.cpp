@@ -6,6 +6,8 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
 using namespace testing;
 using namespace std::chrono_literals;
@@ -465,3 +467,130 @@ TEST(StdSubclientTest, InvalidCommTest3) {
 
   ASSERT_EQ(result, nlohmann::json::parse(SUBCLIENT_EXPECTED_INVALIDCOMM3));
 }
+
+TEST(StdSubclientTest, BinaryProtocol) {
+  StrictMock<test::MockClient> client;
+
+  adaptyst::SymbolTable symbols;
+  adaptyst::MemoryBudget budget;
+  unsigned long long start_time = 1000;
+
+  EXPECT_CALL(client, notify).Times(1);
+  EXPECT_CALL(client, get_symbol_table).WillRepeatedly(ReturnRef(symbols));
+  EXPECT_CALL(client, get_memory_budget).WillRepeatedly(ReturnRef(budget));
+  EXPECT_CALL(client, get_snapshot_interval).WillRepeatedly(Return(0));
+  EXPECT_CALL(client, get_profile_start_tstamp(_))
+    .WillRepeatedly(DoAll(SetArgPointee<0>(start_time), Return(true)));
+
+  const std::string profiled_filename = "test";
+  const unsigned int buf_size = 1024;
+
+  // Thread 5/6 sends a delta sample with a full callchain, a delta sample
+  // reusing the first element of it, and an aggregated sample of 3 samples,
+  // followed by a sample of another event
+  std::string records;
+  adaptyst::protocol::encode(adaptyst::protocol::Symbol{0, "[\"main\", \"app\"]"}, records);
+  adaptyst::protocol::encode(adaptyst::protocol::Symbol{1, "[\"foo\", \"app\"]"}, records);
+  adaptyst::protocol::encode(adaptyst::protocol::Symbol{2, "[\"bar\", \"app\"]"}, records);
+
+  adaptyst::protocol::Sample sample;
+  sample.event_type = "task-clock";
+  sample.pid = 5;
+  sample.tid = 6;
+  sample.time = 2000;
+  sample.period = 100;
+  sample.delta = true;
+  sample.callchain = {{0, 0x10}, {1, 0x20}};
+  adaptyst::protocol::encode(sample, records);
+
+  sample.time = 2100;
+  sample.period = 50;
+  sample.common_prefix = 1;
+  sample.callchain = {{2, 0x30}};
+  adaptyst::protocol::encode(sample, records);
+
+  sample.time = 2400;
+  sample.period = 300;
+  sample.count = 3;
+  sample.delta = false;
+  sample.common_prefix = 0;
+  sample.callchain = {{0, 0x10}, {1, 0x20}};
+  adaptyst::protocol::encode(sample, records);
+
+  sample.event_type = "cache-misses";
+  sample.time = 2500;
+  sample.period = 7;
+  sample.count = 1;
+  sample.callchain = {{1, 0x20}};
+  adaptyst::protocol::encode(sample, records);
+
+  adaptyst::protocol::encode_stop(records);
+
+  const std::string negotiation = PROTOCOL_NEGOTIATION " binary 3";
+  std::size_t pos = 0;
+
+  std::unique_ptr<adaptyst::Acceptor::Factory> acceptor_factory =
+    std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+      EXPECT_CALL(a, construct(1)).Times(1);
+      EXPECT_CALL(a, real_accept(buf_size)).Times(1);
+      EXPECT_CALL(a, close).Times(1);
+    }, [&](test::MockConnection &c) {
+      InSequence sequence;
+
+      EXPECT_CALL(c, read_line(_, NO_TIMEOUT)).Times(1)
+        .WillOnce([&](std::string_view &line, long timeout) {
+          line = negotiation;
+          return true;
+        });
+      EXPECT_CALL(c, write(negotiation, true)).Times(1);
+      EXPECT_CALL(c, read(_, _, NO_TIMEOUT)).Times(AtLeast(1))
+        .WillRepeatedly([&](char *buf, unsigned int len, long timeout) {
+          unsigned int to_read = std::min((std::size_t)len, records.size() - pos);
+          std::memcpy(buf, records.data() + pos, to_read);
+          pos += to_read;
+          return (int)to_read;
+        });
+      EXPECT_CALL(c, close).Times(1);
+    }, true);
+
+  adaptyst::StdSubclient::Factory factory(acceptor_factory);
+  std::unique_ptr<adaptyst::Subclient> subclient = factory.make_subclient(client,
+                                                                       profiled_filename,
+                                                                       buf_size);
+
+  subclient->process();
+
+  // Symbol names are normalised by StdSubclient as in the JSON protocol
+  std::uint32_t main_id = symbols.intern(nlohmann::json::array({"main", "app"}).dump());
+  std::uint32_t foo_id = symbols.intern(nlohmann::json::array({"foo", "app"}).dump());
+  std::uint32_t bar_id = symbols.intern(nlohmann::json::array({"bar", "app"}).dump());
+
+  std::vector<adaptyst::protocol::CallchainElem> main_foo = {{main_id, 0x10}, {foo_id, 0x20}};
+  std::vector<adaptyst::protocol::CallchainElem> main_bar = {{main_id, 0x10}, {bar_id, 0x30}};
+  std::vector<adaptyst::protocol::CallchainElem> foo = {{foo_id, 0x20}};
+
+  adaptyst::CallTree walltime(false), walltime_time_ordered(true);
+  walltime.add(main_foo, 100, false);
+  walltime.add(main_bar, 50, false);
+  walltime.add(main_foo, 300, false);
+  walltime.set_value(450);
+  walltime_time_ordered.add(main_foo, 100, false);
+  walltime_time_ordered.add(main_bar, 50, false);
+  walltime_time_ordered.add(main_foo, 300, false);
+  walltime_time_ordered.set_value(450);
+
+  adaptyst::CallTree misses(false), misses_time_ordered(true);
+  misses.add(foo, 7, false);
+  misses.set_value(7);
+  misses_time_ordered.add(foo, 7, false);
+  misses_time_ordered.set_value(7);
+
+  nlohmann::json &result = subclient->get_result();
+
+  ASSERT_EQ(result["sample"]["5_6"]["sampled_time"], 450);
+  ASSERT_EQ(result["sample"]["5_6"]["offcpu_regions"], nlohmann::json::array());
+  ASSERT_EQ(result["sample"]["5_6"]["walltime"],
+            nlohmann::json({walltime.to_json(), walltime_time_ordered.to_json()}));
+  ASSERT_EQ(result["sample cache-misses"]["5_6"]["cache-misses"],
+            nlohmann::json({misses.to_json(), misses_time_ordered.to_json()}));
+}
@@ -0,0 +1,164 @@
+// Adaptyst: a performance analysis tool
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "socket.hpp"
+#include "zstdfile.hpp"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+using namespace testing;
+using namespace adaptyst;
+
+class ZstdConnectionTest : public Test {
+protected:
+  std::shared_ptr<Connection> writer;
+  std::shared_ptr<Connection> reader;
+
+  ZstdConnectionTest() {
+    int fds[2];
+    EXPECT_EQ(pipe(fds), 0);
+
+    this->writer = std::make_shared<FileDescriptor>(nullptr, fds, 1024);
+    this->reader = std::make_shared<FileDescriptor>(fds, nullptr, 1024);
+  }
+};
+
+TEST_F(ZstdConnectionTest, LinesRoundTrip) {
+  std::thread sender([&]() {
+    ZstdConnection connection(this->writer, false, true);
+
+    for (int i = 0; i < 100000; i++) {
+      connection.write("sample " + std::to_string(i % 17) + " 0x7fffabcd", true);
+    }
+
+    connection.write("<STOP>", true);
+    this->writer.reset();
+  });
+
+  ZstdConnection connection(this->reader, true, false);
+  std::string_view line;
+  int received = 0;
+
+  while (connection.read_line(line) && line != "<STOP>") {
+    ASSERT_EQ(line, "sample " + std::to_string(received % 17) + " 0x7fffabcd");
+    received++;
+  }
+
+  sender.join();
+  ASSERT_EQ(received, 100000);
+}
+
+TEST_F(ZstdConnectionTest, FileRoundTrip) {
+  fs::path src = fs::temp_directory_path() / "adaptyst_zstd_test_src";
+  fs::path dst = fs::temp_directory_path() / "adaptyst_zstd_test_dst";
+  std::string content;
+
+  for (int i = 0; i < 300000; i++) {
+    content += std::to_string(i * 31) + ",";
+  }
+
+  {
+    std::ofstream stream(src, std::ios::out | std::ios::binary);
+    stream << content;
+  }
+
+  std::thread sender([&]() {
+    ZstdConnection connection(this->writer, false, true);
+    connection.write("header", true);
+    connection.write(src);
+    this->writer.reset();
+  });
+
+  ZstdConnection connection(this->reader, true, false);
+  ASSERT_EQ(connection.read(), "header");
+  connection.read(dst, NO_TIMEOUT);
+  sender.join();
+
+  std::ifstream stream(dst, std::ios::in | std::ios::binary);
+  std::stringstream received;
+  received << stream.rdbuf();
+
+  fs::remove(src);
+  fs::remove(dst);
+
+  ASSERT_EQ(received.str(), content);
+}
+
+TEST_F(ZstdConnectionTest, CorruptedData) {
+  this->writer->write("this is not a zstd stream", true);
+  this->writer.reset();
+
+  ZstdConnection connection(this->reader, true, false);
+  std::string_view line;
+
+  ASSERT_THROW(connection.read_line(line), ConnectionException);
+}
+
+TEST(ZstdFileTest, CompressedFileRoundTrip) {
+  fs::path path = "test_zstd_file.json";
+  fs::path compressed_path = "test_zstd_file.json.zst";
+  std::string content;
+
+  for (int i = 0; i < 200000; i++) {
+    content += "{\"children\":[],\"cold\":false,\"name\":\"" + std::to_string(i % 97) + "\"}";
+  }
+
+  for (int workers : {0, 2}) {
+    {
+      ZstdOutputStream stream(compressed_path, 3, workers);
+      stream << content;
+      stream.close();
+      ASSERT_TRUE(stream);
+    }
+
+    ASSERT_FALSE(fs::exists(path));
+    ASSERT_LT(fs::file_size(compressed_path), content.size() / 10);
+    ASSERT_EQ(read_processed_file(path), content);
+  }
+
+  fs::remove(compressed_path);
+}
+
+TEST(ZstdFileTest, CompressFile) {
+  fs::path path = "test_zstd_compress.json";
+  fs::path compressed_path = "test_zstd_compress.json.zst";
+
+  {
+    std::ofstream stream(path);
+    stream << "{\"a\":[1,2,3]}" << std::endl;
+  }
+
+  compress_file(path, 19);
+
+  ASSERT_FALSE(fs::exists(path));
+  ASSERT_TRUE(fs::exists(compressed_path));
+  ASSERT_EQ(read_processed_json(path), nlohmann::json::parse("{\"a\":[1,2,3]}"));
+
+  // An uncompressed file takes precedence
+  {
+    std::ofstream stream(path);
+    stream << "{}";
+  }
+
+  ASSERT_EQ(read_processed_file(path), "{}");
+
+  fs::remove(path);
+  fs::remove(compressed_path);
+
+  ASSERT_THROW(read_processed_file(path), std::runtime_error);
+}
+
+TEST(ZstdFileTest, CorruptedFile) {
+  fs::path compressed_path = "test_zstd_corrupted.json.zst";
+
+  {
+    std::ofstream stream(compressed_path);
+    stream << "this is not a zstd stream";
+  }
+
+  ASSERT_THROW(read_processed_file("test_zstd_corrupted.json"), std::runtime_error);
+  fs::remove(compressed_path);
+}